@@ -0,0 +1,84 @@
+"""
+Count the allocator calls the server makes per steady state GET.
+
+Stop any running server first: the server runs in this process with counting hooks wrapped around the python
+allocators, and a client in a child process sends the requests. The counts are
+taken after a warm up, so buffers, connections and queue nodes are already
+pooled, and everything counted is paid by every request.
+
+The raw domain is what the server's own structs and buffers use, the mem and
+obj domains count python objects created while dispatching.
+
+    python benchmarks/bench_allocs.py --requests 20000 --value list
+
+`--value` picks what is stored under the key. Values are kept in the form
+they were sent in, so a GET of a list or tuple costs the same as a GET of a
+str.
+"""
+import argparse
+import multiprocessing
+import os
+import threading
+import time
+
+from five_one_one_kv import Client
+from five_one_one_kv.c import allocation_counts, track_allocations
+from five_one_one_kv.server import Server
+
+
+_VALUES = {
+    "str": "value",
+    "list": [ix for ix in range(64)],
+    "tuple": tuple(f"item_{ix}" for ix in range(64)),
+}
+
+
+def _client(num_requests, value, conn):
+    client = Client()
+    client["bench_allocs"] = _VALUES[value]
+    for _ in range(num_requests):
+        client["bench_allocs"]
+    conn.send("warmed up")
+    conn.recv()
+    for _ in range(num_requests):
+        client["bench_allocs"]
+    conn.send("done")
+    client.close()
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--requests", type=int, default=20000)
+    parser.add_argument("--value", choices=sorted(_VALUES), default="str")
+    args = parser.parse_args()
+
+    track_allocations()
+    threading.Thread(target=Server, daemon=True).start()
+    time.sleep(1)
+
+    ctx = multiprocessing.get_context("spawn")
+    conn, child_conn = ctx.Pipe()
+    proc = ctx.Process(target=_client, args=(args.requests, args.value, child_conn))
+    proc.start()
+    conn.recv()
+    # let the idle server threads settle before counting
+    time.sleep(0.5)
+
+    before = allocation_counts()
+    conn.send("measure")
+    # wait for the client without reading its message, which would allocate
+    conn.poll(None)
+    after = allocation_counts()
+    proc.join()
+
+    print(f"{'domain':>8} {'calls':>10} {'per GET':>9}")
+    for domain in ("raw", "mem", "obj"):
+        calls = after[domain] - before[domain]
+        print(f"{domain:>8} {calls:>10} {calls / args.requests:>9.2f}")
+
+    # the server threads never return, so don't wait for them on the way out
+    os._exit(0)
+
+
+if __name__ == "__main__":
+    main()
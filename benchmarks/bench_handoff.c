@@ -0,0 +1,261 @@
+// microbenchmark for handing ready connections from the poll loop to io workers
+//
+// compares the old waiting_conns (intq_t behind a semaphore, with a pthread
+// condition variable to wake workers) with connring_t (lock-free ring, futex
+// parking). one producer plays the poll loop, and 2-16 consumers play the io
+// workers. like the server's threads, every thread holds the GIL except while it
+// blocks, so the numbers include the GIL hand-offs the server pays for as well.
+//
+//  * throughput: the producer pushes `NUM_ITEMS` as fast as it can
+//  * latency: the producer pushes one item at a time and waits for it to be
+//    popped, the time from push to pop is the hand-off latency
+//
+// build and run with `make bench-handoff`
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <pthread.h>
+
+#include <Python.h>
+
+#include "../server/util.h"
+
+#define NUM_ITEMS 200000
+#define NUM_LATENCY_ITEMS 20000
+#define RING_CAPACITY 1024
+
+enum { KIND_INTQ, KIND_RING };
+
+struct bench_t {
+    int32_t kind;
+    int32_t num_workers;
+    // old: intq_t + sem_t + cond_t
+    struct intq_t *intq;
+    sem_t intq_lock;
+    struct cond_t *cond;
+    // new
+    struct connring_t *ring;
+    // per item push timestamps and hand-off latencies, items are 1-based since 0 means stop
+    double *pushed_at;
+    double *latency;
+    int32_t consumed;
+};
+
+static double now_us() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+
+}
+
+static int cmp_double(const void *a, const void *b) {
+
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+
+}
+
+static void bench_push(struct bench_t *bench, int32_t val) {
+    // same as poll_loop() before and after the change
+
+    if (bench->kind == KIND_INTQ) {
+        threadsafe_sem_wait(&bench->intq_lock);
+        intq_put(bench->intq, val);
+        sem_post(&bench->intq_lock);
+        cond_notify(bench->cond);
+        return;
+    }
+
+    while (connring_push(bench->ring, val)) {
+        // full, let the consumers catch up
+        Py_BEGIN_ALLOW_THREADS
+        sched_yield();
+        Py_END_ALLOW_THREADS
+    }
+    connring_notify(bench->ring);
+
+}
+
+static int32_t bench_pop(struct bench_t *bench) {
+    // same as io_loop() before and after the change
+    // returns -1 if the caller should try again
+
+    if (bench->kind == KIND_RING) {
+        return connring_pop_wait(bench->ring, 1000);
+    }
+
+    threadsafe_sem_wait(&bench->intq_lock);
+    if (intq_empty(bench->intq)) {
+        sem_post(&bench->intq_lock);
+        cond_wait(bench->cond);
+        threadsafe_sem_wait(&bench->intq_lock);
+        if (intq_empty(bench->intq)) {
+            sem_post(&bench->intq_lock);
+            return -1;
+        }
+    }
+    int32_t val = intq_get(bench->intq);
+    sem_post(&bench->intq_lock);
+
+    return val;
+
+}
+
+static void *consumer(void *arg) {
+
+    struct bench_t *bench = arg;
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
+    while (1) {
+        int32_t val = bench_pop(bench);
+        if (val < 0) {
+            continue;
+        }
+        if (val == 0) {
+            break;
+        }
+        bench->latency[val] = now_us() - bench->pushed_at[val];
+        __atomic_add_fetch(&bench->consumed, 1, __ATOMIC_RELEASE);
+    }
+
+    PyGILState_Release(gstate);
+    return NULL;
+
+}
+
+static void wait_consumed(struct bench_t *bench, int32_t target) {
+
+    Py_BEGIN_ALLOW_THREADS
+    while (__atomic_load_n(&bench->consumed, __ATOMIC_ACQUIRE) < target) {
+        sched_yield();
+    }
+    Py_END_ALLOW_THREADS
+
+}
+
+static void run(int32_t kind, int32_t num_workers) {
+
+    struct bench_t bench = {};
+    bench.kind = kind;
+    bench.num_workers = num_workers;
+    bench.intq = intq_new();
+    sem_init(&bench.intq_lock, 0, 1);
+    bench.cond = cond_new();
+    bench.ring = connring_new(RING_CAPACITY);
+    bench.pushed_at = PyMem_RawCalloc(NUM_ITEMS + 1, sizeof(double));
+    bench.latency = PyMem_RawCalloc(NUM_ITEMS + 1, sizeof(double));
+
+    pthread_t threads[16];
+    Py_BEGIN_ALLOW_THREADS
+    for (int32_t ix = 0; ix < num_workers; ix++) {
+        pthread_create(&threads[ix], NULL, consumer, &bench);
+    }
+    Py_END_ALLOW_THREADS
+
+    // throughput
+    double start = now_us();
+    for (int32_t val = 1; val <= NUM_ITEMS; val++) {
+        bench.pushed_at[val] = now_us();
+        bench_push(&bench, val);
+    }
+    if (kind == KIND_INTQ) {
+        // the old poll loop gave another notify once per iteration, because a
+        // notify can be lost between a worker's empty check and its cond_wait()
+        while (__atomic_load_n(&bench.consumed, __ATOMIC_ACQUIRE) < NUM_ITEMS) {
+            cond_notify(bench.cond);
+            Py_BEGIN_ALLOW_THREADS
+            sched_yield();
+            Py_END_ALLOW_THREADS
+        }
+    }
+    wait_consumed(&bench, NUM_ITEMS);
+    double elapsed = now_us() - start;
+
+    // latency
+    __atomic_store_n(&bench.consumed, 0, __ATOMIC_RELEASE);
+    for (int32_t val = 1; val <= NUM_LATENCY_ITEMS; val++) {
+        bench.pushed_at[val] = now_us();
+        bench_push(&bench, val);
+        if (kind == KIND_INTQ) {
+            while (__atomic_load_n(&bench.consumed, __ATOMIC_ACQUIRE) < val) {
+                cond_notify(bench.cond);
+                Py_BEGIN_ALLOW_THREADS
+                sched_yield();
+                Py_END_ALLOW_THREADS
+            }
+        }
+        wait_consumed(&bench, val);
+    }
+    qsort(bench.latency + 1, NUM_LATENCY_ITEMS, sizeof(double), cmp_double);
+    double p50 = bench.latency[1 + NUM_LATENCY_ITEMS / 2];
+    double p99 = bench.latency[1 + NUM_LATENCY_ITEMS * 99 / 100];
+
+    // stop
+    for (int32_t ix = 0; ix < num_workers; ix++) {
+        bench_push(&bench, 0);
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (int32_t ix = 0; ix < num_workers; ix++) {
+        if (kind == KIND_INTQ) {
+            // same lost notify problem as above
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            while (pthread_timedjoin_np(threads[ix], NULL, &deadline)) {
+                pthread_cond_broadcast(&bench.cond->cond);
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += 1;
+            }
+        } else {
+            pthread_join(threads[ix], NULL);
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    printf("%-22s %8d %14.0f %10.1f %10.1f\n",
+           kind == KIND_INTQ ? "intq + sem + cond" : "connring + futex",
+           num_workers, NUM_ITEMS / (elapsed / 1e6), p50, p99);
+
+    intq_destroy(bench.intq);
+    sem_destroy(&bench.intq_lock);
+    cond_destroy(bench.cond);
+    PyMem_RawFree(bench.cond);
+    connring_destroy(bench.ring);
+    PyMem_RawFree(bench.pushed_at);
+    PyMem_RawFree(bench.latency);
+
+}
+
+int main(int argc, char **argv) {
+
+    Py_Initialize();
+
+    // util.c logs through these, without ensure_py_deps() and the rest of the module
+    PyObject *logging = PyImport_ImportModule("logging");
+    _logger = PyObject_CallMethod(logging, "getLogger", "s", "bench_handoff");
+    _error_str = PyUnicode_FromString("error");
+    _warning_str = PyUnicode_FromString("warning");
+    _info_str = PyUnicode_FromString("info");
+    _debug_str = PyUnicode_FromString("debug");
+
+    int32_t worker_counts[] = {2, 4, 8, 16};
+
+    printf("%-22s %8s %14s %10s %10s\n", "queue", "workers", "items/s", "p50 us", "p99 us");
+    for (size_t ix = 0; ix < sizeof(worker_counts) / sizeof(worker_counts[0]); ix++) {
+        run(KIND_INTQ, worker_counts[ix]);
+        run(KIND_RING, worker_counts[ix]);
+    }
+
+    Py_DECREF(logging);
+    Py_FinalizeEx();
+
+    return 0;
+
+}
@@ -0,0 +1,96 @@
+// microbenchmark for the hashes of client data
+//
+// compares hash64() (seeded wyhash, what the storage uses) with
+// hash_given_len() (what commands are routed with) and 64 bit FNV-1a (what
+// the storage used before), on keys of several lengths. every hash is fed
+// into the next key so the calls can't overlap or be optimized out.
+//
+// build and run with `make bench-hash`
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <Python.h>
+
+#include "../server/util.h"
+
+#define NUM_BYTES (256 * 1024 * 1024)
+
+// keeps the hashes from being optimized out
+static volatile uint64_t sink;
+
+static double now_us() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+
+}
+
+static uint64_t fnv1a(const uint8_t *s, size_t n) {
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t ix = 0; ix < n; ix++) {
+        hash ^= s[ix];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+
+}
+
+enum { KIND_HASH64, KIND_HASH_GIVEN_LEN, KIND_FNV1A };
+
+static void run(int32_t kind, size_t len) {
+
+    uint8_t *key = PyMem_RawMalloc(len + sizeof(uint64_t));
+    for (size_t ix = 0; ix < len + sizeof(uint64_t); ix++) {
+        key[ix] = (uint8_t)(ix * 131 + 7);
+    }
+
+    uint64_t num_hashes = NUM_BYTES / len;
+    uint64_t acc = 0;
+    double start = now_us();
+    for (uint64_t ix = 0; ix < num_hashes; ix++) {
+        switch (kind) {
+            case KIND_HASH64:
+                acc = hash64(key, len, hash64_seed ^ acc);
+                break;
+            case KIND_HASH_GIVEN_LEN:
+                acc = (uint32_t)hash_given_len(key, len) ^ acc;
+                break;
+            case KIND_FNV1A:
+                acc = fnv1a(key, len) ^ acc;
+                break;
+        }
+        memcpy(key, &acc, sizeof(uint8_t));
+    }
+    double elapsed = now_us() - start;
+
+    const char *names[] = {"hash64", "hash_given_len", "fnv1a"};
+    printf("%-16s %8zu %10.2f %10.2f\n", names[kind], len, elapsed * 1e3 / num_hashes, NUM_BYTES / elapsed / 1e3);
+    sink = acc;
+
+    PyMem_RawFree(key);
+
+}
+
+int main(int argc, char **argv) {
+
+    hash64_seed_init();
+
+    size_t lengths[] = {4, 8, 16, 32, 64, 256, 1024};
+
+    printf("%-16s %8s %10s %10s\n", "hash", "bytes", "ns/hash", "GB/s");
+    for (size_t ix = 0; ix < sizeof(lengths) / sizeof(lengths[0]); ix++) {
+        run(KIND_HASH64, lengths[ix]);
+        run(KIND_HASH_GIVEN_LEN, lengths[ix]);
+        run(KIND_FNV1A, lengths[ix]);
+    }
+
+    return 0;
+
+}
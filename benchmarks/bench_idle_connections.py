@@ -0,0 +1,90 @@
+"""
+Measure how the cost of serving one request scales with the number of idle
+connections held open against the server.
+
+Run the server first (`python -m five_one_one_kv.server`), then:
+
+    python benchmarks/bench_idle_connections.py --idle 0 1000 5000 10000
+
+With `--server-pid`, the growth of the server's resident memory while the idle
+connections are open is reported as well, per idle connection.
+"""
+import argparse
+import resource
+import socket
+import statistics
+import time
+
+from five_one_one_kv import Client
+
+
+def _raise_fd_limit(needed):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < needed:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(needed, hard), hard))
+
+
+def _server_rss(pid):
+    if pid is None:
+        return None
+    with open(f"/proc/{pid}/status") as f:
+        for line in f:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1]) * 1024
+    return None
+
+
+def _open_idle(num):
+    socks = []
+    for _ in range(num):
+        socks.append(socket.create_connection(("0.0.0.0", 8513)))
+    return socks
+
+
+def _measure(client, num_requests):
+    latencies = []
+    for ix in range(num_requests):
+        start = time.perf_counter()
+        client.set("bench_idle_connections", ix)
+        latencies.append(time.perf_counter() - start)
+    return latencies
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--idle", type=int, nargs="+", default=[0, 1000, 5000])
+    parser.add_argument("--requests", type=int, default=2000)
+    parser.add_argument("--server-pid", type=int, default=None)
+    args = parser.parse_args()
+
+    _raise_fd_limit(max(args.idle) + 64)
+
+    header = f"{'idle conns':>10} {'p50 us':>10} {'p99 us':>10} {'req/s':>10}"
+    if args.server_pid is not None:
+        header += f" {'rss/conn B':>11}"
+    print(header)
+    for num_idle in args.idle:
+        rss_before = _server_rss(args.server_pid)
+        idle = _open_idle(num_idle)
+        client = Client()
+        # warm up, so the connection is registered before we start timing
+        _measure(client, 16)
+        latencies = _measure(client, args.requests)
+        latencies.sort()
+        p50 = statistics.median(latencies) * 1e6
+        p99 = latencies[int(len(latencies) * 0.99) - 1] * 1e6
+        rps = len(latencies) / sum(latencies)
+        line = f"{num_idle:>10} {p50:>10.1f} {p99:>10.1f} {rps:>10.0f}"
+        if rss_before is not None:
+            growth = _server_rss(args.server_pid) - rss_before
+            line += f" {growth / max(num_idle, 1):>11.0f}"
+        print(line)
+        client.close()
+        for sock in idle:
+            sock.close()
+        # give the server a moment to reap the closed connections
+        time.sleep(1)
+
+
+if __name__ == "__main__":
+    main()
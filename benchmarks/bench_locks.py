@@ -0,0 +1,91 @@
+"""
+Measure user lock acquisition latency, throughput and fairness under contention.
+
+Many clients lock, hold and unlock the same few locks in a loop. With `--poll`
+they retry a failed `lock()` after a short sleep instead of waiting in line on
+the server, which is what they would do without server side waiters. Fairness
+is Jain's index of the acquisitions per client: 1 if every client got the
+locks as often as the others, 1/clients if one client got them all.
+
+Run the server first (`python -m five_one_one_kv.server`), then:
+
+    python benchmarks/bench_locks.py --clients 200 --locks 1
+    python benchmarks/bench_locks.py --clients 200 --locks 1 --poll
+"""
+import argparse
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+from five_one_one_kv import Client
+
+
+def _contend(token, names, hold, poll, stop):
+    client = Client()
+    latencies = []
+    ix = 0
+    while not stop.is_set():
+        name = names[ix % len(names)]
+        start = time.perf_counter()
+        if poll:
+            while client.lock(name, token) is None and not stop.is_set():
+                time.sleep(0.001)
+        elif client.lock(name, token, wait=60) is None:
+            continue
+        if stop.is_set():
+            client.unlock(name, token)
+            break
+        latencies.append(time.perf_counter() - start)
+        if hold:
+            time.sleep(hold)
+        client.unlock(name, token)
+        ix += 1
+    client.close()
+    return latencies
+
+
+def _percentile(values, pct):
+    return values[min(len(values) - 1, int(len(values) * pct / 100))]
+
+
+def _jain(counts):
+    return sum(counts) ** 2 / (len(counts) * sum(count * count for count in counts)) if any(counts) else 0.0
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--clients", type=int, default=200)
+    parser.add_argument("--locks", type=int, default=1)
+    parser.add_argument("--hold", type=float, default=0.0, help="seconds to hold each lock")
+    parser.add_argument("--poll", action="store_true", help="retry instead of waiting on the server")
+    parser.add_argument("--seconds", type=float, default=5.0)
+    args = parser.parse_args()
+
+    names = [f"bench_locks_{ix}" for ix in range(args.locks)]
+    stop = threading.Event()
+    with ThreadPoolExecutor(max_workers=args.clients) as executor:
+        futures = [executor.submit(_contend, f"client_{ix}", names, args.hold, args.poll, stop) for ix in range(args.clients)]
+        time.sleep(args.seconds)
+        stop.set()
+        per_client = [future.result() for future in futures]
+
+    counts = [len(latencies) for latencies in per_client]
+    latencies = sorted(lat for found in per_client for lat in found)
+    if not latencies:
+        print("no lock was acquired")
+        return
+
+    print(f"{'locks/s':>9} {'p50 us':>9} {'p99 us':>9} {'p99.9 us':>9} {'min':>6} {'max':>6} {'jain':>6}")
+    print(
+        f"{len(latencies) / args.seconds:>9.0f}"
+        f" {_percentile(latencies, 50) * 1e6:>9.0f}"
+        f" {_percentile(latencies, 99) * 1e6:>9.0f}"
+        f" {_percentile(latencies, 99.9) * 1e6:>9.0f}"
+        f" {min(counts):>6}"
+        f" {max(counts):>6}"
+        f" {_jain(counts):>6.3f}"
+    )
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,64 @@
+"""
+Compare fetching a batch of keys with pipelined GETs and with one MGET.
+
+Run the server first (`python -m five_one_one_kv.server`), then:
+
+    python benchmarks/bench_multi.py --batch 10 100 1000
+
+Both fetch the same keys: the pipeline sends one frame per key and gets one
+response per key, MGET sends them all in one frame, locks each shard once and
+answers with one response.
+"""
+import argparse
+import time
+
+from five_one_one_kv import Client, Pipeline
+
+
+def _pipelined(pipeline, keys):
+    for key in keys:
+        pipeline.get(key)
+    pipeline.execute()
+    pipeline._keys.clear()
+    pipeline._wbuff.clear()
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--batch", type=int, nargs="+", default=[10, 100, 1000])
+    parser.add_argument("--keys", type=int, default=20000)
+    args = parser.parse_args()
+
+    client = Client()
+    pipeline = Pipeline()
+    for start in range(0, args.keys, 1000):
+        client.mset({f"bench_multi_{ix}": ix for ix in range(start, min(start + 1000, args.keys))})
+
+    print(f"{'batch':>6} {'pipeline keys/s':>16} {'mget keys/s':>12}")
+    for batch in args.batch:
+        batches = [
+            [f"bench_multi_{ix}" for ix in range(start, start + batch)]
+            for start in range(0, args.keys - batch + 1, batch)
+        ]
+        num_keys = len(batches) * batch
+
+        start = time.perf_counter()
+        for keys in batches:
+            _pipelined(pipeline, keys)
+        pipelined = num_keys / (time.perf_counter() - start)
+
+        start = time.perf_counter()
+        for keys in batches:
+            client.mget(keys)
+        mget = num_keys / (time.perf_counter() - start)
+
+        print(f"{batch:>6} {pipelined:>16.0f} {mget:>12.0f}")
+
+    for start in range(0, args.keys, 1000):
+        client.mdel(f"bench_multi_{ix}" for ix in range(start, min(start + 1000, args.keys)))
+    client.close()
+    pipeline.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,77 @@
+"""
+Measure throughput of pipelined requests at several pipeline depths.
+
+Run the server first (`python -m five_one_one_kv.server`, with or without
+`--io-uring` to compare backends), then:
+
+    python benchmarks/bench_pipeline.py --depth 1 16 64 --server-pid <pid>
+
+With `--server-pid`, the read/write syscalls (`syscr`/`syscw` from
+/proc/<pid>/io) and context switches the server made are reported per request.
+Receives and sends that go through io_uring are not counted as read/write
+syscalls, so comparing the two backends shows how many of them io_uring saves.
+"""
+import argparse
+import os
+import time
+
+from five_one_one_kv import Pipeline
+
+
+def _server_counters(pid):
+    if pid is None:
+        return None
+    counters = {}
+    with open(f"/proc/{pid}/io") as f:
+        for line in f:
+            name, value = line.split(":")
+            counters[name] = int(value)
+    counters["ctxt"] = 0
+    for tid in os.listdir(f"/proc/{pid}/task"):
+        with open(f"/proc/{pid}/task/{tid}/status") as f:
+            for line in f:
+                if "ctxt_switches" in line:
+                    counters["ctxt"] += int(line.split()[-1])
+    return counters
+
+
+def _run(depth, num_requests):
+    pipeline = Pipeline()
+    num_batches = max(1, num_requests // depth)
+    start = time.perf_counter()
+    for batch in range(num_batches):
+        for ix in range(depth):
+            pipeline.set(f"bench_pipeline_{ix}", batch)
+        pipeline.execute()
+        pipeline._keys.clear()
+        pipeline._wbuff.clear()
+    elapsed = time.perf_counter() - start
+    pipeline.close()
+    return num_batches * depth, elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--depth", type=int, nargs="+", default=[1, 16, 64])
+    parser.add_argument("--requests", type=int, default=20000)
+    parser.add_argument("--server-pid", type=int, default=None)
+    args = parser.parse_args()
+
+    header = f"{'depth':>6} {'req/s':>10}"
+    if args.server_pid is not None:
+        header += f" {'rw sys/req':>11} {'ctxsw/req':>10}"
+    print(header)
+    for depth in args.depth:
+        before = _server_counters(args.server_pid)
+        num_done, elapsed = _run(depth, args.requests)
+        after = _server_counters(args.server_pid)
+        line = f"{depth:>6} {num_done / elapsed:>10.0f}"
+        if before is not None:
+            rw = (after["syscr"] + after["syscw"]) - (before["syscr"] + before["syscw"])
+            ctxt = after["ctxt"] - before["ctxt"]
+            line += f" {rw / num_done:>11.2f} {ctxt / num_done:>10.2f}"
+        print(line)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,79 @@
+"""
+Measure request latency under skewed, bursty load from many clients.
+
+A few heavy clients send back to back bursts of pipelined requests while many
+light clients send one request at a time. The latency percentiles of the light
+clients' requests show how long a request waits behind the bursts.
+
+Run the server first (`python -m five_one_one_kv.server`), then:
+
+    python benchmarks/bench_skew.py --light 16 --heavy 2 --depth 16
+"""
+import argparse
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+from five_one_one_kv import Client, Pipeline
+
+
+def _light(name, stop):
+    client = Client()
+    latencies = []
+    ix = 0
+    while not stop.is_set():
+        start = time.perf_counter()
+        client[f"{name}_{ix % 16}"] = ix
+        latencies.append(time.perf_counter() - start)
+        ix += 1
+    client.close()
+    return latencies
+
+
+def _heavy(name, depth, stop):
+    pipeline = Pipeline()
+    num_done = 0
+    while not stop.is_set():
+        for ix in range(depth):
+            pipeline.set(f"{name}_{ix}", num_done)
+        pipeline.execute()
+        pipeline._keys.clear()
+        pipeline._wbuff.clear()
+        num_done += depth
+    pipeline.close()
+    return num_done
+
+
+def _percentile(values, pct):
+    return values[min(len(values) - 1, int(len(values) * pct / 100))]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--light", type=int, default=16)
+    parser.add_argument("--heavy", type=int, default=2)
+    parser.add_argument("--depth", type=int, default=16)
+    parser.add_argument("--seconds", type=float, default=5.0)
+    args = parser.parse_args()
+
+    stop = threading.Event()
+    with ThreadPoolExecutor(max_workers=args.light + args.heavy) as executor:
+        heavy = [executor.submit(_heavy, f"bench_skew_heavy_{ix}", args.depth, stop) for ix in range(args.heavy)]
+        light = [executor.submit(_light, f"bench_skew_light_{ix}", stop) for ix in range(args.light)]
+        time.sleep(args.seconds)
+        stop.set()
+        latencies = sorted(lat for future in light for lat in future.result())
+        heavy_done = sum(future.result() for future in heavy)
+
+    print(f"{'light req/s':>12} {'p50 us':>9} {'p99 us':>9} {'p99.9 us':>9} {'heavy req/s':>12}")
+    print(
+        f"{len(latencies) / args.seconds:>12.0f}"
+        f" {_percentile(latencies, 50) * 1e6:>9.0f}"
+        f" {_percentile(latencies, 99) * 1e6:>9.0f}"
+        f" {_percentile(latencies, 99.9) * 1e6:>9.0f}"
+        f" {heavy_done / args.seconds:>12.0f}"
+    )
+
+
+if __name__ == "__main__":
+    main()
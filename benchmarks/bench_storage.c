@@ -0,0 +1,165 @@
+// microbenchmark for the storage's tables
+//
+// fills a storage with N keys, the way do_set() does (lock the key's shard,
+// insert, unlock), then looks up random keys that are present. the latency of
+// every insert is recorded, so the tail shows what growing the tables costs
+// the unlucky requests that trigger it.
+//
+//  * insert: inserts/s and insert latency percentiles while growing to N keys.
+//    every shard's table grows last near the end, so with STORAGE_NUM_SHARDS
+//    shards the STORAGE_NUM_SHARDS-th slowest insert shows how long the biggest
+//    growths stall, without the noise of the few slowest ones.
+//  * lookup: lookups/s of random present keys in the full storage
+//
+// `make bench-storage` builds it twice, with incremental rehashing and with
+// STORAGE_MIGRATE_SLOTS=0, which moves a whole table at once when it grows,
+// and runs both. sizes default to 1M, 10M and 50M keys, 50M needs about 5GB,
+// pass others with `make bench-storage SIZES="1000000 10000000"`.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <Python.h>
+
+#include "../server/util.h"
+#include "../server/storage.h"
+
+#define NUM_LOOKUPS 5000000
+
+static double now_us() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+
+}
+
+static int cmp_float(const void *a, const void *b) {
+
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+
+}
+
+static inline uint64_t xorshift(uint64_t *state) {
+
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+
+}
+
+static inline uint16_t make_key(uint8_t *buff, uint64_t ix) {
+    // a wire encoded str key, like the client sends
+
+    return (uint16_t)sprintf((char *)buff, "\"key_%lu", (unsigned long)ix);
+
+}
+
+static int32_t run(uint64_t num_keys) {
+
+    struct storage_t *storage = storage_new();
+    float *latency = PyMem_RawMalloc(num_keys * sizeof(float));
+    if (!storage || !latency) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+
+    uint8_t key[32];
+    const uint8_t val[] = "#12345";
+
+    double start = now_us();
+    for (uint64_t ix = 0; ix < num_keys; ix++) {
+        uint16_t key_len = make_key(key, ix);
+        double op_start = now_us();
+        struct storage_entry_t *entry = storage_entry_new(key, key_len, val, sizeof(val) - 1, STORAGE_VALUE);
+        struct storage_shard_t *shard = storage_shard(storage, entry->hash);
+        struct storage_entry_t *replaced;
+        storage_shard_lock(shard);
+        int32_t err = storage_insert(shard, entry, &replaced);
+        storage_shard_unlock(shard);
+        latency[ix] = (float)(now_us() - op_start);
+        if (err) {
+            fprintf(stderr, "out of memory after %lu keys\n", (unsigned long)ix);
+            return -1;
+        }
+    }
+    double insert_elapsed = now_us() - start;
+
+    uint64_t rng = 88172645463325252ULL;
+    uint64_t found = 0;
+    start = now_us();
+    for (uint64_t ix = 0; ix < NUM_LOOKUPS; ix++) {
+        uint16_t key_len = make_key(key, xorshift(&rng) % num_keys);
+        uint64_t hash = storage_hash(key, key_len);
+        struct storage_shard_t *shard = storage_shard(storage, hash);
+        storage_shard_read_lock(shard);
+        found += storage_find(shard, hash, key, key_len) != NULL;
+        storage_shard_unlock(shard);
+    }
+    double lookup_elapsed = now_us() - start;
+    if (found != NUM_LOOKUPS) {
+        fprintf(stderr, "only found %lu of %d keys\n", (unsigned long)found, NUM_LOOKUPS);
+        return -1;
+    }
+
+    qsort(latency, num_keys, sizeof(float), cmp_float);
+    printf("%10lu %12.0f %9.2f %9.2f %10.1f %10.1f %10.1f %12.0f\n",
+           (unsigned long)num_keys,
+           num_keys / insert_elapsed * 1e6,
+           latency[num_keys / 2],
+           latency[num_keys * 99 / 100],
+           latency[num_keys - 1 - num_keys / 10000],
+           latency[num_keys - STORAGE_NUM_SHARDS],
+           latency[num_keys - 1],
+           NUM_LOOKUPS / lookup_elapsed * 1e6);
+
+    PyMem_RawFree(latency);
+    storage_dealloc(storage);
+
+    return 0;
+
+}
+
+int main(int argc, char **argv) {
+
+    Py_Initialize();
+
+    // util.c logs through these, without ensure_py_deps() and the rest of the module
+    PyObject *logging = PyImport_ImportModule("logging");
+    _logger = PyObject_CallMethod(logging, "getLogger", "s", "bench_storage");
+    _error_str = PyUnicode_FromString("error");
+    _warning_str = PyUnicode_FromString("warning");
+    _info_str = PyUnicode_FromString("info");
+    _debug_str = PyUnicode_FromString("debug");
+    hash64_seed_init();
+
+    printf("STORAGE_MIGRATE_SLOTS=%d\n", STORAGE_MIGRATE_SLOTS);
+    printf("%10s %12s %9s %9s %10s %10s %10s %12s\n", "keys", "inserts/s", "p50 us", "p99 us", "p99.99 us", "64th us", "max us", "lookups/s");
+    if (argc > 1) {
+        for (int32_t ix = 1; ix < argc; ix++) {
+            if (run(strtoull(argv[ix], NULL, 10))) {
+                return 1;
+            }
+        }
+    } else {
+        uint64_t sizes[] = {1000000, 10000000, 50000000};
+        for (size_t ix = 0; ix < sizeof(sizes) / sizeof(sizes[0]); ix++) {
+            if (run(sizes[ix])) {
+                return 1;
+            }
+        }
+    }
+
+    Py_DECREF(logging);
+    Py_FinalizeEx();
+
+    return 0;
+
+}
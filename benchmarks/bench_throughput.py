@@ -0,0 +1,94 @@
+"""
+Measure how GET/PUT throughput scales with the server's `--num-threads`.
+
+Stop any running server first: a server is started for every thread count,
+and several client processes send pipelined GETs and PUTs to it at once.
+Requests are served from the native storage without the GIL, so throughput
+should grow with the number of io threads until the clients or the cores run
+out.
+
+    python benchmarks/bench_throughput.py --num-threads 4 8 16 --clients 8 --reads 95
+
+`--reads` is the percentage of requests that are GETs, the rest are PUTs.
+GETs of the same shard share its lock, PUTs take it exclusively.
+"""
+import argparse
+import multiprocessing
+import subprocess
+import sys
+import time
+
+from five_one_one_kv import Pipeline
+
+
+def _client(name, num_requests, depth, reads, conn):
+    pipeline = Pipeline()
+    for ix in range(depth):
+        pipeline.set(f"{name}_{ix}", ix)
+    pipeline.execute()
+    pipeline._keys.clear()
+    pipeline._wbuff.clear()
+    conn.send("ready")
+    conn.recv()
+    for batch in range(num_requests // depth):
+        for ix in range(depth):
+            if (batch * depth + ix) % 100 >= reads:
+                pipeline.set(f"{name}_{ix}", batch)
+            else:
+                pipeline.get(f"{name}_{ix}")
+        pipeline.execute()
+        pipeline._keys.clear()
+        pipeline._wbuff.clear()
+    conn.send("done")
+    pipeline.close()
+
+
+def _run(num_threads, num_clients, num_requests, depth, reads):
+    server = subprocess.Popen(
+        [sys.executable, "-m", "five_one_one_kv.server", "--num-threads", str(num_threads)],
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL,
+    )
+    try:
+        time.sleep(1)
+        ctx = multiprocessing.get_context("spawn")
+        conns, procs = [], []
+        for ix in range(num_clients):
+            conn, child_conn = ctx.Pipe()
+            proc = ctx.Process(target=_client, args=(f"bench_throughput_{ix}", num_requests, depth, reads, child_conn))
+            proc.start()
+            conns.append(conn)
+            procs.append(proc)
+        for conn in conns:
+            conn.recv()
+        start = time.perf_counter()
+        for conn in conns:
+            conn.send("go")
+        for conn in conns:
+            conn.recv()
+        elapsed = time.perf_counter() - start
+        for proc in procs:
+            proc.join()
+    finally:
+        server.kill()
+        server.wait()
+    return num_clients * (num_requests // depth) * depth / elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--num-threads", type=int, nargs="+", default=[4, 8, 16])
+    parser.add_argument("--clients", type=int, default=8)
+    parser.add_argument("--requests", type=int, default=20000)
+    parser.add_argument("--depth", type=int, default=16)
+    parser.add_argument("--reads", type=int, default=75)
+    args = parser.parse_args()
+
+    print(f"{'threads':>8} {'req/s':>10}")
+    for num_threads in args.num_threads:
+        rate = _run(num_threads, args.clients, args.requests, args.depth, args.reads)
+        print(f"{num_threads:>8} {rate:>10.0f}")
+
+
+if __name__ == "__main__":
+    main()
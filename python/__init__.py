@@ -1,3 +1,4 @@
 from .client import Client  # noqa
 from .client import Pipeline  # noqa
+from .client import Transaction  # noqa
 from .server import Server  # noqa
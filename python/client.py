@@ -1,9 +1,10 @@
 import collections
+import itertools
 import logging
 import socket
 import struct
 from datetime import datetime, timedelta, timezone
-from typing import Any, Tuple, Union
+from typing import Any, Iterable, Tuple, Union
 
 from five_one_one_kv.c import (
     MAX_MSG_SIZE,
@@ -13,9 +14,13 @@ from five_one_one_kv.c import (
     RES_BAD_HASH,
     RES_BAD_IX,
     RES_BAD_KEY,
+    RES_BAD_LOCK,
     RES_BAD_OP,
+    RES_BAD_RANGE,
     RES_BAD_TYPE,
+    RES_BAD_VERSION,
     RES_ERR_CLIENT,
+    RES_ERR_MEMORY,
     RES_ERR_SERVER,
     RES_OK,
     RES_UNKNOWN,
@@ -26,10 +31,13 @@ from five_one_one_kv.c import (
 from five_one_one_kv.exceptions import (
     ClientError,
     EmbeddedCollectionError,
+    LockError,
     NotEnoughDataError,
     NotHashableError,
+    OutOfMemoryError,
     ServerError,
     TooLargeError,
+    VersionMismatchError,
 )
 
 logger = logging.getLogger(__name__)
@@ -158,6 +166,7 @@ _code_to_exc[RES_UNKNOWN] = Exception(
 )
 _code_to_exc[RES_ERR_SERVER] = ServerError("Server encountered an error")
 _code_to_exc[RES_ERR_CLIENT] = ClientError("Server claims client made a mistake")
+_code_to_exc[RES_ERR_MEMORY] = OutOfMemoryError("Server is at its maxmemory")
 _code_to_exc[RES_BAD_CMD] = Exception("Server did not recognize the command")
 _code_to_exc[RES_BAD_TYPE] = TypeError("Server did not recognize the argument type")
 _code_to_exc[RES_BAD_KEY] = KeyError("")
@@ -170,11 +179,16 @@ _code_to_exc[RES_BAD_HASH] = TypeError("Tried to send an unhashable type as a ke
 _code_to_exc[RES_BAD_COLLECTION] = EmbeddedCollectionError(
     "Cannot embed a collection in another collection."
 )
+_code_to_exc[RES_BAD_RANGE] = OverflowError("The result is out of range")
+_code_to_exc[RES_BAD_VERSION] = VersionMismatchError(
+    "The key's version or value did not match"
+)
+_code_to_exc[RES_BAD_LOCK] = LockError("The lock is held by another owner")
 
 
 class Client:
-    def __init__(self):
-        self._sock = socket.create_connection(("0.0.0.0", 8513))
+    def __init__(self, port=8513):
+        self._sock = socket.create_connection(("0.0.0.0", port))
 
     def close(self):
         self._sock.shutdown(socket.SHUT_RDWR)
@@ -196,9 +210,25 @@ class Client:
             exc = KeyError(f"key {key} was not found")
         raise exc
 
-    def get(self, key: Any) -> bytes:
+    def get(self, key: Any, version: bool = False) -> bytes:
+        """
+        Returns the value at `key`, or None if there is none. With `version`,
+        returns the value and the key's version, (None, 0) if there is none,
+        which `cas()` can write back.
+        """
         dumped_key = dumps_hashable(key)
-        return self._submit(key, _pack(b"get", dumped_key), suppress_errors=(KeyError,))
+        if not version:
+            return self._submit(key, _pack(b"get", dumped_key), suppress_errors=(KeyError,))
+        try:
+            items = self._submit(key, _pack(b"get", dumped_key, dumps("version"), dumps(True)))
+        except KeyError:
+            return None, 0
+        if items is None:
+            # queued in a pipeline
+            return None
+        # the value comes as its encoding, lists can't hold collections
+        found_version, val = items
+        return loads(val), found_version
 
     def __getitem__(self, key: Any) -> Any:
         dumped_key = dumps_hashable(key)
@@ -236,6 +266,36 @@ class Client:
             return self._submit(key, _pack(b"put", dumped_key, val, ttl))
         return self._submit(key, _pack(b"put", dumped_key, val))
 
+    def cas(
+        self, key: Any, version: int, val: Any, ttl: Union[datetime, timedelta, int, None] = None
+    ) -> Union[int, None]:
+        """
+        Sets `key` to `val` only if the key is still at `version`, as returned
+        by `get(key, version=True)`, 0 meaning that the key must not exist.
+        Returns the key's new version, or None if it was written since.
+
+        Every write of a key gives it a higher version, so a read, modify,
+        `cas()` loop never loses a concurrent write.
+        """
+        dumped_key = dumps_hashable(key)
+        args = [dumped_key, dumps(version), dumps(val)]
+        if ttl is not None:
+            args.append(_convert_ttl(ttl))
+        return self._submit(key, _pack(b"cas", *args), suppress_errors=(VersionMismatchError,))
+
+    def setif(
+        self, key: Any, expected: Any, val: Any, ttl: Union[datetime, timedelta, int, None] = None
+    ) -> Union[int, None]:
+        """
+        Sets `key` to `val` only if it holds `expected`. Returns the key's new
+        version, or None if it holds something else or nothing.
+        """
+        dumped_key = dumps_hashable(key)
+        args = [dumped_key, dumps(expected), dumps(val)]
+        if ttl is not None:
+            args.append(_convert_ttl(ttl))
+        return self._submit(key, _pack(b"setif", *args), suppress_errors=(VersionMismatchError,))
+
     def __delitem__(self, key: Any) -> None:
         dumped_key = dumps_hashable(key)
         self._submit(key, _pack(b"del", dumped_key))
@@ -265,6 +325,266 @@ class Client:
             return self._submit(key, _pack(b"ttl", dumped_key, ttl))
         return self._submit(key, _pack(b"ttl", dumped_key))
 
+    def mget(self, keys: Iterable) -> list:
+        """
+        Returns the values of `keys` in one request, with None for keys that
+        are missing or hold a queue.
+        """
+        keys = list(keys)
+        if not keys:
+            return []
+        items = self._submit(keys, _pack(b"mget", *(dumps_hashable(key) for key in keys)))
+        if items is None:
+            # queued in a pipeline
+            return None
+        # values come as their encoding, lists can't hold collections
+        return [loads(item) if item else None for item in items]
+
+    def mset(self, mapping: dict) -> None:
+        """
+        Sets every key of `mapping` to its value in one request, all of them or
+        none if they don't fit in the server's maxmemory.
+        """
+        args = []
+        for key, val in mapping.items():
+            args.append(dumps_hashable(key))
+            args.append(dumps(val))
+        if not args:
+            return None
+        return self._submit(list(mapping), _pack(b"mset", *args))
+
+    def mdel(self, keys: Iterable) -> int:
+        """
+        Deletes `keys` in one request and returns how many of them there were.
+        """
+        keys = list(keys)
+        if not keys:
+            return 0
+        return self._submit(keys, _pack(b"mdel", *(dumps_hashable(key) for key in keys)))
+
+    def scan(
+        self, cursor: int = 0, match: str = None, type: str = None, count: int = None
+    ) -> Tuple[int, list]:
+        """
+        Returns the cursor to pass to the next call, 0 once every key was
+        visited, and a batch of keys. Start with cursor 0. Every key that is
+        there for the whole scan is returned at least once, keys can be
+        returned more than once if the server's tables grow in between.
+
+        Args:
+            cursor: 0, or the cursor the last call returned.
+            match (optional): a glob like `user:*` that str, bytes, int and
+                float keys are matched against, tuple keys never match.
+            type (optional): only return keys holding this type, one of int,
+                float, str, bytes, tuple, list, bool, datetime or queue.
+            count (optional): about how many keys the server visits for the
+                batch, 100 by default. Filtered keys are visited too, so a
+                batch can be empty before the scan is done.
+        """
+        args = [b"scan", dumps(cursor)]
+        if count is not None:
+            args += [dumps("count"), dumps(count)]
+        if match is not None:
+            args += [dumps("match"), dumps(match)]
+        if type is not None:
+            args += [dumps("type"), dumps(type)]
+        items = self._submit(None, _pack(*args))
+        if items is None:
+            # queued in a pipeline
+            return None
+        # keys come as their encoding, lists can't hold tuples
+        return items[0], [loads(key) for key in items[1:]]
+
+    def scan_iter(self, match: str = None, type: str = None, count: int = None):
+        """
+        Yields every key, see `scan()`.
+        """
+        cursor = 0
+        while True:
+            cursor, keys = self.scan(cursor, match=match, type=type, count=count)
+            yield from keys
+            if not cursor:
+                return
+
+    def range(
+        self,
+        prefix: Any = None,
+        start: Any = None,
+        stop: Any = None,
+        after: Any = None,
+        count: int = None,
+        values: bool = False,
+    ) -> Tuple[Any, list]:
+        """
+        Returns the key to pass as `after` for the next batch, None once there
+        are no more, and a batch of keys in order, or of (key, value) pairs if
+        `values` is set. Needs a server started with an index, which holds the
+        str, bytes and tuple keys.
+
+        Keys are ordered like python orders them, and keys of different types
+        by type: numbers, str, bytes, then tuples.
+
+        Args:
+            prefix (optional): only keys that are this tuple, or start with its
+                items, or str or bytes keys that start with it, like
+                `("user", 42)` for every `("user", 42, ...)`.
+            start (optional): only keys from this one on.
+            stop (optional): only keys before this one.
+            after (optional): only keys after this one, the key the last call
+                returned. Can't be given with `start`.
+            count (optional): the most keys to return, 100 by default.
+            values (optional): return the value of each key too, None for a
+                queue.
+        """
+        args = [b"range"]
+        for name, key in (("prefix", prefix), ("start", start), ("after", after), ("stop", stop)):
+            if key is not None:
+                args += [dumps(name), dumps_hashable(key)]
+        if count is not None:
+            args += [dumps("count"), dumps(count)]
+        if values:
+            args += [dumps("values"), dumps(True)]
+        items = self._submit(None, _pack(*args))
+        if items is None:
+            # queued in a pipeline
+            return None
+        # keys and values come as their encoding, lists can't hold tuples
+        more, items = items[0], [loads(item) if item else None for item in items[1:]]
+        if values:
+            items = list(zip(items[::2], items[1::2]))
+            last = items[-1][0] if items else None
+        else:
+            last = items[-1] if items else None
+        return (last if more else None), items
+
+    def range_iter(self, prefix: Any = None, start: Any = None, stop: Any = None, count: int = None, values: bool = False):
+        """
+        Yields every key in order, or (key, value) pairs, see `range()`.
+        """
+        after = None
+        while True:
+            if after is None:
+                after, items = self.range(prefix=prefix, start=start, stop=stop, count=count, values=values)
+            else:
+                after, items = self.range(prefix=prefix, after=after, stop=stop, count=count, values=values)
+            yield from items
+            if after is None:
+                return
+
+    def incr(self, key: Any, amount: Union[int, float] = 1) -> Union[int, float]:
+        """
+        Adds `amount` to the number at `key`, or to 0 if there is none, and
+        returns the result. The server does the addition, so concurrent
+        increments are never lost. Ints stay 64 bit ints, adding a float makes
+        the value a float.
+        """
+        dumped_key = dumps_hashable(key)
+        if isinstance(amount, float):
+            return self._submit(key, _pack(b"incrbyfloat", dumped_key, dumps(amount)))
+        if amount == 1:
+            return self._submit(key, _pack(b"incr", dumped_key))
+        return self._submit(key, _pack(b"incrby", dumped_key, dumps(amount)))
+
+    def decr(self, key: Any, amount: Union[int, float] = 1) -> Union[int, float]:
+        """
+        Subtracts `amount` from the number at `key`, see `incr()`.
+        """
+        if amount == 1:
+            return self._submit(key, _pack(b"decr", dumps_hashable(key)))
+        return self.incr(key, -amount)
+
+    def lock(self, name: Any, token: Any, lease: int = 10, wait: int = 0) -> Union[int, None]:
+        """
+        Locks `name` for `token` for `lease` seconds, and returns the lock's
+        fencing token, which is higher for every grant of any lock, or None if
+        another token holds it. With `wait`, waits up to that many seconds for
+        the lock, in line behind the others that wait for it.
+
+        Locks are their own namespace, `name` has nothing to do with the key
+        of the same name. Locking again with the token that holds the lock
+        renews its lease.
+        """
+        args = [dumps_hashable(name), dumps_hashable(token), dumps(lease)]
+        if wait:
+            args.append(dumps(wait))
+        return self._submit(name, _pack(b"lock", *args), suppress_errors=(LockError,))
+
+    def unlock(self, name: Any, token: Any) -> bool:
+        """
+        Releases `name` if `token` holds it, granting it to the next in line.
+        Returns False if it doesn't, e.g. because its lease ran out.
+        """
+        try:
+            self._submit(name, _pack(b"unlock", dumps_hashable(name), dumps_hashable(token)))
+        except LockError:
+            return False
+        return True
+
+    def extend(self, name: Any, token: Any, lease: int) -> bool:
+        """
+        Makes the lease of `name` end `lease` seconds from now, if `token`
+        holds it. Returns False if it doesn't.
+        """
+        try:
+            self._submit(name, _pack(b"extend", dumps_hashable(name), dumps_hashable(token), dumps(lease)))
+        except LockError:
+            return False
+        return True
+
+    def info(self) -> dict:
+        """
+        Returns the server's counters: the number of `keys`, the `used_memory`
+        of the storage in bytes, its `maxmemory` (0 for no limit), the
+        `maxmemory_policy` and the number of `evicted_keys`, the number of
+        held `locks` and of `lock_waiters`, and with an index the number of
+        `index_keys` and the `index_memory` in bytes.
+        """
+        items = self._submit(None, _pack(b"info"))
+        if items is None:
+            # queued in a pipeline
+            return None
+        return dict(zip(items[::2], items[1::2]))
+
+    def memory(self, key: Any) -> int:
+        """
+        Returns the bytes the server keeps for `key`, its value or queue items
+        included.
+        """
+        dumped_key = dumps_hashable(key)
+        return self._submit(key, _pack(b"memory", dumped_key))
+
+    def stats(self, samples: int = None) -> dict:
+        """
+        Returns the number of `keys` and their `bytes` by type, and from
+        `samples` random keys (10000 by default) a `histogram` of their sizes,
+        by the upper bound of each bucket, and the `largest` of them as
+        (key, size) pairs.
+        """
+        if samples is None:
+            items = self._submit(None, _pack(b"stats"))
+        else:
+            items = self._submit(None, _pack(b"stats", dumps(samples)))
+        if items is None:
+            # queued in a pipeline
+            return None
+        stats = {"types": {}, "histogram": {}, "largest": []}
+        items = iter(items)
+        for name, value in zip(items, items):
+            if name == "largest":
+                # keys come as their encoding, lists can't hold tuples
+                stats["largest"] = [(loads(key), next(items)) for key in itertools.islice(items, value)]
+            elif name.startswith("size."):
+                bound = name[len("size.") :]
+                stats["histogram"][float(bound) if bound == "inf" else int(bound)] = value
+            elif "." in name:
+                kind, counter = name.split(".")
+                stats["types"].setdefault(kind, {})[counter] = value
+            else:
+                stats[name] = value
+        stats["keys"] = sum(counters["keys"] for counters in stats["types"].values())
+        stats["bytes"] = sum(counters["bytes"] for counters in stats["types"].values())
+        return stats
+
     def _looped_recv(self):
         response = b""
         status = RES_UNKNOWN
@@ -281,8 +601,8 @@ class Client:
 
 
 class Pipeline(Client):
-    def __init__(self):
-        self._sock = socket.create_connection(("0.0.0.0", 8513))
+    def __init__(self, port=8513):
+        self._sock = socket.create_connection(("0.0.0.0", port))
         self._keys = []
         self._wbuff = []
 
@@ -311,17 +631,47 @@ class Pipeline(Client):
             try:
                 while True:
                     status, data, offset = _unpack_from(response, offset=offset)
-                    if status == RES_OK:
-                        if data is None:
-                            results.append(None)
-                            continue
-                        results.append(loads(data))
-                        continue
-                    if status == RES_BAD_KEY:
-                        k = self._keys[len(results)]
-                        results.append(KeyError("key %s not found in server" % (k,)))
-                        continue
-                    results.append(_code_to_exc[status])
+                    results.append(self._result(status, data, self._keys[len(results)]))
             except NotEnoughDataError:
                 continue
         return results
+
+    def _result(self, status, data, key):
+        if status == RES_OK:
+            if data is None:
+                return None
+            return loads(data)
+        if status == RES_BAD_KEY:
+            return KeyError("key %s not found in server" % (key,))
+        return _code_to_exc[status]
+
+
+class Transaction(Pipeline):
+    """
+    Queues commands like a pipeline, and runs all of them on the server as one
+    `exec`, so no other client sees their keys in between. A command that fails
+    doesn't undo the ones before it, its exception is its result. Only commands
+    on keys can be part of a transaction, `execute()` raises for any other.
+    Unlike a pipeline, `execute()` empties the queue for the next transaction.
+    """
+
+    def _exec(self):
+        keys, wbuff = self._keys, self._wbuff
+        self._keys, self._wbuff = [], []
+        if not wbuff:
+            return []
+        # each command goes as bytes holding its frame without the length in
+        # front, encoded here since dumps() stops at the first 0 byte
+        data = _pack(b"exec", *(b"'" + frame[_SINGLEOFFSET:] for frame in wbuff))
+        if len(data) > MAX_MSG_SIZE:
+            raise TooLargeError("Message size was too large.")
+        self._sock.send(data)
+        status, data = Client._looped_recv(self)
+        if status != RES_OK:
+            raise _code_to_exc[status]
+        results = []
+        # each item is a command's status followed by its response
+        for key, item in zip(keys, loads(data)):
+            (status,) = struct.unpack_from("=H", item)
+            results.append(self._result(status, item[_SINGLEOFFSET:] or None, key))
+        return results
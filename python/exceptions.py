@@ -38,9 +38,36 @@ class NotHashableError(Exception):
     pass
 
 
+class OutOfMemoryError(ServerError):
+    """
+    The server is at its maxmemory and its policy does not let it evict keys to
+    make room for the write.
+    """
+
+    pass
+
+
 class TooLargeError(Exception):
     """
     The user tried to send a message to the server that was too large.
     """
 
     pass
+
+
+class VersionMismatchError(Exception):
+    """
+    A conditional write was refused because the key's version or value was not
+    the one it expected.
+    """
+
+    pass
+
+
+class LockError(Exception):
+    """
+    The lock is held by another owner, or is not held by the token that tried
+    to release or extend it.
+    """
+
+    pass
@@ -8,25 +8,113 @@ logger = logging.getLogger(__name__)
 
 
 class Server:
-    def __init__(self, port=8513, num_threads=4):
+    def __init__(
+        self,
+        port=8513,
+        num_threads=4,
+        reuseport=False,
+        io_uring=False,
+        maxmemory=0,
+        maxmemory_policy="noeviction",
+        index=False,
+    ):
+        """
+        Args:
+            port: the port to listen on.
+            num_threads: the total number of server threads.
+            reuseport: if set, every io thread opens its own SO_REUSEPORT
+                listening socket and runs its own event loop, instead of
+                sharing one poll loop and one queue of ready connections.
+            io_uring: if set, the shared poll loop receives and sends through
+                io_uring when the kernel supports it, and uses epoll otherwise.
+                Ignored in reuseport mode.
+            maxmemory: the most bytes the stored keys and values may take, 0
+                for no limit.
+            maxmemory_policy: what a write that doesn't fit does. one of
+                "noeviction" (the write fails), "allkeys-lru" (evict the least
+                recently used keys), "allkeys-lfu" (evict the least frequently
+                used keys) or "volatile-ttl" (evict the keys with a ttl that
+                expire first, and fail if there are none).
+            index: if set, the server keeps its str, bytes and tuple keys in
+                order for range queries. Every write of such a key then also
+                takes the index's lock.
+        """
         if num_threads < 4 or num_threads > 16:
             raise ValueError("num_threads must be in [4, 16]")
         try:
-            self._server = server(port=port, num_threads=num_threads)
+            self._server = server(
+                port=port,
+                num_threads=num_threads,
+                reuseport=reuseport,
+                io_uring=io_uring,
+                maxmemory=maxmemory,
+                maxmemory_policy=maxmemory_policy,
+                index=index,
+            )
         except Exception:
             logger.exception("server failed to initialize")
             raise
         logger.info("server has initialized")
-        with ThreadPoolExecutor(max_workers=num_threads) as executor:
-            executor.submit(self._server.poll_loop)
+        # the lock ttl loop is one more thread, it only wakes up for leases
+        # and waits that run out
+        with ThreadPoolExecutor(max_workers=num_threads + 1) as executor:
             executor.submit(self._server.storage_ttl_loop)
-            for _ in range(num_threads - 2):
-                executor.submit(self._server.io_loop)
+            executor.submit(self._server.lock_ttl_loop)
+            if reuseport:
+                for _ in range(num_threads - 1):
+                    executor.submit(self._server.reactor_loop)
+            else:
+                executor.submit(self._server.poll_loop)
+                for _ in range(num_threads - 2):
+                    executor.submit(self._server.io_loop)
+
+
+def _parse_size(size):
+    # bytes, or with a k, m or g suffix like "100mb" or "2g"
+    size = size.strip().lower().rstrip("b")
+    for suffix, scale in (("k", 1 << 10), ("m", 1 << 20), ("g", 1 << 30)):
+        if size.endswith(suffix):
+            return int(size[:-1]) * scale
+    return int(size)
 
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser()
     parser.add_argument("-v", "--verbose", action="count", default=0)
+    parser.add_argument("--port", type=int, default=8513)
+    parser.add_argument(
+        "--num-threads",
+        type=int,
+        default=4,
+        help="total number of server threads, in [4, 16]",
+    )
+    parser.add_argument(
+        "--reuseport",
+        action="store_true",
+        help="run one SO_REUSEPORT event loop per io thread",
+    )
+    parser.add_argument(
+        "--io-uring",
+        action="store_true",
+        help="receive and send through io_uring if the kernel supports it",
+    )
+    parser.add_argument(
+        "--maxmemory",
+        type=_parse_size,
+        default=0,
+        help="most memory for keys and values, like 100mb, 0 for no limit",
+    )
+    parser.add_argument(
+        "--maxmemory-policy",
+        choices=("noeviction", "allkeys-lru", "allkeys-lfu", "volatile-ttl"),
+        default="noeviction",
+        help="what to do when a write doesn't fit in maxmemory",
+    )
+    parser.add_argument(
+        "--index",
+        action="store_true",
+        help="keep str, bytes and tuple keys in order for range queries",
+    )
     args = parser.parse_args()
     if args.verbose > 0:
         import logging
@@ -49,4 +137,12 @@ if __name__ == "__main__":
         else:
             logger.setLevel(logging.DEBUG)
 
-    my_server = Server()
+    my_server = Server(
+        port=args.port,
+        num_threads=args.num_threads,
+        reuseport=args.reuseport,
+        io_uring=args.io_uring,
+        maxmemory=args.maxmemory,
+        maxmemory_policy=args.maxmemory_policy,
+        index=args.index,
+    )
@@ -0,0 +1,174 @@
+// size-classed buffer pool for connection buffers, with per thread caches and a shared depot
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <semaphore.h>
+
+#include "util.h"
+#include "bufpool.h"
+
+// CHANGE ME
+#define _FOO_KV_DEBUG 1
+
+static __thread struct bufpool_class_t thread_cache[BUFPOOL_NUM_CLASSES];
+static struct bufpool_depot_t depot;
+// bytes currently allocated by the pool, whether they are lent out or cached
+static int64_t allocated_bytes = 0;
+
+int32_t bufpool_init(void) {
+
+    return sem_init(&depot.lock, 0, 1) ? -1 : 0;
+
+}
+
+static int32_t depot_lock(void) {
+
+    // the lock is only ever held to move a few pointers, so try before giving up the GIL
+    if (!sem_trywait(&depot.lock)) {
+        return 0;
+    }
+    return threadsafe_sem_wait(&depot.lock);
+
+}
+
+static int32_t bufpool_class(size_t size) {
+    // returns the smallest class that fits `size`, or -1 if it is too large for the pool
+
+    int32_t cls = 0;
+    size_t class_size = (size_t)1 << BUFPOOL_MIN_SHIFT;
+    while (class_size < size) {
+        class_size <<= 1;
+        cls++;
+    }
+
+    return (cls < BUFPOOL_NUM_CLASSES) ? cls : -1;
+
+}
+
+static inline size_t bufpool_class_size(int32_t cls) {
+    return (size_t)1 << (BUFPOOL_MIN_SHIFT + cls);
+}
+
+static inline uint32_t bufpool_thread_cap(int32_t cls) {
+    // at least 2, so a cache that spills half of itself keeps something
+    uint32_t cap = BUFPOOL_THREAD_CACHE_BYTES / bufpool_class_size(cls);
+    return (cap < 2) ? 2 : cap;
+}
+
+static inline void freelist_push(struct bufpool_class_t *list, void *buff) {
+    *(void **)buff = list->head;
+    list->head = buff;
+    list->count++;
+}
+
+static inline void *freelist_pop(struct bufpool_class_t *list) {
+    void *buff = list->head;
+    if (buff) {
+        list->head = *(void **)buff;
+        list->count--;
+    }
+    return buff;
+}
+
+uint8_t *bufpool_get(size_t size, size_t *capacity) {
+    // borrows a buffer of at least `size` bytes, its real size is stored in `capacity`
+    // returns NULL if out of memory
+
+    int32_t cls = bufpool_class(size);
+    if (cls < 0) {
+        uint8_t *buff = PyMem_RawMalloc(size);
+        if (buff) {
+            __atomic_add_fetch(&allocated_bytes, size, __ATOMIC_RELAXED);
+            *capacity = size;
+        }
+        return buff;
+    }
+
+    struct bufpool_class_t *cache = &thread_cache[cls];
+    *capacity = bufpool_class_size(cls);
+
+    void *buff = freelist_pop(cache);
+    if (buff) {
+        return buff;
+    }
+
+    // refill up to half of the cache from the depot, so the next few gets are local
+    if (__atomic_load_n(&depot.classes[cls].count, __ATOMIC_RELAXED)) {
+        uint32_t want = bufpool_thread_cap(cls) / 2;
+        if (!depot_lock()) {
+            struct bufpool_class_t *shared = &depot.classes[cls];
+            while (want-- && shared->head) {
+                freelist_push(cache, freelist_pop(shared));
+            }
+            sem_post(&depot.lock);
+        }
+        buff = freelist_pop(cache);
+        if (buff) {
+            return buff;
+        }
+    }
+
+    buff = PyMem_RawMalloc(*capacity);
+    if (buff) {
+        __atomic_add_fetch(&allocated_bytes, *capacity, __ATOMIC_RELAXED);
+    }
+
+    return buff;
+
+}
+
+void bufpool_put(uint8_t *buff, size_t capacity) {
+    // returns a buffer borrowed with bufpool_get(), `capacity` is the size it
+    // reported
+
+    if (!buff) {
+        return;
+    }
+
+    int32_t cls = bufpool_class(capacity);
+    if (cls < 0 || bufpool_class_size(cls) != capacity) {
+        PyMem_RawFree(buff);
+        __atomic_sub_fetch(&allocated_bytes, capacity, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct bufpool_class_t *cache = &thread_cache[cls];
+    uint32_t cap = bufpool_thread_cap(cls);
+    if (cache->count < cap) {
+        freelist_push(cache, buff);
+        return;
+    }
+
+    // the cache is full, which happens on threads that return more buffers
+    // than they borrow: move half of it to the depot, and free what the depot
+    // has no room for
+    freelist_push(cache, buff);
+    uint32_t depot_cap = BUFPOOL_DEPOT_BYTES / capacity;
+    size_t num_freed = 0;
+    if (depot_lock()) {
+        return;
+    }
+    struct bufpool_class_t *shared = &depot.classes[cls];
+    while (cache->count > cap / 2) {
+        void *spill = freelist_pop(cache);
+        if (shared->count < depot_cap) {
+            freelist_push(shared, spill);
+        } else {
+            PyMem_RawFree(spill);
+            num_freed++;
+        }
+    }
+    sem_post(&depot.lock);
+
+    if (num_freed) {
+        __atomic_sub_fetch(&allocated_bytes, num_freed * capacity, __ATOMIC_RELAXED);
+    }
+
+}
+
+int64_t bufpool_allocated_bytes(void) {
+
+    return __atomic_load_n(&allocated_bytes, __ATOMIC_RELAXED);
+
+}
@@ -0,0 +1,44 @@
+#ifndef _FOO_KV_BUFPOOL
+#define _FOO_KV_BUFPOOL
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <semaphore.h>
+
+#include <Python.h>
+
+// size classes are powers of 2 from 4 KiB (DEFAULT_MSG_SIZE) to 512 KiB, which
+// covers the largest buffer a connection uses (a batch of responses, see
+// MAX_RESPONSE_BATCH). larger requests bypass the pool.
+#define BUFPOOL_MIN_SHIFT 12
+#define BUFPOOL_NUM_CLASSES 8
+// how many bytes of each class a thread keeps for itself, and how many more
+// are kept in the shared depot, before buffers are given back to the allocator
+#define BUFPOOL_THREAD_CACHE_BYTES (256 * 1024)
+#define BUFPOOL_DEPOT_BYTES (2 * 1024 * 1024)
+
+// connection buffers are borrowed from the pool while a read or write is in
+// flight, and returned when they are empty, so memory scales with the number of
+// active connections rather than with the number of open connections.
+// every thread has a cache per size class, so borrowing and returning usually
+// touch no shared state. a buffer can be returned by a different thread than the
+// one that borrowed it (the reactor frees the buffers io workers filled), so
+// caches that overflow spill half of their buffers into a shared depot, and
+// empty caches refill from it.
+// free buffers are kept on intrusive lists, linked through their first bytes.
+struct bufpool_class_t {
+    void *head;
+    uint32_t count;
+};
+
+struct bufpool_depot_t {
+    sem_t lock;
+    struct bufpool_class_t classes[BUFPOOL_NUM_CLASSES];
+};
+
+int32_t bufpool_init(void);
+uint8_t *bufpool_get(size_t size, size_t *capacity);
+void bufpool_put(uint8_t *buff, size_t capacity);
+int64_t bufpool_allocated_bytes(void);
+
+#endif
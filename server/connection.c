@@ -17,6 +17,8 @@
 
 #include "util.h"
 #include "connection.h"
+#include "bufpool.h"
+#include "slab.h"
 
 // CHANGE ME
 #define _FOO_KV_DEBUG 1
@@ -44,9 +46,26 @@ void fd_set_nb(int fd) {
 
 }
 
+// conn_t and conn_uring_t come from slabs, see conn_alloc_init()
+static struct slab_t conn_slab;
+static struct slab_t conn_uring_slab;
+
+int32_t conn_alloc_init(void) {
+
+    if (slab_init(&conn_slab, sizeof(struct conn_t))) {
+        return -1;
+    }
+    if (slab_init(&conn_uring_slab, sizeof(struct conn_uring_t))) {
+        return -1;
+    }
+
+    return 0;
+
+}
+
 struct conn_t *conn_new(int connfd) {
 
-    struct conn_t *conn = PyMem_RawCalloc(1, sizeof(struct conn_t));
+    struct conn_t *conn = slab_alloc(&conn_slab);
     if (conn == NULL) {
         close(connfd);
         return NULL;
@@ -56,119 +75,139 @@ struct conn_t *conn_new(int connfd) {
     conn->err = 0;
     conn->rbuff_size = 0;
     conn->rbuff_read = 0;
-    conn->rbuff_max = DEFAULT_MSG_SIZE;
+    conn->rbuff_max = 0;
     conn->wbuff_size = 0;
     conn->wbuff_sent = 0;
-    conn->wbuff_max = DEFAULT_MSG_SIZE;
+    conn->wbuff_max = 0;
     conn->connid = conncounter++;
+    conn->worker = -1;
 
-    conn->rbuff = PyMem_RawCalloc(DEFAULT_MSG_SIZE, sizeof(uint8_t));
+    // rbuff and wbuff are borrowed from the buffer pool when they are needed
+    conn->rbuff = NULL;
+    conn->wbuff = NULL;
+
+    sem_init(&conn->lock, 0, 1);
+
+    return conn;
+
+}
+
+int32_t conn_rbuff_acquire(struct conn_t *conn) {
+    // borrows rbuff from the buffer pool, if the connection doesn't hold one
+
+    if (conn->rbuff) {
+        return 0;
+    }
+    conn->rbuff = bufpool_get(DEFAULT_MSG_SIZE, &conn->rbuff_max);
     if (!conn->rbuff) {
-        return NULL;
+        conn->rbuff_max = 0;
+        return -1;
     }
-    conn->wbuff = PyMem_RawCalloc(DEFAULT_MSG_SIZE, sizeof(uint8_t));
-    if (!conn->wbuff) {
-        return NULL;
+    conn->rbuff_size = 0;
+    conn->rbuff_read = 0;
+
+    return 0;
+
+}
+
+void conn_release_idle_buffers(struct conn_t *conn) {
+    // returns rbuff and wbuff to the buffer pool if they are empty, so an idle
+    // connection holds no buffers
+
+    if (conn->rbuff && conn->rbuff_read == conn->rbuff_size) {
+        bufpool_put(conn->rbuff, conn->rbuff_max);
+        conn->rbuff = NULL;
+        conn->rbuff_max = 0;
+        conn->rbuff_size = 0;
+        conn->rbuff_read = 0;
+    }
+    if (conn->wbuff && conn->wbuff_sent == conn->wbuff_size) {
+        conn_wbuff_reset(conn);
     }
 
-    conn->lock = PyMem_RawCalloc(1, sizeof(sem_t));
-    if (!conn->lock) {
-        close(connfd);
+}
+
+static uint8_t *buff_grow(uint8_t *buff, size_t *buff_max, const uint8_t *keep, size_t keep_len, size_t newsize) {
+    // swaps `buff` for a pooled buffer of at least `newsize` bytes that starts
+    // with the `keep_len` bytes at `keep`
+    // returns NULL and leaves `buff` alone if out of memory
+
+    size_t newmax;
+    uint8_t *newbuff = bufpool_get(newsize, &newmax);
+    if (!newbuff) {
         return NULL;
     }
-    sem_init(conn->lock, 0, 1);
+    if (keep_len) {
+        memcpy(newbuff, keep, keep_len);
+    }
+    bufpool_put(buff, *buff_max);
+    *buff_max = newmax;
 
-    return conn;
+    return newbuff;
 
 }
 
 int32_t conn_rbuff_resize(struct conn_t *conn, uint32_t newsize) {
-
-    uint8_t *newbuff;
+    // grows rbuff to fit a frame of up to `newsize` bytes, keeping the unread bytes
 
     if (newsize == 0) {
         return -1;
     }
-
-    if (conn->rbuff_read == 0) {
-        newbuff = (uint8_t *)PyMem_RawRealloc(conn->rbuff, (newsize + 1) * sizeof(uint8_t));
-        if (!newbuff) {
-            return -1;
-        }
-    } else {
-        newbuff = PyMem_RawCalloc(newsize + 1, sizeof(uint8_t));
-        if (!newbuff) {
-            return -1;
-        }
-        memcpy(newbuff, conn->rbuff + conn->rbuff_read, conn->rbuff_size - conn->rbuff_read);
-        PyMem_RawFree(conn->rbuff);
+    if (newsize <= conn->rbuff_max) {
+        return conn_rbuff_flush(conn);
     }
 
+    size_t remain = conn->rbuff_size - conn->rbuff_read;
+    uint8_t *newbuff = buff_grow(conn->rbuff, &conn->rbuff_max, conn->rbuff + conn->rbuff_read, remain, newsize);
+    if (!newbuff) {
+        return -1;
+    }
     conn->rbuff = newbuff;
-    conn->rbuff_size -= conn->rbuff_read;
+    conn->rbuff_size = remain;
     conn->rbuff_read = 0;
-    conn->rbuff_max = newsize;
 
     return 0;
 
 }
 
 int32_t conn_wbuff_resize(struct conn_t *conn, uint32_t newsize) {
-
-    uint8_t *newbuff;
+    // grows wbuff to `newsize` bytes, keeping the unsent bytes
 
     if (newsize == 0) {
         return -1;
     }
 
-    if (conn->wbuff_sent == 0) {
-        newbuff = (uint8_t *)PyMem_RawRealloc(conn->wbuff, (newsize + 1) * sizeof(uint8_t));
-        if (!newbuff) {
-            return -1;
+    size_t remain = conn->wbuff_size - conn->wbuff_sent;
+    if (newsize <= conn->wbuff_max) {
+        if (conn->wbuff_sent) {
+            memmove(conn->wbuff, conn->wbuff + conn->wbuff_sent, remain);
         }
     } else {
-        newbuff = PyMem_RawCalloc(newsize + 1, sizeof(uint8_t));
+        uint8_t *newbuff = buff_grow(conn->wbuff, &conn->wbuff_max, conn->wbuff + conn->wbuff_sent, remain, newsize);
         if (!newbuff) {
             return -1;
         }
-        memcpy(newbuff, conn->wbuff + conn->wbuff_sent, conn->wbuff_size - conn->wbuff_sent);
-        PyMem_RawFree(conn->wbuff);
+        conn->wbuff = newbuff;
     }
-
-    conn->wbuff = newbuff;
-    conn->wbuff_size -= conn->wbuff_sent;
+    conn->wbuff_size = remain;
     conn->wbuff_sent = 0;
-    conn->wbuff_max = newsize;
 
     return 0;
 
 }
 
 int32_t conn_rbuff_flush(struct conn_t *conn) {
+    // removes the requests that have been read from the buffer, by moving the
+    // unread bytes (at most one partial request) to the front
+    // never allocates
 
-    // remove the request from the buffer
     size_t remain = conn->rbuff_size - conn->rbuff_read;
-    size_t newsize;
-    if (remain) {
-        newsize = CEIL(remain + 1, 4096);
-    } else {
-        newsize = 4096;
-    }
-    uint8_t *newbuff = PyMem_RawCalloc(newsize + 1, sizeof(uint8_t));
-    if (!newbuff) {
-        log_error("conn_rbuff_flush(): failed to flush rbuff");
-        return -1;
-    }
-    if (remain) {
-        memcpy(newbuff, conn->rbuff + conn->rbuff_read, remain);
+
+    if (remain && conn->rbuff_read) {
+        memmove(conn->rbuff, conn->rbuff + conn->rbuff_read, remain);
     }
-    PyMem_RawFree(conn->rbuff);
-    conn->rbuff = newbuff;
     conn->rbuff_size = remain;
     conn->rbuff_read = 0;
-    conn->rbuff_max = newsize;
-
-    conn->rbuff_size = remain;
 
     #if _FOO_KV_DEBUG == 1
     log_debug("conn_rbuff_flush(): successfully flushed rbuff");
@@ -178,50 +217,91 @@ int32_t conn_rbuff_flush(struct conn_t *conn) {
 
 }
 
+void conn_wbuff_reset(struct conn_t *conn) {
+    // call once wbuff has been fully sent, returns it to the buffer pool
+
+    bufpool_put(conn->wbuff, conn->wbuff_max);
+    conn->wbuff = NULL;
+    conn->wbuff_max = 0;
+    conn->wbuff_sent = 0;
+    conn->wbuff_size = 0;
+
+}
+
+static int32_t conn_wbuff_reserve(struct conn_t *conn, uint32_t len) {
+    // makes room for `len` more bytes after the responses already in wbuff
+
+    uint32_t required_wbuff_size = conn->wbuff_size + len;
+    if (required_wbuff_size <= conn->wbuff_max) {
+        return 0;
+    }
+
+    // double, so that a long batch of small responses doesn't reallocate for
+    // every one of them
+    uint32_t newsize = CEIL(required_wbuff_size + 1, 1024);
+    if (newsize < 2 * conn->wbuff_max) {
+        newsize = 2 * conn->wbuff_max;
+    }
+
+    return conn_wbuff_resize(conn, newsize);
+
+}
+
+uint8_t *response_payload(struct response_t *response, uint32_t len) {
+    // returns where the handler should copy a payload of `len` bytes, or NULL
+    // if it is too large or out of memory
+
+    struct conn_t *conn = response->conn;
+
+    // 2 for status + rest for data
+    if (sizeof(uint16_t) + response->offset + len > MAX_MSG_SIZE) {
+        log_error("response_payload(): got response larger than max allowed size");
+        return NULL;
+    }
+    // additional 2 for initial len
+    if (conn_wbuff_reserve(conn, sizeof(uint16_t) * 2 + response->offset + len) < 0) {
+        return NULL;
+    }
+    response->payload_len = len;
+
+    return conn->wbuff + conn->wbuff_size + sizeof(uint16_t) * 2 + response->offset;
+
+}
+
 int32_t conn_write_response(struct conn_t *conn, const struct response_t *response) {
+    // appends the response to wbuff, after the responses to earlier requests
+    // of the same batch
     // we should never get here if in state STATE_RES_WAITING
-    // therefore wbuff should always be flushed
+    // therefore wbuff should never be partially sent
 
-    // payload
-    int32_t payloadlen = (response->payload) ? PyBytes_GET_SIZE(response->payload) : 0;
     // 2 for status + rest for data
-    uint32_t msglen = sizeof(uint16_t) + payloadlen;
+    uint32_t msglen = sizeof(uint16_t) + response->payload_len;
     // additional 2 for initial len
-    uint32_t required_wbuff_size = sizeof(uint16_t) + msglen;
+    uint32_t required_wbuff_size = conn->wbuff_size + sizeof(uint16_t) + msglen;
 
-    // resize if necessary
-    if (required_wbuff_size > conn->wbuff_max) {
-        uint32_t newsize = CEIL(required_wbuff_size + 1, 1024);
-        if (newsize > MAX_MSG_SIZE) {
-            log_error("conn_write_response(): got response larger than max allowed size");
-            return -1;
-        }
-        if (conn_wbuff_resize(conn, newsize) < 0) {
-            return -1;
-        }
+    // the payload already has its room, see response_payload()
+    if (!response->payload_len && conn_wbuff_reserve(conn, sizeof(uint16_t) * 2) < 0) {
+        return -1;
     }
 
     #if _FOO_KV_DEBUG == 1
     char debug_buff[256];
     sprintf(debug_buff, "conn_write_response(): got response with status: %hd", response->status);
     log_debug(debug_buff);
-    if (response->payload) {
-        sprintf(debug_buff, "conn_write_response(): got response with data: %s", PyBytes_AS_STRING(response->payload));
+    if (response->payload_len) {
+        sprintf(debug_buff, "conn_write_response(): got response with data: %.*s",
+                (int)(response->payload_len < 128 ? response->payload_len : 128), conn->wbuff + conn->wbuff_size + sizeof(uint16_t) * 2);
         log_debug(debug_buff);
     }
     #endif
 
     uint16_t wmsglen = msglen;
+    uint8_t *wbuff_end = conn->wbuff + conn->wbuff_size;
 
     // write the response len
-    memcpy(conn->wbuff, &wmsglen, sizeof(uint16_t));
+    memcpy(wbuff_end, &wmsglen, sizeof(uint16_t));
     // write the response status
-    memcpy(conn->wbuff + sizeof(uint16_t), &response->status, sizeof(int16_t));
-    // write the data
-    if (response->payload) {
-        memcpy(conn->wbuff + sizeof(uint16_t) * 2, PyBytes_AS_STRING(response->payload), payloadlen);
-        Py_DECREF(response->payload);
-    }
+    memcpy(wbuff_end + sizeof(uint16_t), &response->status, sizeof(int16_t));
     // update `wbuff_size`
     conn->wbuff_size = required_wbuff_size;
 
@@ -229,6 +309,161 @@ int32_t conn_write_response(struct conn_t *conn, const struct response_t *respon
 
 }
 
+static int32_t conn_uring_lock(struct conn_uring_t *uring) {
+
+    // the lock is only ever held for a memcpy, so try before giving up the GIL
+    if (!sem_trywait(&uring->lock)) {
+        return 0;
+    }
+    return threadsafe_sem_wait(&uring->lock);
+
+}
+
+int32_t conn_uring_init(struct conn_t *conn) {
+
+    struct conn_uring_t *uring = slab_alloc(&conn_uring_slab);
+    if (!uring) {
+        return -1;
+    }
+    if (sem_init(&uring->lock, 0, 1)) {
+        slab_free(&conn_uring_slab, uring);
+        return -1;
+    }
+    conn->uring = uring;
+
+    return 0;
+
+}
+
+int32_t conn_uring_push(struct conn_t *conn, const uint8_t *data, size_t len, int32_t eof) {
+    // appends received data to the inbox, and/or records EOF (1) or a receive error (-errno)
+    // only the reactor thread may call this
+
+    struct conn_uring_t *uring = conn->uring;
+
+    if (conn_uring_lock(uring)) {
+        log_error("conn_uring_push(): sem_wait() failed");
+        return -1;
+    }
+
+    int32_t err = 0;
+    if (len) {
+        size_t unread = uring->inbox_size - uring->inbox_read;
+        if (uring->inbox_size + len > uring->inbox_max && uring->inbox_read) {
+            // compact before growing
+            memmove(uring->inbox, uring->inbox + uring->inbox_read, unread);
+            uring->inbox_size = unread;
+            uring->inbox_read = 0;
+        }
+        if (unread + len > uring->inbox_max) {
+            // an empty inbox has no buffer, so this is also where it borrows one
+            uint8_t *newbuff = buff_grow(uring->inbox, &uring->inbox_max, uring->inbox + uring->inbox_read, unread, unread + len);
+            if (!newbuff) {
+                log_error("conn_uring_push(): failed to grow inbox");
+                err = -1;
+                goto CONN_URING_PUSH_END;
+            }
+            uring->inbox = newbuff;
+            uring->inbox_size = unread;
+            uring->inbox_read = 0;
+        }
+        memcpy(uring->inbox + uring->inbox_size, data, len);
+        uring->inbox_size += len;
+    }
+    if (eof && !uring->eof) {
+        uring->eof = eof;
+    }
+
+CONN_URING_PUSH_END:
+
+    if (sem_post(&uring->lock)) {
+        log_error("conn_uring_push(): sem_post() failed");
+        return -1;
+    }
+
+    return err;
+
+}
+
+ssize_t conn_uring_pull(struct conn_t *conn, uint8_t *dst, size_t cap) {
+    // read() for connections served by the io_uring backend
+    // returns the number of bytes copied, 0 on EOF, or -1 with errno set
+    // (EAGAIN if the inbox is empty)
+
+    struct conn_uring_t *uring = conn->uring;
+
+    if (conn_uring_lock(uring)) {
+        return -1;
+    }
+
+    size_t unread = uring->inbox_size - uring->inbox_read;
+    size_t n = (unread < cap) ? unread : cap;
+    if (n) {
+        memcpy(dst, uring->inbox + uring->inbox_read, n);
+        uring->inbox_read += n;
+        if (uring->inbox_read == uring->inbox_size) {
+            bufpool_put(uring->inbox, uring->inbox_max);
+            uring->inbox = NULL;
+            uring->inbox_max = 0;
+            uring->inbox_read = 0;
+            uring->inbox_size = 0;
+        }
+    }
+    int32_t eof = uring->eof;
+
+    if (sem_post(&uring->lock)) {
+        return -1;
+    }
+
+    if (n) {
+        return (ssize_t)n;
+    }
+    if (eof > 0) {
+        return 0;
+    }
+    errno = (eof < 0) ? -eof : EAGAIN;
+    return -1;
+
+}
+
+size_t conn_uring_pending(struct conn_t *conn) {
+    // number of received bytes no io worker has consumed yet
+
+    struct conn_uring_t *uring = conn->uring;
+
+    if (conn_uring_lock(uring)) {
+        return 0;
+    }
+    size_t unread = uring->inbox_size - uring->inbox_read;
+    sem_post(&uring->lock);
+
+    return unread;
+
+}
+
+int32_t conn_has_input(struct conn_t *conn) {
+    // returns 1 if an io worker would make progress on the connection: there is a
+    // complete request in rbuff, or the inbox has data or EOF the worker has not seen
+
+    size_t unread = conn->rbuff_size - conn->rbuff_read;
+    if (unread >= sizeof(uint16_t)) {
+        uint16_t len;
+        memcpy(&len, conn->rbuff + conn->rbuff_read, sizeof(uint16_t));
+        if (unread >= sizeof(uint16_t) + len) {
+            return 1;
+        }
+    }
+
+    if (!conn->uring) {
+        return 0;
+    }
+    if (conn_uring_pending(conn)) {
+        return 1;
+    }
+    return conn->uring->eof != 0;
+
+}
+
 int32_t connarray_init(struct connarray_t *conns, int maxsize) {
 
     conns->size = 0;
@@ -287,7 +522,7 @@ int32_t connarray_put(struct connarray_t *fd_to_conn, struct conn_t *conn) {
 
 int32_t connarray_remove(struct connarray_t *fd_to_conn, struct conn_t *conn) {
 
-    if (sem_trywait(conn->lock) < 0) {
+    if (sem_trywait(&conn->lock) < 0) {
         log_warning("poll_loop(): conn lock is locked for ended connection");
         return -1;
     }
@@ -297,11 +532,16 @@ int32_t connarray_remove(struct connarray_t *fd_to_conn, struct conn_t *conn) {
     
     fd_to_conn->arr[conn->fd] = NULL;
     close(conn->fd);
-    PyMem_RawFree(conn->rbuff);
-    PyMem_RawFree(conn->wbuff);
-    sem_post(conn->lock);
-    sem_destroy(conn->lock);
-    PyMem_RawFree(conn);
+    bufpool_put(conn->rbuff, conn->rbuff_max);
+    bufpool_put(conn->wbuff, conn->wbuff_max);
+    if (conn->uring) {
+        sem_destroy(&conn->uring->lock);
+        bufpool_put(conn->uring->inbox, conn->uring->inbox_max);
+        slab_free(&conn_uring_slab, conn->uring);
+    }
+    sem_post(&conn->lock);
+    sem_destroy(&conn->lock);
+    slab_free(&conn_slab, conn);
 
     fd_to_conn->size--;
 
@@ -310,8 +550,8 @@ int32_t connarray_remove(struct connarray_t *fd_to_conn, struct conn_t *conn) {
 }
 
 int32_t accept_new_conn(struct connarray_t *fd_to_conn, int fd) {
-
-    log_info("accept_new_conn(): got new connection");
+    // returns the fd of the new connection, or -1 with errno set
+    // EAGAIN means that there was nobody left to accept
 
     struct sockaddr_in client_addr = {};
     socklen_t socklen = sizeof(client_addr);
@@ -320,10 +560,16 @@ int32_t accept_new_conn(struct connarray_t *fd_to_conn, int fd) {
     connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
     Py_END_ALLOW_THREADS
     if (connfd < 0) {
-        log_error("accept_new_conn() error");
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            int err = errno;
+            log_error("accept_new_conn() error");
+            errno = err;
+        }
         return -1;
     }
 
+    log_info("accept_new_conn(): got new connection");
+
     if (connfd < fd_to_conn->maxsize && fd_to_conn->arr[connfd] != NULL) {
         connarray_remove(fd_to_conn, fd_to_conn->arr[connfd]);
     }
@@ -334,17 +580,20 @@ int32_t accept_new_conn(struct connarray_t *fd_to_conn, int fd) {
     struct conn_t *conn = conn_new(connfd);
     if (!conn) {
         log_error("accept_new_conn(): failed to allocate new connection!");
+        errno = ENOMEM;
         return -1;
     }
     if (connarray_put(fd_to_conn, conn) < 0) {
         log_error("accept_new_conn(): connarray_put() error");
         close(connfd);
+        errno = ENOMEM;
         return -1;
     }
 
     #if _FOO_KV_DEBUG == 1
     if (fd_to_conn->arr[connfd] != conn) {
         log_error("accept_new_conn(): got to end, but connection is not set...");
+        errno = EINVAL;
         return -1;
     }
     char debug_buff[256];
@@ -352,6 +601,6 @@ int32_t accept_new_conn(struct connarray_t *fd_to_conn, int fd) {
     log_debug(debug_buff);
     #endif
 
-    return 0;
+    return connfd;
 
 }
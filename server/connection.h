@@ -19,9 +19,41 @@
 void fd_set_nb(int fd);
 
 // response management
+// pipelined requests are dispatched back to back and their responses are
+// appended to wbuff, until wbuff holds at least this much and is flushed
+#define MAX_RESPONSE_BATCH (4 * MAX_MSG_SIZE)
+
+// handlers copy their payload straight into the connection's wbuff, after room
+// for the len and status, with response_payload(), and conn_write_response()
+// fills those in. so a response never holds python objects, and can be built
+// without the GIL.
 struct response_t {
     int16_t status;
-    PyObject *payload;
+    uint32_t payload_len;
+    struct conn_t *conn;
+    // the response of one command of a transaction goes inside the payload of
+    // the transaction's response, this many bytes into it. see do_exec().
+    uint32_t offset;
+};
+
+// io_uring backend: per-connection receive state
+// the reactor copies whatever its multishot recv delivers into `inbox`, and the
+// io worker that owns the connection reads from `inbox` instead of the socket.
+// `inbox` is borrowed from the buffer pool and returned whenever it is drained.
+// `lock` guards `inbox`, `inbox_size`, `inbox_read` and `eof`, the other fields
+// are only touched by the reactor thread.
+struct conn_uring_t {
+    sem_t lock;
+    uint8_t *inbox;
+    size_t inbox_size;
+    size_t inbox_read;
+    size_t inbox_max;
+    // 1 after EOF, a negative errno after a receive error
+    int32_t eof;
+    int32_t recv_armed;
+    int32_t recv_cancelling;
+    // set while the connection is waiting on io and belongs to the reactor
+    int32_t parked;
 };
 
 // connection management
@@ -36,17 +68,36 @@ struct conn_t {
     size_t wbuff_size;
     size_t wbuff_sent;
     size_t wbuff_max;
+    // rbuff and wbuff are NULL while empty, see struct bufpool_depot_t
     uint8_t *wbuff;
     int32_t connid;
-    sem_t *lock;
+    sem_t lock;
+    // index of the io worker that served the connection last, -1 until one has
+    int32_t worker;
+    // NULL unless the reactor uses the io_uring backend
+    struct conn_uring_t *uring;
+    // the reactor the connection is registered with
+    struct reactor_t *reactor;
+    // the lock request the connection is parked on, see struct lock_waiter_t
+    struct lock_waiter_t *waiter;
 
 };
 
+int32_t conn_alloc_init(void);
 struct conn_t *conn_new(int connfd);
 int32_t conn_rbuff_resize(struct conn_t *conn, uint32_t newsize);
 int32_t conn_wbuff_resize(struct conn_t *conn, uint32_t newsize);
 int32_t conn_rbuff_flush(struct conn_t *conn);
+void conn_wbuff_reset(struct conn_t *conn);
+int32_t conn_rbuff_acquire(struct conn_t *conn);
+void conn_release_idle_buffers(struct conn_t *conn);
+uint8_t *response_payload(struct response_t *response, uint32_t len);
 int32_t conn_write_response(struct conn_t *conn, const struct response_t *response);
+int32_t conn_uring_init(struct conn_t *conn);
+int32_t conn_uring_push(struct conn_t *conn, const uint8_t *data, size_t len, int32_t eof);
+ssize_t conn_uring_pull(struct conn_t *conn, uint8_t *dst, size_t cap);
+size_t conn_uring_pending(struct conn_t *conn);
+int32_t conn_has_input(struct conn_t *conn);
 
 struct connarray_t {
     int32_t size;
@@ -15,11 +15,16 @@
 #include "connection.h"
 #include "connection_io.h"
 #include "dispatch.h"
+#include "locks.h"
 
 // CHANGE ME
 #define _FOO_KV_DEBUG 1
 
 int32_t connection_io(foo_kv_server *server, struct conn_t *conn) {
+    // returns a negative number on error
+    // returns 1 if another thread already owns the connection
+    // returns 0 otherwise, in which case the caller owns the connection until
+    // it hands it back to the reactor
 
     #if _FOO_KV_DEBUG == 1
     char debug_buffer[256];
@@ -31,7 +36,7 @@ int32_t connection_io(foo_kv_server *server, struct conn_t *conn) {
     sprintf(debug_buffer, "connection_io(): conn_fd: %d: about to acquire conn lock", conn->fd);
     log_debug(debug_buffer);
     #endif
-    if (sem_trywait(conn->lock)) {
+    if (sem_trywait(&conn->lock)) {
         if (errno == EINVAL) {
             log_error("connection_io(): sem_trywait() failed");
             conn->state = STATE_END;
@@ -41,7 +46,7 @@ int32_t connection_io(foo_kv_server *server, struct conn_t *conn) {
         sprintf(debug_buffer, "connection_io(): conn_fd: %d: another thread is already handling request, exiting", conn->fd);
         log_debug(debug_buffer);
         #endif
-        return 0;
+        return 1;
     }
     #if _FOO_KV_DEBUG == 1
     sprintf(debug_buffer, "connection_io(): conn_fd: %d: successfully acquired conn lock", conn->fd);
@@ -77,6 +82,23 @@ int32_t connection_io(foo_kv_server *server, struct conn_t *conn) {
                     goto CONNECTION_IO_END;
                 }
                 continue;
+            case STATE_LOCK_READY:
+                #if _FOO_KV_DEBUG == 1
+                sprintf(debug_buffer, "connection_io(): conn_fd: %d: entered STATE_LOCK_READY", conn->fd);
+                log_debug(debug_buffer);
+                #endif
+                err = state_lock_ready(conn);
+                if (err) {
+                    goto CONNECTION_IO_END;
+                }
+                continue;
+            case STATE_LOCK_WAITING:
+                #if _FOO_KV_DEBUG == 1
+                sprintf(debug_buffer, "connection_io(): conn_fd: %d: entered STATE_LOCK_WAITING", conn->fd);
+                log_debug(debug_buffer);
+                #endif
+                err = 0;
+                goto CONNECTION_IO_END;
             case STATE_REQ_WAITING:
                 #if _FOO_KV_DEBUG == 1
                 sprintf(debug_buffer, "connection_io(): conn_fd: %d: entered STATE_REQ_WAITING", conn->fd);
@@ -122,7 +144,10 @@ int32_t connection_io(foo_kv_server *server, struct conn_t *conn) {
 
 CONNECTION_IO_END:
 
-    if (sem_post(conn->lock)) {
+    // idle connections hold no buffers
+    conn_release_idle_buffers(conn);
+
+    if (sem_post(&conn->lock)) {
         log_error("connection_io(): sem_post() failed");
         err = -1;
     }
@@ -191,6 +216,12 @@ int32_t try_fill_buffer(struct conn_t *conn) {
     }
     #endif
 
+    if (conn_rbuff_acquire(conn)) {
+        log_error("try_fill_buffer(): failed to borrow rbuff");
+        conn->state = STATE_END;
+        return -1;
+    }
+
     ssize_t rv = 0;
     do {
         size_t cap = conn->rbuff_max - conn->rbuff_size;
@@ -200,9 +231,14 @@ int32_t try_fill_buffer(struct conn_t *conn) {
             log_warning("try_fill_buffer(): hit cap: will try resize");
             return 0;
         }
-        Py_BEGIN_ALLOW_THREADS
-        rv = read(conn->fd, conn->rbuff + conn->rbuff_size, cap);
-        Py_END_ALLOW_THREADS
+        if (conn->uring) {
+            // io_uring backend: the reactor has already received the data
+            rv = conn_uring_pull(conn, conn->rbuff + conn->rbuff_size, cap);
+        } else {
+            Py_BEGIN_ALLOW_THREADS
+            rv = read(conn->fd, conn->rbuff + conn->rbuff_size, cap);
+            Py_END_ALLOW_THREADS
+        }
     } while (rv < 0 && errno == EINTR);
 
     if (rv < 0) {
@@ -268,7 +304,8 @@ int32_t try_one_request(struct conn_t *conn) {
             }
         }
         if (conn->err) {
-            conn->state = STATE_REQ_WAITING;
+            // send the responses of the batch so far before waiting for more
+            conn->state = conn->wbuff_size ? STATE_RES : STATE_REQ_WAITING;
         }
         return 0;
     }
@@ -283,6 +320,14 @@ int32_t try_one_request(struct conn_t *conn) {
             conn->state = STATE_END;
             return -1;
         }
+        if (msglen <= conn->rbuff_max) {
+            // the frame fits once the requests before it are out of the way
+            if (conn_rbuff_flush(conn) < 0) {
+                conn->state = STATE_END;
+                return -1;
+            }
+            return 0;
+        }
         #if _FOO_KV_DEBUG == 1
         log_debug("try_one_request(): need to resize rbuff");
         #endif
@@ -309,7 +354,7 @@ int32_t try_one_request(struct conn_t *conn) {
             #if _FOO_KV_DEBUG == 1
             log_debug("try_one_request(): previous read resulted in EAGAIN: will exit loop");
             #endif
-            conn->state = STATE_REQ_WAITING;
+            conn->state = conn->wbuff_size ? STATE_RES : STATE_REQ_WAITING;
         }
         return 0;
     }
@@ -321,43 +366,146 @@ int32_t try_one_request(struct conn_t *conn) {
 }
 
 int32_t state_dispatch(foo_kv_server *server, struct conn_t *conn) {
+    // dispatches every complete request in rbuff, try_one_request() has
+    // checked that there is at least one, and appends their responses to wbuff
+    // so that the whole batch is sent at once
 
     #if _FOO_KV_DEBUG == 1
     log_debug("state_dispatch(): beginning");
+    int32_t num_dispatched = 0;
     #endif
 
     uint16_t len;
-    int32_t err;
-    uint8_t *rbuff_start = conn->rbuff + conn->rbuff_read;
-    memcpy(&len, rbuff_start, sizeof(uint16_t));
-    rbuff_start += sizeof(uint16_t);
+    int32_t err = 0;
+    int32_t parked = 0;
 
-    struct response_t *response = PyMem_RawCalloc(1, sizeof(struct response_t));
-    if (!response) {
-        log_error("state_dispatch(): calloc returned null");
-        return -1;
-    }
+    // the response only lives until it has been copied into wbuff
+    struct response_t response_storage;
+    struct response_t *response = &response_storage;
+
+    // requests are served from the native storage, so the GIL is only taken
+    // back by the handlers that need python (see dispatch())
+    Py_BEGIN_ALLOW_THREADS
+    do {
+        uint8_t *rbuff_start = conn->rbuff + conn->rbuff_read;
+        memcpy(&len, rbuff_start, sizeof(uint16_t));
+        rbuff_start += sizeof(uint16_t);
+
+        memset(response, 0, sizeof(struct response_t));
+        response->conn = conn;
+        err = dispatch(server, conn->connid, rbuff_start, len, response);
+        // a lock request that waits has no response yet, see state_lock_ready()
+        parked = response->status == RES_PARKED;
+        if (!parked && conn_write_response(conn, response) < 0) {
+            err = -1;
+        }
+
+        // 2 for the len indicator + rest of message
+        conn->rbuff_read += sizeof(uint16_t) + len;
+
+        if (parked) {
+            // the requests after it wait along with it, so the responses stay
+            // in order
+            break;
+        }
 
-    err = dispatch(server, conn->connid, rbuff_start, len, response);
-    conn_write_response(conn, response);
-    PyMem_RawFree(response);
+        #if _FOO_KV_DEBUG == 1
+        num_dispatched++;
+        #endif
+
+        if (err || conn->wbuff_size >= MAX_RESPONSE_BATCH) {
+            break;
+        }
+        // stop at the first incomplete request, the next read picks it up
+        size_t unread = conn->rbuff_size - conn->rbuff_read;
+        if (unread < sizeof(uint16_t)) {
+            break;
+        }
+        memcpy(&len, conn->rbuff + conn->rbuff_read, sizeof(uint16_t));
+        if (unread < sizeof(uint16_t) + len) {
+            break;
+        }
+    } while (1);
+    Py_END_ALLOW_THREADS
+
+    if (conn->rbuff_read == conn->rbuff_size) {
+        // everything was consumed, start over at the front of rbuff for free
+        conn_rbuff_flush(conn);
+    }
 
-    // 4 for the len indicator + rest of message
-    conn->rbuff_read += sizeof(uint16_t) + len;
+    #if _FOO_KV_DEBUG == 1
+    char debug_buffer[256];
+    sprintf(debug_buffer, "state_dispatch(): conn_fd: %d: dispatched %d requests, %ld response bytes", conn->fd, num_dispatched, conn->wbuff_size);
+    log_debug(debug_buffer);
+    #endif
 
     // change state
-    conn->state = STATE_RES;
+    if (parked) {
+        conn->state = STATE_LOCK_WAITING;
+    } else if (!err && !conn->err && conn->wbuff_size < MAX_RESPONSE_BATCH) {
+        // the last read filled rbuff rather than draining the socket, so the
+        // rest of the batch is probably still there, read it before responding
+        // instead of splitting the responses over several writes
+        conn->state = STATE_REQ;
+    } else {
+        conn->state = STATE_RES;
+    }
 
     return err;
 
 }
 
+int32_t state_lock_ready(struct conn_t *conn) {
+    // writes the response to the lock request the connection was parked on,
+    // after the responses of the requests before it
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("state_lock_ready(): beginning");
+    #endif
+
+    struct lock_waiter_t *waiter = conn->waiter;
+    struct response_t response = {0};
+    response.conn = conn;
+    response.status = waiter->status;
+
+    if (waiter->status == RES_OK) {
+        // the fencing token
+        char value[32];
+        int32_t value_len = sprintf(value, "%c%llu", INT_SYMBOL, (unsigned long long)waiter->fence);
+        uint8_t *payload = response_payload(&response, value_len);
+        if (payload) {
+            memcpy(payload, value, value_len);
+        } else {
+            response.status = RES_ERR_SERVER;
+        }
+    }
+
+    conn->waiter = NULL;
+    lock_waiter_free(waiter);
+
+    if (conn_write_response(conn, &response) < 0) {
+        conn->state = STATE_END;
+        return -1;
+    }
+    conn->state = STATE_REQ;
+
+    return 0;
+
+}
+
 int32_t state_res(struct conn_t *conn) {
 
     #if _FOO_KV_DEBUG == 1
     log_debug("state_res(): beginning");
     #endif
 
+    if (conn->uring) {
+        // io_uring backend: hand the response to the reactor, which submits the
+        // sends of every connection handed back in the same pass at once
+        conn->state = STATE_RES_WAITING;
+        return 0;
+    }
+
     while (try_flush_buffer(conn)) {}
     return 0;
 
@@ -408,8 +556,7 @@ int32_t try_flush_buffer(struct conn_t *conn) {
         // response was fully sent
         // success case
         conn->state = STATE_REQ;
-        conn->wbuff_sent = 0;
-        conn->wbuff_size = 0;
+        conn_wbuff_reset(conn);
         return 0;
     }
 
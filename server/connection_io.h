@@ -14,6 +14,7 @@ int32_t state_req(struct conn_t *conn);
 int32_t try_fill_buffer(struct conn_t *conn);
 int32_t state_dispatch(foo_kv_server *server, struct conn_t *conn);
 int32_t try_one_request(struct conn_t *conn);
+int32_t state_lock_ready(struct conn_t *conn);
 int32_t state_res(struct conn_t *conn);
 int32_t try_flush_buffer(struct conn_t *conn);
 
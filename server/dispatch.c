@@ -11,14 +11,35 @@
 #include "util.h"
 #include "connection.h"
 #include "dispatch.h"
+#include "storage.h"
+#include "index.h"
 #include "ttl.h"
+#include "locks.h"
 
 // CHANGE ME
 #define _FOO_KV_DEBUG 1
 
-int16_t _dispatch_errno = 0;
+// dispatch runs on several threads at once, without the GIL
+__thread int16_t _dispatch_errno = 0;
+
+// the keys whose ttl the commands of a transaction changed, put on the ttl heap
+// once it lets go of its shards, see do_exec()
+struct deferred_ttl_t {
+    const uint8_t *key;
+    uint16_t key_len;
+};
+static __thread struct deferred_ttl_t *deferred_ttls = NULL;
+static __thread int32_t num_deferred_ttls = 0;
+static __thread int32_t max_deferred_ttls = 0;
+static __thread int32_t defer_ttls = 0;
+
+static uint32_t ttl_expires(const uint8_t *x, int32_t len);
+static int32_t parse_int64(const uint8_t *x, int32_t len, int64_t *out);
+static int32_t list_append_bytes(uint8_t *list, int32_t len, char symbol, const uint8_t *item, uint16_t item_len);
+static int32_t arg_is(const uint8_t *arg, uint16_t len, const char *name);
 
 int32_t dispatch(foo_kv_server *server, int32_t connid, const uint8_t *buff, int32_t len, struct response_t *response) {
+    // called without the GIL, see state_dispatch()
 
     #if _FOO_KV_DEBUG == 1
     char debug_buffer[256];
@@ -30,6 +51,12 @@ int32_t dispatch(foo_kv_server *server, int32_t connid, const uint8_t *buff, int
     }
     #endif
 
+    if ((uint32_t)len < sizeof(uint16_t)) {
+        log_error("dispatch(): got misformed request: too short for the number of strings");
+        response->status = RES_ERR_CLIENT;
+        return 0;
+    }
+
     uint16_t nstrs;
     memcpy(&nstrs, buff, sizeof(uint16_t));
 
@@ -38,14 +65,20 @@ int32_t dispatch(foo_kv_server *server, int32_t connid, const uint8_t *buff, int
     log_debug(debug_buffer);
     #endif
 
+    if (nstrs < 1) {
+        log_error("dispatch(): got misformed request: no command");
+        response->status = RES_ERR_CLIENT;
+        return 0;
+    }
+
     const uint8_t *subcmds[nstrs];
     uint16_t subcmd_to_len[nstrs];
-    uint16_t offset = sizeof(uint16_t);
+    int32_t offset = sizeof(uint16_t);
     int32_t err = 0;
 
     for (int32_t ix = 0; ix < nstrs; ix++) {
         // sanity
-        if (offset >= len) {
+        if (offset + (int32_t)sizeof(uint16_t) > len) {
             log_error("dispatch(): got misformed request.");
             response->status = RES_ERR_CLIENT;
             return 0;
@@ -53,11 +86,6 @@ int32_t dispatch(foo_kv_server *server, int32_t connid, const uint8_t *buff, int
         // establish str len
         uint16_t slen;
         memcpy(&slen, buff + offset, sizeof(uint16_t));
-        if (slen < 0) {
-            log_error("dispatch(): got request subcmd with negative len");
-            response->status = RES_ERR_CLIENT;
-            return 0;
-        }
         subcmd_to_len[ix] = slen;
 
         #if _FOO_KV_DEBUG == 1
@@ -72,7 +100,7 @@ int32_t dispatch(foo_kv_server *server, int32_t connid, const uint8_t *buff, int
         offset += slen;
 
         #if _FOO_KV_DEBUG == 1
-        if (slen < 200) {
+        if (slen < 200 && offset <= len) {
             sprintf(debug_buffer, "dispatch(): subcmds[%d]=%.*s", (int)ix, slen, subcmds[ix]);
             log_debug(debug_buffer);
         } else {
@@ -106,9 +134,6 @@ int32_t dispatch(foo_kv_server *server, int32_t connid, const uint8_t *buff, int
     }
     #endif
 
-    Py_INCREF(server);
-    Py_INCREF(server->storage);
-
     switch (cmd_hash) {
         case CMD_GET:
             err = do_get(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
@@ -116,6 +141,10 @@ int32_t dispatch(foo_kv_server *server, int32_t connid, const uint8_t *buff, int
         case CMD_PUT:
             err = do_set(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
             break;
+        case CMD_CAS:
+        case CMD_SETIF:
+            err = do_cas(server, cmd_hash, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
         case CMD_DEL:
             err = do_del(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
             break;
@@ -131,48 +160,61 @@ int32_t dispatch(foo_kv_server *server, int32_t connid, const uint8_t *buff, int
         case CMD_TTL:
             err = do_ttl(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
             break;
+        case CMD_INFO:
+            err = do_info(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_MEMORY:
+            err = do_memory(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_STATS:
+            err = do_stats(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_MGET:
+            err = do_mget(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_MSET:
+            err = do_mset(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_MDEL:
+            err = do_mdel(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_SCAN:
+            err = do_scan(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_RANGE:
+            err = do_range(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_LOCK:
+            err = do_lock(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_UNLOCK:
+            err = do_unlock(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_EXTEND:
+            err = do_extend(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_EXEC:
+            err = do_exec(server, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
+        case CMD_INCR:
+        case CMD_DECR:
+        case CMD_INCRBY:
+        case CMD_INCRBYFLOAT:
+            err = do_incr(server, cmd_hash, subcmds + 1, subcmd_to_len + 1, nstrs - 1, response);
+            break;
         default:
             log_error("dispatch(): got unrecognized command");
             response->status = RES_BAD_CMD;
             break;
     }
 
-    #if _FOO_KV_DEBUG == 1
-    log_debug("dispatch(): sanity checking storage");
-    Py_ssize_t ix = 0;
-    PyObject *key, *value;
-    while (PyDict_Next(server->storage, &ix, &key, &value) < 0) {
-        if (key->ob_refcnt <= 2 || key->ob_refcnt > 1000) {
-            PyObject *as_str = PyUnicode_FromFormat("%U", key);
-            PyObject *as_bytes = PyUnicode_AsUTF8String(as_str);
-            sprintf(debug_buffer, "dispatch(): sanity check: key %s has %ld refcnt", PyBytes_AS_STRING(as_bytes), key->ob_refcnt);
-            log_debug(debug_buffer);
-            Py_DECREF(as_str);
-            Py_DECREF(as_bytes);
-        }
-        if (value->ob_refcnt <= 2 || key->ob_refcnt > 1000) {
-            PyObject *as_str = PyUnicode_FromFormat("%U", value);
-            PyObject *as_bytes = PyUnicode_AsUTF8String(as_str);
-            sprintf(debug_buffer, "dispatch(): sanity check: value %s has %ld refcnt", PyBytes_AS_STRING(as_bytes), value->ob_refcnt);
-            log_debug(debug_buffer);
-            Py_DECREF(as_str);
-            Py_DECREF(as_bytes);
-        }
-    }
-    log_debug("dispatch(): sanity check complete");
-    #endif
-
-    Py_DECREF(server->storage);
-    Py_INCREF(server);
-
     if (response->status == -1) {
         log_warning("dispatch(): response status did not get set!");
         response->status = RES_UNKNOWN;
     }
-
-    if (PyErr_Occurred()) {
-        log_warning("dispatch(): a handler raised a Python exception that was not cleared");
-        PyErr_Clear();
+    if (response->status != RES_OK) {
+        // drop whatever a handler copied before it failed
+        response->payload_len = 0;
     }
 
     _dispatch_errno = 0;
@@ -182,10 +224,8 @@ int32_t dispatch(foo_kv_server *server, int32_t connid, const uint8_t *buff, int
 }
 
 void error_handler(struct response_t *response) {
-    PyObject *py_err = PyErr_Occurred();
-    if (py_err) {
-        PyErr_Clear();
-    }
+    // turns the _dispatch_errno left by a failed validation into a status
+
     #if _FOO_KV_DEBUG == 1
     char debug_buffer[256];
     sprintf(debug_buffer, "error_handler: got dispatch_errno: %hd", _dispatch_errno);
@@ -204,55 +244,262 @@ void error_handler(struct response_t *response) {
             log_error("error_handler(): Failed to loads(key): embedded collection");
             response->status = RES_BAD_COLLECTION;
             break;
+        case RES_ERR_CLIENT:
+            log_error("error_handler(): Failed to loads(key): malformed collection");
+            response->status = RES_ERR_CLIENT;
+            break;
         default:
             #if _FOO_KV_DEBUG == 1
-            sprintf(debug_buffer, "error_handler(): Failed to loads(key): unexpected py error type: %hd", _dispatch_errno);
+            sprintf(debug_buffer, "error_handler(): Failed to loads(key): unexpected error type: %hd", _dispatch_errno);
             log_error(debug_buffer);
             #else
-            log_error("error_handler(): Failed to loads(key): unexpected py error type");
+            log_error("error_handler(): Failed to loads(key): unexpected error type");
             #endif
             response->status = RES_UNKNOWN;
     }
 }
 
+static int32_t dispatch_ttl_update(foo_kv_server *server, const uint8_t *key, uint16_t key_len) {
+    // puts the ttl that `key` has in the storage on the ttl heap, or drops the
+    // one there if it has none. called after a request set or dropped a ttl,
+    // once the shard's lock is released.
+    // the ttl heap is made of python objects, so this is the one place that
+    // takes the GIL back, and only requests that set a ttl or replace a key
+    // that had one get here. the key is read again under the GIL, so the heap
+    // ends up with the ttl of the last write whatever order the requests that
+    // wrote it get here in.
+
+    if (defer_ttls) {
+        if (num_deferred_ttls == max_deferred_ttls) {
+            int32_t max = max_deferred_ttls ? 2 * max_deferred_ttls : 16;
+            struct deferred_ttl_t *grown = PyMem_RawRealloc(deferred_ttls, max * sizeof(struct deferred_ttl_t));
+            if (!grown) {
+                return -1;
+            }
+            deferred_ttls = grown;
+            max_deferred_ttls = max;
+        }
+        deferred_ttls[num_deferred_ttls].key = key;
+        deferred_ttls[num_deferred_ttls].key_len = key_len;
+        num_deferred_ttls++;
+        return 0;
+    }
+
+    int32_t err = -1;
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
+    uint64_t hash = storage_hash(key, key_len);
+    struct storage_shard_t *shard = storage_shard(server->storage, hash);
+    if (storage_shard_read_lock(shard)) {
+        goto DISPATCH_TTL_UPDATE_END;
+    }
+    struct storage_entry_t *entry = storage_find(shard, hash, key, key_len);
+    int32_t has_ttl = entry && entry->has_ttl;
+    time_t expires = has_ttl ? entry->expires : 0;
+    storage_shard_unlock(shard);
+
+    PyObject *py_key = PyBytes_FromStringAndSize((const char *)key, key_len);
+    if (!py_key) {
+        goto DISPATCH_TTL_UPDATE_END;
+    }
+    if (has_ttl) {
+        err = foo_kv_ttl_heap_put(server->storage_ttl_heap, py_key, expires);
+    } else {
+        err = foo_kv_ttl_heap_invalidate(server->storage_ttl_heap, py_key);
+    }
+    Py_DECREF(py_key);
+
+DISPATCH_TTL_UPDATE_END:
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
+    }
+    PyGILState_Release(gstate);
+
+    return err;
+
+}
+
+// what a conditional write expects to replace: the value `value` if it is set,
+// else the version `version`, 0 meaning no key at all
+struct store_check_t {
+    uint64_t version;
+    const uint8_t *value;
+    uint16_t value_len;
+};
+
+static int32_t store_check(struct storage_shard_t *shard, const uint8_t *key, uint16_t key_len, uint64_t hash, const struct store_check_t *check) {
+    // returns 0 if the key is as `check` expects, under the shard's lock
+
+    struct storage_entry_t *found = storage_find(shard, hash, key, key_len);
+    if (check->value) {
+        return !found || found->type != STORAGE_VALUE || found->val_len != check->value_len ||
+               memcmp(found->data + found->key_len, check->value, check->value_len) ? -1 : 0;
+    }
+
+    return (found ? found->version : 0) == check->version ? 0 : -1;
+
+}
+
+static int32_t dispatch_store(foo_kv_server *server, const uint8_t *key, uint16_t key_len, struct storage_entry_t *entry,
+                              const uint8_t *ttl, uint16_t ttl_len, const struct store_check_t *check, struct response_t *response) {
+    // stores `entry` under `key`, replacing what was there, and gives it `ttl`
+    // if one is given. with a `check`, only stores it if the key is as expected
+    // and responds with its new version, or RES_BAD_VERSION.
+
+    entry->has_ttl = ttl != NULL;
+    if (ttl) {
+        entry->expires = ttl_expires(ttl, ttl_len);
+    }
+
+    struct storage_shard_t *shard = storage_shard(server->storage, entry->hash);
+    if (storage_shard_lock(shard)) {
+        log_error("dispatch_store(): encountered error trying to acquire storage lock");
+        storage_entry_free(entry);
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+    if (check && store_check(shard, key, key_len, entry->hash, check)) {
+        storage_shard_unlock(shard);
+        storage_entry_free(entry);
+        response->status = RES_BAD_VERSION;
+        return 0;
+    }
+    // only what it takes over the entry it replaces, which is kept
+    struct storage_entry_t *found = storage_find(shard, entry->hash, key, key_len);
+    uint64_t size = storage_entry_size(entry);
+    if (found) {
+        size = size > storage_entry_size(found) ? size - storage_entry_size(found) : 0;
+    }
+    if (storage_reserve(server->storage, shard, size, found) < 0) {
+        storage_shard_unlock(shard);
+        log_warning("dispatch_store(): refused write, the storage is at maxmemory");
+        storage_entry_free(entry);
+        response->status = RES_ERR_MEMORY;
+        return 0;
+    }
+    struct storage_entry_t *replaced;
+    int32_t err = storage_insert(shard, entry, &replaced);
+    uint64_t version = entry->version;
+    if (!err) {
+        storage_track(server->storage, entry, replaced);
+    }
+    storage_shard_unlock(shard);
+
+    if (err) {
+        log_error("dispatch_store(): unable to grow the storage");
+        storage_entry_free(entry);
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+
+    // `entry` belongs to the storage now, it can be replaced and freed by
+    // another thread as soon as the lock is released
+    int32_t had_ttl = replaced && replaced->has_ttl;
+    storage_entry_free(replaced);
+
+    if (ttl || had_ttl) {
+        if (dispatch_ttl_update(server, key, key_len)) {
+            log_error("dispatch_store(): unable to update the ttl of the item");
+            response->status = RES_ERR_SERVER;
+            return 0;
+        }
+    }
+
+    if (check) {
+        char value[32];
+        int32_t value_len = sprintf(value, "%c%llu", INT_SYMBOL, (unsigned long long)version);
+        uint8_t *payload = response_payload(response, value_len);
+        if (!payload) {
+            response->status = RES_ERR_SERVER;
+            return 0;
+        }
+        memcpy(payload, value, value_len);
+    }
+
+    response->status = RES_OK;
+    return 0;
+
+}
+
 int32_t do_get(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // takes a key, and optionally "version" followed by a bool. with a true
+    // version, responds with a list of the key's version and its value as
+    // bytes holding its encoding.
 
     #if _FOO_KV_DEBUG == 1
     log_debug("do_get(): got request");
     #endif
 
-    if (nargs != 1) {
+    if (nargs != 1 && nargs != 3) {
         response->status = RES_BAD_ARGS;
         return 0;
     }
 
-    PyObject *loaded_key = _loads_hashable((char *)args[0], arg_to_len[0]);
-    if (!loaded_key) {
+    if (validate_hashable(args[0], arg_to_len[0])) {
         error_handler(response);
         return 0;
     }
+    int32_t with_version = 0;
+    if (nargs == 3) {
+        if (validate_value(args[2], arg_to_len[2])) {
+            error_handler(response);
+            return 0;
+        }
+        if (!arg_is(args[1], arg_to_len[1], "version") || args[2][0] != BOOL_SYMBOL) {
+            response->status = RES_BAD_ARGS;
+            return 0;
+        }
+        with_version = args[2][1] == '1';
+    }
 
-    // this returns a BORROWED REFERENCE, do not decref
-    PyObject *py_val = PyDict_GetItem(server->storage, loaded_key);
-    Py_DECREF(loaded_key);
-
-    if (!py_val) {
-        #if _FOO_KV_DEBUG == 1
-        log_debug("do_get(): Failed to lookup key in storage, perhaps this is expected.");
-        #endif
-        PyErr_Clear();
-        response->status = RES_BAD_KEY;
+    uint64_t hash = storage_hash(args[0], arg_to_len[0]);
+    struct storage_shard_t *shard = storage_shard(server->storage, hash);
+    // a shared lock, GETs of keys in the same shard don't wait on each other
+    if (storage_shard_read_lock(shard)) {
+        log_error("do_get(): encountered error trying to acquire storage lock");
+        response->status = RES_ERR_SERVER;
         return 0;
     }
 
-    PyObject *py_res = dumps_as_pyobject(py_val);
-    if (!py_res) {
-        error_handler(response);
-        return 0;
+    struct storage_entry_t *entry = storage_find(shard, hash, args[0], arg_to_len[0]);
+    if (!entry) {
+        response->status = RES_BAD_KEY;
+    } else if (entry->type != STORAGE_VALUE) {
+        response->status = RES_BAD_OP;
+    } else if (with_version) {
+        char version[32];
+        int32_t version_len = sprintf(version, "%llu", (unsigned long long)entry->version);
+        uint32_t len = sizeof(char) + 2 * (sizeof(uint16_t) + sizeof(char)) + sizeof(uint16_t) + version_len + entry->val_len;
+        uint8_t *payload = entry->val_len < MAX_MSG_SIZE ? response_payload(response, len) : NULL;
+        if (payload) {
+            payload[0] = LIST_SYMBOL;
+            memset(payload + sizeof(char), 0, sizeof(uint16_t));
+            int32_t offset = list_append_bytes(payload, sizeof(char) + sizeof(uint16_t), INT_SYMBOL, (const uint8_t *)version, version_len);
+            list_append_bytes(payload, offset, BYTES_SYMBOL, entry->data + entry->key_len, entry->val_len);
+            storage_touch(server->storage, entry);
+            response->status = RES_OK;
+        } else {
+            response->status = RES_ERR_SERVER;
+        }
+    } else {
+        // the value is copied straight from the storage into wbuff
+        uint8_t *payload = response_payload(response, entry->val_len);
+        if (payload) {
+            memcpy(payload, entry->data + entry->key_len, entry->val_len);
+            storage_touch(server->storage, entry);
+            response->status = RES_OK;
+        } else {
+            response->status = RES_ERR_SERVER;
+        }
     }
 
-    response->status = RES_OK;
-    response->payload = py_res;
+    storage_shard_unlock(shard);
+
+    #if _FOO_KV_DEBUG == 1
+    if (response->status == RES_BAD_KEY) {
+        log_debug("do_get(): Failed to lookup key in storage, perhaps this is expected.");
+    }
+    #endif
 
     return 0;
 
@@ -269,73 +516,85 @@ int32_t do_set(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_
         return 0;
     }
 
-    PyObject *loaded_key = _loads_hashable((char *)args[0], arg_to_len[0]);
-    if (!loaded_key) {
+    if (validate_hashable(args[0], arg_to_len[0]) || validate_value(args[1], arg_to_len[1])) {
         error_handler(response);
         return 0;
     }
-
-    #if _FOO_KV_DEBUG == 1
-    log_debug("do_set(): loaded key");
-    #endif
-
-    PyObject *loaded_val = loads((char *)args[1], arg_to_len[1]);
-    if (!loaded_val) {
+    if (nargs == 3 && validate_datetime(args[2], arg_to_len[2])) {
         error_handler(response);
         return 0;
     }
 
     #if _FOO_KV_DEBUG == 1
-    log_debug("do_set(): loaded val");
+    log_debug("do_set(): validated key and val");
     #endif
 
-    if (threadsafe_sem_wait(server->storage_lock)) {
-        log_error("do_set(): encountered error trying to acquire storage lock");
+    struct storage_entry_t *entry = storage_entry_new(args[0], arg_to_len[0], args[1], arg_to_len[1], STORAGE_VALUE);
+    if (!entry) {
+        log_error("do_set(): unable to allocate storage entry");
         response->status = RES_ERR_SERVER;
         return 0;
     }
 
-    int32_t res = PyDict_SetItem(server->storage, loaded_key, loaded_val);
+    if (nargs == 3) {
+        return dispatch_store(server, args[0], arg_to_len[0], entry, args[2], arg_to_len[2], NULL, response);
+    }
+    return dispatch_store(server, args[0], arg_to_len[0], entry, NULL, 0, NULL, response);
+
+}
 
-    Py_DECREF(loaded_key);
-    Py_DECREF(loaded_val);
+int32_t do_cas(foo_kv_server *server, int32_t cmd, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // cas takes a key, the version it must be at, 0 if it must not exist, and
+    // a value, setif a key, the value it must hold, and a value. both take an
+    // optional ttl, store the value only if the key is as expected, checked
+    // under the shard's lock, and respond with its new version.
 
-    if (sem_post(server->storage_lock)) {
-        log_error("do_set(): failed to release lock");
-        response->status = RES_ERR_SERVER;
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_cas(): got request");
+    #endif
+
+    if (nargs < 3 || nargs > 4) {
+        response->status = RES_BAD_ARGS;
         return 0;
     }
 
-    if (nargs == 3) {
-        PyObject *loaded_ttl = _loads_foo_datetime((char *)args[2], arg_to_len[2]);
-        if (!loaded_ttl) {
-            error_handler(response);
+    if (validate_hashable(args[0], arg_to_len[0]) || validate_value(args[1], arg_to_len[1]) || validate_value(args[2], arg_to_len[2])) {
+        error_handler(response);
+        return 0;
+    }
+    if (nargs == 4 && validate_datetime(args[3], arg_to_len[3])) {
+        error_handler(response);
+        return 0;
+    }
+
+    struct store_check_t check = {0};
+    if (cmd == CMD_CAS) {
+        int64_t version;
+        if (args[1][0] != INT_SYMBOL) {
+            response->status = RES_BAD_TYPE;
             return 0;
         }
-        #if _FOO_KV_DEBUG == 1
-        log_debug("do_set(): loaded ttl");
-        #endif
-        if (foo_kv_ttl_heap_put_dt(server->storage_ttl_heap, loaded_key, loaded_ttl)) {
-            log_error("do_set(): unable to set ttl on item, exiting!");
-            response->status = RES_ERR_SERVER;
+        if (parse_int64(args[1] + sizeof(char), arg_to_len[1] - sizeof(char), &version) || version < 0) {
+            response->status = RES_BAD_ARGS;
             return 0;
         }
+        check.version = version;
     } else {
-        if (foo_kv_ttl_heap_invalidate(server->storage_ttl_heap, loaded_key)) {
-            log_error("do_set(): unable to invalidate previous ttl, exiting");
-            response->status = RES_ERR_SERVER;
-            return 0;
-        }
+        check.value = args[1];
+        check.value_len = arg_to_len[1];
     }
 
-    if (res) {
-        log_error("do_set(): got error setting item in storage: perhaps this is expected");
+    struct storage_entry_t *entry = storage_entry_new(args[0], arg_to_len[0], args[2], arg_to_len[2], STORAGE_VALUE);
+    if (!entry) {
+        log_error("do_cas(): unable to allocate storage entry");
         response->status = RES_ERR_SERVER;
         return 0;
     }
 
-    response->status = RES_OK;
-    return 0;
+    if (nargs == 4) {
+        return dispatch_store(server, args[0], arg_to_len[0], entry, args[3], arg_to_len[3], &check, response);
+    }
+    return dispatch_store(server, args[0], arg_to_len[0], entry, NULL, 0, &check, response);
 
 }
 
@@ -350,89 +609,36 @@ int32_t do_del(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_
         return 0;
     }
 
-    int32_t res;
-
-    PyObject *loaded_key = _loads_hashable((char *)args[0], arg_to_len[0]);
-    if (!loaded_key) {
+    if (validate_hashable(args[0], arg_to_len[0])) {
         error_handler(response);
         return 0;
     }
 
-    #if _FOO_KV_DEBUG == 1
-    log_debug("do_del(): got past py_key");
-
-    if (server->storage == NULL) {
-        log_error("do_del(): server storage has become NULL!!!");
-        response->status = RES_ERR_SERVER;
-        return -1;
-    }
-    #endif
-
-    if (threadsafe_sem_wait(server->storage_lock)) {
-        log_error("do_del(): sem_wait() failed");
+    uint64_t hash = storage_hash(args[0], arg_to_len[0]);
+    struct storage_shard_t *shard = storage_shard(server->storage, hash);
+    if (storage_shard_lock(shard)) {
+        log_error("do_del(): encountered error trying to acquire storage lock");
         response->status = RES_ERR_SERVER;
         return -1;
     }
+    struct storage_entry_t *removed = storage_remove(shard, hash, args[0], arg_to_len[0]);
+    storage_shard_unlock(shard);
 
-    #if _FOO_KV_DEBUG == 1
-    log_debug("do_del(): got past sem_wait");
-    #endif
-
-    /*
-    res = PyDict_Contains(server->storage, loaded_key);
-    if (res != 1) {
-        if (res == 0) {
-            log_debug("do_del(): storage does not contain key, perhaps this is expected");
-            response->status = RES_BAD_KEY;
-        } else {
-            log_error("do_del(): server storage contains returned error!");
-            response->status = RES_ERR_SERVER;
-        }
-        if (sem_post(server->storage_lock)) {
-            log_error("do_del(): sem_post() failed");
-            response->status = RES_ERR_SERVER;
-            return -1;
-        }
+    if (!removed) {
+        #if _FOO_KV_DEBUG == 1
+        log_debug("do_del(): key was not in storage: perhaps this is expected");
+        #endif
+        response->status = RES_BAD_KEY;
         return 0;
-    }  // storage contains key if we got here
-
-    #if _FOO_KV_DEBUG == 1
-    log_debug("do_del(): storage contains key");
-    #endif
-    */
-
-    // PyDict_DelItem segfaults randomly
-    res = _pyobject_safe_delitem(server->storage, loaded_key);
-    //res = PyDict_DelItem(server->storage, loaded_key);
-    Py_DECREF(loaded_key);
-    if (res < 0) {
-        log_error("do_del(): py operation resulted in error");
-        if (PyErr_Occurred()) {
-            PyErr_Clear();
-        }
-        response->status = RES_ERR_SERVER;
-        return -1;
     }
 
-    #if _FOO_KV_DEBUG == 1
-    log_debug("do_del(): got res");
-    #endif
+    int32_t had_ttl = removed->has_ttl;
+    storage_entry_free(removed);
 
-    if (sem_post(server->storage_lock)) {
-        log_error("do_del(): sem_post() failed");
+    // otherwise the ttl would expire the key if it is stored again
+    if (had_ttl && dispatch_ttl_update(server, args[0], arg_to_len[0])) {
+        log_error("do_del(): unable to invalidate previous ttl");
         response->status = RES_ERR_SERVER;
-        return -1;
-    }
-
-    #if _FOO_KV_DEBUG == 1
-    log_debug("do_del(): got past release lock");
-    #endif
-
-    if (res == 0) {
-        #if _FOO_KV_DEBUG == 1
-        log_debug("do_del(): key was not in storage: perhaps this is expected");
-        #endif
-        response->status = RES_BAD_KEY;
         return 0;
     }
 
@@ -456,73 +662,26 @@ int32_t do_queue(foo_kv_server *server, const uint8_t **args, const uint16_t *ar
         return 0;
     }
 
-    PyObject *loaded_key = _loads_hashable((char *)args[0], arg_to_len[0]);
-    if (!loaded_key) {
+    if (validate_hashable(args[0], arg_to_len[0])) {
         error_handler(response);
         return 0;
     }
-
-    #if _FOO_KV_DEBUG == 1
-    log_debug("do_queue(): loaded key");
-    #endif
-
-    PyObject *deq_obj = PyObject_CallNoArgs(_deq_class);
-    if (!deq_obj) {
-        _dispatch_errno = RES_ERR_SERVER;
-        return 0;
-    }
-
-    #if _FOO_KV_DEBUG == 1
-    log_debug("do_queue(): loaded val");
-    #endif
-
-    if (threadsafe_sem_wait(server->storage_lock)) {
-        log_error("do_queue(): encountered error trying to acquire storage lock");
-        response->status = RES_ERR_SERVER;
+    if (nargs == 2 && validate_datetime(args[1], arg_to_len[1])) {
+        error_handler(response);
         return 0;
     }
 
-    int32_t res = PyDict_SetItem(server->storage, loaded_key, deq_obj);
-
-    Py_DECREF(loaded_key);
-    Py_DECREF(deq_obj);
-
-    if (sem_post(server->storage_lock)) {
-        log_error("do_queue(): failed to release lock");
+    struct storage_entry_t *entry = storage_entry_new(args[0], arg_to_len[0], NULL, 0, STORAGE_QUEUE);
+    if (!entry) {
+        log_error("do_queue(): unable to allocate storage entry");
         response->status = RES_ERR_SERVER;
         return 0;
     }
 
-    if (nargs == 3) {
-        PyObject *loaded_ttl = _loads_foo_datetime((char *)args[2], arg_to_len[2]);
-        if (!loaded_ttl) {
-            error_handler(response);
-            return 0;
-        }
-        #if _FOO_KV_DEBUG == 1
-        log_debug("do_queue(): loaded ttl");
-        #endif
-        if (foo_kv_ttl_heap_put_dt(server->storage_ttl_heap, loaded_key, loaded_ttl)) {
-            log_error("do_queue(): unable to set ttl on item, exiting!");
-            response->status = RES_ERR_SERVER;
-            return 0;
-        }
-    } else {
-        if (foo_kv_ttl_heap_invalidate(server->storage_ttl_heap, loaded_key)) {
-            log_error("do_queue(): unable to invalidate previous ttl, exiting");
-            response->status = RES_ERR_SERVER;
-            return 0;
-        }
-    }
-
-    if (res) {
-        log_error("do_queue(): got error setting item in storage: perhaps this is expected");
-        response->status = RES_ERR_SERVER;
-        return 0;
+    if (nargs == 2) {
+        return dispatch_store(server, args[0], arg_to_len[0], entry, args[1], arg_to_len[1], NULL, response);
     }
-
-    response->status = RES_OK;
-    return 0;
+    return dispatch_store(server, args[0], arg_to_len[0], entry, NULL, 0, NULL, response);
 
 }
 
@@ -537,233 +696,2241 @@ int32_t do_push(foo_kv_server *server, const uint8_t **args, const uint16_t *arg
         return 0;
     }
 
-    PyObject *loaded_key = _loads_hashable((char *)args[0], arg_to_len[0]);
-    if (!loaded_key) {
+    if (validate_hashable(args[0], arg_to_len[0]) || validate_collectable(args[1], arg_to_len[1])) {
         error_handler(response);
         return 0;
     }
 
-    #if _FOO_KV_DEBUG == 1
-    log_debug("do_push(): loaded key");
-    #endif
-
-    PyObject *loaded_val = _loads_collectable((char *)args[1], arg_to_len[1]);
-    if (!loaded_val) {
-        error_handler(response);
+    struct storage_blob_t *blob = storage_blob_new(args[1], arg_to_len[1]);
+    if (!blob) {
+        log_error("do_push(): unable to allocate queue item");
+        response->status = RES_ERR_SERVER;
         return 0;
     }
 
-    #if _FOO_KV_DEBUG == 1
-    log_debug("do_push(): loaded val");
-    #endif
-
-    // TODO seems like just the deq should be locked, in opposed to all of storage?
-    if (threadsafe_sem_wait(server->storage_lock)) {
+    uint64_t hash = storage_hash(args[0], arg_to_len[0]);
+    struct storage_shard_t *shard = storage_shard(server->storage, hash);
+    if (storage_shard_lock(shard)) {
         log_error("do_push(): encountered error trying to acquire storage lock");
+        PyMem_RawFree(blob);
         response->status = RES_ERR_SERVER;
         return -1;
     }
 
-    int32_t err = 0;
-
-    PyObject *deq_obj = PyDict_GetItem(server->storage, loaded_key);
-    Py_DECREF(loaded_key);
-    if (!deq_obj) {
-        if (PyErr_Occurred()) {
-            PyErr_Clear();
-        }
+    struct storage_entry_t *entry = storage_find(shard, hash, args[0], arg_to_len[0]);
+    if (!entry) {
         response->status = RES_BAD_KEY;
-        goto DO_PUSH_END;
+    } else if (entry->type != STORAGE_QUEUE) {
+        response->status = RES_BAD_OP;
+    } else if (storage_reserve(server->storage, shard, sizeof(struct storage_blob_t) + blob->len, entry) < 0) {
+        // the queue itself is never evicted to make room for its item
+        response->status = RES_ERR_MEMORY;
+    } else {
+        storage_queue_push(shard, entry, blob);
+        storage_touch(server->storage, entry);
+        blob = NULL;
+        response->status = RES_OK;
     }
 
-    Py_INCREF(_deq_class);
-    int32_t is_valid = PyObject_IsInstance(deq_obj, _deq_class);
-    Py_DECREF(_deq_class);
-    if (is_valid < 0) {
-        if (PyErr_Occurred()) {
-            PyErr_Clear();
-        }
-        log_error("do_push(): could not determine if item is a deque");
+    storage_shard_unlock(shard);
+    PyMem_RawFree(blob);
+
+    #if _FOO_KV_DEBUG == 1
+    if (response->status == RES_BAD_OP) {
+        log_debug("do_push(): item at key is not a queue");
+    }
+    #endif
+
+    return 0;
+
+}
+
+int32_t do_pop(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_pop(): got request");
+    #endif
+
+    if (nargs != 1) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+
+    if (validate_hashable(args[0], arg_to_len[0])) {
+        error_handler(response);
+        return 0;
+    }
+
+    uint64_t hash = storage_hash(args[0], arg_to_len[0]);
+    struct storage_shard_t *shard = storage_shard(server->storage, hash);
+    if (storage_shard_lock(shard)) {
+        log_error("do_pop(): encountered error trying to acquire storage lock");
         response->status = RES_ERR_SERVER;
-        goto DO_PUSH_END;
+        return -1;
     }
-    if (is_valid == 0) {
-        log_error("do_push(): item at key is not a deq");
+
+    struct storage_blob_t *blob = NULL;
+    struct storage_entry_t *entry = storage_find(shard, hash, args[0], arg_to_len[0]);
+    if (!entry) {
+        response->status = RES_BAD_KEY;
+    } else if (entry->type != STORAGE_QUEUE) {
         response->status = RES_BAD_OP;
-        goto DO_PUSH_END;
-        return 0;
+    } else {
+        blob = storage_queue_pop(shard, entry);
+        storage_touch(server->storage, entry);
+        response->status = blob ? RES_OK : RES_BAD_IX;
     }
 
-    PyObject *push_result = PyObject_CallMethodObjArgs(deq_obj, _append_str, loaded_val, NULL);
-    Py_DECREF(loaded_val);
+    storage_shard_unlock(shard);
 
-    if (!push_result) {
-        if (PyErr_Occurred()) {
-            PyErr_Clear();
+    if (blob) {
+        uint8_t *payload = response_payload(response, blob->len);
+        if (payload) {
+            memcpy(payload, blob->data, blob->len);
+        } else {
+            log_error("do_pop(): was not able to copy item");
+            response->status = RES_ERR_SERVER;
         }
-        log_error("do_push(): append call raised an error");
+        PyMem_RawFree(blob);
+    }
+
+    return 0;
+}
+
+int32_t do_ttl(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_ttl(): got request");
+    #endif
+
+    if (nargs < 1 || nargs > 2) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+
+    if (validate_hashable(args[0], arg_to_len[0])) {
+        error_handler(response);
+        return 0;
+    }
+    if (nargs == 2 && validate_datetime(args[1], arg_to_len[1])) {
+        error_handler(response);
+        return 0;
+    }
+
+    uint64_t hash = storage_hash(args[0], arg_to_len[0]);
+    struct storage_shard_t *shard = storage_shard(server->storage, hash);
+    if (storage_shard_lock(shard)) {
+        log_error("do_ttl(): encountered error trying to acquire storage lock");
         response->status = RES_ERR_SERVER;
-        goto DO_PUSH_END;
+        return 0;
+    }
+
+    int32_t had_ttl = 0;
+    struct storage_entry_t *entry = storage_find(shard, hash, args[0], arg_to_len[0]);
+    if (entry) {
+        had_ttl = entry->has_ttl;
+        entry->has_ttl = nargs == 2;
+        if (nargs == 2) {
+            entry->expires = ttl_expires(args[1], arg_to_len[1]);
+        }
+    }
+
+    storage_shard_unlock(shard);
+
+    if (!entry) {
+        log_error("do_ttl(): key is not contained, cannot set ttl.");
+        response->status = RES_BAD_KEY;
+        return 0;
+    }
+
+    if (nargs == 2 || had_ttl) {
+        if (dispatch_ttl_update(server, args[0], arg_to_len[0])) {
+            log_error("do_ttl(): unable to update the ttl of the item");
+            response->status = RES_ERR_SERVER;
+            return 0;
+        }
     }
-    Py_DECREF(push_result);
 
     response->status = RES_OK;
+    return 0;
 
-DO_PUSH_END:
-    if (sem_post(server->storage_lock)) {
-        log_error("do_push(): failed to release lock");
-        response->status = RES_ERR_SERVER;
+}
+
+static int32_t parse_int64(const uint8_t *x, int32_t len, int64_t *out) {
+    // parses the digits of a validated wire int, returns -1 if it doesn't fit
+    // in an int64
+
+    int32_t ix = 0;
+    int32_t negative = x[0] == '-';
+    if (x[0] == '-' || x[0] == '+') {
+        ix++;
+    }
+    // accumulated as a negative number, which has room for INT64_MIN
+    int64_t value = 0;
+    for (; ix < len; ix++) {
+        if (__builtin_mul_overflow(value, 10, &value) || __builtin_sub_overflow(value, x[ix] - '0', &value)) {
+            return -1;
+        }
+    }
+    if (!negative && __builtin_mul_overflow(value, -1, &value)) {
         return -1;
     }
+    *out = value;
 
-    return err;
+    return 0;
 
 }
 
-int32_t do_pop(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+static int32_t parse_double(const uint8_t *x, int32_t len, double *out) {
+    // parses the digits of a validated wire int or float, returns -1 for ints
+    // too long to bother with
+
+    char buff[128];
+    if ((size_t)len >= sizeof(buff)) {
+        return -1;
+    }
+    memcpy(buff, x, len);
+    buff[len] = '\0';
+    *out = strtod(buff, NULL);
+
+    return 0;
+
+}
+
+static int32_t format_double(char *buff, double x) {
+    // writes x as a wire float, with the fewest digits that read back as x like
+    // python's repr(), and returns its length
+
+    int32_t len = 0;
+    for (int32_t precision = 1; precision <= 17; precision++) {
+        len = sprintf(buff, "%c%.*g", FLOAT_SYMBOL, precision, x);
+        if (strtod(buff + sizeof(char), NULL) == x) {
+            break;
+        }
+    }
+
+    return len;
+
+}
+
+static int32_t incr_value(const struct storage_entry_t *entry, int32_t cmd, int64_t by, double by_float, char *value, struct response_t *response) {
+    // writes the wire encoded value of `entry` plus the increment to `value`,
+    // a missing entry counting as 0, and returns its length. sets the status
+    // and returns -1 if the value is not a number or the result is out of range.
+
+    const uint8_t *x = entry ? entry->data + entry->key_len : NULL;
+    int32_t len = entry ? entry->val_len : 0;
+
+    if (cmd == CMD_INCRBYFLOAT) {
+        double current = 0;
+        if (x && x[0] != INT_SYMBOL && x[0] != FLOAT_SYMBOL) {
+            response->status = RES_BAD_OP;
+            return -1;
+        }
+        if (x && parse_double(x + sizeof(char), len - sizeof(char), &current)) {
+            response->status = RES_BAD_RANGE;
+            return -1;
+        }
+        double result = current + by_float;
+        if (!isfinite(result)) {
+            response->status = RES_BAD_RANGE;
+            return -1;
+        }
+        return format_double(value, result);
+    }
+
+    // the fast path, ints are parsed and written back without python
+    int64_t current = 0;
+    if (x && x[0] != INT_SYMBOL) {
+        response->status = RES_BAD_OP;
+        return -1;
+    }
+    int64_t result;
+    if ((x && parse_int64(x + sizeof(char), len - sizeof(char), &current)) || __builtin_add_overflow(current, by, &result)) {
+        response->status = RES_BAD_RANGE;
+        return -1;
+    }
+
+    return sprintf(value, "%c%lld", INT_SYMBOL, (long long)result);
+
+}
+
+int32_t do_incr(foo_kv_server *server, int32_t cmd, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // incr and decr add 1 and -1, incrby an int and incrbyfloat an int or a
+    // float to the number at the key, or to 0 if there is none, and respond
+    // with the result. the value is updated in place under the shard's lock,
+    // so concurrent increments are never lost.
 
     #if _FOO_KV_DEBUG == 1
-    log_debug("do_pop(): got request");
+    log_debug("do_incr(): got request");
     #endif
 
-    if (nargs != 1) {
+    int32_t num_args = (cmd == CMD_INCR || cmd == CMD_DECR) ? 1 : 2;
+    if (nargs != num_args) {
         response->status = RES_BAD_ARGS;
         return 0;
     }
 
-    PyObject *loaded_key = _loads_hashable((char *)args[0], arg_to_len[0]);
-    if (!loaded_key) {
+    if (validate_hashable(args[0], arg_to_len[0])) {
         error_handler(response);
         return 0;
     }
 
-    // TODO seems like just the deq should be locked, in opposed to all of storage?
-    if (threadsafe_sem_wait(server->storage_lock)) {
-        log_error("do_pop(): encountered error trying to acquire storage lock");
+    int64_t by = cmd == CMD_DECR ? -1 : 1;
+    double by_float = 0;
+    if (num_args == 2) {
+        if (validate_value(args[1], arg_to_len[1])) {
+            error_handler(response);
+            return 0;
+        }
+        if (args[1][0] != INT_SYMBOL && (cmd == CMD_INCRBY || args[1][0] != FLOAT_SYMBOL)) {
+            response->status = RES_BAD_TYPE;
+            return 0;
+        }
+        if (cmd == CMD_INCRBY && parse_int64(args[1] + sizeof(char), arg_to_len[1] - sizeof(char), &by)) {
+            response->status = RES_BAD_RANGE;
+            return 0;
+        }
+        if (cmd == CMD_INCRBYFLOAT && (parse_double(args[1] + sizeof(char), arg_to_len[1] - sizeof(char), &by_float) || !isfinite(by_float))) {
+            response->status = RES_BAD_RANGE;
+            return 0;
+        }
+    }
+
+    uint64_t hash = storage_hash(args[0], arg_to_len[0]);
+    struct storage_shard_t *shard = storage_shard(server->storage, hash);
+    if (storage_shard_lock(shard)) {
+        log_error("do_incr(): encountered error trying to acquire storage lock");
         response->status = RES_ERR_SERVER;
         return -1;
     }
 
-    PyObject *deq_obj = PyDict_GetItem(server->storage, loaded_key);
-    Py_DECREF(loaded_key);
-    if (!deq_obj) {
-        if (PyErr_Occurred()) {
-            PyErr_Clear();
+    // long enough for an int64 or a float's repr()
+    char value[32];
+    int32_t value_len = 0;
+    struct storage_entry_t *entry = storage_find(shard, hash, args[0], arg_to_len[0]);
+    if (entry && entry->type != STORAGE_VALUE) {
+        response->status = RES_BAD_OP;
+    } else if ((value_len = incr_value(entry, cmd, by, by_float, value, response)) >= 0) {
+        uint64_t size = sizeof(struct storage_entry_t) + arg_to_len[0] + value_len;
+        if (entry) {
+            size = (uint32_t)value_len > entry->val_len ? value_len - entry->val_len : 0;
+        }
+        // the key itself is never evicted to make room for its new value
+        if (storage_reserve(server->storage, shard, size, entry) < 0) {
+            response->status = RES_ERR_MEMORY;
         }
-        response->status = RES_BAD_KEY;
-        goto DO_POP_END;
     }
 
-    Py_INCREF(_deq_class);
-    int32_t is_valid = PyObject_IsInstance(deq_obj, _deq_class);
-    Py_DECREF(_deq_class);
-    if (is_valid < 0) {
-        if (PyErr_Occurred()) {
-            PyErr_Clear();
+    if (response->status == -1 && entry) {
+        entry = storage_set_value(shard, entry, (const uint8_t *)value, value_len);
+        if (entry) {
+            storage_touch(server->storage, entry);
         }
-        log_error("do_pop(): could not determine if item is a deque");
-        response->status = RES_ERR_SERVER;
-        goto DO_POP_END;
-    }
-    if (is_valid == 0) {
-        log_error("do_pop(): item at key is not a deque");
-        response->status = RES_BAD_OP;
-        goto DO_POP_END;
-        return 0;
+        response->status = entry ? RES_OK : RES_ERR_SERVER;
+    } else if (response->status == -1) {
+        struct storage_entry_t *replaced;
+        entry = storage_entry_new(args[0], arg_to_len[0], (const uint8_t *)value, value_len, STORAGE_VALUE);
+        if (entry && storage_insert(shard, entry, &replaced)) {
+            PyMem_RawFree(entry);
+            entry = NULL;
+        }
+        if (entry) {
+            storage_track(server->storage, entry, NULL);
+        }
+        response->status = entry ? RES_OK : RES_ERR_SERVER;
     }
 
-    PyObject *pop_result = PyObject_CallMethodObjArgs(deq_obj, _popleft_str, NULL);
-    if (!pop_result) {
-        if (PyErr_Occurred()) {
-            PyErr_Clear();
+    storage_shard_unlock(shard);
+
+    if (response->status == RES_OK) {
+        uint8_t *payload = response_payload(response, value_len);
+        if (!payload) {
+            response->status = RES_ERR_SERVER;
+            return 0;
         }
-        response->status = RES_BAD_IX;
-        goto DO_POP_END;
+        memcpy(payload, value, value_len);
     }
 
-    PyObject *dumped_result = dumps_as_pyobject(pop_result);
-    Py_DECREF(pop_result);
-    if (!dumped_result) {
-        log_error("do_pop(): was not able to dump item");
-        error_handler(response);
-        goto DO_POP_END;
+    return 0;
+
+}
+
+static int32_t list_append_bytes(uint8_t *list, int32_t len, char symbol, const uint8_t *item, uint16_t item_len) {
+    // appends `item` as an item of type `symbol` to the wire encoded list of
+    // `len` bytes at `list`, which has room for it, and returns the new length
+
+    uint16_t num_items;
+    memcpy(&num_items, list + sizeof(char), sizeof(uint16_t));
+    num_items++;
+    memcpy(list + sizeof(char), &num_items, sizeof(uint16_t));
+
+    uint16_t encoded_len = sizeof(char) + item_len;
+    memcpy(list + len, &encoded_len, sizeof(uint16_t));
+    len += sizeof(uint16_t);
+    list[len] = symbol;
+    memcpy(list + len + sizeof(char), item, item_len);
+
+    return len + encoded_len;
+
+}
+
+static int32_t list_append(uint8_t *list, int32_t len, char symbol, const char *item) {
+
+    return list_append_bytes(list, len, symbol, (const uint8_t *)item, strlen(item));
+
+}
+
+static int32_t list_append_count(uint8_t *list, int32_t len, const char *name, uint64_t count) {
+    // appends the name of a counter and its value
+
+    char value[32];
+    len = list_append(list, len, STRING_SYMBOL, name);
+    sprintf(value, "%lu", (unsigned long)count);
+
+    return list_append(list, len, INT_SYMBOL, value);
+
+}
+
+int32_t do_info(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // responds with a list of alternating counter names and values
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_info(): got request");
+    #endif
+
+    // takes no arguments, but has the signature of every command
+    (void)args;
+    (void)arg_to_len;
+    if (nargs != 0) {
+        response->status = RES_BAD_ARGS;
+        return 0;
     }
 
-    response->status = RES_OK;
-    response->payload = dumped_result;
+    struct storage_t *storage = server->storage;
+    uint8_t list[512];
+    list[0] = LIST_SYMBOL;
+    memset(list + sizeof(char), 0, sizeof(uint16_t));
+    int32_t len = sizeof(char) + sizeof(uint16_t);
+
+    len = list_append_count(list, len, "keys", storage_num_keys(storage));
+    len = list_append_count(list, len, "used_memory", storage_used_memory(storage));
+    len = list_append_count(list, len, "maxmemory", storage->maxmemory);
+    len = list_append(list, len, STRING_SYMBOL, "maxmemory_policy");
+    len = list_append(list, len, STRING_SYMBOL, storage_policy_names[storage->policy]);
+    len = list_append_count(list, len, "evicted_keys", __atomic_load_n(&storage->evicted, __ATOMIC_RELAXED));
+    if (storage->index) {
+        len = list_append_count(list, len, "index_keys", __atomic_load_n(&storage->index->size, __ATOMIC_RELAXED));
+        len = list_append_count(list, len, "index_memory", __atomic_load_n(&storage->index->memory, __ATOMIC_RELAXED));
+    }
+    len = list_append_count(list, len, "locks", __atomic_load_n(&server->user_locks->num_held, __ATOMIC_RELAXED));
+    len = list_append_count(list, len, "lock_waiters", __atomic_load_n(&server->user_locks->num_waiters, __ATOMIC_RELAXED));
 
-DO_POP_END:
-    if (sem_post(server->storage_lock)) {
-        log_error("do_pop(): failed to release lock");
+    uint8_t *payload = response_payload(response, len);
+    if (!payload) {
         response->status = RES_ERR_SERVER;
-        return -1;
+        return 0;
     }
+    memcpy(payload, list, len);
+    response->status = RES_OK;
 
     return 0;
+
 }
 
-int32_t do_ttl(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+int32_t do_memory(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // responds with the bytes the key takes, its entry, queue items and slot
 
     #if _FOO_KV_DEBUG == 1
-    log_debug("do_ttl(): got request");
+    log_debug("do_memory(): got request");
     #endif
 
-    if (nargs < 1 || nargs > 2) {
+    if (nargs != 1) {
         response->status = RES_BAD_ARGS;
         return 0;
     }
 
-    PyObject *loaded_key = _loads_hashable((char *)args[0], arg_to_len[0]);
-    if (!loaded_key) {
+    if (validate_hashable(args[0], arg_to_len[0])) {
         error_handler(response);
         return 0;
     }
 
-    #if _FOO_KV_DEBUG == 1
-    log_debug("do_ttl(): loaded key");
-    #endif
+    uint64_t hash = storage_hash(args[0], arg_to_len[0]);
+    struct storage_shard_t *shard = storage_shard(server->storage, hash);
+    if (storage_shard_read_lock(shard)) {
+        log_error("do_memory(): encountered error trying to acquire storage lock");
+        response->status = RES_ERR_SERVER;
+        return -1;
+    }
+    uint64_t size = 0;
+    struct storage_entry_t *entry = storage_find(shard, hash, args[0], arg_to_len[0]);
+    if (entry) {
+        size = storage_entry_size(entry) + STORAGE_SLOT_SIZE;
+    }
+    storage_shard_unlock(shard);
+
+    if (!entry) {
+        response->status = RES_BAD_KEY;
+        return 0;
+    }
 
-    int32_t is_contained = PyDict_Contains(server->storage, loaded_key);
-    if (is_contained < 0) {
-        log_error("do_ttl(): could not determine if key exists");
+    char value[32];
+    int32_t len = sprintf(value, "#%lu", (unsigned long)size);
+    uint8_t *payload = response_payload(response, len);
+    if (!payload) {
         response->status = RES_ERR_SERVER;
         return 0;
     }
-    if (is_contained == 0) {
-        log_error("do_ttl(): key is not contained, cannot set ttl.");
-        response->status = RES_BAD_KEY;
+    memcpy(payload, value, len);
+    response->status = RES_OK;
+
+    return 0;
+
+}
+
+// sampled entries when stats doesn't say
+#define STATS_SAMPLES 10000
+#define STATS_MAX_SAMPLES 1000000
+// the histogram's buckets are powers of 2 from 64 bytes to 64KiB, and one for
+// anything larger
+#define STATS_MIN_BUCKET_SHIFT 6
+#define STATS_NUM_BUCKETS 12
+// the largest sampled keys that are reported
+#define STATS_LARGEST 8
+
+struct stats_key_t {
+    uint8_t *key;
+    uint16_t key_len;
+    uint64_t size;
+};
+
+static void stats_sample(struct stats_key_t *largest, int32_t *num_largest, uint64_t *histogram, const struct storage_entry_t *entry) {
+    // counts a sampled entry, copying its key if it is one of the largest so
+    // far. called with the lock of the entry's shard held.
+
+    uint64_t size = storage_entry_size(entry) + STORAGE_SLOT_SIZE;
+    int32_t bucket = 0;
+    if (size > (1 << STATS_MIN_BUCKET_SHIFT)) {
+        bucket = 64 - __builtin_clzll(size - 1) - STATS_MIN_BUCKET_SHIFT;
+    }
+    histogram[bucket < STATS_NUM_BUCKETS ? bucket : STATS_NUM_BUCKETS - 1]++;
+
+    if (*num_largest == STATS_LARGEST && size <= largest[STATS_LARGEST - 1].size) {
+        return;
+    }
+    // big keys are likely to be sampled more than once
+    for (int32_t ix = 0; ix < *num_largest; ix++) {
+        if (largest[ix].key_len == entry->key_len && !memcmp(largest[ix].key, entry->data, entry->key_len)) {
+            return;
+        }
+    }
+    uint8_t *key = PyMem_RawMalloc(entry->key_len);
+    if (!key) {
+        return;
+    }
+    memcpy(key, entry->data, entry->key_len);
+
+    if (*num_largest == STATS_LARGEST) {
+        PyMem_RawFree(largest[STATS_LARGEST - 1].key);
+        (*num_largest)--;
+    }
+    int32_t ix = *num_largest;
+    for (; ix > 0 && largest[ix - 1].size < size; ix--) {
+        largest[ix] = largest[ix - 1];
+    }
+    largest[ix].key = key;
+    largest[ix].key_len = entry->key_len;
+    largest[ix].size = size;
+    (*num_largest)++;
+
+}
+
+int32_t do_stats(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // responds with a list of the keys and bytes of every kind of value, then
+    // a size histogram of sampled keys and the largest of them. the counters
+    // are exact, the histogram and largest keys come from random entries, so
+    // they are cheap whatever the size of the storage.
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_stats(): got request");
+    #endif
+
+    if (nargs > 1) {
+        response->status = RES_BAD_ARGS;
         return 0;
     }
 
-    if (nargs == 2) {
-        PyObject *loaded_ttl = _loads_foo_datetime((char *)args[1], arg_to_len[1]);
-        if (!loaded_ttl) {
-            error_handler(response);
+    uint64_t num_samples = STATS_SAMPLES;
+    if (nargs == 1) {
+        // the number of samples, a non negative int without leading zeros
+        if (arg_to_len[0] < 2 || arg_to_len[0] > 8 || args[0][0] != INT_SYMBOL || (args[0][1] == '0' && arg_to_len[0] > 2)) {
+            response->status = RES_BAD_ARGS;
             return 0;
         }
-        #if _FOO_KV_DEBUG == 1
-        log_debug("do_ttl(): loaded ttl");
-        #endif
-        if (foo_kv_ttl_heap_put_dt(server->storage_ttl_heap, loaded_key, loaded_ttl)) {
-            log_error("do_ttl(): unable to set ttl on item, exiting!");
-            response->status = RES_ERR_SERVER;
-            return 0;
+        num_samples = 0;
+        for (int32_t ix = 1; ix < arg_to_len[0]; ix++) {
+            if (args[0][ix] < '0' || args[0][ix] > '9') {
+                response->status = RES_BAD_ARGS;
+                return 0;
+            }
+            num_samples = num_samples * 10 + args[0][ix] - '0';
         }
-    } else {
-        if (foo_kv_ttl_heap_invalidate(server->storage_ttl_heap, loaded_key)) {
-            log_error("do_ttl(): unable to invalidate previous ttl, exiting");
-            response->status = RES_ERR_SERVER;
+        if (num_samples > STATS_MAX_SAMPLES) {
+            response->status = RES_BAD_ARGS;
             return 0;
         }
     }
 
-    response->status = RES_OK;
-    return 0;
+    struct storage_t *storage = server->storage;
+    uint64_t kind_keys[STORAGE_NUM_KINDS] = {0};
+    uint64_t kind_bytes[STORAGE_NUM_KINDS] = {0};
+    uint64_t histogram[STATS_NUM_BUCKETS] = {0};
+    uint64_t num_sampled = 0;
+    struct stats_key_t largest[STATS_LARGEST];
+    int32_t num_largest = 0;
 
-}
+    // keys are spread evenly over the shards, so are the samples
+    for (uint32_t shard_ix = 0; shard_ix < storage->num_shards; shard_ix++) {
+        struct storage_shard_t *shard = &storage->shards[shard_ix];
+        if (storage_shard_read_lock(shard)) {
+            log_error("do_stats(): encountered error trying to acquire storage lock");
+            response->status = RES_ERR_SERVER;
+            break;
+        }
+        for (int32_t kind = 0; kind < STORAGE_NUM_KINDS; kind++) {
+            kind_keys[kind] += shard->kind_keys[kind];
+            kind_bytes[kind] += shard->kind_bytes[kind];
+        }
+        uint64_t shard_samples = num_samples / storage->num_shards + (shard_ix < num_samples % storage->num_shards);
+        for (uint64_t ix = 0; ix < shard_samples; ix++) {
+            struct storage_entry_t *entry = storage_random_entry(shard);
+            if (!entry) {
+                break;
+            }
+            stats_sample(largest, &num_largest, histogram, entry);
+            num_sampled++;
+        }
+        storage_shard_unlock(shard);
+    }
 
+    uint8_t *list = NULL;
+    if (response->status == -1) {
+        list = PyMem_RawMalloc(MAX_MSG_SIZE);
+        if (!list) {
+            response->status = RES_ERR_SERVER;
+        }
+    }
 
+    if (list) {
+        char name[32];
+        list[0] = LIST_SYMBOL;
+        memset(list + sizeof(char), 0, sizeof(uint16_t));
+        int32_t len = sizeof(char) + sizeof(uint16_t);
 
+        for (int32_t kind = 0; kind < STORAGE_NUM_KINDS; kind++) {
+            sprintf(name, "%s.keys", storage_kind_names[kind]);
+            len = list_append_count(list, len, name, kind_keys[kind]);
+            sprintf(name, "%s.bytes", storage_kind_names[kind]);
+            len = list_append_count(list, len, name, kind_bytes[kind]);
+        }
+        len = list_append_count(list, len, "sampled", num_sampled);
+        for (int32_t bucket = 0; bucket < STATS_NUM_BUCKETS - 1; bucket++) {
+            sprintf(name, "size.%lu", 1UL << (bucket + STATS_MIN_BUCKET_SHIFT));
+            len = list_append_count(list, len, name, histogram[bucket]);
+        }
+        len = list_append_count(list, len, "size.inf", histogram[STATS_NUM_BUCKETS - 1]);
+
+        // as many of the largest keys as fit, each followed by its size. lists
+        // can't hold tuples, so keys are sent as bytes holding their encoding.
+        int32_t num_fit = 0;
+        int32_t fit_len = len + 2 * (sizeof(uint16_t) + 32);
+        for (; num_fit < num_largest; num_fit++) {
+            fit_len += 2 * sizeof(uint16_t) + sizeof(char) + largest[num_fit].key_len + 32;
+            if (fit_len > MAX_MSG_SIZE - (int32_t)sizeof(uint16_t)) {
+                break;
+            }
+        }
+        len = list_append_count(list, len, "largest", num_fit);
+        for (int32_t ix = 0; ix < num_fit; ix++) {
+            char value[32];
+            len = list_append_bytes(list, len, BYTES_SYMBOL, largest[ix].key, largest[ix].key_len);
+            sprintf(value, "%lu", (unsigned long)largest[ix].size);
+            len = list_append(list, len, INT_SYMBOL, value);
+        }
+
+        uint8_t *payload = response_payload(response, len);
+        if (payload) {
+            memcpy(payload, list, len);
+            response->status = RES_OK;
+        } else {
+            response->status = RES_ERR_SERVER;
+        }
+        PyMem_RawFree(list);
+    }
+
+    for (int32_t ix = 0; ix < num_largest; ix++) {
+        PyMem_RawFree(largest[ix].key);
+    }
+
+    return 0;
+
+}
+
+// multi-key commands
+// a batch hashes all of its keys, locks each of their shards once, in address
+// order so batches can't deadlock, and prefetches every key's first group
+// before probing any, so the probes wait on memory together instead of one
+// after the other.
+
+static int32_t batch_lock(struct storage_t *storage, const uint64_t *hashes, int32_t num_keys, struct storage_shard_t **shards, int32_t shared) {
+    // `shards` has room for `num_keys` and is what storage_unlock_shards() takes
+
+    for (int32_t ix = 0; ix < num_keys; ix++) {
+        shards[ix] = storage_shard(storage, hashes[ix]);
+    }
+    int32_t err = shared ? storage_read_lock_shards(shards, num_keys) : storage_lock_shards(shards, num_keys);
+    if (err) {
+        return -1;
+    }
+    for (int32_t ix = 0; ix < num_keys; ix++) {
+        storage_prefetch(storage_shard(storage, hashes[ix]), hashes[ix]);
+    }
+
+    return 0;
+
+}
+
+int32_t do_mget(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // responds with a list of the values of the keys, each as bytes holding its
+    // encoding since lists can't hold collections, and empty bytes for a key
+    // that is missing or a queue
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_mget(): got request");
+    #endif
+
+    if (nargs < 1) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+    for (int32_t ix = 0; ix < nargs; ix++) {
+        if (validate_hashable(args[ix], arg_to_len[ix])) {
+            error_handler(response);
+            return 0;
+        }
+    }
+
+    uint64_t *hashes = PyMem_RawMalloc(nargs * (sizeof(uint64_t) + sizeof(struct storage_shard_t *) + sizeof(struct storage_entry_t *)));
+    if (!hashes) {
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+    struct storage_shard_t **shards = (struct storage_shard_t **)(hashes + nargs);
+    struct storage_entry_t **entries = (struct storage_entry_t **)(shards + nargs);
+    for (int32_t ix = 0; ix < nargs; ix++) {
+        hashes[ix] = storage_hash(args[ix], arg_to_len[ix]);
+    }
+
+    struct storage_t *storage = server->storage;
+    if (batch_lock(storage, hashes, nargs, shards, 1)) {
+        log_error("do_mget(): encountered error trying to acquire storage locks");
+        PyMem_RawFree(hashes);
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+
+    int32_t len = sizeof(char) + sizeof(uint16_t);
+    for (int32_t ix = 0; ix < nargs; ix++) {
+        entries[ix] = storage_find(storage_shard(storage, hashes[ix]), hashes[ix], args[ix], arg_to_len[ix]);
+        if (entries[ix] && entries[ix]->type != STORAGE_VALUE) {
+            entries[ix] = NULL;
+        }
+        len += sizeof(uint16_t) + sizeof(char) + (entries[ix] ? entries[ix]->val_len : 0);
+    }
+
+    // the values are copied straight from the storage into wbuff
+    uint8_t *payload = NULL;
+    if (len + sizeof(uint16_t) > MAX_MSG_SIZE) {
+        response->status = RES_BAD_ARGS;
+    } else if (!(payload = response_payload(response, len))) {
+        response->status = RES_ERR_SERVER;
+    }
+    if (payload) {
+        payload[0] = LIST_SYMBOL;
+        memset(payload + sizeof(char), 0, sizeof(uint16_t));
+        int32_t offset = sizeof(char) + sizeof(uint16_t);
+        for (int32_t ix = 0; ix < nargs; ix++) {
+            struct storage_entry_t *entry = entries[ix];
+            if (entry) {
+                offset = list_append_bytes(payload, offset, BYTES_SYMBOL, entry->data + entry->key_len, entry->val_len);
+                storage_touch(storage, entry);
+            } else {
+                offset = list_append_bytes(payload, offset, BYTES_SYMBOL, (const uint8_t *)"", 0);
+            }
+        }
+        response->status = RES_OK;
+    }
+
+    storage_unlock_shards(shards, nargs);
+    PyMem_RawFree(hashes);
+
+    // logging takes the GIL, not to be done under the locks
+    if (response->status == RES_BAD_ARGS) {
+        log_error("do_mget(): values too large for one response");
+    }
+
+    return 0;
+
+}
+
+int32_t do_mset(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // takes alternating keys and values and stores all of them at once, or
+    // none if they don't fit in maxmemory. like put, replaced keys lose their ttl.
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_mset(): got request");
+    #endif
+
+    if (nargs < 2 || nargs % 2) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+    for (int32_t ix = 0; ix < nargs; ix += 2) {
+        if (validate_hashable(args[ix], arg_to_len[ix]) || validate_value(args[ix + 1], arg_to_len[ix + 1])) {
+            error_handler(response);
+            return 0;
+        }
+    }
+
+    int32_t num_keys = nargs / 2;
+    uint64_t *hashes = PyMem_RawCalloc(num_keys, sizeof(uint64_t) + sizeof(struct storage_shard_t *) + sizeof(struct storage_entry_t *));
+    if (!hashes) {
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+    struct storage_shard_t **shards = (struct storage_shard_t **)(hashes + num_keys);
+    struct storage_entry_t **entries = (struct storage_entry_t **)(shards + num_keys);
+
+    // entries are allocated outside of the locks
+    struct storage_t *storage = server->storage;
+    for (int32_t ix = 0; ix < num_keys; ix++) {
+        entries[ix] = storage_entry_new(args[2 * ix], arg_to_len[2 * ix], args[2 * ix + 1], arg_to_len[2 * ix + 1], STORAGE_VALUE);
+        if (!entries[ix]) {
+            log_error("do_mset(): unable to allocate storage entries");
+            response->status = RES_ERR_SERVER;
+            break;
+        }
+        hashes[ix] = entries[ix]->hash;
+    }
+
+    if (response->status == -1 && batch_lock(storage, hashes, num_keys, shards, 0)) {
+        log_error("do_mset(): encountered error trying to acquire storage locks");
+        response->status = RES_ERR_SERVER;
+    } else if (response->status == -1) {
+        // only what each entry takes over the one it replaces, and room in
+        // each shard's reservation for the entries of the shards before it
+        uint64_t reserve[storage->num_shards];
+        memset(reserve, 0, sizeof(reserve));
+        for (int32_t ix = 0; ix < num_keys; ix++) {
+            struct storage_shard_t *shard = storage_shard(storage, hashes[ix]);
+            struct storage_entry_t *found = storage_find(shard, hashes[ix], args[2 * ix], arg_to_len[2 * ix]);
+            uint64_t size = storage_entry_size(entries[ix]);
+            if (found) {
+                size = size > storage_entry_size(found) ? size - storage_entry_size(found) : 0;
+            }
+            reserve[shard - storage->shards] += size;
+        }
+        uint64_t reserved = 0;
+        for (uint32_t shard_ix = 0; shard_ix < storage->num_shards; shard_ix++) {
+            reserved += reserve[shard_ix];
+            if (reserve[shard_ix] && storage_reserve(storage, &storage->shards[shard_ix], reserved, NULL) < 0) {
+                response->status = RES_ERR_MEMORY;
+                break;
+            }
+        }
+        for (int32_t ix = 0; ix < num_keys && response->status == -1; ix++) {
+            struct storage_entry_t *replaced;
+            if (storage_insert(storage_shard(storage, hashes[ix]), entries[ix], &replaced)) {
+                // the keys before it are stored
+                response->status = RES_ERR_SERVER;
+                break;
+            }
+            storage_track(storage, entries[ix], replaced);
+            // the entry belongs to the storage now, keep what it replaced to
+            // free once the locks are released
+            entries[ix] = replaced;
+        }
+        storage_unlock_shards(shards, num_keys);
+    }
+
+    if (response->status == RES_ERR_MEMORY) {
+        log_warning("do_mset(): refused write, the storage is at maxmemory");
+    } else if (response->status == RES_ERR_SERVER) {
+        log_error("do_mset(): unable to store every key");
+    } else {
+        response->status = RES_OK;
+    }
+
+    for (int32_t ix = 0; ix < num_keys; ix++) {
+        // new entries that weren't stored have no ttl
+        int32_t had_ttl = entries[ix] && entries[ix]->has_ttl;
+        storage_entry_free(entries[ix]);
+        if (had_ttl && dispatch_ttl_update(server, args[2 * ix], arg_to_len[2 * ix])) {
+            log_error("do_mset(): unable to invalidate previous ttl");
+            response->status = RES_ERR_SERVER;
+        }
+    }
+    PyMem_RawFree(hashes);
+
+    return 0;
+
+}
+
+int32_t do_mdel(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // responds with the number of keys that were deleted
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_mdel(): got request");
+    #endif
+
+    if (nargs < 1) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+    for (int32_t ix = 0; ix < nargs; ix++) {
+        if (validate_hashable(args[ix], arg_to_len[ix])) {
+            error_handler(response);
+            return 0;
+        }
+    }
+
+    uint64_t *hashes = PyMem_RawMalloc(nargs * (sizeof(uint64_t) + sizeof(struct storage_shard_t *) + sizeof(struct storage_entry_t *)));
+    if (!hashes) {
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+    struct storage_shard_t **shards = (struct storage_shard_t **)(hashes + nargs);
+    struct storage_entry_t **removed = (struct storage_entry_t **)(shards + nargs);
+    for (int32_t ix = 0; ix < nargs; ix++) {
+        hashes[ix] = storage_hash(args[ix], arg_to_len[ix]);
+    }
+
+    struct storage_t *storage = server->storage;
+    if (batch_lock(storage, hashes, nargs, shards, 0)) {
+        log_error("do_mdel(): encountered error trying to acquire storage locks");
+        PyMem_RawFree(hashes);
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+    for (int32_t ix = 0; ix < nargs; ix++) {
+        removed[ix] = storage_remove(storage_shard(storage, hashes[ix]), hashes[ix], args[ix], arg_to_len[ix]);
+    }
+    storage_unlock_shards(shards, nargs);
+
+    uint64_t num_removed = 0;
+    response->status = RES_OK;
+    for (int32_t ix = 0; ix < nargs; ix++) {
+        if (!removed[ix]) {
+            continue;
+        }
+        num_removed++;
+        int32_t had_ttl = removed[ix]->has_ttl;
+        storage_entry_free(removed[ix]);
+        // otherwise the ttl would expire the key if it is stored again
+        if (had_ttl && dispatch_ttl_update(server, args[ix], arg_to_len[ix])) {
+            log_error("do_mdel(): unable to invalidate previous ttl");
+            response->status = RES_ERR_SERVER;
+        }
+    }
+    PyMem_RawFree(hashes);
+
+    if (response->status == RES_OK) {
+        char value[32];
+        int32_t len = sprintf(value, "#%lu", (unsigned long)num_removed);
+        uint8_t *payload = response_payload(response, len);
+        if (!payload) {
+            response->status = RES_ERR_SERVER;
+            return 0;
+        }
+        memcpy(payload, value, len);
+    }
+
+    return 0;
+
+}
+
+// entries a scan visits when it doesn't say
+#define SCAN_COUNT 100
+#define SCAN_MAX_COUNT 10000
+// the top bits of a scan's cursor are the shard, the rest the cursor of
+// storage_scan() in that shard
+#define SCAN_SHARD_SHIFT 56
+
+struct scan_batch_t {
+    uint8_t *keys;
+    int32_t len;
+    int32_t num_keys;
+    int32_t overflow;
+    int32_t kind;
+    const uint8_t *pattern;
+    int32_t pattern_len;
+};
+
+static void scan_emit(struct storage_entry_t *entry, void *arg) {
+    // appends the key of an entry that passes the filters to the batch, as
+    // bytes holding its encoding since lists can't hold tuples
+
+    struct scan_batch_t *batch = arg;
+
+    if (batch->kind >= 0 && storage_entry_kind(entry) != batch->kind) {
+        return;
+    }
+    // keys are matched by what follows their symbol, tuples never match
+    if (batch->pattern && (entry->data[0] == TUPLE_SYMBOL ||
+                           !glob_match(batch->pattern, batch->pattern_len, entry->data + sizeof(char), entry->key_len - sizeof(char)))) {
+        return;
+    }
+    // room for the list's header and the cursor
+    if (batch->overflow || batch->len + 2 * sizeof(uint16_t) + sizeof(char) + entry->key_len > MAX_MSG_SIZE - 64) {
+        batch->overflow = 1;
+        return;
+    }
+    uint16_t item_len = sizeof(char) + entry->key_len;
+    memcpy(batch->keys + batch->len, &item_len, sizeof(uint16_t));
+    batch->keys[batch->len + sizeof(uint16_t)] = BYTES_SYMBOL;
+    memcpy(batch->keys + batch->len + sizeof(uint16_t) + sizeof(char), entry->data, entry->key_len);
+    batch->len += sizeof(uint16_t) + item_len;
+    batch->num_keys++;
+
+}
+
+static int32_t arg_is(const uint8_t *arg, uint16_t len, const char *name) {
+    // whether `arg` is the str `name`
+
+    return len == sizeof(char) + strlen(name) && arg[0] == STRING_SYMBOL && !memcmp(arg + sizeof(char), name, len - sizeof(char));
+
+}
+
+int32_t do_scan(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // takes a cursor, 0 to start, and optionally "count", "match" and "type"
+    // each followed by its value. responds with a list of the next cursor, 0
+    // once every key was visited, and the keys of about `count` entries that
+    // pass the filters. each call holds one shard's shared lock at a time, for
+    // one batch, so a scan of any size never blocks writers for longer.
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_scan(): got request");
+    #endif
+
+    if (nargs < 1 || nargs % 2 == 0) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+
+    struct storage_t *storage = server->storage;
+    int64_t cursor;
+    if (validate_value(args[0], arg_to_len[0]) || args[0][0] != INT_SYMBOL ||
+        parse_int64(args[0] + sizeof(char), arg_to_len[0] - sizeof(char), &cursor) ||
+        cursor < 0 || (uint64_t)cursor >> SCAN_SHARD_SHIFT >= storage->num_shards) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+
+    int64_t count = SCAN_COUNT;
+    struct scan_batch_t batch = {0};
+    batch.kind = -1;
+    for (int32_t ix = 1; ix < nargs; ix += 2) {
+        const uint8_t *val = args[ix + 1];
+        uint16_t val_len = arg_to_len[ix + 1];
+        if (validate_value(val, val_len)) {
+            error_handler(response);
+            return 0;
+        }
+        if (arg_is(args[ix], arg_to_len[ix], "count") && val[0] == INT_SYMBOL &&
+            !parse_int64(val + sizeof(char), val_len - sizeof(char), &count) && count > 0 && count <= SCAN_MAX_COUNT) {
+            continue;
+        }
+        if (arg_is(args[ix], arg_to_len[ix], "match") && (val[0] == STRING_SYMBOL || val[0] == BYTES_SYMBOL)) {
+            batch.pattern = val + sizeof(char);
+            batch.pattern_len = val_len - sizeof(char);
+            continue;
+        }
+        if (arg_is(args[ix], arg_to_len[ix], "type") && val[0] == STRING_SYMBOL) {
+            for (int32_t kind = 0; kind < STORAGE_NUM_KINDS; kind++) {
+                if (arg_is(val, val_len, storage_kind_names[kind])) {
+                    batch.kind = kind;
+                }
+            }
+            if (batch.kind >= 0) {
+                continue;
+            }
+        }
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+
+    batch.keys = PyMem_RawMalloc(MAX_MSG_SIZE);
+    if (!batch.keys) {
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+
+    uint32_t shard_ix = (uint64_t)cursor >> SCAN_SHARD_SHIFT;
+    uint64_t shard_cursor = (uint64_t)cursor & ((1ULL << SCAN_SHARD_SHIFT) - 1);
+    struct storage_shard_t *shard = NULL;
+    int64_t num_visited = 0;
+    int64_t num_steps = 0;
+
+    while (shard_ix < storage->num_shards && num_visited < count && num_steps < count) {
+        if (!shard) {
+            shard = &storage->shards[shard_ix];
+            if (storage_shard_read_lock(shard)) {
+                log_error("do_scan(): encountered error trying to acquire storage lock");
+                response->status = RES_ERR_SERVER;
+                shard = NULL;
+                break;
+            }
+        }
+
+        int32_t len = batch.len;
+        int32_t num_keys = batch.num_keys;
+        uint64_t num_emitted;
+        uint64_t next = storage_scan(shard, shard_cursor, &num_emitted, scan_emit, &batch);
+        if (batch.overflow) {
+            // the next call starts over from this step
+            batch.len = len;
+            batch.num_keys = num_keys;
+            if (!num_steps) {
+                response->status = RES_ERR_SERVER;
+            }
+            break;
+        }
+        num_visited += num_emitted;
+        num_steps++;
+
+        shard_cursor = next;
+        if (!shard_cursor) {
+            storage_shard_unlock(shard);
+            shard = NULL;
+            shard_ix++;
+        }
+    }
+    if (shard) {
+        storage_shard_unlock(shard);
+    }
+    // logging takes the GIL, not to be done under the lock
+    if (batch.overflow && !num_steps) {
+        log_error("do_scan(): keys of one step too large for a response");
+    }
+
+    if (response->status == -1) {
+        char value[32];
+        uint64_t next = shard_ix < storage->num_shards ? ((uint64_t)shard_ix << SCAN_SHARD_SHIFT) | shard_cursor : 0;
+        sprintf(value, "%lu", (unsigned long)next);
+
+        uint8_t *payload = response_payload(response, sizeof(char) + sizeof(uint16_t) * 2 + sizeof(char) + strlen(value) + batch.len);
+        if (payload) {
+            payload[0] = LIST_SYMBOL;
+            memset(payload + sizeof(char), 0, sizeof(uint16_t));
+            int32_t len = list_append(payload, sizeof(char) + sizeof(uint16_t), INT_SYMBOL, value);
+            memcpy(payload + len, batch.keys, batch.len);
+            uint16_t num_items = 1 + batch.num_keys;
+            memcpy(payload + sizeof(char), &num_items, sizeof(uint16_t));
+            response->status = RES_OK;
+        } else {
+            response->status = RES_ERR_SERVER;
+        }
+    }
+    PyMem_RawFree(batch.keys);
+
+    return 0;
+
+}
+
+// ranges
+
+// keys a range returns when it doesn't say
+#define RANGE_COUNT 100
+#define RANGE_MAX_COUNT 10000
+
+static int32_t range_values(struct storage_t *storage, const uint8_t *keys, int32_t num_keys, int32_t *more, struct response_t *response) {
+    // writes the list of `more` and the keys at `keys`, each followed by its
+    // value, to the response. keys that were removed since they were read
+    // from the index are left out, and if the values don't all fit, the list
+    // stops before the first that doesn't and `more` is set.
+
+    uint64_t *hashes = PyMem_RawMalloc(num_keys * (sizeof(uint64_t) + sizeof(struct storage_shard_t *) + sizeof(struct storage_entry_t *) + sizeof(int32_t)));
+    if (!hashes) {
+        return -1;
+    }
+    struct storage_shard_t **shards = (struct storage_shard_t **)(hashes + num_keys);
+    struct storage_entry_t **entries = (struct storage_entry_t **)(shards + num_keys);
+    int32_t *offsets = (int32_t *)(entries + num_keys);
+    for (int32_t ix = 0, offset = 0; ix < num_keys; ix++) {
+        uint16_t item_len;
+        memcpy(&item_len, keys + offset, sizeof(uint16_t));
+        offsets[ix] = offset;
+        hashes[ix] = storage_hash(keys + offset + sizeof(uint16_t) + sizeof(char), item_len - sizeof(char));
+        offset += sizeof(uint16_t) + item_len;
+    }
+
+    if (batch_lock(storage, hashes, num_keys, shards, 1)) {
+        log_error("range_values(): encountered error trying to acquire storage locks");
+        PyMem_RawFree(hashes);
+        return -1;
+    }
+
+    // room for the list's header and `more`
+    int32_t len = 2 * (sizeof(char) + sizeof(uint16_t)) + sizeof(char);
+    int32_t num_fit = 0;
+    for (; num_fit < num_keys; num_fit++) {
+        uint16_t item_len;
+        const uint8_t *key = keys + offsets[num_fit] + sizeof(uint16_t) + sizeof(char);
+        memcpy(&item_len, keys + offsets[num_fit], sizeof(uint16_t));
+        uint16_t key_len = item_len - sizeof(char);
+        struct storage_entry_t *entry = storage_find(storage_shard(storage, hashes[num_fit]), hashes[num_fit], key, key_len);
+        entries[num_fit] = entry;
+        if (!entry) {
+            continue;
+        }
+        int32_t val_len = entry->type == STORAGE_VALUE ? entry->val_len : 0;
+        int32_t size = 2 * (sizeof(uint16_t) + sizeof(char)) + key_len + val_len;
+        if (len + size > MAX_MSG_SIZE - 64) {
+            *more = 1;
+            break;
+        }
+        len += size;
+    }
+
+    uint8_t *payload = NULL;
+    if (*more && len == 2 * (sizeof(char) + sizeof(uint16_t)) + sizeof(char)) {
+        log_error("range_values(): key and value too large for a response");
+    } else {
+        payload = response_payload(response, len);
+    }
+    if (payload) {
+        payload[0] = LIST_SYMBOL;
+        memset(payload + sizeof(char), 0, sizeof(uint16_t));
+        int32_t offset = list_append(payload, sizeof(char) + sizeof(uint16_t), BOOL_SYMBOL, *more ? "1" : "0");
+        for (int32_t ix = 0; ix < num_fit; ix++) {
+            struct storage_entry_t *entry = entries[ix];
+            if (!entry) {
+                continue;
+            }
+            offset = list_append_bytes(payload, offset, BYTES_SYMBOL, entry->data, entry->key_len);
+            if (entry->type == STORAGE_VALUE) {
+                offset = list_append_bytes(payload, offset, BYTES_SYMBOL, entry->data + entry->key_len, entry->val_len);
+                storage_touch(storage, entry);
+            } else {
+                offset = list_append_bytes(payload, offset, BYTES_SYMBOL, (const uint8_t *)"", 0);
+            }
+        }
+    }
+
+    storage_unlock_shards(shards, num_keys);
+    PyMem_RawFree(hashes);
+
+    return payload ? 0 : -1;
+
+}
+
+int32_t do_range(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // takes optionally "prefix", "start" or "after", "stop", "count" and
+    // "values", each followed by its value. responds with a list of whether
+    // there are keys after the batch, then the keys of the batch in order, each
+    // followed by its value if "values" is true, as bytes holding their
+    // encodings. the next batch is the one "after" the last key. the index's
+    // shared lock is held while the keys are read, then the shards' shared
+    // locks while the values are.
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_range(): got request");
+    #endif
+
+    struct storage_t *storage = server->storage;
+    if (!storage->index) {
+        log_error("do_range(): the server was started without an index");
+        response->status = RES_BAD_OP;
+        return 0;
+    }
+    if (nargs % 2) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+
+    const uint8_t *prefix = NULL;
+    const uint8_t *start = NULL;
+    const uint8_t *stop = NULL;
+    uint16_t prefix_len = 0, start_len = 0, stop_len = 0;
+    int32_t after = 0;
+    int32_t with_values = 0;
+    int64_t count = RANGE_COUNT;
+    for (int32_t ix = 0; ix < nargs; ix += 2) {
+        const uint8_t *name = args[ix];
+        uint16_t name_len = arg_to_len[ix];
+        const uint8_t *val = args[ix + 1];
+        uint16_t val_len = arg_to_len[ix + 1];
+        if (arg_is(name, name_len, "count") || arg_is(name, name_len, "values")) {
+            if (validate_value(val, val_len)) {
+                error_handler(response);
+                return 0;
+            }
+            if (arg_is(name, name_len, "count") && val[0] == INT_SYMBOL &&
+                !parse_int64(val + sizeof(char), val_len - sizeof(char), &count) && count > 0 && count <= RANGE_MAX_COUNT) {
+                continue;
+            }
+            if (arg_is(name, name_len, "values") && val[0] == BOOL_SYMBOL) {
+                with_values = val[1] == '1';
+                continue;
+            }
+            response->status = RES_BAD_ARGS;
+            return 0;
+        }
+
+        // the rest are keys
+        const uint8_t **bound;
+        uint16_t *bound_len;
+        if (arg_is(name, name_len, "prefix")) {
+            bound = &prefix;
+            bound_len = &prefix_len;
+        } else if (arg_is(name, name_len, "start") || arg_is(name, name_len, "after")) {
+            after = arg_is(name, name_len, "after");
+            bound = &start;
+            bound_len = &start_len;
+        } else if (arg_is(name, name_len, "stop")) {
+            bound = &stop;
+            bound_len = &stop_len;
+        } else {
+            response->status = RES_BAD_ARGS;
+            return 0;
+        }
+        if (*bound) {
+            response->status = RES_BAD_ARGS;
+            return 0;
+        }
+        if (validate_hashable(val, val_len)) {
+            error_handler(response);
+            return 0;
+        }
+        *bound = val;
+        *bound_len = val_len;
+    }
+    if (prefix && !index_covers(prefix, prefix_len)) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+    // the keys with the prefix start at the prefix
+    if (prefix && (!start || index_compare(prefix, prefix_len, start, start_len) > 0)) {
+        start = prefix;
+        start_len = prefix_len;
+        after = 0;
+    }
+
+    uint8_t *keys = PyMem_RawMalloc(MAX_MSG_SIZE);
+    if (!keys) {
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+    struct index_t *index = storage->index;
+    if (index_read_lock(index)) {
+        log_error("do_range(): encountered error trying to acquire the index lock");
+        PyMem_RawFree(keys);
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+
+    // keys as list items
+    int32_t keys_len = 0;
+    int32_t num_keys = 0;
+    int32_t more = 0;
+    struct index_iter_t iter;
+    const struct index_key_t *key;
+    index_seek(index, start, start_len, &iter);
+    while ((key = index_next(&iter))) {
+        if (after && !index_compare(key->data, key->len, start, start_len)) {
+            continue;
+        }
+        if ((stop && index_compare(key->data, key->len, stop, stop_len) >= 0) ||
+            (prefix && !index_has_prefix(key->data, key->len, prefix, prefix_len))) {
+            break;
+        }
+        // room for the list's header and `more`
+        if (num_keys == count || keys_len + sizeof(uint16_t) + sizeof(char) + key->len > MAX_MSG_SIZE - 64) {
+            more = 1;
+            break;
+        }
+        uint16_t item_len = sizeof(char) + key->len;
+        memcpy(keys + keys_len, &item_len, sizeof(uint16_t));
+        keys[keys_len + sizeof(uint16_t)] = BYTES_SYMBOL;
+        memcpy(keys + keys_len + sizeof(uint16_t) + sizeof(char), key->data, key->len);
+        keys_len += sizeof(uint16_t) + item_len;
+        num_keys++;
+    }
+    index_unlock(index);
+
+    if (more && !num_keys) {
+        log_error("do_range(): key too large for a response");
+        response->status = RES_ERR_SERVER;
+    } else if (with_values && num_keys) {
+        response->status = range_values(storage, keys, num_keys, &more, response) ? RES_ERR_SERVER : RES_OK;
+    } else {
+        uint8_t *payload = response_payload(response, 2 * (sizeof(char) + sizeof(uint16_t)) + sizeof(char) + keys_len);
+        if (payload) {
+            payload[0] = LIST_SYMBOL;
+            memset(payload + sizeof(char), 0, sizeof(uint16_t));
+            int32_t len = list_append(payload, sizeof(char) + sizeof(uint16_t), BOOL_SYMBOL, more ? "1" : "0");
+            memcpy(payload + len, keys, keys_len);
+            uint16_t num_items = 1 + num_keys;
+            memcpy(payload + sizeof(char), &num_items, sizeof(uint16_t));
+            response->status = RES_OK;
+        } else {
+            response->status = RES_ERR_SERVER;
+        }
+    }
+    PyMem_RawFree(keys);
+
+    return 0;
+
+}
+
+// transactions
+// exec takes the frames of several commands, each as bytes, and runs them one
+// after the other while it holds the locks of the shards of all of their keys,
+// so no other command sees the keys between two of them. a command that fails
+// doesn't undo the ones before it. only commands on keys can be part of one:
+// their keys are found before any runs, and a command that waits, or that
+// reads other shards or the server, would hold the shards for too long.
+//
+// the ttls the commands change are put on the ttl heap once the shards are let
+// go of, so that the heap isn't updated under them. the keys are read again
+// then, see dispatch_ttl_update(), so the heap gets what the transaction left.
+
+// the response of each command goes in the list after its own item header, of
+// 2 bytes of length, the symbol and 2 of status
+#define EXEC_ITEM_HEADER (sizeof(uint16_t) + sizeof(char) + sizeof(int16_t))
+
+static int16_t exec_shards(struct storage_t *storage, const uint8_t *frame, int32_t len, uint64_t *mask) {
+    // sets the bit of each shard the keys of the command in `frame` are in,
+    // and returns RES_ERR_CLIENT if the frame is malformed and RES_BAD_CMD if
+    // the command can't be part of a transaction
+
+    uint16_t nstrs;
+    if ((uint32_t)len < sizeof(uint16_t)) {
+        return RES_ERR_CLIENT;
+    }
+    memcpy(&nstrs, frame, sizeof(uint16_t));
+    if (nstrs < 1) {
+        return RES_ERR_CLIENT;
+    }
+
+    int32_t cmd = 0;
+    int32_t offset = sizeof(uint16_t);
+    for (int32_t ix = 0; ix < nstrs; ix++) {
+        uint16_t slen;
+        if (offset + (int32_t)sizeof(uint16_t) > len) {
+            return RES_ERR_CLIENT;
+        }
+        memcpy(&slen, frame + offset, sizeof(uint16_t));
+        offset += sizeof(uint16_t);
+        if (offset + slen > len) {
+            return RES_ERR_CLIENT;
+        }
+        if (ix == 0) {
+            cmd = hash_given_len(frame + offset, slen);
+            switch (cmd) {
+                case CMD_GET:
+                case CMD_PUT:
+                case CMD_CAS:
+                case CMD_SETIF:
+                case CMD_DEL:
+                case CMD_QUEUE:
+                case CMD_PUSH:
+                case CMD_POP:
+                case CMD_TTL:
+                case CMD_MEMORY:
+                case CMD_INCR:
+                case CMD_DECR:
+                case CMD_INCRBY:
+                case CMD_INCRBYFLOAT:
+                case CMD_MGET:
+                case CMD_MSET:
+                case CMD_MDEL:
+                    break;
+                default:
+                    return RES_BAD_CMD;
+            }
+        } else if (ix == 1 || cmd == CMD_MGET || cmd == CMD_MDEL || (cmd == CMD_MSET && ix % 2)) {
+            struct storage_shard_t *shard = storage_shard(storage, storage_hash(frame + offset, slen));
+            *mask |= 1ULL << (shard - storage->shards);
+        }
+        offset += slen;
+    }
+    if (offset != len) {
+        return RES_ERR_CLIENT;
+    }
+
+    return RES_OK;
+
+}
+
+int32_t do_exec(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // takes the frames of the commands as bytes and responds with a list of
+    // bytes, for each command its status followed by its response
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_exec(): got request");
+    #endif
+
+    if (nargs < 1) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+
+    // every frame is checked before any command runs
+    struct storage_t *storage = server->storage;
+    uint64_t mask = 0;
+    for (int32_t ix = 0; ix < nargs; ix++) {
+        if (arg_to_len[ix] < sizeof(char) || args[ix][0] != BYTES_SYMBOL) {
+            response->status = RES_BAD_TYPE;
+            return 0;
+        }
+        int16_t status = exec_shards(storage, args[ix] + sizeof(char), arg_to_len[ix] - sizeof(char), &mask);
+        if (status != RES_OK) {
+            log_error("do_exec(): got a command that can't be part of a transaction");
+            response->status = status;
+            return 0;
+        }
+    }
+
+    // in address order, like storage_lock_shards() sorts them
+    struct storage_shard_t *shards[STORAGE_NUM_SHARDS];
+    int32_t num_shards = 0;
+    for (uint32_t ix = 0; ix < storage->num_shards; ix++) {
+        if (mask & (1ULL << ix)) {
+            shards[num_shards++] = storage->shards + ix;
+        }
+    }
+
+    // room for the largest response there can be, so that wbuff doesn't move,
+    // and lose the list, when a command makes room for its own
+    uint8_t *list = response_payload(response, MAX_MSG_SIZE - sizeof(uint16_t));
+    if (!list) {
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+    list[0] = LIST_SYMBOL;
+    memset(list + sizeof(char), 0, sizeof(uint16_t));
+    int32_t len = sizeof(char) + sizeof(uint16_t);
+
+    if (storage_hold_shards(shards, num_shards)) {
+        log_error("do_exec(): encountered error trying to acquire storage locks");
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+
+    struct conn_t *conn = response->conn;
+    int32_t too_large = 0;
+    defer_ttls = 1;
+    for (int32_t ix = 0; ix < nargs; ix++) {
+        // each command writes its response straight into the list, after room
+        // for its item header
+        struct response_t sub = {0};
+        sub.conn = conn;
+        sub.offset = len + EXEC_ITEM_HEADER;
+        if (!response_payload(&sub, 0)) {
+            sub.status = RES_ERR_SERVER;
+        } else {
+            dispatch(server, conn->connid, args[ix] + sizeof(char), arg_to_len[ix] - sizeof(char), &sub);
+        }
+        // and every later one needs room for its header. a command that left
+        // none ran all the same, like a single command whose response is too
+        // large, and its response is dropped
+        uint32_t rest = (nargs - ix - 1) * EXEC_ITEM_HEADER;
+        if (sizeof(uint16_t) + sub.offset + sub.payload_len + rest > MAX_MSG_SIZE) {
+            too_large = 1;
+            sub.status = RES_ERR_SERVER;
+            sub.payload_len = 0;
+        }
+
+        uint16_t num_items;
+        memcpy(&num_items, list + sizeof(char), sizeof(uint16_t));
+        num_items++;
+        memcpy(list + sizeof(char), &num_items, sizeof(uint16_t));
+        uint16_t encoded_len = sizeof(char) + sizeof(int16_t) + sub.payload_len;
+        memcpy(list + len, &encoded_len, sizeof(uint16_t));
+        list[len + sizeof(uint16_t)] = BYTES_SYMBOL;
+        memcpy(list + len + sizeof(uint16_t) + sizeof(char), &sub.status, sizeof(int16_t));
+        len += sizeof(uint16_t) + encoded_len;
+    }
+
+    storage_release_shards();
+    defer_ttls = 0;
+
+    if (too_large) {
+        log_error("do_exec(): responses too large for one response");
+    }
+    // the keys are in the request, which is still around
+    for (int32_t ix = 0; ix < num_deferred_ttls; ix++) {
+        if (dispatch_ttl_update(server, deferred_ttls[ix].key, deferred_ttls[ix].key_len)) {
+            log_error("do_exec(): unable to update the ttl of an item");
+        }
+    }
+    PyMem_RawFree(deferred_ttls);
+    deferred_ttls = NULL;
+    num_deferred_ttls = 0;
+    max_deferred_ttls = 0;
+
+    response->payload_len = len;
+    response->status = RES_OK;
+
+    return 0;
+
+}
+
+// user locks
+// a lock is named by a hashable and owned by a hashable token. the names are
+// their own namespace, a lock and a key of the same name have nothing to do
+// with each other.
+
+static int32_t lock_args(const uint8_t **args, const uint16_t *arg_to_len, struct response_t *response) {
+    // checks the name and the token, returns -1 with the response's status set
+    // if they are bad
+
+    if (validate_hashable(args[0], arg_to_len[0]) || validate_hashable(args[1], arg_to_len[1])) {
+        error_handler(response);
+        return -1;
+    }
+    if (arg_to_len[1] > LOCK_MAX_TOKEN) {
+        response->status = RES_BAD_ARGS;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static int32_t lock_seconds(const uint8_t *arg, uint16_t arg_len, int64_t min, int64_t max, int64_t *seconds, struct response_t *response) {
+    // parses a lease or a wait, returns -1 with the response's status set if
+    // it isn't an int from `min` to `max`
+
+    if (validate_value(arg, arg_len)) {
+        error_handler(response);
+        return -1;
+    }
+    if (arg[0] != INT_SYMBOL) {
+        response->status = RES_BAD_TYPE;
+        return -1;
+    }
+    if (parse_int64(arg + sizeof(char), arg_len - sizeof(char), seconds) || *seconds < min || *seconds > max) {
+        response->status = RES_BAD_ARGS;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static int32_t lock_respond_fence(uint64_t fence, struct response_t *response) {
+
+    char value[32];
+    int32_t value_len = sprintf(value, "%c%llu", INT_SYMBOL, (unsigned long long)fence);
+    uint8_t *payload = response_payload(response, value_len);
+    if (!payload) {
+        response->status = RES_ERR_SERVER;
+        return 0;
+    }
+    memcpy(payload, value, value_len);
+    response->status = RES_OK;
+
+    return 0;
+
+}
+
+int32_t do_lock(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // takes a name, an owner token, a lease and optionally how long to wait
+    // for the lock, in seconds. responds with the lock's fencing token, or
+    // RES_BAD_LOCK if another owner holds it. a request that waits parks its
+    // connection until the lock is granted or the wait is over.
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_lock(): got request");
+    #endif
+
+    if (nargs < 3 || nargs > 4) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+
+    int64_t lease, wait = 0;
+    if (lock_args(args, arg_to_len, response) || lock_seconds(args[2], arg_to_len[2], 1, LOCK_MAX_LEASE, &lease, response)) {
+        return 0;
+    }
+    if (nargs == 4 && lock_seconds(args[3], arg_to_len[3], 0, LOCK_MAX_WAIT, &wait, response)) {
+        return 0;
+    }
+
+    struct lock_waiter_t *waiter = NULL;
+    if (wait) {
+        waiter = lock_waiter_new(response->conn, args[1], arg_to_len[1], lease, time(NULL) + wait);
+        if (!waiter) {
+            response->status = RES_ERR_SERVER;
+            return 0;
+        }
+    }
+
+    uint64_t fence;
+    int32_t res = locks_acquire(server->user_locks, args[0], arg_to_len[0], args[1], arg_to_len[1], lease, waiter, &fence);
+    if (res == 1) {
+        // the waiter can be granted the lock by now, but its connection is
+        // only resumed once the reactor has parked it
+        response->conn->waiter = waiter;
+        locks_schedule(server->user_locks, server->lock_ttl_heap, args[0], arg_to_len[0]);
+        response->status = RES_PARKED;
+        return 0;
+    }
+    if (waiter) {
+        lock_waiter_free(waiter);
+    }
+
+    switch (res) {
+        case 0:
+            locks_schedule(server->user_locks, server->lock_ttl_heap, args[0], arg_to_len[0]);
+            return lock_respond_fence(fence, response);
+        case 2:
+            response->status = RES_BAD_LOCK;
+            return 0;
+        default:
+            log_error("do_lock(): unable to allocate lock");
+            response->status = RES_ERR_SERVER;
+            return 0;
+    }
+
+}
+
+int32_t do_unlock(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // takes a name and the token that holds the lock, and grants it to the
+    // next waiter, if any
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_unlock(): got request");
+    #endif
+
+    if (nargs != 2) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+
+    if (lock_args(args, arg_to_len, response)) {
+        return 0;
+    }
+
+    struct lock_waiter_t *granted;
+    if (locks_release(server->user_locks, args[0], arg_to_len[0], args[1], arg_to_len[1], &granted)) {
+        response->status = RES_BAD_LOCK;
+        return 0;
+    }
+    if (granted) {
+        lock_waiter_wake(granted);
+        locks_schedule(server->user_locks, server->lock_ttl_heap, args[0], arg_to_len[0]);
+    }
+
+    response->status = RES_OK;
+    return 0;
+
+}
+
+int32_t do_extend(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response) {
+    // takes a name, the token that holds the lock and a new lease in seconds,
+    // from now
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("do_extend(): got request");
+    #endif
+
+    if (nargs != 3) {
+        response->status = RES_BAD_ARGS;
+        return 0;
+    }
+
+    int64_t lease;
+    if (lock_args(args, arg_to_len, response) || lock_seconds(args[2], arg_to_len[2], 1, LOCK_MAX_LEASE, &lease, response)) {
+        return 0;
+    }
+
+    if (locks_extend(server->user_locks, args[0], arg_to_len[0], args[1], arg_to_len[1], lease)) {
+        response->status = RES_BAD_LOCK;
+        return 0;
+    }
+    locks_schedule(server->user_locks, server->lock_ttl_heap, args[0], arg_to_len[0]);
+
+    response->status = RES_OK;
+    return 0;
+
+}
+
+// validators
+// these check that a wire encoded item would loads() without building it, so
+// requests can be served without the GIL. they are never more lenient than
+// loads(), and set _dispatch_errno the way loads() would on failure.
+
+// nested tuples are validated recursively, so don't let a client blow the stack
+#define VALIDATE_MAX_DEPTH 64
+
+// CPython refuses to convert ints with more digits than this from a string
+#define VALIDATE_MAX_INT_DIGITS 4300
+
+static int32_t validate_collectable_item(const uint8_t *x, int32_t len);
+
+static int32_t validate_long(const uint8_t *x, int32_t len) {
+    // [+-]?[0-9]+, without leading zeros since loads() parses with base 0
+
+    int32_t ix = 0;
+    if (ix < len && (x[ix] == '+' || x[ix] == '-')) {
+        ix++;
+    }
+    int32_t num_digits = len - ix;
+    if (num_digits < 1 || num_digits > VALIDATE_MAX_INT_DIGITS) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+    int32_t all_zeros = 1;
+    for (int32_t jx = ix; jx < len; jx++) {
+        if (x[jx] < '0' || x[jx] > '9') {
+            _dispatch_errno = RES_BAD_TYPE;
+            return -1;
+        }
+        all_zeros &= x[jx] == '0';
+    }
+    if (x[ix] == '0' && !all_zeros) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static int32_t validate_float(const uint8_t *x, int32_t len) {
+
+    // long enough for any repr() of a float
+    char buff[128];
+    if (len < 1 || (size_t)len >= sizeof(buff)) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+    for (int32_t ix = 0; ix < len; ix++) {
+        // strtod also takes hex floats and nan(...), python does not
+        // and python skips whitespace that strtod might not agree on
+        switch (x[ix]) {
+            case 'x':
+            case 'X':
+            case 'p':
+            case 'P':
+            case '(':
+            case ' ':
+            case '\t':
+            case '\n':
+            case '\r':
+            case '\v':
+            case '\f':
+            case '\0':
+                _dispatch_errno = RES_BAD_TYPE;
+                return -1;
+        }
+    }
+    memcpy(buff, x, len);
+    buff[len] = '\0';
+
+    char *end;
+    strtod(buff, &end);
+    if (end != buff + len) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static int32_t validate_unicode(const uint8_t *x, int32_t len) {
+    // strict utf-8: no overlong forms, surrogates or code points past U+10FFFF
+
+    int32_t ix = 0;
+    while (ix < len) {
+        uint8_t c = x[ix];
+        int32_t num_cont;
+        uint8_t lo = 0x80, hi = 0xBF;
+        if (c < 0x80) {
+            ix++;
+            continue;
+        } else if (c >= 0xC2 && c <= 0xDF) {
+            num_cont = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            num_cont = 2;
+            if (c == 0xE0) {
+                lo = 0xA0;
+            } else if (c == 0xED) {
+                hi = 0x9F;
+            }
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            num_cont = 3;
+            if (c == 0xF0) {
+                lo = 0x90;
+            } else if (c == 0xF4) {
+                hi = 0x8F;
+            }
+        } else {
+            _dispatch_errno = RES_BAD_TYPE;
+            return -1;
+        }
+        if (ix + num_cont >= len) {
+            _dispatch_errno = RES_BAD_TYPE;
+            return -1;
+        }
+        // only the first continuation byte has a narrowed range
+        if (x[ix + 1] < lo || x[ix + 1] > hi) {
+            _dispatch_errno = RES_BAD_TYPE;
+            return -1;
+        }
+        for (int32_t jx = 2; jx <= num_cont; jx++) {
+            if ((x[ix + jx] & 0xC0) != 0x80) {
+                _dispatch_errno = RES_BAD_TYPE;
+                return -1;
+            }
+        }
+        ix += num_cont + 1;
+    }
+
+    return 0;
+
+}
+
+static int32_t validate_bool(const uint8_t *x, int32_t len) {
+
+    if (len != 1 || (x[0] != '0' && x[0] != '1')) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static int32_t parse_digits(const uint8_t *x, int32_t num_digits) {
+    // returns -1 unless x starts with num_digits decimal digits
+
+    int32_t value = 0;
+    for (int32_t ix = 0; ix < num_digits; ix++) {
+        if (x[ix] < '0' || x[ix] > '9') {
+            return -1;
+        }
+        value = 10 * value + (x[ix] - '0');
+    }
+
+    return value;
+
+}
+
+static int32_t validate_datetime_body(const uint8_t *x, int32_t len) {
+    // matches what strptime() takes for "%Y-%m-%d %H:%M:%S %z" and datetime
+    // accepts, but only in the zero padded form that strftime() produces
+
+    static const int32_t days_in_month[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+    // "YYYY-MM-DD HH:MM:SS " and at least one character of timezone
+    if (len < 21 || x[4] != '-' || x[7] != '-' || x[10] != ' ' || x[13] != ':' || x[16] != ':' || x[19] != ' ') {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+    int32_t year = parse_digits(x, 4);
+    int32_t month = parse_digits(x + 5, 2);
+    int32_t day = parse_digits(x + 8, 2);
+    int32_t hour = parse_digits(x + 11, 2);
+    int32_t minute = parse_digits(x + 14, 2);
+    int32_t second = parse_digits(x + 17, 2);
+    if (year < 1 || month < 1 || month > 12 || day < 1 || hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 59) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+    int32_t is_leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    if (day > days_in_month[month - 1] + (month == 2 && is_leap)) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+
+    // Z or [+-]HH[:]MM([:]SS(.ffffff)?)?
+    const uint8_t *tz = x + 20;
+    int32_t tz_len = len - 20;
+    if (tz_len == 1 && tz[0] == 'Z') {
+        return 0;
+    }
+    if (tz_len < 5 || (tz[0] != '+' && tz[0] != '-')) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+    int32_t has_colons = tz[3] == ':';
+    int32_t offset = 3 + has_colons;
+    int32_t tz_hours = parse_digits(tz + 1, 2);
+    if (tz_hours < 0 || tz_hours > 23 || tz_len < offset + 2) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+    int32_t tz_minutes = parse_digits(tz + offset, 2);
+    offset += 2;
+    if (tz_minutes < 0 || tz_minutes > 59) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+    if (offset == tz_len) {
+        return 0;
+    }
+
+    if (has_colons) {
+        if (tz[offset] != ':') {
+            _dispatch_errno = RES_BAD_TYPE;
+            return -1;
+        }
+        offset++;
+    }
+    if (tz_len < offset + 2) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+    int32_t tz_seconds = parse_digits(tz + offset, 2);
+    offset += 2;
+    if (tz_seconds < 0 || tz_seconds > 59) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+    if (offset == tz_len) {
+        return 0;
+    }
+
+    int32_t num_frac = tz_len - offset - 1;
+    if (tz[offset] != '.' || num_frac < 1 || num_frac > 6 || parse_digits(tz + offset + 1, num_frac) < 0) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static int32_t validate_items(const uint8_t *x, int32_t len, int32_t hashable, int32_t depth) {
+    // validates the body of a list or tuple, a count followed by length
+    // prefixed items. items of a hashable tuple have to be hashable, other
+    // items have to be collectable.
+
+    if ((uint32_t)len < sizeof(uint16_t)) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+    if (depth >= VALIDATE_MAX_DEPTH) {
+        log_error("validate_items(): tuple nested too deeply");
+        _dispatch_errno = RES_ERR_CLIENT;
+        return -1;
+    }
+
+    uint16_t nstrs;
+    memcpy(&nstrs, x, sizeof(uint16_t));
+    int32_t offset = sizeof(uint16_t);
+
+    for (int32_t ix = 0; ix < nstrs; ix++) {
+        // sanity
+        if (offset + (int32_t)sizeof(uint16_t) > len) {
+            log_error("validate_items(): got misformed request.");
+            _dispatch_errno = RES_ERR_CLIENT;
+            return -1;
+        }
+        uint16_t slen;
+        memcpy(&slen, x + offset, sizeof(uint16_t));
+        offset += sizeof(uint16_t);
+        if (slen < sizeof(char) || offset + slen > len) {
+            log_error("validate_items(): got misformed request item");
+            _dispatch_errno = RES_ERR_CLIENT;
+            return -1;
+        }
+
+        const uint8_t *item = x + offset;
+        offset += slen;
+
+        if (!hashable) {
+            if (validate_collectable_item(item, slen)) {
+                return -1;
+            }
+            continue;
+        }
+
+        // like loads(), report any bad item of a key as unhashable
+        int32_t err;
+        if (item[0] == TUPLE_SYMBOL) {
+            err = validate_items(item + 1, slen - 1, 1, depth + 1);
+        } else {
+            err = validate_hashable(item, slen);
+        }
+        if (err) {
+            if (_dispatch_errno != RES_ERR_CLIENT) {
+                _dispatch_errno = RES_BAD_HASH;
+            }
+            return -1;
+        }
+    }
+
+    if (offset != len) {
+        log_error("validate_items(): got malformed request: offset undershot len");
+        _dispatch_errno = RES_ERR_CLIENT;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static int32_t validate_scalar(const uint8_t *x, int32_t len) {
+    // validates the items that can be keys, values and queue items alike
+
+    switch (x[0]) {
+        case INT_SYMBOL:
+            return validate_long(x + 1, len - 1);
+        case FLOAT_SYMBOL:
+            return validate_float(x + 1, len - 1);
+        case STRING_SYMBOL:
+            return validate_unicode(x + 1, len - 1);
+        case BYTES_SYMBOL:
+            return 0;
+        default:
+            _dispatch_errno = RES_BAD_TYPE;
+            return -1;
+    }
+
+}
+
+int32_t validate_hashable(const uint8_t *x, int32_t len) {
+    // mirrors _loads_hashable()
+
+    if ((uint32_t)len < sizeof(char)) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+
+    switch (x[0]) {
+        case TUPLE_SYMBOL:
+            return validate_items(x + 1, len - 1, 1, 0);
+        case LIST_SYMBOL:
+        case BOOL_SYMBOL:
+        case DATETIME_SYMBOL:
+            _dispatch_errno = RES_BAD_HASH;
+            return -1;
+        default:
+            return validate_scalar(x, len);
+    }
+
+}
+
+static int32_t validate_collectable_item(const uint8_t *x, int32_t len) {
+    // mirrors _loads_collectable()
+
+    switch (x[0]) {
+        case LIST_SYMBOL:
+            _dispatch_errno = RES_BAD_COLLECTION;
+            return -1;
+        case BOOL_SYMBOL:
+            return validate_bool(x + 1, len - 1);
+        case DATETIME_SYMBOL:
+            return validate_datetime_body(x + 1, len - 1);
+        default:
+            return validate_scalar(x, len);
+    }
+
+}
+
+int32_t validate_collectable(const uint8_t *x, int32_t len) {
+
+    if ((uint32_t)len < sizeof(char)) {
+        _dispatch_errno = RES_BAD_COLLECTION;
+        return -1;
+    }
+
+    return validate_collectable_item(x, len);
+
+}
+
+int32_t validate_value(const uint8_t *x, int32_t len) {
+    // mirrors loads()
+
+    if ((uint32_t)len < sizeof(char)) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+
+    switch (x[0]) {
+        case LIST_SYMBOL:
+        case TUPLE_SYMBOL:
+            return validate_items(x + 1, len - 1, 0, 0);
+        default:
+            return validate_collectable_item(x, len);
+    }
+
+}
+
+int32_t validate_datetime(const uint8_t *x, int32_t len) {
+    // mirrors _loads_foo_datetime()
+
+    if ((uint32_t)len < sizeof(char) || x[0] != DATETIME_SYMBOL) {
+        _dispatch_errno = RES_BAD_TYPE;
+        return -1;
+    }
+
+    return validate_datetime_body(x + 1, len - 1);
+
+}
+
+static uint32_t ttl_expires(const uint8_t *x, int32_t len) {
+    // the seconds since the epoch of a ttl that passed validate_datetime(),
+    // for the ttl heap and the volatile-ttl eviction policy. clamped to 32 bits, which only
+    // loses the order of ttls past 2106.
+
+    x++;
+    len--;
+
+    int64_t year = parse_digits(x, 4);
+    int64_t month = parse_digits(x + 5, 2);
+    int64_t day = parse_digits(x + 8, 2);
+
+    // days since 1970-01-01 in the proleptic gregorian calendar, with years
+    // starting in march so leap days come last
+    year -= month <= 2;
+    int64_t era = year / 400;
+    int64_t year_of_era = year - era * 400;
+    int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    int64_t days = era * 146097 + day_of_era - 719468;
+
+    int64_t epoch = days * 86400 + parse_digits(x + 11, 2) * 3600 + parse_digits(x + 14, 2) * 60 + parse_digits(x + 17, 2);
+
+    // Z or [+-]HH[:]MM([:]SS(.ffffff)?)?, the fraction is dropped
+    const uint8_t *tz = x + 20;
+    int32_t tz_len = len - 20;
+    if (tz[0] != 'Z') {
+        int32_t offset = 3 + (tz[3] == ':');
+        int64_t tz_offset = parse_digits(tz + 1, 2) * 3600 + parse_digits(tz + offset, 2) * 60;
+        offset += 2;
+        if (offset < tz_len) {
+            offset += tz[offset] == ':';
+            tz_offset += parse_digits(tz + offset, 2);
+        }
+        epoch += tz[0] == '-' ? tz_offset : -tz_offset;
+    }
+
+    if (epoch < 0) {
+        return 0;
+    }
+    if (epoch > UINT32_MAX) {
+        return UINT32_MAX;
+    }
+    return (uint32_t)epoch;
+
+}
 
 // helper methods
 PyObject *dumps_as_pyobject(PyObject *x) {
@@ -16,20 +16,60 @@
 #define CMD_PUSH 1069254648
 #define CMD_POP 638676238
 #define CMD_TTL 320309783
+#define CMD_INFO -544098464
+#define CMD_MEMORY 554821943
+#define CMD_STATS 2094644388
+#define CMD_INCR -541098590
+#define CMD_DECR -517094882
+#define CMD_INCRBY 1169272399
+#define CMD_INCRBYFLOAT 1079997870
+#define CMD_MGET 1093472383
+#define CMD_MSET -521225317
+#define CMD_MDEL -1200667956
+#define CMD_SCAN -2044784249
+#define CMD_RANGE 1512732402
+#define CMD_CAS 405875048
+#define CMD_SETIF -59497064
+#define CMD_LOCK -949872247
+#define CMD_UNLOCK -926463342
+#define CMD_EXTEND -216529722
+#define CMD_EXEC 591295431
 
 
-extern int16_t _dispatch_errno;
+// set by loads() and the validators when they fail, per thread since requests
+// are dispatched on many threads at once
+extern __thread int16_t _dispatch_errno;
 
 // server methods.
 int32_t dispatch(foo_kv_server *server, int32_t connid, const uint8_t *buff, int32_t len, struct response_t *response);
 void error_handler(struct response_t *response);
 int32_t do_get(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
 int32_t do_set(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_cas(foo_kv_server *server, int32_t cmd, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
 int32_t do_del(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
 int32_t do_queue(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
 int32_t do_push(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
 int32_t do_pop(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
 int32_t do_ttl(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_info(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_memory(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_stats(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_incr(foo_kv_server *server, int32_t cmd, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_mget(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_mset(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_mdel(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_scan(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_range(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_lock(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_unlock(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_extend(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+int32_t do_exec(foo_kv_server *server, const uint8_t **args, const uint16_t *arg_to_len, int32_t nargs, struct response_t *response);
+
+// validators, these don't need the GIL
+int32_t validate_hashable(const uint8_t *x, int32_t len);
+int32_t validate_collectable(const uint8_t *x, int32_t len);
+int32_t validate_value(const uint8_t *x, int32_t len);
+int32_t validate_datetime(const uint8_t *x, int32_t len);
 
 // helper methods
 PyObject *dumps_as_pyobject(PyObject *x);
@@ -0,0 +1,768 @@
+// ordered index of the keys for range queries, a B+tree
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "index.h"
+
+// CHANGE ME
+#define _FOO_KV_DEBUG 1
+
+// ordering
+// keys are compared in their wire encoded form, an item at a time, so nothing
+// is built to compare them
+
+static int32_t type_rank(uint8_t symbol) {
+
+    switch (symbol) {
+        case INT_SYMBOL:
+        case FLOAT_SYMBOL:
+            return 0;
+        case STRING_SYMBOL:
+            return 1;
+        case BYTES_SYMBOL:
+            return 2;
+        case TUPLE_SYMBOL:
+            return 3;
+        default:
+            return 4;
+    }
+
+}
+
+static int32_t compare_bytes(const uint8_t *a, int32_t a_len, const uint8_t *b, int32_t b_len) {
+    // byte by byte and a prefix first, which is code point order for utf-8
+
+    int32_t cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp) {
+        return cmp;
+    }
+
+    return (a_len > b_len) - (a_len < b_len);
+
+}
+
+static int32_t int_sign(const uint8_t **digits, int32_t *len) {
+    // strips the sign and leading zeros of a validated int, and returns its sign
+
+    int32_t sign = 1;
+    if (*len && (**digits == '-' || **digits == '+')) {
+        sign = **digits == '-' ? -1 : 1;
+        (*digits)++;
+        (*len)--;
+    }
+    while (*len && **digits == '0') {
+        (*digits)++;
+        (*len)--;
+    }
+
+    return *len ? sign : 0;
+
+}
+
+static int32_t compare_ints(const uint8_t *a, int32_t a_len, const uint8_t *b, int32_t b_len) {
+    // ints can have any number of digits, so they are compared as digits
+
+    int32_t a_sign = int_sign(&a, &a_len);
+    int32_t b_sign = int_sign(&b, &b_len);
+    if (a_sign != b_sign) {
+        return a_sign < b_sign ? -1 : 1;
+    }
+    // without leading zeros, the one with more digits is further from 0
+    int32_t cmp = a_len != b_len ? (a_len > b_len) - (a_len < b_len) : memcmp(a, b, a_len);
+
+    return a_sign * cmp;
+
+}
+
+static double number_value(const uint8_t *x, int32_t len) {
+    // the value of a validated int or float, symbol included, as a double
+
+    char buff[128];
+    int32_t sign = 1;
+    x += sizeof(char);
+    len -= sizeof(char);
+    if (x[-1] == INT_SYMBOL && !(sign = int_sign(&x, &len))) {
+        return 0;
+    }
+    if ((size_t)len >= sizeof(buff)) {
+        // only ints get this long, and they are past what a double holds
+        return sign * INFINITY;
+    }
+    memcpy(buff, x, len);
+    buff[len] = '\0';
+
+    return sign * strtod(buff, NULL);
+
+}
+
+static int32_t compare_numbers(const uint8_t *a, int32_t a_len, const uint8_t *b, int32_t b_len) {
+    // by value, then an int before a float of the same value, then by their
+    // encoding, so numbers that are equal but not the same key are ordered too.
+    // ints are compared exactly, which agrees with their rounded values.
+
+    if (a[0] == INT_SYMBOL && b[0] == INT_SYMBOL) {
+        int32_t cmp = compare_ints(a + sizeof(char), a_len - sizeof(char), b + sizeof(char), b_len - sizeof(char));
+        if (cmp) {
+            return cmp;
+        }
+    } else {
+        double x = number_value(a, a_len);
+        double y = number_value(b, b_len);
+        // nan after every other number
+        int32_t x_nan = isnan(x);
+        int32_t y_nan = isnan(y);
+        if (x_nan != y_nan) {
+            return x_nan - y_nan;
+        }
+        if (!x_nan && x != y) {
+            return x < y ? -1 : 1;
+        }
+        if (a[0] != b[0]) {
+            return a[0] == INT_SYMBOL ? -1 : 1;
+        }
+    }
+
+    return compare_bytes(a, a_len, b, b_len);
+
+}
+
+static int32_t compare_items(const uint8_t *a, int32_t a_len, const uint8_t *b, int32_t b_len);
+
+static int32_t compare_tuples(const uint8_t *a, const uint8_t *b) {
+    // item by item, and a tuple before the longer tuples it is a prefix of.
+    // takes the bodies of validated tuples, a count then length prefixed items,
+    // which carry their own lengths.
+
+    uint16_t a_num, b_num;
+    memcpy(&a_num, a, sizeof(uint16_t));
+    memcpy(&b_num, b, sizeof(uint16_t));
+    int32_t a_offset = sizeof(uint16_t);
+    int32_t b_offset = sizeof(uint16_t);
+
+    for (int32_t ix = 0; ix < a_num && ix < b_num; ix++) {
+        uint16_t a_item, b_item;
+        memcpy(&a_item, a + a_offset, sizeof(uint16_t));
+        memcpy(&b_item, b + b_offset, sizeof(uint16_t));
+        a_offset += sizeof(uint16_t);
+        b_offset += sizeof(uint16_t);
+        int32_t cmp = compare_items(a + a_offset, a_item, b + b_offset, b_item);
+        if (cmp) {
+            return cmp;
+        }
+        a_offset += a_item;
+        b_offset += b_item;
+    }
+
+    return (a_num > b_num) - (a_num < b_num);
+
+}
+
+static int32_t compare_items(const uint8_t *a, int32_t a_len, const uint8_t *b, int32_t b_len) {
+
+    int32_t a_rank = type_rank(a[0]);
+    int32_t b_rank = type_rank(b[0]);
+    if (a_rank != b_rank) {
+        return a_rank < b_rank ? -1 : 1;
+    }
+
+    switch (a_rank) {
+        case 0:
+            return compare_numbers(a, a_len, b, b_len);
+        case 3:
+            return compare_tuples(a + sizeof(char), b + sizeof(char));
+        default:
+            return compare_bytes(a, a_len, b, b_len);
+    }
+
+}
+
+int32_t index_compare(const uint8_t *a, uint16_t a_len, const uint8_t *b, uint16_t b_len) {
+
+    return compare_items(a, a_len, b, b_len);
+
+}
+
+int32_t index_covers(const uint8_t *key, uint16_t len) {
+
+    return len && (key[0] == STRING_SYMBOL || key[0] == BYTES_SYMBOL || key[0] == TUPLE_SYMBOL);
+
+}
+
+int32_t index_has_prefix(const uint8_t *key, uint16_t len, const uint8_t *prefix, uint16_t prefix_len) {
+
+    if (!len || !prefix_len || key[0] != prefix[0] || len < prefix_len) {
+        return 0;
+    }
+
+    switch (prefix[0]) {
+        case TUPLE_SYMBOL: {
+            // the same items are encoded the same way
+            uint16_t num_items, num_prefix_items;
+            int32_t offset = sizeof(char) + sizeof(uint16_t);
+            memcpy(&num_items, key + sizeof(char), sizeof(uint16_t));
+            memcpy(&num_prefix_items, prefix + sizeof(char), sizeof(uint16_t));
+            return num_items >= num_prefix_items && !memcmp(key + offset, prefix + offset, prefix_len - offset);
+        }
+        case STRING_SYMBOL:
+        case BYTES_SYMBOL:
+            return !memcmp(key, prefix, prefix_len);
+        default:
+            return len == prefix_len && !memcmp(key, prefix, prefix_len);
+    }
+
+}
+
+// nodes
+
+static struct index_key_t *key_new(struct index_t *index, const uint8_t *data, uint16_t len) {
+
+    struct index_key_t *key = PyMem_RawMalloc(sizeof(struct index_key_t) + len);
+    if (!key) {
+        return NULL;
+    }
+    key->refs = 1;
+    key->len = len;
+    memcpy(key->data, data, len);
+    index->memory += sizeof(struct index_key_t) + len;
+
+    return key;
+
+}
+
+static void key_unref(struct index_t *index, struct index_key_t *key) {
+
+    if (--key->refs) {
+        return;
+    }
+    index->memory -= sizeof(struct index_key_t) + key->len;
+    PyMem_RawFree(key);
+
+}
+
+static inline size_t node_size(int32_t is_leaf) {
+
+    return is_leaf ? sizeof(struct index_leaf_t) : sizeof(struct index_inner_t);
+
+}
+
+static struct index_node_t *node_new(struct index_t *index, int32_t is_leaf) {
+
+    struct index_node_t *node = PyMem_RawCalloc(1, node_size(is_leaf));
+    if (!node) {
+        return NULL;
+    }
+    node->is_leaf = is_leaf;
+    index->memory += node_size(is_leaf);
+
+    return node;
+
+}
+
+static void node_free(struct index_t *index, struct index_node_t *node) {
+    // frees the node but not its keys, see node_dealloc()
+
+    index->memory -= node_size(node->is_leaf);
+    PyMem_RawFree(node);
+
+}
+
+static void node_dealloc(struct index_t *index, struct index_node_t *node) {
+    // frees the node, its keys and its children
+
+    if (!node->is_leaf) {
+        for (int32_t ix = 0; ix <= node->num_keys; ix++) {
+            node_dealloc(index, ((struct index_inner_t *)node)->children[ix]);
+        }
+    }
+    for (int32_t ix = 0; ix < node->num_keys; ix++) {
+        key_unref(index, node->keys[ix]);
+    }
+    node_free(index, node);
+
+}
+
+static int32_t node_lower_bound(const struct index_node_t *node, const uint8_t *key, uint16_t len) {
+    // the number of keys of the node before `key`
+
+    int32_t lo = 0;
+    int32_t hi = node->num_keys;
+    while (lo < hi) {
+        int32_t mid = (lo + hi) / 2;
+        if (index_compare(node->keys[mid]->data, node->keys[mid]->len, key, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+
+}
+
+static int32_t node_upper_bound(const struct index_node_t *node, const uint8_t *key, uint16_t len) {
+    // the number of keys of the node up to `key`, which is the child of an
+    // inner node that `key` belongs in
+
+    int32_t lo = 0;
+    int32_t hi = node->num_keys;
+    while (lo < hi) {
+        int32_t mid = (lo + hi) / 2;
+        if (index_compare(node->keys[mid]->data, node->keys[mid]->len, key, len) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+
+}
+
+static struct index_leaf_t *tree_descend(struct index_t *index, const uint8_t *key, uint16_t len, struct index_inner_t **path, int32_t *slots, int32_t *depth) {
+    // returns the leaf `key` belongs in, and the nodes and children taken to
+    // get there if `path` is given
+
+    struct index_node_t *node = index->root;
+    *depth = 0;
+    while (!node->is_leaf) {
+        int32_t ix = node_upper_bound(node, key, len);
+        if (path) {
+            path[*depth] = (struct index_inner_t *)node;
+            slots[*depth] = ix;
+        }
+        (*depth)++;
+        node = ((struct index_inner_t *)node)->children[ix];
+    }
+
+    return (struct index_leaf_t *)node;
+
+}
+
+// inserting
+
+static void leaf_split(struct index_leaf_t *leaf, struct index_leaf_t *right, int32_t pos, struct index_key_t *key) {
+    // moves the upper half of the full leaf, with `key` inserted at `pos`, to
+    // the empty leaf `right` that follows it
+
+    struct index_key_t *keys[INDEX_MAX_KEYS + 1];
+    memcpy(keys, leaf->node.keys, pos * sizeof(struct index_key_t *));
+    keys[pos] = key;
+    memcpy(keys + pos + 1, leaf->node.keys + pos, (INDEX_MAX_KEYS - pos) * sizeof(struct index_key_t *));
+
+    int32_t num_left = (INDEX_MAX_KEYS + 1) / 2;
+    memcpy(leaf->node.keys, keys, num_left * sizeof(struct index_key_t *));
+    leaf->node.num_keys = num_left;
+    memcpy(right->node.keys, keys + num_left, (INDEX_MAX_KEYS + 1 - num_left) * sizeof(struct index_key_t *));
+    right->node.num_keys = INDEX_MAX_KEYS + 1 - num_left;
+
+    right->next = leaf->next;
+    leaf->next = right;
+
+}
+
+static struct index_key_t *inner_split(struct index_inner_t *inner, struct index_inner_t *right, int32_t pos, struct index_key_t *key, struct index_node_t *child) {
+    // moves the upper half of the full inner node, with `key` inserted at `pos`
+    // and `child` after it, to the empty node `right`, and returns the key in
+    // the middle, which goes up to the parent
+
+    struct index_key_t *keys[INDEX_MAX_KEYS + 1];
+    struct index_node_t *children[INDEX_MAX_KEYS + 2];
+    memcpy(keys, inner->node.keys, pos * sizeof(struct index_key_t *));
+    keys[pos] = key;
+    memcpy(keys + pos + 1, inner->node.keys + pos, (INDEX_MAX_KEYS - pos) * sizeof(struct index_key_t *));
+    memcpy(children, inner->children, (pos + 1) * sizeof(struct index_node_t *));
+    children[pos + 1] = child;
+    memcpy(children + pos + 2, inner->children + pos + 1, (INDEX_MAX_KEYS - pos) * sizeof(struct index_node_t *));
+
+    int32_t num_left = (INDEX_MAX_KEYS + 1) / 2;
+    int32_t num_right = INDEX_MAX_KEYS - num_left;
+    memcpy(inner->node.keys, keys, num_left * sizeof(struct index_key_t *));
+    memcpy(inner->children, children, (num_left + 1) * sizeof(struct index_node_t *));
+    inner->node.num_keys = num_left;
+    memcpy(right->node.keys, keys + num_left + 1, num_right * sizeof(struct index_key_t *));
+    memcpy(right->children, children + num_left + 1, (num_right + 1) * sizeof(struct index_node_t *));
+    right->node.num_keys = num_right;
+
+    return keys[num_left];
+
+}
+
+static void inner_insert(struct index_inner_t *inner, int32_t pos, struct index_key_t *key, struct index_node_t *child) {
+    // inserts `key` at `pos` and `child` after it into an inner node with room
+
+    int32_t num_keys = inner->node.num_keys;
+    memmove(inner->node.keys + pos + 1, inner->node.keys + pos, (num_keys - pos) * sizeof(struct index_key_t *));
+    memmove(inner->children + pos + 2, inner->children + pos + 1, (num_keys - pos) * sizeof(struct index_node_t *));
+    inner->node.keys[pos] = key;
+    inner->children[pos + 1] = child;
+    inner->node.num_keys++;
+
+}
+
+static int32_t tree_insert(struct index_t *index, const uint8_t *data, uint16_t len) {
+    // inserts the key into its leaf, and splits the full nodes on the way back
+    // up. the nodes the splits need are allocated before anything changes, so
+    // running out of memory leaves the tree as it was.
+
+    struct index_inner_t *path[INDEX_MAX_HEIGHT];
+    int32_t slots[INDEX_MAX_HEIGHT];
+    int32_t depth;
+    struct index_leaf_t *leaf = tree_descend(index, data, len, path, slots, &depth);
+
+    int32_t pos = node_lower_bound(&leaf->node, data, len);
+    if (pos < leaf->node.num_keys && !index_compare(leaf->node.keys[pos]->data, leaf->node.keys[pos]->len, data, len)) {
+        return 0;
+    }
+
+    // a full leaf splits, then every full node above it, and a full root
+    // splits under a new root
+    int32_t num_splits = 0;
+    if (leaf->node.num_keys == INDEX_MAX_KEYS) {
+        num_splits = 1;
+        while (num_splits <= depth && path[depth - num_splits]->node.num_keys == INDEX_MAX_KEYS) {
+            num_splits++;
+        }
+    }
+    if (depth + 1 == INDEX_MAX_HEIGHT && num_splits == depth + 1) {
+        log_error("tree_insert(): the index is too tall");
+        return -1;
+    }
+    int32_t num_nodes = num_splits + (num_splits == depth + 1);
+    struct index_node_t *nodes[INDEX_MAX_HEIGHT + 1];
+    struct index_key_t *key = key_new(index, data, len);
+    int32_t num_allocated = 0;
+    while (key && num_allocated < num_nodes) {
+        nodes[num_allocated] = node_new(index, num_allocated == 0);
+        if (!nodes[num_allocated]) {
+            break;
+        }
+        num_allocated++;
+    }
+    if (!key || num_allocated < num_nodes) {
+        while (num_allocated-- > 0) {
+            node_free(index, nodes[num_allocated]);
+        }
+        if (key) {
+            key_unref(index, key);
+        }
+        return -1;
+    }
+
+    index->size++;
+    if (!num_splits) {
+        memmove(leaf->node.keys + pos + 1, leaf->node.keys + pos, (leaf->node.num_keys - pos) * sizeof(struct index_key_t *));
+        leaf->node.keys[pos] = key;
+        leaf->node.num_keys++;
+        return 0;
+    }
+
+    struct index_leaf_t *right_leaf = (struct index_leaf_t *)nodes[0];
+    leaf_split(leaf, right_leaf, pos, key);
+    // the first key of the new leaf separates it from the old one
+    struct index_key_t *up = right_leaf->node.keys[0];
+    up->refs++;
+    struct index_node_t *right = &right_leaf->node;
+    int32_t next_node = 1;
+
+    for (int32_t level = depth - 1; level >= 0 && right; level--) {
+        struct index_inner_t *parent = path[level];
+        if (parent->node.num_keys < INDEX_MAX_KEYS) {
+            inner_insert(parent, slots[level], up, right);
+            right = NULL;
+        } else {
+            struct index_inner_t *right_inner = (struct index_inner_t *)nodes[next_node++];
+            up = inner_split(parent, right_inner, slots[level], up, right);
+            right = &right_inner->node;
+        }
+    }
+
+    if (right) {
+        struct index_inner_t *root = (struct index_inner_t *)nodes[next_node];
+        root->node.keys[0] = up;
+        root->node.num_keys = 1;
+        root->children[0] = index->root;
+        root->children[1] = right;
+        index->root = &root->node;
+        index->height++;
+    }
+
+    return 0;
+
+}
+
+// removing
+
+static void borrow_left(struct index_t *index, struct index_inner_t *parent, int32_t ix) {
+    // moves the last key of the child before children[ix] to children[ix]
+
+    struct index_node_t *child = parent->children[ix];
+    struct index_node_t *left = parent->children[ix - 1];
+
+    memmove(child->keys + 1, child->keys, child->num_keys * sizeof(struct index_key_t *));
+    if (child->is_leaf) {
+        child->keys[0] = left->keys[left->num_keys - 1];
+        key_unref(index, parent->node.keys[ix - 1]);
+        parent->node.keys[ix - 1] = child->keys[0];
+        child->keys[0]->refs++;
+    } else {
+        struct index_inner_t *inner = (struct index_inner_t *)child;
+        struct index_inner_t *left_inner = (struct index_inner_t *)left;
+        memmove(inner->children + 1, inner->children, (child->num_keys + 1) * sizeof(struct index_node_t *));
+        child->keys[0] = parent->node.keys[ix - 1];
+        inner->children[0] = left_inner->children[left->num_keys];
+        parent->node.keys[ix - 1] = left->keys[left->num_keys - 1];
+    }
+    left->num_keys--;
+    child->num_keys++;
+
+}
+
+static void borrow_right(struct index_t *index, struct index_inner_t *parent, int32_t ix) {
+    // moves the first key of the child after children[ix] to children[ix]
+
+    struct index_node_t *child = parent->children[ix];
+    struct index_node_t *right = parent->children[ix + 1];
+
+    if (child->is_leaf) {
+        child->keys[child->num_keys] = right->keys[0];
+        memmove(right->keys, right->keys + 1, (right->num_keys - 1) * sizeof(struct index_key_t *));
+        key_unref(index, parent->node.keys[ix]);
+        parent->node.keys[ix] = right->keys[0];
+        right->keys[0]->refs++;
+    } else {
+        struct index_inner_t *inner = (struct index_inner_t *)child;
+        struct index_inner_t *right_inner = (struct index_inner_t *)right;
+        child->keys[child->num_keys] = parent->node.keys[ix];
+        inner->children[child->num_keys + 1] = right_inner->children[0];
+        parent->node.keys[ix] = right->keys[0];
+        memmove(right->keys, right->keys + 1, (right->num_keys - 1) * sizeof(struct index_key_t *));
+        memmove(right_inner->children, right_inner->children + 1, right->num_keys * sizeof(struct index_node_t *));
+    }
+    right->num_keys--;
+    child->num_keys++;
+
+}
+
+static void merge(struct index_t *index, struct index_inner_t *parent, int32_t ix) {
+    // moves children[ix + 1] into children[ix] and drops the key between them
+
+    struct index_node_t *left = parent->children[ix];
+    struct index_node_t *right = parent->children[ix + 1];
+
+    if (left->is_leaf) {
+        memcpy(left->keys + left->num_keys, right->keys, right->num_keys * sizeof(struct index_key_t *));
+        left->num_keys += right->num_keys;
+        ((struct index_leaf_t *)left)->next = ((struct index_leaf_t *)right)->next;
+        key_unref(index, parent->node.keys[ix]);
+    } else {
+        // the key between them comes down between their children
+        left->keys[left->num_keys] = parent->node.keys[ix];
+        memcpy(left->keys + left->num_keys + 1, right->keys, right->num_keys * sizeof(struct index_key_t *));
+        memcpy(((struct index_inner_t *)left)->children + left->num_keys + 1, ((struct index_inner_t *)right)->children,
+               (right->num_keys + 1) * sizeof(struct index_node_t *));
+        left->num_keys += 1 + right->num_keys;
+    }
+
+    int32_t num_after = parent->node.num_keys - ix - 1;
+    memmove(parent->node.keys + ix, parent->node.keys + ix + 1, num_after * sizeof(struct index_key_t *));
+    memmove(parent->children + ix + 1, parent->children + ix + 2, num_after * sizeof(struct index_node_t *));
+    parent->node.num_keys--;
+    node_free(index, right);
+
+}
+
+static void rebalance(struct index_t *index, struct index_inner_t *parent, int32_t ix) {
+    // children[ix] is less than half full: it takes a key from a sibling that
+    // has more than half, or else merges with one
+
+    struct index_node_t *left = ix > 0 ? parent->children[ix - 1] : NULL;
+    struct index_node_t *right = ix < parent->node.num_keys ? parent->children[ix + 1] : NULL;
+
+    if (left && left->num_keys > INDEX_MIN_KEYS) {
+        borrow_left(index, parent, ix);
+    } else if (right && right->num_keys > INDEX_MIN_KEYS) {
+        borrow_right(index, parent, ix);
+    } else if (left) {
+        merge(index, parent, ix - 1);
+    } else {
+        merge(index, parent, ix);
+    }
+
+}
+
+static void tree_remove(struct index_t *index, const uint8_t *data, uint16_t len) {
+    // removes the key from its leaf, and rebalances the nodes that are left
+    // less than half full on the way back up. separators of removed keys can
+    // stay in inner nodes, they still separate the same children.
+
+    struct index_inner_t *path[INDEX_MAX_HEIGHT];
+    int32_t slots[INDEX_MAX_HEIGHT];
+    int32_t depth;
+    struct index_leaf_t *leaf = tree_descend(index, data, len, path, slots, &depth);
+
+    int32_t pos = node_lower_bound(&leaf->node, data, len);
+    if (pos == leaf->node.num_keys || index_compare(leaf->node.keys[pos]->data, leaf->node.keys[pos]->len, data, len)) {
+        return;
+    }
+    key_unref(index, leaf->node.keys[pos]);
+    memmove(leaf->node.keys + pos, leaf->node.keys + pos + 1, (leaf->node.num_keys - pos - 1) * sizeof(struct index_key_t *));
+    leaf->node.num_keys--;
+    index->size--;
+
+    struct index_node_t *node = &leaf->node;
+    for (int32_t level = depth - 1; level >= 0 && node->num_keys < INDEX_MIN_KEYS; level--) {
+        rebalance(index, path[level], slots[level]);
+        node = &path[level]->node;
+    }
+
+    // a root that is left with one child hands over to it
+    struct index_node_t *root = index->root;
+    if (!root->is_leaf && !root->num_keys) {
+        index->root = ((struct index_inner_t *)root)->children[0];
+        index->height--;
+        node_free(index, root);
+    }
+
+}
+
+// public
+
+struct index_t *index_new(void) {
+
+    struct index_t *index = PyMem_RawCalloc(1, sizeof(struct index_t));
+    if (!index) {
+        return NULL;
+    }
+    index->root = node_new(index, 1);
+    if (!index->root) {
+        PyMem_RawFree(index);
+        return NULL;
+    }
+    index->height = 1;
+
+    // like the shards' locks, don't let readers keep writers out
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    int32_t err = pthread_rwlock_init(&index->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    if (err) {
+        node_free(index, index->root);
+        PyMem_RawFree(index);
+        return NULL;
+    }
+
+    return index;
+
+}
+
+void index_dealloc(struct index_t *index) {
+
+    node_dealloc(index, index->root);
+    pthread_rwlock_destroy(&index->lock);
+    PyMem_RawFree(index);
+
+}
+
+static int32_t index_wait(struct index_t *index, int (*acquire)(pthread_rwlock_t *)) {
+    // gives up the GIL while waiting if the caller holds it, like
+    // storage_shard_wait()
+
+    int32_t res;
+
+    if (!PyGILState_Check()) {
+        res = acquire(&index->lock);
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        res = acquire(&index->lock);
+        Py_END_ALLOW_THREADS
+    }
+
+    return res ? -1 : 0;
+
+}
+
+int32_t index_add(struct index_t *index, const uint8_t *key, uint16_t len) {
+
+    if (!index_covers(key, len)) {
+        return 0;
+    }
+    if (pthread_rwlock_trywrlock(&index->lock) && index_wait(index, pthread_rwlock_wrlock)) {
+        log_error("index_add(): unable to acquire the index lock");
+        return -1;
+    }
+    int32_t err = tree_insert(index, key, len);
+    pthread_rwlock_unlock(&index->lock);
+
+    return err;
+
+}
+
+void index_remove(struct index_t *index, const uint8_t *key, uint16_t len) {
+
+    if (!index_covers(key, len)) {
+        return;
+    }
+    if (pthread_rwlock_trywrlock(&index->lock) && index_wait(index, pthread_rwlock_wrlock)) {
+        log_error("index_remove(): unable to acquire the index lock");
+        return;
+    }
+    tree_remove(index, key, len);
+    pthread_rwlock_unlock(&index->lock);
+
+}
+
+int32_t index_read_lock(struct index_t *index) {
+
+    if (!pthread_rwlock_tryrdlock(&index->lock)) {
+        return 0;
+    }
+    return index_wait(index, pthread_rwlock_rdlock);
+
+}
+
+void index_unlock(struct index_t *index) {
+
+    pthread_rwlock_unlock(&index->lock);
+
+}
+
+void index_seek(struct index_t *index, const uint8_t *key, uint16_t len, struct index_iter_t *iter) {
+
+    if (!key) {
+        struct index_node_t *node = index->root;
+        while (!node->is_leaf) {
+            node = ((struct index_inner_t *)node)->children[0];
+        }
+        iter->leaf = (struct index_leaf_t *)node;
+        iter->ix = 0;
+        return;
+    }
+
+    int32_t depth;
+    iter->leaf = tree_descend(index, key, len, NULL, NULL, &depth);
+    iter->ix = node_lower_bound(&iter->leaf->node, key, len);
+
+}
+
+const struct index_key_t *index_next(struct index_iter_t *iter) {
+
+    // only an empty root leaf has no keys, but the first key from where a seek
+    // lands can be in the next leaf
+    while (iter->leaf && iter->ix >= iter->leaf->node.num_keys) {
+        iter->leaf = iter->leaf->next;
+        iter->ix = 0;
+    }
+    if (!iter->leaf) {
+        return NULL;
+    }
+
+    return iter->leaf->node.keys[iter->ix++];
+
+}
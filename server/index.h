@@ -0,0 +1,98 @@
+#ifndef _FOO_KV_INDEX
+#define _FOO_KV_INDEX
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <Python.h>
+
+// keys per node of the tree. a node is half full at least, except the root.
+#define INDEX_MAX_KEYS 32
+#define INDEX_MIN_KEYS (INDEX_MAX_KEYS / 2)
+// a tree of this height holds more keys than the storage can
+#define INDEX_MAX_HEIGHT 16
+
+// a key of the index in its wire encoded form. the leaf that holds it and the
+// inner nodes it separates share it, so a split or a rebalance never copies a
+// key.
+struct index_key_t {
+    uint32_t refs;
+    uint16_t len;
+    uint8_t data[];
+};
+
+struct index_node_t {
+    uint16_t num_keys;
+    uint8_t is_leaf;
+    struct index_key_t *keys[INDEX_MAX_KEYS];
+};
+
+struct index_leaf_t {
+    struct index_node_t node;
+    struct index_leaf_t *next;
+};
+
+// children[ix + 1] holds the keys from keys[ix] on, and children[ix] the keys
+// before it
+struct index_inner_t {
+    struct index_node_t node;
+    struct index_node_t *children[INDEX_MAX_KEYS + 1];
+};
+
+// an ordered index of the str, bytes and tuple keys of the storage, a B+tree
+// whose leaves are linked in key order, so a range of keys is read leaf by leaf
+// without going back up the tree. it is kept up to date by the storage as keys
+// are added and removed, under the lock of their shard, so it is one lock that
+// every write of an indexed key takes: only enable it if range queries are
+// needed.
+//
+// keys are ordered like python orders them: str by code point, bytes by byte,
+// numbers by value, and tuples item by item with a tuple before the longer
+// tuples it is a prefix of. keys of different types are ordered by type,
+// numbers, then str, then bytes, then tuples, so all the tuples starting with
+// the same items are next to each other.
+//
+// `lock` is taken after the locks of the shards, never before.
+struct index_t {
+    pthread_rwlock_t lock;
+    struct index_node_t *root;
+    uint32_t height;
+    // updated under the lock, read without it by info
+    uint64_t size;
+    uint64_t memory;
+};
+
+// where a read of the index is at, see index_seek()
+struct index_iter_t {
+    struct index_leaf_t *leaf;
+    int32_t ix;
+};
+
+struct index_t *index_new(void);
+void index_dealloc(struct index_t *index);
+// whether keys like `key` are indexed
+int32_t index_covers(const uint8_t *key, uint16_t len);
+// orders two wire encoded keys, returning <0, 0 or >0 like memcmp(). 0 only if
+// they are the same key.
+int32_t index_compare(const uint8_t *a, uint16_t a_len, const uint8_t *b, uint16_t b_len);
+// whether `key` is `prefix`, or a str or bytes that starts with it, or a tuple
+// that starts with its items. the keys with a prefix are all next to each
+// other, from the prefix on.
+int32_t index_has_prefix(const uint8_t *key, uint16_t len, const uint8_t *prefix, uint16_t prefix_len);
+
+// these take the lock themselves. index_add() returns -1 if out of memory, in
+// which case the index is unchanged. keys that aren't covered are ignored.
+int32_t index_add(struct index_t *index, const uint8_t *key, uint16_t len);
+void index_remove(struct index_t *index, const uint8_t *key, uint16_t len);
+
+// reads take the lock shared for as long as they use an iterator
+int32_t index_read_lock(struct index_t *index);
+void index_unlock(struct index_t *index);
+// points `iter` at the first key from `key` on, or the first key if `key` is
+// NULL, and index_next() returns the keys in order from there, or NULL after
+// the last one
+void index_seek(struct index_t *index, const uint8_t *key, uint16_t len, struct index_iter_t *iter);
+const struct index_key_t *index_next(struct index_iter_t *iter);
+
+#endif
@@ -0,0 +1,452 @@
+// user locks: leases with owner tokens, and FIFO queues of parked waiters
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <Python.h>
+
+#include "util.h"
+#include "connection.h"
+#include "reactor.h"
+#include "locks.h"
+#include "slab.h"
+#include "ttl.h"
+
+// CHANGE ME
+#define _FOO_KV_DEBUG 1
+
+static struct slab_t waiter_slab;
+
+int32_t locks_alloc_init(void) {
+
+    return slab_init(&waiter_slab, sizeof(struct lock_waiter_t));
+
+}
+
+struct locks_t *locks_new(void) {
+
+    struct locks_t *locks = PyMem_RawCalloc(1, sizeof(struct locks_t));
+    if (!locks) {
+        return NULL;
+    }
+    locks->buckets = PyMem_RawCalloc(LOCKS_MIN_BUCKETS, sizeof(struct user_lock_t *));
+    if (!locks->buckets) {
+        PyMem_RawFree(locks);
+        return NULL;
+    }
+    locks->num_buckets = LOCKS_MIN_BUCKETS;
+    pthread_mutex_init(&locks->mutex, NULL);
+
+    return locks;
+
+}
+
+void locks_dealloc(struct locks_t *locks) {
+    // the parked connections of the waiters are never resumed, the server is
+    // going away
+
+    for (uint32_t ix = 0; ix < locks->num_buckets; ix++) {
+        struct user_lock_t *lock = locks->buckets[ix];
+        while (lock) {
+            struct user_lock_t *next = lock->next;
+            while (lock->head) {
+                struct lock_waiter_t *waiter = lock->head;
+                lock->head = waiter->next;
+                slab_free(&waiter_slab, waiter);
+            }
+            PyMem_RawFree(lock);
+            lock = next;
+        }
+    }
+    pthread_mutex_destroy(&locks->mutex);
+    PyMem_RawFree(locks->buckets);
+    PyMem_RawFree(locks);
+
+}
+
+struct lock_waiter_t *lock_waiter_new(struct conn_t *conn, const uint8_t *token, uint16_t token_len, uint32_t lease, time_t deadline) {
+
+    struct lock_waiter_t *waiter = slab_alloc(&waiter_slab);
+    if (!waiter) {
+        return NULL;
+    }
+    waiter->next = NULL;
+    waiter->conn = conn;
+    waiter->flags = 0;
+    waiter->lease = lease;
+    waiter->deadline = deadline;
+    waiter->status = RES_BAD_LOCK;
+    waiter->fence = 0;
+    waiter->token_len = token_len;
+    memcpy(waiter->token, token, token_len);
+
+    return waiter;
+
+}
+
+void lock_waiter_free(struct lock_waiter_t *waiter) {
+
+    slab_free(&waiter_slab, waiter);
+
+}
+
+int32_t lock_waiter_park(struct lock_waiter_t *waiter) {
+
+    return (__atomic_fetch_or(&waiter->flags, LOCK_WAITER_PARKED, __ATOMIC_ACQ_REL) & LOCK_WAITER_DONE) != 0;
+
+}
+
+int32_t lock_waiter_wake(struct lock_waiter_t *waiter) {
+
+    // the waiter is freed as soon as the connection is resumed, so read what
+    // resuming it takes first
+    struct conn_t *conn = waiter->conn;
+    if (!(__atomic_fetch_or(&waiter->flags, LOCK_WAITER_DONE, __ATOMIC_ACQ_REL) & LOCK_WAITER_PARKED)) {
+        // the reactor resumes it when it parks it
+        return 0;
+    }
+
+    return reactor_return_conn(conn->reactor, conn);
+
+}
+
+static time_t lease_end(uint32_t lease) {
+    // the heap only has whole seconds, so a lease lasts at least `lease`
+    // seconds and less than a second more
+
+    return time(NULL) + lease + 1;
+
+}
+
+static struct user_lock_t *locks_find(struct locks_t *locks, uint64_t hash, const uint8_t *name, uint16_t name_len) {
+
+    struct user_lock_t *lock = locks->buckets[hash & (locks->num_buckets - 1)];
+    while (lock && (lock->hash != hash || lock->name_len != name_len || memcmp(lock->name, name, name_len))) {
+        lock = lock->next;
+    }
+
+    return lock;
+
+}
+
+static void locks_grow(struct locks_t *locks) {
+    // doubles the buckets, or leaves them alone if out of memory
+
+    uint32_t num_buckets = locks->num_buckets * 2;
+    struct user_lock_t **buckets = PyMem_RawCalloc(num_buckets, sizeof(struct user_lock_t *));
+    if (!buckets) {
+        return;
+    }
+    for (uint32_t ix = 0; ix < locks->num_buckets; ix++) {
+        struct user_lock_t *lock = locks->buckets[ix];
+        while (lock) {
+            struct user_lock_t *next = lock->next;
+            uint32_t bucket = lock->hash & (num_buckets - 1);
+            lock->next = buckets[bucket];
+            buckets[bucket] = lock;
+            lock = next;
+        }
+    }
+    PyMem_RawFree(locks->buckets);
+    locks->buckets = buckets;
+    locks->num_buckets = num_buckets;
+
+}
+
+static void locks_delete(struct locks_t *locks, struct user_lock_t *lock) {
+
+    struct user_lock_t **link = &locks->buckets[lock->hash & (locks->num_buckets - 1)];
+    while (*link != lock) {
+        link = &(*link)->next;
+    }
+    *link = lock->next;
+    locks->size--;
+    PyMem_RawFree(lock);
+
+}
+
+static int32_t lock_is_owner(const struct user_lock_t *lock, const uint8_t *token, uint16_t token_len) {
+
+    return lock->owner_len == token_len && !memcmp(lock->owner, token, token_len);
+
+}
+
+static struct lock_waiter_t *lock_handover(struct locks_t *locks, struct user_lock_t *lock) {
+    // grants the lock to its first waiter and returns it, or releases the lock
+    // and returns NULL if nobody waits for it
+
+    struct lock_waiter_t *waiter = lock->head;
+    if (!waiter) {
+        locks->num_held--;
+        if (!lock->scheduled) {
+            locks_delete(locks, lock);
+            return NULL;
+        }
+        // kept until its lease expiry fires, so that locking it again before
+        // then doesn't put another one on the heap
+        lock->owner_len = 0;
+        lock->expires = 0;
+        return NULL;
+    }
+    lock->head = waiter->next;
+    if (!lock->head) {
+        lock->tail = NULL;
+    }
+    locks->num_waiters--;
+
+    lock->owner_len = waiter->token_len;
+    memcpy(lock->owner, waiter->token, waiter->token_len);
+    lock->expires = lease_end(waiter->lease);
+    lock->fence = ++locks->fence;
+    waiter->next = NULL;
+    waiter->status = RES_OK;
+    waiter->fence = lock->fence;
+
+    return waiter;
+
+}
+
+int32_t locks_acquire(struct locks_t *locks, const uint8_t *name, uint16_t name_len, const uint8_t *token, uint16_t token_len,
+                      uint32_t lease, struct lock_waiter_t *waiter, uint64_t *fence) {
+
+    uint64_t hash = hash64(name, name_len, hash64_seed);
+    int32_t res = 0;
+
+    pthread_mutex_lock(&locks->mutex);
+
+    struct user_lock_t *lock = locks_find(locks, hash, name, name_len);
+    if (!lock) {
+        if (locks->size >= locks->num_buckets) {
+            locks_grow(locks);
+        }
+        lock = PyMem_RawCalloc(1, sizeof(struct user_lock_t) + name_len);
+        if (!lock) {
+            res = -1;
+            goto LOCKS_ACQUIRE_END;
+        }
+        lock->hash = hash;
+        lock->name_len = name_len;
+        memcpy(lock->name, name, name_len);
+        uint32_t bucket = hash & (locks->num_buckets - 1);
+        lock->next = locks->buckets[bucket];
+        locks->buckets[bucket] = lock;
+        locks->size++;
+    }
+    if (!lock->owner_len) {
+        lock->owner_len = token_len;
+        memcpy(lock->owner, token, token_len);
+        lock->fence = ++locks->fence;
+        locks->num_held++;
+    } else if (!lock_is_owner(lock, token, token_len)) {
+        if (!waiter) {
+            res = 2;
+            goto LOCKS_ACQUIRE_END;
+        }
+        if (lock->tail) {
+            lock->tail->next = waiter;
+        } else {
+            lock->head = waiter;
+        }
+        lock->tail = waiter;
+        locks->num_waiters++;
+        res = 1;
+        goto LOCKS_ACQUIRE_END;
+    }
+    lock->expires = lease_end(lease);
+    *fence = lock->fence;
+
+LOCKS_ACQUIRE_END:
+    pthread_mutex_unlock(&locks->mutex);
+
+    return res;
+
+}
+
+int32_t locks_release(struct locks_t *locks, const uint8_t *name, uint16_t name_len, const uint8_t *token, uint16_t token_len,
+                      struct lock_waiter_t **granted) {
+
+    uint64_t hash = hash64(name, name_len, hash64_seed);
+    int32_t res = -1;
+    *granted = NULL;
+
+    pthread_mutex_lock(&locks->mutex);
+    struct user_lock_t *lock = locks_find(locks, hash, name, name_len);
+    if (lock && lock_is_owner(lock, token, token_len)) {
+        *granted = lock_handover(locks, lock);
+        res = 0;
+    }
+    pthread_mutex_unlock(&locks->mutex);
+
+    return res;
+
+}
+
+int32_t locks_extend(struct locks_t *locks, const uint8_t *name, uint16_t name_len, const uint8_t *token, uint16_t token_len, uint32_t lease) {
+
+    uint64_t hash = hash64(name, name_len, hash64_seed);
+    int32_t res = -1;
+
+    pthread_mutex_lock(&locks->mutex);
+    struct user_lock_t *lock = locks_find(locks, hash, name, name_len);
+    if (lock && lock_is_owner(lock, token, token_len)) {
+        lock->expires = lease_end(lease);
+        res = 0;
+    }
+    pthread_mutex_unlock(&locks->mutex);
+
+    return res;
+
+}
+
+int32_t locks_expire(struct locks_t *locks, const uint8_t *name, uint16_t name_len, time_t now, struct lock_waiter_t **granted) {
+
+    uint64_t hash = hash64(name, name_len, hash64_seed);
+    int32_t res = -1;
+    *granted = NULL;
+
+    pthread_mutex_lock(&locks->mutex);
+    struct user_lock_t *lock = locks_find(locks, hash, name, name_len);
+    if (lock) {
+        // this was the lease expiry on the heap
+        lock->scheduled = 0;
+        if (!lock->owner_len) {
+            // released since, and not locked again
+            locks_delete(locks, lock);
+        } else if (lock->expires > now) {
+            // extended, or held by another owner since
+            res = 1;
+        } else {
+            *granted = lock_handover(locks, lock);
+            res = 0;
+        }
+    }
+    pthread_mutex_unlock(&locks->mutex);
+
+    return res;
+
+}
+
+struct lock_waiter_t *locks_timeout(struct locks_t *locks, const uint8_t *name, uint16_t name_len, time_t now) {
+
+    uint64_t hash = hash64(name, name_len, hash64_seed);
+    struct lock_waiter_t *timed_out = NULL;
+    struct lock_waiter_t **last = &timed_out;
+
+    pthread_mutex_lock(&locks->mutex);
+    struct user_lock_t *lock = locks_find(locks, hash, name, name_len);
+    if (lock) {
+        lock->timeout_scheduled = 0;
+        struct lock_waiter_t **link = &lock->head;
+        struct lock_waiter_t *prev = NULL;
+        while (*link) {
+            struct lock_waiter_t *waiter = *link;
+            if (waiter->deadline > now) {
+                prev = waiter;
+                link = &waiter->next;
+                continue;
+            }
+            *link = waiter->next;
+            waiter->next = NULL;
+            *last = waiter;
+            last = &waiter->next;
+            locks->num_waiters--;
+        }
+        lock->tail = prev;
+    }
+    pthread_mutex_unlock(&locks->mutex);
+
+    return timed_out;
+
+}
+
+static int32_t locks_plan(struct locks_t *locks, const uint8_t *name, uint16_t name_len, time_t *lease_at, time_t *timeout_at) {
+    // sets when the lease expiry and the first wait timeout the heap is missing
+    // should fire, 0 for the ones it isn't missing, and returns whether there
+    // are any. under the mutex.
+
+    *lease_at = 0;
+    *timeout_at = 0;
+    struct user_lock_t *lock = locks_find(locks, hash64(name, name_len, hash64_seed), name, name_len);
+    if (!lock) {
+        return 0;
+    }
+    if (lock->owner_len && (!lock->scheduled || lock->scheduled > lock->expires)) {
+        *lease_at = lock->expires;
+    }
+    if (lock->head && !lock->timeout_scheduled) {
+        *timeout_at = lock->head->deadline;
+        for (struct lock_waiter_t *waiter = lock->head; waiter; waiter = waiter->next) {
+            if (waiter->deadline < *timeout_at) {
+                *timeout_at = waiter->deadline;
+            }
+        }
+    } else if (lock->tail && lock->tail->deadline < lock->timeout_scheduled) {
+        // every waiter but the last was there when it was scheduled
+        *timeout_at = lock->tail->deadline;
+    }
+
+    return *lease_at || *timeout_at;
+
+}
+
+int32_t locks_schedule(struct locks_t *locks, foo_kv_ttl_heap *heap, const uint8_t *name, uint16_t name_len) {
+
+    time_t lease_at, timeout_at;
+
+    pthread_mutex_lock(&locks->mutex);
+    int32_t missing = locks_plan(locks, name, name_len, &lease_at, &timeout_at);
+    pthread_mutex_unlock(&locks->mutex);
+    if (!missing) {
+        return 0;
+    }
+
+    // the heap is made of python objects. the plan is made again under the
+    // GIL, so that the puts of two threads can't land in the opposite order of
+    // their plans.
+    int32_t err = 0;
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
+    pthread_mutex_lock(&locks->mutex);
+    locks_plan(locks, name, name_len, &lease_at, &timeout_at);
+    struct user_lock_t *lock = locks_find(locks, hash64(name, name_len, hash64_seed), name, name_len);
+    if (lease_at) {
+        lock->scheduled = lease_at;
+    }
+    if (timeout_at) {
+        lock->timeout_scheduled = timeout_at;
+    }
+    pthread_mutex_unlock(&locks->mutex);
+
+    if (lease_at) {
+        PyObject *py_key = PyBytes_FromStringAndSize((const char *)name, name_len);
+        if (!py_key || foo_kv_ttl_heap_put(heap, py_key, lease_at)) {
+            log_error("locks_schedule(): unable to put the lease expiry on the heap");
+            err = -1;
+        }
+        Py_XDECREF(py_key);
+    }
+    if (timeout_at) {
+        PyObject *py_key = PyBytes_FromStringAndSize(NULL, sizeof(char) + name_len);
+        if (py_key) {
+            PyBytes_AS_STRING(py_key)[0] = 0;
+            memcpy(PyBytes_AS_STRING(py_key) + sizeof(char), name, name_len);
+        }
+        if (!py_key || foo_kv_ttl_heap_put(heap, py_key, timeout_at)) {
+            log_error("locks_schedule(): unable to put the wait timeout on the heap");
+            err = -1;
+        }
+        Py_XDECREF(py_key);
+    }
+
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
+    }
+    PyGILState_Release(gstate);
+
+    return err;
+
+}
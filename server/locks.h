@@ -0,0 +1,127 @@
+#ifndef _FOO_KV_LOCKS
+#define _FOO_KV_LOCKS
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <Python.h>
+
+#include "pythontypes.h"
+
+// the longest owner token, encoded
+#define LOCK_MAX_TOKEN 64
+// the longest lease and the longest wait, in seconds
+#define LOCK_MAX_LEASE (30 * 24 * 3600)
+#define LOCK_MAX_WAIT 3600
+// the lock table starts with this many buckets, a power of 2
+#define LOCKS_MIN_BUCKETS 64
+
+// the bits of lock_waiter_t.flags
+#define LOCK_WAITER_PARKED 1
+#define LOCK_WAITER_DONE 2
+
+// a lock request that waits for the lock. the connection that sent it is
+// parked in STATE_LOCK_WAITING, neither read from nor written to, until the
+// request is granted or times out, and then resumed in STATE_LOCK_READY to
+// write the response.
+//
+// the waiter is queued while an io worker still owns the connection, so it can
+// be done before the connection is parked: `flags` is set to PARKED by the
+// reactor once it holds the connection and to DONE by whoever ends the wait,
+// and whichever of the two comes second hands the connection to the io workers.
+struct lock_waiter_t {
+    struct lock_waiter_t *next;
+    struct conn_t *conn;
+    int32_t flags;
+    // the lease to hold the lock for once granted, and when to give up
+    uint32_t lease;
+    time_t deadline;
+    // the response, RES_OK with the fencing token or RES_BAD_LOCK
+    int16_t status;
+    uint64_t fence;
+    uint16_t token_len;
+    uint8_t token[LOCK_MAX_TOKEN];
+};
+
+// a lock. a lock exists while it is held, and after it is released until its
+// lease expiry on the heap fires, with no owner. its waiters wait in FIFO
+// order and get it in that order.
+struct user_lock_t {
+    struct user_lock_t *next;
+    uint64_t hash;
+    // when the lease ends, in seconds since the epoch
+    time_t expires;
+    // when the lease expiry and the earliest wait timeout on the lock ttl heap
+    // fire, 0 if there are none. hints that save putting one when there is an
+    // earlier one already, which puts another one when it fires if the lease or
+    // the waits go on after it, so a lock handed from waiter to waiter rarely
+    // needs the GIL.
+    time_t scheduled;
+    time_t timeout_scheduled;
+    uint64_t fence;
+    struct lock_waiter_t *head;
+    struct lock_waiter_t *tail;
+    // 0 if released, tokens are never empty
+    uint16_t owner_len;
+    uint8_t owner[LOCK_MAX_TOKEN];
+    uint16_t name_len;
+    uint8_t name[];
+};
+
+// the user locks, by name, in a chained hash table under one mutex. a lock's
+// owner is the token it was locked with, which unlocks and extends it, and
+// every grant of any lock gets a higher fencing token.
+//
+// leases expire on the server's lock ttl heap, the same kind of heap the
+// storage uses for ttls, keyed by the lock's name. the waits of a lock time out
+// on it too, keyed by a 0 byte and the name, since no encoded name starts with
+// 0. like storage ttls, they are checked against the lock when they fire.
+struct locks_t {
+    pthread_mutex_t mutex;
+    struct user_lock_t **buckets;
+    uint32_t num_buckets;
+    uint32_t size;
+    uint32_t num_held;
+    uint32_t num_waiters;
+    uint64_t fence;
+};
+
+int32_t locks_alloc_init(void);
+struct locks_t *locks_new(void);
+void locks_dealloc(struct locks_t *locks);
+
+// waiters come from a slab, see locks_alloc_init()
+struct lock_waiter_t *lock_waiter_new(struct conn_t *conn, const uint8_t *token, uint16_t token_len, uint32_t lease, time_t deadline);
+void lock_waiter_free(struct lock_waiter_t *waiter);
+// called by the reactor when the connection is parked, returns 1 if the
+// waiter is done already and the connection should be resumed
+int32_t lock_waiter_park(struct lock_waiter_t *waiter);
+// ends the wait of a waiter that was dequeued, and resumes its connection if
+// it is parked already
+int32_t lock_waiter_wake(struct lock_waiter_t *waiter);
+
+// these take the mutex themselves.
+// locks_acquire() returns 0 and sets `fence` if the lock is granted, 1 if
+// `waiter` was queued, 2 if the lock is held and there is no waiter, and -1 if
+// out of memory. granting the lock to the token that holds it renews its lease.
+int32_t locks_acquire(struct locks_t *locks, const uint8_t *name, uint16_t name_len, const uint8_t *token, uint16_t token_len,
+                      uint32_t lease, struct lock_waiter_t *waiter, uint64_t *fence);
+// these return -1 if the lock isn't held by `token`. releasing a lock grants it
+// to its first waiter, which is returned in `granted` to be woken.
+int32_t locks_release(struct locks_t *locks, const uint8_t *name, uint16_t name_len, const uint8_t *token, uint16_t token_len,
+                      struct lock_waiter_t **granted);
+int32_t locks_extend(struct locks_t *locks, const uint8_t *name, uint16_t name_len, const uint8_t *token, uint16_t token_len, uint32_t lease);
+// for the lock ttl heap. locks_expire() releases the lock if its lease is
+// over, returning 1 if it isn't and -1 if the lock is gone, and locks_timeout()
+// dequeues the waiters whose wait is over, returning them linked through `next`
+// to be woken.
+int32_t locks_expire(struct locks_t *locks, const uint8_t *name, uint16_t name_len, time_t now, struct lock_waiter_t **granted);
+struct lock_waiter_t *locks_timeout(struct locks_t *locks, const uint8_t *name, uint16_t name_len, time_t now);
+
+// puts the lease expiry and the earliest wait timeout of the lock on `heap`,
+// unless earlier ones are there. only takes the GIL if it has to put one.
+int32_t locks_schedule(struct locks_t *locks, foo_kv_ttl_heap *heap, const uint8_t *name, uint16_t name_len);
+
+#endif
@@ -5,13 +5,13 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <semaphore.h>
 #include <pthread.h>
+#include <sys/epoll.h>
 
 #include <Python.h>
 #include "structmember.h"
@@ -21,7 +21,12 @@
 #include "module.h"
 #include "connection_io.h"
 #include "dispatch.h"
+#include "reactor.h"
+#include "scheduler.h"
+#include "bufpool.h"
+#include "storage.h"
 #include "ttl.h"
+#include "locks.h"
 
 // CHANGE ME
 #define _FOO_KV_DEBUG 1
@@ -46,17 +51,26 @@ static void foo_kv_server_tp_clear(foo_kv_server *self) {
     log_warning("five_one_one_kv.server is being cleared!!!");
     #endif
 
-    Py_DECREF(self->storage);
-    Py_DECREF(self->user_locks);
-    Py_DECREF(self->user_locks_lock);
+    // tp_init() can fail before any of these are set
+    Py_XDECREF(self->storage_ttl_heap);
+    Py_XDECREF(self->lock_ttl_heap);
 
-    PyMem_RawFree(self->waiting_conns_ready_cond);
-
-    sem_destroy(self->storage_lock);
-    sem_destroy(self->waiting_conns_lock);
-    PyMem_RawFree(self->waiting_conns_lock);
+    if (self->storage) {
+        storage_dealloc(self->storage);
+    }
+    if (self->scheduler) {
+        scheduler_dealloc(self->scheduler);
+    }
+    if (self->user_locks) {
+        locks_dealloc(self->user_locks);
+    }
 
-    connarray_dealloc(self->fd_to_conn);
+    if (self->reactor) {
+        reactor_dealloc(self->reactor);
+    }
+    if (self->fd_to_conn) {
+        connarray_dealloc(self->fd_to_conn);
+    }
 
 }
 
@@ -71,77 +85,12 @@ static void foo_kv_server_tp_dealloc(foo_kv_server *self) {
 
 }
 
-static int foo_kv_server_tp_init(foo_kv_server *self, PyObject *args, PyObject *kwargs) {
-
-    if (ensure_py_deps()) {
-        return -1;
-    }
-
-    #if _FOO_KV_DEBUG == 1
-    char debug_buff[256];
-    log_debug("got past ensure_py_deps()");
-    #endif
-
-    int port, num_threads;
-
-    static char *kwlist[] = {"port", "num_threads", NULL};
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ii", kwlist, &port, &num_threads)) {
-        return -1;
-    }
-
-    #if _FOO_KV_DEBUG == 1
-    sprintf(debug_buff, "got past arg parsing: got port: %d, num_threads: %d", port, num_threads);
-    log_debug(debug_buff);
-    #endif
-
-    if (num_threads < 2 || num_threads > 16) {
-        return -1;
-    }
-    self->num_threads = num_threads;
-
-    self->storage = PyDict_New();
-    if (!self->storage) {
-        return -1;
-    }
-    self->storage_lock = PyMem_RawCalloc(1, sizeof(sem_t));
-    if (!self->storage_lock) {
-        return -1;
-    }
-    if (sem_init(self->storage_lock, 0, 1)) {
-        return -1;
-    }
-    self->user_locks = PyDict_New();
-    if (!self->user_locks) {
-        return -1;
-    }
-    self->user_locks_lock = PyObject_CallNoArgs(_threading_lock);
-    if (!self->user_locks) {
-        return -1;
-    }
-    self->waiting_conns = intq_new();
-    if (!self->waiting_conns) {
-        return -1;
-    }
-    self->waiting_conns_lock = PyMem_RawCalloc(1, sizeof(sem_t));
-    if (!self->waiting_conns_lock) {
-        return -1;
-    }
-    if (sem_init(self->waiting_conns_lock, 0, 1)) {
-        return -1;
-    }
-    self->waiting_conns_ready_cond = cond_new();
-    if (!self->waiting_conns_ready_cond) {
-        return -1;
-    }
+static int listen_on_port(int port, int reuseport) {
+    // returns a nonblocking listening socket, or -1 with a python exception set
 
     // return value for io operations
     int rv;
 
-    #if _FOO_KV_DEBUG == 1
-    log_debug("got past py member init");
-    #endif
-
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
         PyErr_SetString(PyExc_RuntimeError, "socket()");
@@ -152,11 +101,15 @@ static int foo_kv_server_tp_init(foo_kv_server *self, PyObject *args, PyObject *
     log_debug("got past socket creation");
     #endif
 
-    self->fd = fd;
-
     // following is constant for most server applications
     int val = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val))) {
+        log_error("failed to set SO_REUSEPORT");
+        PyErr_SetString(PyExc_RuntimeError, "setsockopt(SO_REUSEPORT) failed");
+        close(fd);
+        return -1;
+    }
 
     #if _FOO_KV_DEBUG == 1
     log_debug("got past setsockopt()");
@@ -170,14 +123,11 @@ static int foo_kv_server_tp_init(foo_kv_server *self, PyObject *args, PyObject *
     // 0 -> 0.0.0.0
     addr.sin_addr.s_addr = ntohl(0); 
 
-    #if _FOO_KV_DEBUG == 1
-    log_debug("got past setting up addr");
-    #endif
-
     rv = bind(fd, (const struct sockaddr *)&addr, sizeof(addr));
     if (rv) {
         log_error("failed to bind()");
         PyErr_SetString(PyExc_ValueError, "bind() failed to connect");
+        close(fd);
         return -1;
     }
 
@@ -190,6 +140,7 @@ static int foo_kv_server_tp_init(foo_kv_server *self, PyObject *args, PyObject *
     if (rv) {
         log_error("failed to listen()");
         PyErr_SetString(PyExc_ValueError, "listen() failed to start");
+        close(fd);
         return -1;
     }
 
@@ -197,13 +148,133 @@ static int foo_kv_server_tp_init(foo_kv_server *self, PyObject *args, PyObject *
     log_debug("got past listen()");
     #endif
 
+    fd_set_nb(fd);
+
+    return fd;
+
+}
+
+static int foo_kv_server_tp_init(foo_kv_server *self, PyObject *args, PyObject *kwargs) {
+
+    if (ensure_py_deps()) {
+        return -1;
+    }
+
+    #if _FOO_KV_DEBUG == 1
+    char debug_buff[256];
+    log_debug("got past ensure_py_deps()");
+    #endif
+
+    int port, num_threads;
+    int reuseport = 0;
+    int use_io_uring = 0;
+    unsigned long long maxmemory = 0;
+    const char *policy_name = "noeviction";
+    int use_index = 0;
+
+    static char *kwlist[] = {"port", "num_threads", "reuseport", "io_uring", "maxmemory", "maxmemory_policy", "index", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ii|ppKsp", kwlist, &port, &num_threads, &reuseport, &use_io_uring, &maxmemory, &policy_name, &use_index)) {
+        return -1;
+    }
+
+    int32_t policy = 0;
+    while (policy < STORAGE_NUM_POLICIES && strcmp(policy_name, storage_policy_names[policy])) {
+        policy++;
+    }
+    if (policy == STORAGE_NUM_POLICIES) {
+        PyErr_Format(PyExc_ValueError, "unknown maxmemory_policy: %s", policy_name);
+        return -1;
+    }
+
+    #if _FOO_KV_DEBUG == 1
+    sprintf(debug_buff, "got past arg parsing: got port: %d, num_threads: %d", port, num_threads);
+    log_debug(debug_buff);
+    #endif
+
+    if (num_threads < 2 || num_threads > 16) {
+        return -1;
+    }
+    self->num_threads = num_threads;
+
+    // the level only changes how much gets logged, so it is read once here
+    // instead of asking the logger, under the GIL, for every debug message
+    log_refresh_level();
+
+    self->storage = storage_new();
+    if (!self->storage) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    storage_set_maxmemory(self->storage, maxmemory, policy);
+    if (use_index && storage_enable_index(self->storage)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    // dispatch() can set ttls as soon as the server accepts connections, so
+    // this can't wait for storage_ttl_loop() to start
+    self->storage_ttl_heap = foo_kv_ttl_heap_new();
+    if (!self->storage_ttl_heap) {
+        return -1;
+    }
+    self->lock_ttl_heap = foo_kv_ttl_heap_new();
+    if (!self->lock_ttl_heap) {
+        return -1;
+    }
+    self->user_locks = locks_new();
+    if (!self->user_locks) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    // the poll loop and the storage ttl loop take two of the threads
+    self->scheduler = scheduler_new(num_threads > 3 ? num_threads - 2 : 1);
+    if (!self->scheduler) {
+        return -1;
+    }
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("got past py member init");
+    #endif
+
+    self->port = port;
+    self->reuseport = reuseport;
+    // the io_uring backend only applies to the shared poll loop
+    self->io_uring = 0;
+
+    if (reuseport) {
+        // every reactor_loop() opens its own listening socket and connection table
+        self->fd = -1;
+        self->fd_to_conn = NULL;
+        self->reactor = NULL;
+        return 0;
+    }
+
+    int fd = listen_on_port(port, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    self->fd = fd;
+
     self->fd_to_conn = PyMem_RawCalloc(1, sizeof(struct connarray_t));
     if (connarray_init(self->fd_to_conn, 8)) {
         log_error("PyMem_RawCalloc() failed to allocate memory");
         return -1;
     }
-    
-    fd_set_nb(fd);
+
+    self->reactor = reactor_new(fd, self->fd_to_conn);
+    if (!self->reactor) {
+        PyErr_SetString(PyExc_RuntimeError, "failed to create the epoll reactor");
+        return -1;
+    }
+
+    if (use_io_uring) {
+        if (reactor_enable_uring(self->reactor) < 0) {
+            log_warning("io_uring is not available, falling back to epoll");
+        } else {
+            self->io_uring = 1;
+            log_info("using the io_uring backend");
+        }
+    }
 
     return 0;
 
@@ -390,6 +461,61 @@ static PyObject *foo_kv_function_hash(PyObject *self, PyObject *const *args, Py_
 
 }
 
+static PyObject *foo_kv_function_hash64(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+
+    if (nargs < 1 || nargs > 2) {
+        PyErr_SetString(PyExc_TypeError, "wrong number of arguments to `hash64`, expects 1 or 2.");
+        return NULL;
+    }
+
+    char *buff;
+    Py_ssize_t len;
+    if (PyBytes_AsStringAndSize(args[0], &buff, &len) < 0) {
+        return NULL;
+    }
+
+    // the storage's seed unless one is given
+    uint64_t seed = hash64_seed;
+    if (nargs == 2) {
+        seed = PyLong_AsUnsignedLongLongMask(args[1]);
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+
+    return PyLong_FromUnsignedLongLong(hash64((uint8_t *)buff, len, seed));
+
+}
+
+static PyObject *foo_kv_function_track_allocations(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+
+    if (nargs != 0) {
+        PyErr_SetString(PyExc_TypeError, "wrong number of arguments to `track_allocations`, expects 0.");
+        return NULL;
+    }
+
+    alloc_counts_track();
+
+    Py_RETURN_NONE;
+
+}
+
+static PyObject *foo_kv_function_allocation_counts(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+
+    if (nargs != 0) {
+        PyErr_SetString(PyExc_TypeError, "wrong number of arguments to `allocation_counts`, expects 0.");
+        return NULL;
+    }
+
+    // read every counter before building the result, which allocates itself
+    unsigned long long raw = alloc_counts_get(ALLOC_DOMAIN_RAW);
+    unsigned long long mem = alloc_counts_get(ALLOC_DOMAIN_MEM);
+    unsigned long long obj = alloc_counts_get(ALLOC_DOMAIN_OBJ);
+
+    return Py_BuildValue("{sKsKsK}", "raw", raw, "mem", mem, "obj", obj);
+
+}
+
 // server public methods
 // following 
 static PyObject *foo_kv_server_tp_method_poll_loop(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
@@ -399,6 +525,11 @@ static PyObject *foo_kv_server_tp_method_poll_loop(PyObject *self, PyObject *con
         return NULL;
     }
 
+    if (((foo_kv_server *)self)->reuseport) {
+        PyErr_SetString(PyExc_RuntimeError, "poll_loop() is not used in reuseport mode, use reactor_loop().");
+        return NULL;
+    }
+
     poll_loop((foo_kv_server *)self);
 
     Py_RETURN_NONE;
@@ -412,148 +543,219 @@ static PyObject *foo_kv_server_tp_method_io_loop(PyObject *self, PyObject *const
         return NULL;
     }
 
+    if (((foo_kv_server *)self)->reuseport) {
+        PyErr_SetString(PyExc_RuntimeError, "io_loop() is not used in reuseport mode, use reactor_loop().");
+        return NULL;
+    }
+
     io_loop((foo_kv_server *)self);
 
     Py_RETURN_NONE;
 
 }
 
-// helper methods
-static void *poll_loop(foo_kv_server *kv_self) {
+static PyObject *foo_kv_server_tp_method_reactor_loop(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
 
-    struct connarray_t *fd_to_conn = kv_self->fd_to_conn;
+    if (nargs != 0) {
+        PyErr_SetString(PyExc_TypeError, "reactor_loop() expects no arguments.");
+        return NULL;
+    }
 
-    nfds_t poll_args_size = 0;
-    struct pollfd *poll_args = (struct pollfd *)PyMem_RawCalloc(1, sizeof(struct pollfd));
+    if (!((foo_kv_server *)self)->reuseport) {
+        PyErr_SetString(PyExc_RuntimeError, "reactor_loop() is only used in reuseport mode.");
+        return NULL;
+    }
+
+    reactor_loop((foo_kv_server *)self);
+
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+
+}
+
+// helper methods
+static int32_t enqueue_waiting_conn(foo_kv_server *kv_self, struct conn_t *conn) {
+    // queues a connection for the io workers, preferably the one that served it last
+
+    if (scheduler_submit(kv_self->scheduler, conn)) {
+        log_error("poll_loop(): failed to queue connection for the io workers");
+        return -1;
+    }
 
-    int32_t has_lock;
-    // keep track of number of active connections
     #if _FOO_KV_POLL_DEBUG == 1
-    int32_t max_io_workers = kv_self->num_threads - 2;
+    char debug_buff[256];
+    sprintf(debug_buff, "poll_loop(): conn_fd: %d: queued for the io workers", conn->fd);
+    log_debug(debug_buff);
     #endif
-    int32_t num_active = 0;
-    int32_t poll_timeout = 0;
-    // return value for poll
-    int rv;
+
+    return 0;
+
+}
+
+static void *uring_poll_loop(foo_kv_server *kv_self) {
+    // poll_loop() for the io_uring backend
+    // receives and sends are submitted to the ring, so each iteration is a single
+    // io_uring_enter() that submits every pending send and recv and waits for
+    // completions, however many connections are active
+
+    struct reactor_t *reactor = kv_self->reactor;
+    struct connarray_t *fd_to_conn = kv_self->fd_to_conn;
+
+    int32_t has_pending_accept, num_ready;
+    int32_t conn_fd;
 
     #if _FOO_KV_POLL_DEBUG == 1
     char debug_buff[256];
-    log_debug("poll_loop(): got past initialize variables");
+    log_debug("uring_poll_loop(): got past initialize variables");
     #endif
 
-    // the event loop
     while (1) {
 
+        if (reactor_uring_wait(reactor, REACTOR_TIMEOUT_MS) < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "io_uring_enter()");
+            return NULL;
+        }
+
+        has_pending_accept = 0;
+        int32_t ncqes = reactor_uring_process(reactor, &has_pending_accept);
+        if (ncqes < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "failed to process io_uring completions");
+            return NULL;
+        }
+
         #if _FOO_KV_POLL_DEBUG == 1
-        log_debug("poll_loop(): beginning of poll_loop()");
+        sprintf(debug_buff, "uring_poll_loop(): processed %d completions, %d total connections", ncqes, fd_to_conn->size);
+        log_debug(debug_buff);
         #endif
-        num_active = 0;
 
-        PyMem_RawFree(poll_args); 
-        poll_args = PyMem_RawCalloc(fd_to_conn->size + 1, sizeof(struct pollfd));
-        poll_args_size = 0;
+        // queue sends for (or remove) the connections the io workers are done with
+        if (reactor_drain_returned(reactor) < 0) {
+            log_error("uring_poll_loop(): failed to drain returned connections");
+            return NULL;
+        }
 
-        // for convenience, the listening fd is put in the first position
-        struct pollfd pfd = {kv_self->fd, POLLIN, 0};
-        poll_args[poll_args_size] = pfd;
-        poll_args_size++;
+        // accept new connections
+        if (has_pending_accept && reactor_accept(reactor) < 0) {
+            log_error("uring_poll_loop(): reactor_accept() failed");
+        }
 
-        // connection fds
-        for (int32_t ix = 0; ix < fd_to_conn->maxsize; ix++) {
-            struct conn_t *conn = fd_to_conn->arr[ix];
+        num_ready = 0;
+        while ((conn_fd = intq_get(reactor->ready_conns)) >= 0) {
+            struct conn_t *conn = fd_to_conn->arr[conn_fd];
             if (!conn) {
                 continue;
             }
-            #if _FOO_KV_POLL_DEBUG == 1
-            sprintf(debug_buff, "poll_loop(): conn_fd: %d: got non-null conn", conn->fd);
-            log_debug(debug_buff);
-            #endif
-            int events = 0;
-            switch (conn->state) {
-                case STATE_REQ:
-                case STATE_RES:
-                case STATE_DISPATCH:
-                    #if _FOO_KV_POLL_DEBUG == 1
-                    sprintf(debug_buff, "poll_loop(): conn_fd: %d: found connection with active request", conn->fd);
-                    log_debug(debug_buff);
-                    #endif
-                    num_active++;
-                    continue;
-                case STATE_END:
-                    #if _FOO_KV_POLL_DEBUG == 1
-                    sprintf(debug_buff, "poll_loop(): conn_fd: %d: found ended connection but it is not flagged for termination", conn->fd);
-                    log_debug(debug_buff);
-                    #endif
-                    continue;
-                case STATE_TERM:
-                    #if _FOO_KV_POLL_DEBUG == 1
-                    sprintf(debug_buff, "poll_loop(): conn_fd: %d: found connection flagged for termination", conn->fd);
-                    log_debug(debug_buff);
-                    #endif
-                    connarray_remove(fd_to_conn, conn);
-                    continue;
-                case STATE_REQ_WAITING:
-                    #if _FOO_KV_POLL_DEBUG == 1
-                    sprintf(debug_buff, "poll_loop(): conn_fd: %d: connection waiting for incoming data", conn->fd);
-                    log_debug(debug_buff);
-                    #endif
-                    events = POLLIN;
-                    break;
-                case STATE_RES_WAITING:
-                    #if _FOO_KV_POLL_DEBUG == 1
-                    sprintf(debug_buff, "poll_loop(): conn_fd: %d: connection waiting for outgoing data", conn->fd);
-                    log_debug(debug_buff);
-                    #endif
-                    events = POLLOUT;
-                    break;
-                default:
-                    log_error("poll_loop(): got invalid state");
-                    return NULL;
+            if (enqueue_waiting_conn(kv_self, conn) < 0) {
+                return NULL;
             }
-            struct pollfd pfd = {};
-            pfd.fd = conn->fd;
-            pfd.events = events;
-            pfd.events = events | POLLERR;
-            poll_args[poll_args_size] = pfd;
-            poll_args_size++;
+            num_ready++;
         }
 
         #if _FOO_KV_POLL_DEBUG == 1
-        sprintf(debug_buff, "poll_loop(): got %d/%d active io workers, %d waiting connections, %d total connections",
-                num_active, max_io_workers, (int)poll_args_size - 1, fd_to_conn->size);
+        sprintf(debug_buff, "uring_poll_loop(): end of loop: %d connections newly ready", num_ready);
         log_debug(debug_buff);
         #endif
 
-        // poll for active fds
-        poll_timeout = 1000;
+    }
+
+    return NULL;
+
+}
+
+static void *poll_loop(foo_kv_server *kv_self) {
+
+    if (kv_self->reactor->uring) {
+        return uring_poll_loop(kv_self);
+    }
+
+    struct reactor_t *reactor = kv_self->reactor;
+    struct connarray_t *fd_to_conn = kv_self->fd_to_conn;
+
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    int32_t has_lock;
+    int32_t nevents;
+    int32_t poll_timeout = REACTOR_TIMEOUT_MS;
+    int32_t num_ready;
+    int32_t has_pending_accept;
+
+    #if _FOO_KV_POLL_DEBUG == 1
+    char debug_buff[256];
+    log_debug("poll_loop(): got past initialize variables");
+    #endif
+
+    // the event loop
+    // connections are registered with epoll once, when they are accepted, so each
+    // iteration only costs as much as the number of connections that had events
+    while (1) {
+
         #if _FOO_KV_POLL_DEBUG == 1
-        sprintf(debug_buff, "poll_loop: about to call poll(timeout=%d)", poll_timeout);
+        sprintf(debug_buff, "poll_loop: about to call epoll_wait(timeout=%d)", poll_timeout);
         log_debug(debug_buff);
         #endif
-        Py_BEGIN_ALLOW_THREADS
-        rv = poll(poll_args, poll_args_size, poll_timeout);
-        Py_END_ALLOW_THREADS
-        if (rv < 0) {
-            PyErr_SetString(PyExc_RuntimeError, "poll()");
+        nevents = reactor_wait(reactor, events, REACTOR_MAX_EVENTS, poll_timeout);
+        if (nevents < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "epoll_wait()");
             return NULL;
         }
 
         #if _FOO_KV_POLL_DEBUG == 1
-        log_debug("poll_loop(): called poll()");
+        sprintf(debug_buff, "poll_loop(): epoll_wait() reported %d events, %d total connections", nevents, fd_to_conn->size);
+        log_debug(debug_buff);
         #endif
 
+        // re-arm or clean up the connections the io workers are done with
+        for (int32_t ix = 0; ix < nevents; ix++) {
+            if (events[ix].data.fd == reactor->wake_fd) {
+                if (reactor_clear_wake(reactor) < 0) {
+                    return NULL;
+                }
+                break;
+            }
+        }
+        if (reactor_drain_returned(reactor) < 0) {
+            log_error("poll_loop(): failed to drain returned connections");
+            return NULL;
+        }
+
+        num_ready = 0;
+        has_pending_accept = 0;
+
+        // connections whose user lock wait is over
+        int32_t conn_fd;
+        while ((conn_fd = intq_get(reactor->ready_conns)) >= 0) {
+            struct conn_t *conn = fd_to_conn->arr[conn_fd];
+            if (!conn) {
+                continue;
+            }
+            if (enqueue_waiting_conn(kv_self, conn) < 0) {
+                return NULL;
+            }
+            num_ready++;
+        }
+
         // process active connections
-        // TODO comments
-        for (nfds_t ix = 1; ix < poll_args_size; ix++) {
-            if (!poll_args[ix].revents) {
+        for (int32_t ix = 0; ix < nevents; ix++) {
+
+            int fd = events[ix].data.fd;
+
+            if (fd == reactor->listen_fd) {
+                has_pending_accept = 1;
                 continue;
             }
-            struct conn_t *conn = fd_to_conn->arr[poll_args[ix].fd];
+            if (fd == reactor->wake_fd) {
+                continue;
+            }
+
+            struct conn_t *conn = (fd < fd_to_conn->maxsize) ? fd_to_conn->arr[fd] : NULL;
             if (!conn) {
                 log_error("poll_loop(): connection object of active fd became null");
                 continue;
             }
-            has_lock = sem_trywait(conn->lock);
+            has_lock = sem_trywait(&conn->lock);
             if (has_lock < 0) {
                 if (errno == EINVAL) {
                     log_error("poll_loop(): sem_trywait() failed");
@@ -570,106 +772,34 @@ static void *poll_loop(foo_kv_server *kv_self) {
                 conn->state = STATE_RES;
                 is_waiting = 1;
             }
-            if (sem_post(conn->lock)) {
+            if (sem_post(&conn->lock)) {
                 log_error("poll_loop(): sem_post() failed");
                 return NULL;
             }
-            if (is_waiting) {
-                #if _FOO_KV_POLL_DEBUG == 1
-                sprintf(debug_buff, "poll_loop(): conn_fd: %d: about to acquire waiting_conns_lock", conn->fd);
-                log_debug(debug_buff);
-                #endif
-                if (threadsafe_sem_wait(kv_self->waiting_conns_lock)) {
-                    log_error("poll_loop(): sem_wait() failed");
-                    return NULL;
-                }
-                #if _FOO_KV_POLL_DEBUG == 1
-                sprintf(debug_buff, "poll_loop(): conn_fd: %d: successfully acquired waiting_conns_lock", conn->fd);
-                log_debug(debug_buff);
-                #endif
-                if (intq_put(kv_self->waiting_conns, conn->fd)) {
-                    log_error("poll_loop(): failed to enqueue connection");
-                    return NULL;
-                }
-
-                if (sem_post(kv_self->waiting_conns_lock)) {
-                    log_error("poll_loop(): sem_post() failed");
-                    return NULL;
-                }
-                #if _FOO_KV_POLL_DEBUG == 1
-                sprintf(debug_buff, "poll_loop(): conn_fd: %d: released waiting_conns_lock", conn->fd);
-                log_debug(debug_buff);
-                #endif
-
-                // notify other threads that a connection is ready
-                if (cond_notify(kv_self->waiting_conns_ready_cond)) {
-                    log_error("poll_loop(): cond_notify() failed.");
-                    return NULL;
-                }
-
+            if (!is_waiting) {
+                // registrations are one-shot, so this should not happen
                 #if _FOO_KV_POLL_DEBUG == 1
-                sprintf(debug_buff, "poll_loop(): conn_fd: %d: notified waiting_conns_ready_cond", conn->fd);
-                log_debug(debug_buff);
+                sprintf(debug_buff, "poll_loop(): conn_fd: %d: got event for connection that is not waiting: state: %d", conn->fd, conn->state);
+                log_warning(debug_buff);
                 #endif
+                continue;
+            }
 
-            } // end of is waiting block
-
-        } // end of loop
-
-        int32_t is_queue_empty = 0;
-
-        // give another notify, just to be safe
-        #if _FOO_KV_POLL_DEBUG == 1
-        sprintf(debug_buff, "poll_loop(): check waiting conns queue: about to acquire waiting_conns_lock");
-        log_debug(debug_buff);
-        #endif
-        if (threadsafe_sem_wait(kv_self->waiting_conns_lock)) {
-            log_error("poll_loop(): sem_wait() failed");
-            return NULL;
-        }
-        #if _FOO_KV_POLL_DEBUG == 1
-        sprintf(debug_buff, "poll_loop(): check waiting conns queue: successfully acquired waiting_conns_lock");
-        log_debug(debug_buff);
-        #endif
-        is_queue_empty = intq_empty(kv_self->waiting_conns);
-
-        if (sem_post(kv_self->waiting_conns_lock)) {
-            log_error("poll_loop(): sem_post() failed");
-            return NULL;
-        }
-        #if _FOO_KV_POLL_DEBUG == 1
-        sprintf(debug_buff, "poll_loop(): check waiting conns queue: released waiting_conns_lock");
-        log_debug(debug_buff);
-        #endif
-
-        // notify other threads that a connection is ready
-        if (!is_queue_empty) {
-            #if _FOO_KV_POLL_DEBUG == 1
-            sprintf(debug_buff, "poll_loop(): check waiting conns queue: queue is not empty, notifying");
-            log_debug(debug_buff);
-            #endif
-            if (cond_notify(kv_self->waiting_conns_ready_cond)) {
-                log_error("poll_loop(): cond_notify() failed.");
+            if (enqueue_waiting_conn(kv_self, conn) < 0) {
                 return NULL;
             }
-        } else {
-            #if _FOO_KV_POLL_DEBUG == 1
-            sprintf(debug_buff, "poll_loop(): check waiting conns queue: queue is empty, not notifying");
-            log_debug(debug_buff);
-            #endif
-        }
+            num_ready++;
 
-        #if _FOO_KV_POLL_DEBUG == 1
-        log_debug("poll_loop(): about to accept new connections");
-        #endif
+        } // end of loop
 
         // accept new connections
-        if (poll_args[0].revents) {
-            while (accept_new_conn(fd_to_conn, kv_self->fd) < 0) {}
+        if (has_pending_accept && reactor_accept(reactor) < 0) {
+            log_error("poll_loop(): reactor_accept() failed");
         }
 
         #if _FOO_KV_POLL_DEBUG == 1
-        log_debug("poll_loop(): end of loop");
+        sprintf(debug_buff, "poll_loop(): end of loop: %d connections newly ready", num_ready);
+        log_debug(debug_buff);
         #endif
 
     }
@@ -682,9 +812,16 @@ static void *io_loop(foo_kv_server *kv_self) {
 
     struct connarray_t *fd_to_conn = kv_self->fd_to_conn;
 
+    int32_t worker = scheduler_register_worker(kv_self->scheduler);
+    if (worker < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "io_loop(): more io workers than the server has threads for");
+        return NULL;
+    }
+
     #if _FOO_KV_IO_DEBUG == 1
     char debug_buff[256];
-    log_debug("io_loop(): got past initialization");
+    sprintf(debug_buff, "io_loop(): got past initialization: worker: %d", worker);
+    log_debug(debug_buff);
     #endif
 
     while (1) {
@@ -693,91 +830,26 @@ static void *io_loop(foo_kv_server *kv_self) {
         log_debug("io_loop(): beginning of loop");
         #endif
 
-        // need to acquire lock every time we do a waiting_conns operation
-        #if _FOO_KV_IO_DEBUG == 1
-        log_debug("io_loop(): about to acquire waiting_conns_lock");
-        #endif
-        if (threadsafe_sem_wait(kv_self->waiting_conns_lock)) {
-            log_error("io_loop(): sem_wait() failed");
-            return NULL;
-        }
-        #if _FOO_KV_IO_DEBUG == 1
-        log_debug("io_loop(): successfully acquired waiting_conns_lock");
-        #endif
-        // check if deq still has len
-        if (intq_empty(kv_self->waiting_conns)) {
-
-            // we might have to wait a while
-            // first, release lock
-            if (sem_post(kv_self->waiting_conns_lock)) {
-                log_error("io_loop(): sem_post() failed");
-                return NULL;
-            }
-            #if _FOO_KV_IO_DEBUG == 1
-            log_debug("io_loop(): released waiting_conns_lock");
-            #endif
-
-            // waiting_conns_ready_cond will be released when there are items on the q
-            #if _FOO_KV_IO_DEBUG == 1
-            log_debug("io_loop(): about to wait for waiting_conns_ready_cond");
-            #endif
-            if (cond_wait(kv_self->waiting_conns_ready_cond)) {
-                log_error("io_loop(): cond_wait() failed");
-                return NULL;
-            }
-
-            #if _FOO_KV_IO_DEBUG == 1
-            log_debug("io_loop(): got notified by waiting_conns_ready_cond");
-            #endif
-
-            #if _FOO_KV_IO_DEBUG == 1
-            log_debug("io_loop(): about to acquire waiting_conns_lock");
-            #endif
-            if (threadsafe_sem_wait(kv_self->waiting_conns_lock)) {
-                log_error("io_loop(): sem_wait() failed");
-                return NULL;
-            }
-            #if _FOO_KV_IO_DEBUG == 1
-            log_debug("io_loop(): successfully acquired waiting_conns_lock");
-            #endif
-            // check if deq still has len
-            if (intq_empty(kv_self->waiting_conns)) {
-                // whoops, another thread got here first, reiterate
-                if (sem_post(kv_self->waiting_conns_lock)) {
-                    log_error("io_loop(): sem_post() failed");
-                    return NULL;
-                }
-                #if _FOO_KV_IO_DEBUG == 1
-                log_debug("io_loop(): released waiting_conns_cond");
-                log_debug("io_loop(): found empty deque after getting waiting conns notification");
-                #endif
-                continue;
-            }
-
-        } // end if 0 len
-
-        // if we get here, we should always have the waiting conns lock
-        int32_t conn_fd = intq_get(kv_self->waiting_conns);
-        if (sem_post(kv_self->waiting_conns_lock)) {
-            log_error("io_loop(): sem_post() failed");
-            return NULL;
+        // parks while neither this worker's queue nor any other has work for it
+        int32_t conn_fd = scheduler_next(kv_self->scheduler, worker, REACTOR_TIMEOUT_MS);
+        if (conn_fd < 0) {
+            // timed out, or another worker took the connection we were woken up for
+            continue;
         }
         #if _FOO_KV_IO_DEBUG == 1
-        log_debug("io_loop(): released waiting_conns_cond");
+        sprintf(debug_buff, "io_loop(): conn_fd: %d: worker %d took connection from the scheduler", conn_fd, worker);
+        log_debug(debug_buff);
         #endif
-        if (conn_fd < 0) {
-            log_error("io_loop(): failed get from deque: this should never happen if the empty checks and locks worked as intended");
-            return NULL;
-        }
         struct conn_t *conn = fd_to_conn->arr[conn_fd];
         if (!conn) {
             #if _FOO_KV_IO_DEBUG == 1
-            sprintf(debug_buff, "io_loop(): conn_fd: %d: pop from waiting conns queue corresponds to null connection, perhaps this is expected", conn_fd);
+            sprintf(debug_buff, "io_loop(): conn_fd: %d: connection from the scheduler corresponds to null connection, perhaps this is expected", conn_fd);
             log_debug(debug_buff);
             #endif
             continue;
         }
-        if (connection_io(kv_self, conn) < 0) {
+        int32_t io_res = connection_io(kv_self, conn);
+        if (io_res < 0) {
             if (PyErr_Occurred()) {
                 #if _FOO_KV_IO_DEBUG == 1
                 sprintf(debug_buff, "io_loop(): conn_fd: %d: connection_io() reported py error", conn_fd);
@@ -798,6 +870,16 @@ static void *io_loop(foo_kv_server *kv_self) {
         if (conn->state == STATE_END) {
             conn->state = STATE_TERM;
         }
+        if (io_res != 1) {
+            // queue its next request on this worker too
+            conn->worker = worker;
+        }
+
+        // hand the connection back so the reactor can re-arm or remove it
+        if (io_res != 1 && reactor_return_conn(kv_self->reactor, conn) < 0) {
+            log_error("io_loop(): failed to return connection to the reactor");
+            return NULL;
+        }
 
     } // end primary loop
 
@@ -805,28 +887,152 @@ static void *io_loop(foo_kv_server *kv_self) {
 
 }
 
-static PyObject *foo_kv_server_tp_method_storage_ttl_loop(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+static void *reactor_loop(foo_kv_server *kv_self) {
+    // reuseport mode: this thread owns a listening socket, an epoll instance and
+    // a connection table, and serves its connections start to finish without
+    // handing them to any other thread
 
-    if (nargs != 0) {
-        PyErr_SetString(PyExc_TypeError, "ttl_loop expects no arguments.");
+    int fd = listen_on_port(kv_self->port, 1);
+    if (fd < 0) {
         return NULL;
     }
 
-    #if _FOO_KV_DEBUG == 1
-    log_debug("storage_ttl_loop(): starting");
+    struct connarray_t *fd_to_conn = PyMem_RawCalloc(1, sizeof(struct connarray_t));
+    if (!fd_to_conn || connarray_init(fd_to_conn, 8)) {
+        log_error("reactor_loop(): PyMem_RawCalloc() failed to allocate memory");
+        PyMem_RawFree(fd_to_conn);
+        close(fd);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    struct reactor_t *reactor = reactor_new(fd, fd_to_conn);
+    if (!reactor) {
+        connarray_dealloc(fd_to_conn);
+        close(fd);
+        PyErr_SetString(PyExc_RuntimeError, "failed to create the epoll reactor");
+        return NULL;
+    }
+
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int32_t nevents, has_pending_accept, has_resumed_conns;
+
+    #if _FOO_KV_IO_DEBUG == 1
+    char debug_buff[256];
+    sprintf(debug_buff, "reactor_loop(): listening on fd: %d", fd);
+    log_debug(debug_buff);
     #endif
 
-    foo_kv_server *kv_self = (foo_kv_server *)self;
+    while (1) {
+
+        nevents = reactor_wait(reactor, events, REACTOR_MAX_EVENTS, REACTOR_TIMEOUT_MS);
+        if (nevents < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "epoll_wait()");
+            break;
+        }
+
+        has_pending_accept = 0;
+        has_resumed_conns = 0;
+
+        for (int32_t ix = 0; ix < nevents; ix++) {
+
+            int conn_fd = events[ix].data.fd;
+
+            if (conn_fd == fd) {
+                has_pending_accept = 1;
+                continue;
+            }
+            if (conn_fd == reactor->wake_fd) {
+                // connections parked on a user lock are handed back by whoever
+                // ends their wait, and served once the events are
+                reactor_clear_wake(reactor);
+                has_resumed_conns = 1;
+                continue;
+            }
+
+            struct conn_t *conn = (conn_fd < fd_to_conn->maxsize) ? fd_to_conn->arr[conn_fd] : NULL;
+            if (!conn) {
+                log_error("reactor_loop(): connection object of active fd became null");
+                continue;
+            }
+
+            if (conn->state == STATE_REQ_WAITING) {
+                conn->state = STATE_REQ;
+            } else if (conn->state == STATE_RES_WAITING) {
+                conn->state = STATE_RES;
+            }
+
+            if (connection_io(kv_self, conn) < 0) {
+                if (PyErr_Occurred()) {
+                    log_error("reactor_loop(): connection_io() reported py error");
+                    goto REACTOR_LOOP_END;
+                }
+                #if _FOO_KV_IO_DEBUG == 1
+                sprintf(debug_buff, "reactor_loop(): conn_fd: %d: connection_io() returned error", conn_fd);
+                log_error(debug_buff);
+                #endif
+            }
+
+            if (conn->state == STATE_END) {
+                conn->state = STATE_TERM;
+            }
+
+            reactor_settle_conn(reactor, conn);
+
+        }
+
+        if (has_resumed_conns) {
+            // settling them queues them on ready_conns
+            reactor_drain_returned(reactor);
+        }
+        // drained after every batch, not only after a wake: parking a
+        // connection whose lock was granted before it was parked queues it
+        // here without one
+        int32_t ready_fd;
+        while ((ready_fd = intq_get(reactor->ready_conns)) >= 0) {
+            struct conn_t *conn = fd_to_conn->arr[ready_fd];
+            if (!conn) {
+                continue;
+            }
+            if (connection_io(kv_self, conn) < 0 && PyErr_Occurred()) {
+                log_error("reactor_loop(): connection_io() reported py error");
+                goto REACTOR_LOOP_END;
+            }
+            if (conn->state == STATE_END) {
+                conn->state = STATE_TERM;
+            }
+            reactor_settle_conn(reactor, conn);
+        }
+
+        if (has_pending_accept && reactor_accept(reactor) < 0) {
+            log_error("reactor_loop(): reactor_accept() failed");
+        }
+
+    }
+
+REACTOR_LOOP_END:
+
+    reactor_dealloc(reactor);
+    connarray_dealloc(fd_to_conn);
+    close(fd);
 
-    kv_self->storage_ttl_heap = foo_kv_ttl_heap_new();
-    if (!kv_self->storage_ttl_heap) {
+    return NULL;
+
+}
+
+static PyObject *foo_kv_server_tp_method_storage_ttl_loop(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+
+    if (nargs != 0) {
+        PyErr_SetString(PyExc_TypeError, "ttl_loop expects no arguments.");
         return NULL;
     }
 
     #if _FOO_KV_DEBUG == 1
-    log_debug("storage_ttl_loop(): got past init");
+    log_debug("storage_ttl_loop(): starting");
     #endif
 
+    foo_kv_server *kv_self = (foo_kv_server *)self;
+
     while (1) {
         #if _FOO_KV_DEBUG == 1
         log_debug("storage_ttl_loop(): beginning of loop");
@@ -838,29 +1044,115 @@ static PyObject *foo_kv_server_tp_method_storage_ttl_loop(PyObject *self, PyObje
             return NULL;
         }
 
-        if (threadsafe_sem_wait(kv_self->storage_lock)) {
+        // the key is the wire encoding of the client's key, like in the storage
+        const uint8_t *key = (const uint8_t *)PyBytes_AS_STRING(expired_key);
+        uint16_t key_len = (uint16_t)PyBytes_GET_SIZE(expired_key);
+
+        uint64_t hash = storage_hash(key, key_len);
+        struct storage_shard_t *shard = storage_shard(kv_self->storage, hash);
+        if (storage_shard_lock(shard)) {
             log_error("storage_ttl_loop(): unable to acquire storage lock, unable to expire key");
+            Py_DECREF(expired_key);
             continue;
         }
 
-        int32_t del_result = _pyobject_safe_delitem(kv_self->storage, expired_key);
-        if (del_result < 0) {
-            log_error("storage_ttl_loop(): delete operation failed!");
-            // not sure what would be the best mitigation here?
-            return NULL;
+        // a key that was deleted and stored again without a ttl since
+        // must not expire, and neither must one whose ttl was pushed back.
+        // the heap is updated after the shard is unlocked, so two writes of
+        // the key can update it in the other order and leave the earlier ttl
+        // on it, in which case the key goes back on it for its own ttl.
+        struct storage_entry_t *removed = NULL;
+        time_t pushed_back = 0;
+        struct storage_entry_t *entry = storage_find(shard, hash, key, key_len);
+        if (entry && entry->has_ttl && entry->expires <= time(NULL)) {
+            removed = storage_remove(shard, hash, key, key_len);
+        } else if (entry && entry->has_ttl) {
+            pushed_back = entry->expires;
         }
-        if (del_result == 0) {
-            #if _FOO_KV_DEBUG == 1
+
+        storage_shard_unlock(shard);
+
+        if (pushed_back && foo_kv_ttl_heap_put(kv_self->storage_ttl_heap, expired_key, pushed_back)) {
+            log_error("storage_ttl_loop(): unable to put back the ttl of a key");
+            if (PyErr_Occurred()) {
+                PyErr_Clear();
+            }
+        }
+
+        #if _FOO_KV_DEBUG == 1
+        if (!removed) {
             log_debug("storage_ttl_loop(): expired key was not found in storage, unable to expire, perhaps this is expected");
-            #endif
-            // just log, still need to execute the following `sem_post` statement
         }
+        #endif
 
-        if (sem_post(kv_self->storage_lock)) {
-            log_error("storage_ttl_loop(): unable to release storage lock!");
+        storage_entry_free(removed);
+        Py_DECREF(expired_key);
+
+    }
+
+    return NULL;
+
+}
+
+static PyObject *foo_kv_server_tp_method_lock_ttl_loop(PyObject *self, PyObject *const *args, Py_ssize_t nargs) {
+
+    if (nargs != 0) {
+        PyErr_SetString(PyExc_TypeError, "lock_ttl_loop expects no arguments.");
+        return NULL;
+    }
+
+    #if _FOO_KV_DEBUG == 1
+    log_debug("lock_ttl_loop(): starting");
+    #endif
+
+    foo_kv_server *kv_self = (foo_kv_server *)self;
+    struct locks_t *locks = kv_self->user_locks;
+
+    while (1) {
+        PyObject *expired_key = foo_kv_ttl_heap_get(kv_self->lock_ttl_heap);
+
+        if (!expired_key) {
+            log_error("lock_ttl_loop(): got NULL key!");
             return NULL;
         }
 
+        // a lock's name for its lease, a 0 byte and its name for its waits
+        const uint8_t *name = (const uint8_t *)PyBytes_AS_STRING(expired_key);
+        uint16_t name_len = (uint16_t)PyBytes_GET_SIZE(expired_key);
+        int32_t is_timeout = name_len && !name[0];
+        if (is_timeout) {
+            name += sizeof(char);
+            name_len -= sizeof(char);
+        }
+
+        int32_t reschedule;
+        Py_BEGIN_ALLOW_THREADS
+        if (is_timeout) {
+            struct lock_waiter_t *waiter = locks_timeout(locks, name, name_len, time(NULL));
+            while (waiter) {
+                struct lock_waiter_t *next = waiter->next;
+                lock_waiter_wake(waiter);
+                waiter = next;
+            }
+            reschedule = 1;
+        } else {
+            // a lease that was extended, or a lock that was released and locked
+            // again since, doesn't expire
+            struct lock_waiter_t *granted;
+            int32_t res = locks_expire(locks, name, name_len, time(NULL), &granted);
+            if (granted) {
+                lock_waiter_wake(granted);
+            }
+            reschedule = res == 1 || granted;
+        }
+        // the lease or the waits of the lock that go on
+        if (reschedule) {
+            locks_schedule(locks, kv_self->lock_ttl_heap, name, name_len);
+        }
+        Py_END_ALLOW_THREADS
+
+        Py_DECREF(expired_key);
+
     }
 
     return NULL;
@@ -871,13 +1163,17 @@ static PyObject *foo_kv_server_tp_method_storage_ttl_loop(PyObject *self, PyObje
 static PyMethodDef foo_kv_server_tp_methods[] = {
     {"poll_loop", _PyCFunction_CAST(foo_kv_server_tp_method_poll_loop), METH_FASTCALL, "Start the server operations."},
     {"io_loop", _PyCFunction_CAST(foo_kv_server_tp_method_io_loop), METH_FASTCALL, "Start the server operations."},
+    {"reactor_loop", _PyCFunction_CAST(foo_kv_server_tp_method_reactor_loop), METH_FASTCALL, "Start a self-contained event loop (reuseport mode)."},
     {"storage_ttl_loop", _PyCFunction_CAST(foo_kv_server_tp_method_storage_ttl_loop), METH_FASTCALL, "Start the ttl operations."},
+    {"lock_ttl_loop", _PyCFunction_CAST(foo_kv_server_tp_method_lock_ttl_loop), METH_FASTCALL, "Start the lock lease and wait timeout operations."},
     {NULL, NULL, 0, NULL}
 };
 
 // define our members
 static PyMemberDef foo_kv_server_tp_members[] = {
     {"num_threads", T_INT, offsetof(foo_kv_server, num_threads), READONLY, ""},
+    {"reuseport", T_INT, offsetof(foo_kv_server, reuseport), READONLY, ""},
+    {"io_uring", T_INT, offsetof(foo_kv_server, io_uring), READONLY, ""},
     {NULL, 0, 0, 0, NULL}
 };
 
@@ -931,6 +1227,9 @@ static PyMethodDef foo_kv_method_def[] = {
     {"loads", _PyCFunction_CAST(foo_kv_function_loads), METH_FASTCALL, "Deserialize user data."},
     {"loads_hashable", _PyCFunction_CAST(foo_kv_function_loads_hashable), METH_FASTCALL, "Deserialize user data, enforces hashable."},
     {"foo_hash", _PyCFunction_CAST(foo_kv_function_hash), METH_FASTCALL, "Get the hash of the user data."},
+    {"hash64", _PyCFunction_CAST(foo_kv_function_hash64), METH_FASTCALL, "Get the seeded hash the storage uses for the bytes."},
+    {"track_allocations", _PyCFunction_CAST(foo_kv_function_track_allocations), METH_FASTCALL, "Start counting allocator calls."},
+    {"allocation_counts", _PyCFunction_CAST(foo_kv_function_allocation_counts), METH_FASTCALL, "Get the allocator calls counted so far, per domain."},
     {NULL, NULL, 0, NULL}
 };
 
@@ -946,6 +1245,21 @@ static struct PyModuleDef foo_kv_module_def = {
 // register our module and add the public methods to it
 PyMODINIT_FUNC PyInit_c(void) {
 
+    hash64_seed_init();
+
+    if (bufpool_init()) {
+        PyErr_SetString(PyExc_RuntimeError, "failed to initialize the buffer pool");
+        return NULL;
+    }
+    if (conn_alloc_init()) {
+        PyErr_SetString(PyExc_RuntimeError, "failed to initialize the connection slabs");
+        return NULL;
+    }
+    if (locks_alloc_init()) {
+        PyErr_SetString(PyExc_RuntimeError, "failed to initialize the lock waiter slab");
+        return NULL;
+    }
+
     // create module
     PyObject *foo_kv_module = PyModule_Create(&foo_kv_module_def);
 
@@ -957,6 +1271,7 @@ PyMODINIT_FUNC PyInit_c(void) {
     PyModule_AddIntConstant(foo_kv_module, "RES_UNKNOWN", RES_UNKNOWN);
     PyModule_AddIntConstant(foo_kv_module, "RES_ERR_SERVER", RES_ERR_SERVER);
     PyModule_AddIntConstant(foo_kv_module, "RES_ERR_CLIENT", RES_ERR_CLIENT);
+    PyModule_AddIntConstant(foo_kv_module, "RES_ERR_MEMORY", RES_ERR_MEMORY);
     PyModule_AddIntConstant(foo_kv_module, "RES_BAD_CMD", RES_BAD_CMD);
     PyModule_AddIntConstant(foo_kv_module, "RES_BAD_TYPE", RES_BAD_TYPE);
     PyModule_AddIntConstant(foo_kv_module, "RES_BAD_KEY", RES_BAD_KEY);
@@ -965,6 +1280,9 @@ PyMODINIT_FUNC PyInit_c(void) {
     PyModule_AddIntConstant(foo_kv_module, "RES_BAD_IX", RES_BAD_IX);
     PyModule_AddIntConstant(foo_kv_module, "RES_BAD_HASH", RES_BAD_HASH);
     PyModule_AddIntConstant(foo_kv_module, "RES_BAD_COLLECTION", RES_BAD_COLLECTION);
+    PyModule_AddIntConstant(foo_kv_module, "RES_BAD_RANGE", RES_BAD_RANGE);
+    PyModule_AddIntConstant(foo_kv_module, "RES_BAD_VERSION", RES_BAD_VERSION);
+    PyModule_AddIntConstant(foo_kv_module, "RES_BAD_LOCK", RES_BAD_LOCK);
 
     // add other constants
     PyModule_AddIntConstant(foo_kv_module, "MAX_MSG_SIZE", MAX_MSG_SIZE);
@@ -8,15 +8,22 @@
 
 // python server methods
 static void *poll_loop(foo_kv_server *kv_self);
+static void *uring_poll_loop(foo_kv_server *kv_self);
+static int32_t enqueue_waiting_conn(foo_kv_server *kv_self, struct conn_t *conn);
 static void *io_loop(foo_kv_server *kv_self);
+static void *reactor_loop(foo_kv_server *kv_self);
+static int listen_on_port(int port, int reuseport);
 static PyObject *foo_kv_server_tp_method_poll_loop(PyObject *self, PyObject *const *args, Py_ssize_t nargs);
 static PyObject *foo_kv_server_tp_method_io_loop(PyObject *self, PyObject *const *args, Py_ssize_t nargs);
+static PyObject *foo_kv_server_tp_method_reactor_loop(PyObject *self, PyObject *const *args, Py_ssize_t nargs);
 static PyObject *foo_kv_server_tp_method_storage_ttl_loop(PyObject *self, PyObject *const *args, Py_ssize_t nargs);
 
 // python util methods
 static PyObject *foo_kv_function_dumps(PyObject *self, PyObject *const *args, Py_ssize_t nargs);
 static PyObject *foo_kv_function_loads(PyObject *self, PyObject *const *args, Py_ssize_t nargs);
 static PyObject *foo_kv_function_hash(PyObject *self, PyObject *const *args, Py_ssize_t nargs);
+static PyObject *foo_kv_function_track_allocations(PyObject *self, PyObject *const *args, Py_ssize_t nargs);
+static PyObject *foo_kv_function_allocation_counts(PyObject *self, PyObject *const *args, Py_ssize_t nargs);
 
 // allocation method declarations
 static PyObject *foo_kv_server_tp_new(PyTypeObject *subtype, PyObject *args, PyObject *kwargs);
@@ -34,18 +34,18 @@ typedef struct foo_kv_ttl_heap {
 // define our python type
 typedef struct foo_kv_server {
     PyObject_HEAD
-    PyObject *storage;
-    sem_t *storage_lock;
-    PyObject *user_locks;
-    PyObject *user_locks_lock;
+    struct storage_t *storage;
+    struct locks_t *user_locks;
     foo_kv_ttl_heap *storage_ttl_heap;
     foo_kv_ttl_heap *lock_ttl_heap;
     int fd;
     struct connarray_t *fd_to_conn;
-    struct intq_t *waiting_conns;
-    sem_t *waiting_conns_lock;
-    struct cond_t *waiting_conns_ready_cond;
+    struct reactor_t *reactor;
+    struct scheduler_t *scheduler;
     int num_threads;
+    int port;
+    int reuseport;
+    int io_uring;
 } foo_kv_server;
 
 #endif
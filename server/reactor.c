@@ -0,0 +1,634 @@
+// epoll (or io_uring) based reactor: owns the listening socket and the connection registrations
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "connection.h"
+#include "reactor.h"
+#include "uring.h"
+#include "locks.h"
+
+// CHANGE ME
+#define _FOO_KV_DEBUG 1
+
+static int32_t reactor_uring_arm_recv(struct reactor_t *reactor, struct conn_t *conn);
+static int32_t reactor_uring_settle(struct reactor_t *reactor, struct conn_t *conn);
+
+struct reactor_t *reactor_new(int listen_fd, struct connarray_t *fd_to_conn) {
+
+    struct reactor_t *reactor = PyMem_RawCalloc(1, sizeof(struct reactor_t));
+    if (!reactor) {
+        return NULL;
+    }
+
+    reactor->listen_fd = listen_fd;
+    reactor->fd_to_conn = fd_to_conn;
+
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd < 0) {
+        log_error("reactor_new(): epoll_create1() failed");
+        PyMem_RawFree(reactor);
+        return NULL;
+    }
+
+    // the listening socket stays level-triggered so that a backlog which is
+    // not fully drained in one pass is reported again on the next wakeup
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        log_error("reactor_new(): failed to register listening socket");
+        close(reactor->epoll_fd);
+        PyMem_RawFree(reactor);
+        return NULL;
+    }
+
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->wake_fd < 0) {
+        log_error("reactor_new(): eventfd() failed");
+        close(reactor->epoll_fd);
+        PyMem_RawFree(reactor);
+        return NULL;
+    }
+    reactor->wake_pending = 0;
+    ev.events = EPOLLIN;
+    ev.data.fd = reactor->wake_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &ev) < 0) {
+        log_error("reactor_new(): failed to register wake-up eventfd");
+        close(reactor->wake_fd);
+        close(reactor->epoll_fd);
+        PyMem_RawFree(reactor);
+        return NULL;
+    }
+
+    // a connection is handed back at most once at a time, so the ring never fills up
+    reactor->returned_conns = connring_new(max_open_fds());
+    if (!reactor->returned_conns) {
+        close(reactor->wake_fd);
+        close(reactor->epoll_fd);
+        PyMem_RawFree(reactor);
+        return NULL;
+    }
+
+    reactor->ready_conns = intq_new();
+    if (!reactor->ready_conns) {
+        connring_destroy(reactor->returned_conns);
+        close(reactor->wake_fd);
+        close(reactor->epoll_fd);
+        PyMem_RawFree(reactor);
+        return NULL;
+    }
+
+    return reactor;
+
+}
+
+void reactor_dealloc(struct reactor_t *reactor) {
+
+    if (reactor->uring) {
+        uring_dealloc(reactor->uring);
+    }
+    close(reactor->wake_fd);
+    close(reactor->epoll_fd);
+    connring_destroy(reactor->returned_conns);
+    intq_destroy(reactor->ready_conns);
+    PyMem_RawFree(reactor);
+
+}
+
+int32_t reactor_wait(struct reactor_t *reactor, struct epoll_event *events, int32_t max_events, int32_t timeout) {
+
+    int32_t nevents;
+
+    do {
+        Py_BEGIN_ALLOW_THREADS
+        nevents = epoll_wait(reactor->epoll_fd, events, max_events, timeout);
+        Py_END_ALLOW_THREADS
+    } while (nevents < 0 && errno == EINTR);
+
+    if (nevents < 0) {
+        log_error("reactor_wait(): epoll_wait() failed");
+        return -1;
+    }
+
+    return nevents;
+
+}
+
+int32_t reactor_accept(struct reactor_t *reactor) {
+    // accepts until the backlog is empty
+    // returns the number of accepted connections, or -1 on error
+
+    int32_t naccepted = 0;
+
+    while (1) {
+
+        int connfd = accept_new_conn(reactor->fd_to_conn, reactor->listen_fd);
+        if (connfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            // a failed accept() only affects the one client, keep serving the others
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        reactor->fd_to_conn->arr[connfd]->reactor = reactor;
+
+        if (reactor->uring) {
+            struct conn_t *conn = reactor->fd_to_conn->arr[connfd];
+            if (conn_uring_init(conn) < 0) {
+                log_error("reactor_accept(): failed to allocate io_uring state");
+                connarray_remove(reactor->fd_to_conn, conn);
+                continue;
+            }
+            conn->uring->parked = 1;
+            if (reactor_uring_arm_recv(reactor, conn) < 0) {
+                log_error("reactor_accept(): failed to submit recv");
+                reactor_remove_conn(reactor, conn);
+                continue;
+            }
+            naccepted++;
+            continue;
+        }
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        ev.data.fd = connfd;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            log_error("reactor_accept(): failed to register connection");
+            connarray_remove(reactor->fd_to_conn, reactor->fd_to_conn->arr[connfd]);
+            continue;
+        }
+
+        naccepted++;
+
+    }
+
+    return naccepted;
+
+}
+
+int32_t reactor_arm(struct reactor_t *reactor, struct conn_t *conn) {
+
+    struct epoll_event ev = {};
+    ev.data.fd = conn->fd;
+
+    switch (conn->state) {
+        case STATE_REQ_WAITING:
+            ev.events = EPOLLIN;
+            break;
+        case STATE_RES_WAITING:
+            ev.events = EPOLLOUT;
+            break;
+        default:
+            log_error("reactor_arm(): connection is not waiting on io");
+            return -1;
+    }
+    ev.events |= EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+
+    // EPOLL_CTL_MOD re-evaluates readiness, so anything that arrived while the
+    // connection was owned by an io worker is reported right away
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        log_error("reactor_arm(): epoll_ctl() failed");
+        return -1;
+    }
+
+    #if _FOO_KV_DEBUG == 1
+    char debug_buff[256];
+    sprintf(debug_buff, "reactor_arm(): conn_fd: %d: re-armed for %s", conn->fd, (ev.events & EPOLLIN) ? "EPOLLIN" : "EPOLLOUT");
+    log_debug(debug_buff);
+    #endif
+
+    return 0;
+
+}
+
+int32_t reactor_remove_conn(struct reactor_t *reactor, struct conn_t *conn) {
+
+    if (reactor->uring) {
+        // the pending multishot recv holds a reference to the socket, so close()
+        // alone would not hang up on the client. shutting down completes the recv,
+        // and its last completion is ignored since the connid no longer matches
+        shutdown(conn->fd, SHUT_RDWR);
+        return connarray_remove(reactor->fd_to_conn, conn);
+    }
+
+    // closing the fd would drop the registration as well, but only if no other
+    // descriptor refers to the same socket
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+
+    return connarray_remove(reactor->fd_to_conn, conn);
+
+}
+
+static int32_t reactor_park_conn(struct reactor_t *reactor, struct conn_t *conn) {
+    // parks a connection that waits for a user lock, it isn't armed until the
+    // wait is over, or queues it right away if the wait is over already
+
+    if (!lock_waiter_park(conn->waiter)) {
+        return 0;
+    }
+    conn->state = STATE_LOCK_READY;
+
+    if (intq_put(reactor->ready_conns, conn->fd)) {
+        log_error("reactor_park_conn(): failed to enqueue connection");
+        return -1;
+    }
+
+    return 0;
+
+}
+
+int32_t reactor_settle_conn(struct reactor_t *reactor, struct conn_t *conn) {
+    // re-arms a connection that is waiting on io, or removes one that has ended
+    // only the reactor thread may call this
+
+    if (reactor->uring) {
+        return reactor_uring_settle(reactor, conn);
+    }
+
+    switch (conn->state) {
+        case STATE_REQ_WAITING:
+        case STATE_RES_WAITING:
+            if (reactor_arm(reactor, conn) < 0) {
+                conn->state = STATE_TERM;
+                return reactor_remove_conn(reactor, conn);
+            }
+            return 0;
+        case STATE_LOCK_WAITING:
+            return reactor_park_conn(reactor, conn);
+        case STATE_END:
+        case STATE_TERM:
+            return reactor_remove_conn(reactor, conn);
+        default:
+            log_warning("reactor_settle_conn(): connection is still active");
+            return 0;
+    }
+
+}
+
+int32_t reactor_return_conn(struct reactor_t *reactor, struct conn_t *conn) {
+    // called by io workers once connection_io() is done with a connection
+
+    if (connring_push(reactor->returned_conns, conn->fd)) {
+        log_error("reactor_return_conn(): failed to enqueue connection");
+        return -1;
+    }
+
+    return reactor_wake(reactor);
+
+}
+
+int32_t reactor_wake(struct reactor_t *reactor) {
+
+    // only the first hand-off since the reactor last woke up needs to write,
+    // the reactor drains everything that was queued before it clears the flag
+    if (__atomic_exchange_n(&reactor->wake_pending, 1, __ATOMIC_ACQ_REL)) {
+        return 0;
+    }
+
+    uint64_t one = 1;
+    ssize_t rv;
+    do {
+        rv = write(reactor->wake_fd, &one, sizeof(one));
+    } while (rv < 0 && errno == EINTR);
+
+    // EAGAIN means the counter is saturated, so the reactor is already awake
+    if (rv < 0 && errno != EAGAIN) {
+        log_error("reactor_wake(): write() to eventfd failed");
+        return -1;
+    }
+
+    return 0;
+
+}
+
+int32_t reactor_clear_wake(struct reactor_t *reactor) {
+    // must be called before draining the returned connections
+
+    __atomic_store_n(&reactor->wake_pending, 0, __ATOMIC_RELEASE);
+
+    uint64_t count;
+    ssize_t rv;
+    do {
+        rv = read(reactor->wake_fd, &count, sizeof(count));
+    } while (rv < 0 && errno == EINTR);
+
+    if (rv < 0 && errno != EAGAIN) {
+        log_error("reactor_clear_wake(): read() from eventfd failed");
+        return -1;
+    }
+
+    return 0;
+
+}
+
+int32_t reactor_drain_returned(struct reactor_t *reactor) {
+    // re-arms or removes every connection handed back since the last call
+    // only the reactor thread may call this
+
+    struct connarray_t *fd_to_conn = reactor->fd_to_conn;
+
+    int32_t conn_fd;
+    while ((conn_fd = connring_pop(reactor->returned_conns)) >= 0) {
+
+        struct conn_t *conn = (conn_fd < fd_to_conn->maxsize) ? fd_to_conn->arr[conn_fd] : NULL;
+        if (!conn) {
+            #if _FOO_KV_DEBUG == 1
+            char debug_buff[256];
+            sprintf(debug_buff, "reactor_drain_returned(): conn_fd: %d: returned connection is gone, perhaps this is expected", conn_fd);
+            log_debug(debug_buff);
+            #endif
+            continue;
+        }
+
+        reactor_settle_conn(reactor, conn);
+
+    }
+
+    return 0;
+
+}
+
+int32_t reactor_enable_uring(struct reactor_t *reactor) {
+    // switches the reactor to the io_uring backend
+    // must be called before any connection is accepted
+    // returns -1 if the kernel does not support it, in which case the reactor keeps using epoll
+
+    struct uring_t *uring = uring_new();
+    if (!uring) {
+        return -1;
+    }
+
+    // io_uring fails reads of a O_NONBLOCK file with EAGAIN instead of waiting,
+    // and only the ring reads the eventfd from now on
+    int flags = fcntl(reactor->wake_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(reactor->wake_fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        uring_dealloc(uring);
+        return -1;
+    }
+
+    // the listening socket and the eventfd stay registered with epoll as well,
+    // but nothing waits on the epoll instance any more
+    if (uring_prep_poll(uring, reactor->listen_fd) < 0 || uring_prep_read(uring, reactor->wake_fd, &reactor->wake_count, sizeof(uint64_t)) < 0) {
+        uring_dealloc(uring);
+        return -1;
+    }
+
+    reactor->uring = uring;
+
+    return 0;
+
+}
+
+int32_t reactor_uring_wait(struct reactor_t *reactor, int32_t timeout) {
+    // submits the recvs, sends and polls queued since the last call and waits for completions
+
+    return uring_submit_and_wait(reactor->uring, timeout);
+
+}
+
+static struct conn_t *reactor_uring_lookup(struct reactor_t *reactor, uint64_t user_data) {
+
+    struct connarray_t *fd_to_conn = reactor->fd_to_conn;
+    int fd = URING_UD_FD(user_data);
+
+    struct conn_t *conn = (fd < fd_to_conn->maxsize) ? fd_to_conn->arr[fd] : NULL;
+    if (!conn || conn->connid != URING_UD_CONNID(user_data)) {
+        return NULL;
+    }
+
+    return conn;
+
+}
+
+static int32_t reactor_uring_arm_recv(struct reactor_t *reactor, struct conn_t *conn) {
+
+    struct conn_uring_t *conn_uring = conn->uring;
+
+    if (conn_uring->recv_armed || conn_uring->eof) {
+        return 0;
+    }
+    // throttled, the connection is re-armed once its io worker catches up
+    if (conn_uring_pending(conn) >= URING_INBOX_MAX) {
+        return 0;
+    }
+    if (uring_prep_recv(reactor->uring, conn->fd, conn->connid) < 0) {
+        return -1;
+    }
+    conn_uring->recv_armed = 1;
+
+    return 0;
+
+}
+
+static int32_t reactor_uring_ready(struct reactor_t *reactor, struct conn_t *conn) {
+    // hands a parked connection with pending input over to the io workers
+
+    conn->uring->parked = 0;
+    conn->state = STATE_REQ;
+
+    if (intq_put(reactor->ready_conns, conn->fd)) {
+        log_error("reactor_uring_ready(): failed to enqueue connection");
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static int32_t reactor_uring_send(struct reactor_t *reactor, struct conn_t *conn) {
+
+    if (uring_prep_send(reactor->uring, conn->fd, conn->connid, conn->wbuff + conn->wbuff_sent, conn->wbuff_size - conn->wbuff_sent) < 0) {
+        log_error("reactor_uring_send(): failed to submit send");
+        conn->state = STATE_TERM;
+        return reactor_remove_conn(reactor, conn);
+    }
+
+    return 0;
+
+}
+
+static int32_t reactor_uring_settle(struct reactor_t *reactor, struct conn_t *conn) {
+
+    switch (conn->state) {
+        case STATE_REQ_WAITING:
+            conn->uring->parked = 1;
+            if (reactor_uring_arm_recv(reactor, conn) < 0) {
+                conn->state = STATE_TERM;
+                return reactor_remove_conn(reactor, conn);
+            }
+            // the inbox may have filled up after the io worker last looked at it
+            if (conn_has_input(conn)) {
+                return reactor_uring_ready(reactor, conn);
+            }
+            return 0;
+        case STATE_RES_WAITING:
+            conn->uring->parked = 1;
+            return reactor_uring_send(reactor, conn);
+        case STATE_LOCK_WAITING:
+            // the recv stays armed, received requests wait in the inbox
+            conn->uring->parked = 1;
+            if (reactor_park_conn(reactor, conn) < 0) {
+                return -1;
+            }
+            if (conn->state == STATE_LOCK_READY) {
+                conn->uring->parked = 0;
+            }
+            return 0;
+        case STATE_END:
+        case STATE_TERM:
+            return reactor_remove_conn(reactor, conn);
+        default:
+            log_warning("reactor_uring_settle(): connection is still active");
+            return 0;
+    }
+
+}
+
+static int32_t reactor_uring_on_recv(struct reactor_t *reactor, const struct io_uring_cqe *cqe) {
+
+    struct uring_t *uring = reactor->uring;
+    struct conn_t *conn = reactor_uring_lookup(reactor, cqe->user_data);
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (conn && cqe->res > 0 && conn_uring_push(conn, uring_buf(uring, bid), cqe->res, 0) < 0) {
+            conn_uring_push(conn, NULL, 0, -ENOMEM);
+        }
+        uring_buf_recycle(uring, bid);
+    }
+
+    // a late completion for a connection that has been removed
+    if (!conn) {
+        return 0;
+    }
+
+    struct conn_uring_t *conn_uring = conn->uring;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // the multishot recv is done
+        conn_uring->recv_armed = 0;
+        conn_uring->recv_cancelling = 0;
+        if (cqe->res == 0) {
+            conn_uring_push(conn, NULL, 0, 1);
+        } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            conn_uring_push(conn, NULL, 0, cqe->res);
+        }
+        // ENOBUFS means every provided buffer was in use, they have all been
+        // recycled by now, so receiving can resume right away
+        if (reactor_uring_arm_recv(reactor, conn) < 0) {
+            conn_uring_push(conn, NULL, 0, -EIO);
+        }
+    } else if (!conn_uring->recv_cancelling && conn_uring_pending(conn) >= URING_INBOX_MAX) {
+        // the client sends faster than the io workers keep up with, stop receiving
+        // until the inbox is drained rather than buffering without bound
+        if (!uring_prep_cancel(uring, cqe->user_data)) {
+            conn_uring->recv_cancelling = 1;
+        }
+    }
+
+    #if _FOO_KV_DEBUG == 1
+    char debug_buff[256];
+    sprintf(debug_buff, "reactor_uring_on_recv(): conn_fd: %d: res: %d, parked: %d", conn->fd, cqe->res, conn_uring->parked);
+    log_debug(debug_buff);
+    #endif
+
+    if (conn_uring->parked && conn->state == STATE_REQ_WAITING && conn_has_input(conn)) {
+        return reactor_uring_ready(reactor, conn);
+    }
+
+    return 0;
+
+}
+
+static int32_t reactor_uring_on_send(struct reactor_t *reactor, const struct io_uring_cqe *cqe) {
+
+    struct conn_t *conn = reactor_uring_lookup(reactor, cqe->user_data);
+    if (!conn) {
+        return 0;
+    }
+
+    if (cqe->res <= 0) {
+        #if _FOO_KV_DEBUG == 1
+        char debug_buff[256];
+        sprintf(debug_buff, "reactor_uring_on_send(): conn_fd: %d: send failed: %d", conn->fd, cqe->res);
+        log_debug(debug_buff);
+        #endif
+        conn->state = STATE_TERM;
+        return reactor_remove_conn(reactor, conn);
+    }
+
+    conn->wbuff_sent += (size_t)cqe->res;
+    if (conn->wbuff_sent < conn->wbuff_size) {
+        // short send, submit the rest
+        return reactor_uring_send(reactor, conn);
+    }
+
+    // response was fully sent
+    conn_wbuff_reset(conn);
+    conn->state = STATE_REQ_WAITING;
+
+    return reactor_uring_settle(reactor, conn);
+
+}
+
+int32_t reactor_uring_process(struct reactor_t *reactor, int32_t *has_pending_accept) {
+    // handles every completion posted so far
+    // connections with work for the io workers are queued on reactor->ready_conns
+    // returns the number of completions, or -1 on error
+
+    struct uring_t *uring = reactor->uring;
+    struct io_uring_cqe cqe;
+    int32_t ncqes = 0;
+
+    while (uring_pop_cqe(uring, &cqe)) {
+
+        ncqes++;
+
+        switch (URING_UD_OP(cqe.user_data)) {
+            case URING_OP_POLL:
+                *has_pending_accept = 1;
+                // the kernel may end a multishot poll, e.g. if completions overflowed
+                if (!(cqe.flags & IORING_CQE_F_MORE) && uring_prep_poll(uring, reactor->listen_fd) < 0) {
+                    log_error("reactor_uring_process(): failed to re-submit poll");
+                    return -1;
+                }
+                break;
+            case URING_OP_READ:
+                // same as reactor_clear_wake(), the read has already consumed the
+                // counter: the caller drains the returned connections next
+                __atomic_store_n(&reactor->wake_pending, 0, __ATOMIC_RELEASE);
+                if (uring_prep_read(uring, reactor->wake_fd, &reactor->wake_count, sizeof(uint64_t)) < 0) {
+                    log_error("reactor_uring_process(): failed to re-submit eventfd read");
+                    return -1;
+                }
+                break;
+            case URING_OP_RECV:
+                reactor_uring_on_recv(reactor, &cqe);
+                break;
+            case URING_OP_SEND:
+                reactor_uring_on_send(reactor, &cqe);
+                break;
+            default:
+                // cancellations
+                break;
+        }
+
+    }
+
+    return ncqes;
+
+}
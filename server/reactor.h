@@ -0,0 +1,63 @@
+#ifndef _FOO_KV_REACTOR
+#define _FOO_KV_REACTOR
+
+#include <stdint.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+
+#include <Python.h>
+
+#include "util.h"
+#include "connection.h"
+#include "uring.h"
+
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_TIMEOUT_MS 1000
+// io_uring backend: stop receiving for a connection once this much received
+// data is waiting for an io worker
+#define URING_INBOX_MAX (4 * MAX_MSG_SIZE)
+
+// an epoll instance plus the connections registered with it.
+// connections are registered once, when they are accepted, and are armed with
+// EPOLLONESHOT so that at most one io worker ever owns a connection at a time.
+// io workers hand connections back with reactor_return_conn() and the reactor
+// thread re-arms (or removes) them.
+// `wake_fd` is an eventfd registered with the epoll instance. Handing a
+// connection back signals it, so the reactor re-arms the connection right away
+// rather than at the next epoll_wait() timeout.
+// if reactor_enable_uring() succeeds, connections are served by io_uring
+// instead: each one has a multishot recv that feeds its inbox (see struct
+// conn_uring_t), responses handed back by io workers are sent by the reactor,
+// the listening socket is watched with a multishot poll and `wake_fd` is read
+// through the ring as well, into `wake_count`.
+// connections with work for the io workers are queued on `ready_conns`, with
+// either backend that includes the connections whose user lock wait is over
+// (see struct lock_waiter_t), which are parked in the meantime.
+struct reactor_t {
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;
+    int32_t wake_pending;
+    struct connarray_t *fd_to_conn;
+    struct connring_t *returned_conns;
+    struct uring_t *uring;
+    struct intq_t *ready_conns;
+    uint64_t wake_count;
+};
+
+struct reactor_t *reactor_new(int listen_fd, struct connarray_t *fd_to_conn);
+void reactor_dealloc(struct reactor_t *reactor);
+int32_t reactor_wait(struct reactor_t *reactor, struct epoll_event *events, int32_t max_events, int32_t timeout);
+int32_t reactor_accept(struct reactor_t *reactor);
+int32_t reactor_arm(struct reactor_t *reactor, struct conn_t *conn);
+int32_t reactor_remove_conn(struct reactor_t *reactor, struct conn_t *conn);
+int32_t reactor_settle_conn(struct reactor_t *reactor, struct conn_t *conn);
+int32_t reactor_return_conn(struct reactor_t *reactor, struct conn_t *conn);
+int32_t reactor_drain_returned(struct reactor_t *reactor);
+int32_t reactor_wake(struct reactor_t *reactor);
+int32_t reactor_clear_wake(struct reactor_t *reactor);
+int32_t reactor_enable_uring(struct reactor_t *reactor);
+int32_t reactor_uring_wait(struct reactor_t *reactor, int32_t timeout);
+int32_t reactor_uring_process(struct reactor_t *reactor, int32_t *has_pending_accept);
+
+#endif
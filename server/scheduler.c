@@ -0,0 +1,245 @@
+// hands ready connections to io workers: per worker queues, a shared injector queue and work stealing
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "util.h"
+#include "connection.h"
+#include "scheduler.h"
+
+// CHANGE ME
+#define _FOO_KV_DEBUG 1
+
+struct scheduler_t *scheduler_new(int32_t num_workers) {
+
+    struct scheduler_t *sched = PyMem_RawCalloc(1, sizeof(struct scheduler_t));
+    if (!sched) {
+        return NULL;
+    }
+    sched->num_workers = num_workers;
+
+    // every connection is queued at most once, so the injector never fills up
+    sched->injector = connring_new(max_open_fds());
+    if (!sched->injector) {
+        PyMem_RawFree(sched);
+        return NULL;
+    }
+
+    sched->workers = PyMem_RawCalloc(num_workers, sizeof(struct sched_worker_t));
+    if (!sched->workers) {
+        connring_destroy(sched->injector);
+        PyMem_RawFree(sched);
+        return NULL;
+    }
+    for (int32_t ix = 0; ix < num_workers; ix++) {
+        sched->workers[ix].queue = connring_new(SCHED_LOCAL_QUEUE_SIZE);
+        if (!sched->workers[ix].queue) {
+            scheduler_dealloc(sched);
+            return NULL;
+        }
+        // xorshift state for picking steal victims, must not be 0
+        sched->workers[ix].rng = 2654435761u * (ix + 1);
+    }
+
+    return sched;
+
+}
+
+void scheduler_dealloc(struct scheduler_t *sched) {
+
+    if (!sched) {
+        return;
+    }
+    for (int32_t ix = 0; ix < sched->num_workers; ix++) {
+        if (sched->workers[ix].queue) {
+            connring_destroy(sched->workers[ix].queue);
+        }
+    }
+    PyMem_RawFree(sched->workers);
+    connring_destroy(sched->injector);
+    PyMem_RawFree(sched);
+
+}
+
+int32_t scheduler_register_worker(struct scheduler_t *sched) {
+    // returns the calling io worker's index, or -1 if every slot is taken
+
+    int32_t worker = __atomic_fetch_add(&sched->num_registered, 1, __ATOMIC_RELAXED);
+    if (worker >= sched->num_workers) {
+        return -1;
+    }
+
+    return worker;
+
+}
+
+static int32_t scheduler_wake(struct scheduler_t *sched, int32_t worker) {
+    // returns 1 if `worker` was parked and has been woken up, 0 if it wasn't parked
+
+    struct sched_worker_t *target = &sched->workers[worker];
+    int32_t parked = 1;
+
+    // claim the wakeup, so the next submit picks another parked worker
+    if (!__atomic_compare_exchange_n(&target->parked, &parked, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    __atomic_add_fetch(&target->futex_seq, 1, __ATOMIC_RELEASE);
+    if (syscall(SYS_futex, &target->futex_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0) < 0) {
+        log_error("scheduler_wake(): futex wake failed");
+        return -1;
+    }
+
+    return 1;
+
+}
+
+static int32_t scheduler_wake_any(struct scheduler_t *sched) {
+    // wakes up one parked worker, if there is one
+    // starts from a different worker each time to spread the wakeups
+
+    int32_t num_workers = sched->num_workers;
+    uint32_t start = __atomic_fetch_add(&sched->next_wake, 1, __ATOMIC_RELAXED);
+
+    for (int32_t ix = 0; ix < num_workers; ix++) {
+        int32_t res = scheduler_wake(sched, (start + ix) % num_workers);
+        if (res) {
+            return res;
+        }
+    }
+
+    return 0;
+
+}
+
+int32_t scheduler_submit(struct scheduler_t *sched, struct conn_t *conn) {
+    // queues a connection for the io workers: on the queue of the worker that
+    // served it last if there is one, otherwise on the injector
+    // then wakes that worker, or any parked worker if it is busy
+
+    int32_t worker = conn->worker;
+
+    if (worker < 0 || worker >= sched->num_workers || connring_push(sched->workers[worker].queue, conn->fd)) {
+        if (connring_push(sched->injector, conn->fd)) {
+            log_error("scheduler_submit(): injector is full");
+            return -1;
+        }
+        worker = -1;
+    }
+
+    // pairs with the fence in scheduler_next(): either the worker sees the
+    // connection before it parks, or we see that it is parked
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (worker >= 0) {
+        int32_t res = scheduler_wake(sched, worker);
+        if (res) {
+            return res < 0 ? -1 : 0;
+        }
+    }
+    // the worker is busy, let an idle one steal the connection
+    if (scheduler_wake_any(sched) < 0) {
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static uint32_t xorshift32(uint32_t *state) {
+
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+
+}
+
+static int32_t scheduler_take(struct scheduler_t *sched, int32_t worker) {
+    // pops a connection fd from the worker's own queue, the injector, or another
+    // worker's queue, in that order
+    // returns -1 if they are all empty
+
+    struct sched_worker_t *self = &sched->workers[worker];
+
+    int32_t conn_fd = connring_pop(self->queue);
+    if (conn_fd >= 0) {
+        return conn_fd;
+    }
+    conn_fd = connring_pop(sched->injector);
+    if (conn_fd >= 0) {
+        return conn_fd;
+    }
+
+    // steal, starting from a random victim so thieves don't all pile onto the same one
+    int32_t num_workers = sched->num_workers;
+    int32_t start = xorshift32(&self->rng) % num_workers;
+    for (int32_t ix = 0; ix < num_workers; ix++) {
+        int32_t victim = (start + ix) % num_workers;
+        if (victim == worker) {
+            continue;
+        }
+        conn_fd = connring_pop(sched->workers[victim].queue);
+        if (conn_fd >= 0) {
+            self->steals++;
+            #if _FOO_KV_DEBUG == 1
+            char debug_buff[256];
+            sprintf(debug_buff, "scheduler_take(): conn_fd: %d: worker %d stole from worker %d", conn_fd, worker, victim);
+            log_debug(debug_buff);
+            #endif
+            return conn_fd;
+        }
+    }
+
+    return -1;
+
+}
+
+int32_t scheduler_next(struct scheduler_t *sched, int32_t worker, int32_t timeout) {
+    // returns the fd of the next connection for `worker`, parking the calling
+    // thread for up to `timeout` milliseconds if there is none
+    // returns -1 if there is still none after that
+
+    struct sched_worker_t *self = &sched->workers[worker];
+
+    int32_t conn_fd = scheduler_take(sched, worker);
+    if (conn_fd >= 0) {
+        self->served++;
+        return conn_fd;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+
+    // read the futex word before announcing ourselves and looking again, a
+    // wakeup that comes after that bumps the word, and the wait returns right away
+    uint32_t seq = __atomic_load_n(&self->futex_seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&self->parked, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    conn_fd = scheduler_take(sched, worker);
+    if (conn_fd < 0) {
+        Py_BEGIN_ALLOW_THREADS
+        syscall(SYS_futex, &self->futex_seq, FUTEX_WAIT_PRIVATE, seq, &ts, NULL, 0);
+        Py_END_ALLOW_THREADS
+        // EAGAIN, ETIMEDOUT and EINTR all mean the same thing here: look again
+        conn_fd = scheduler_take(sched, worker);
+    }
+
+    __atomic_store_n(&self->parked, 0, __ATOMIC_SEQ_CST);
+
+    if (conn_fd >= 0) {
+        self->served++;
+    }
+
+    return conn_fd;
+
+}
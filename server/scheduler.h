@@ -0,0 +1,50 @@
+#ifndef _FOO_KV_SCHEDULER
+#define _FOO_KV_SCHEDULER
+
+#include <stdint.h>
+
+#include <Python.h>
+
+#include "util.h"
+#include "connection.h"
+
+// per worker queue capacity, a connection that doesn't fit goes to the injector
+#define SCHED_LOCAL_QUEUE_SIZE 1024
+
+// one io worker's slot in the scheduler
+// `parked` is set while the worker sleeps on `futex_seq`, and is cleared by
+// whoever claims the wakeup
+struct sched_worker_t {
+    struct connring_t *queue;
+    uint32_t futex_seq;
+    int32_t parked;
+    uint32_t rng;
+    uint64_t served;
+    uint64_t steals;
+    char _pad[CACHELINE_SIZE];
+};
+
+// hands ready connections from the poll loop to the io workers.
+// every worker has its own queue, and a connection is queued on the queue of the
+// worker that served it last (`conn->worker`), so its buffers and storage are
+// likely still in that worker's cache. connections that haven't been served yet,
+// or whose worker's queue is full, go to the shared `injector` queue instead.
+// a worker takes work from its own queue, then from the injector, then steals
+// from the other workers' queues, and parks only when all of them are empty.
+// queuing a connection on a busy worker wakes a parked one, so a burst on one
+// worker's connections is picked up by idle workers rather than waiting.
+struct scheduler_t {
+    int32_t num_workers;
+    int32_t num_registered;
+    struct connring_t *injector;
+    struct sched_worker_t *workers;
+    uint32_t next_wake;
+};
+
+struct scheduler_t *scheduler_new(int32_t num_workers);
+void scheduler_dealloc(struct scheduler_t *sched);
+int32_t scheduler_register_worker(struct scheduler_t *sched);
+int32_t scheduler_submit(struct scheduler_t *sched, struct conn_t *conn);
+int32_t scheduler_next(struct scheduler_t *sched, int32_t worker, int32_t timeout);
+
+#endif
@@ -0,0 +1,173 @@
+// fixed size object allocator with per thread caches, for conn_t and friends
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <semaphore.h>
+
+#include "util.h"
+#include "slab.h"
+
+// CHANGE ME
+#define _FOO_KV_DEBUG 1
+
+struct slab_cache_t {
+    void *head;
+    uint32_t count;
+};
+
+static __thread struct slab_cache_t thread_cache[SLAB_MAX_SLABS];
+static int32_t num_slabs = 0;
+
+int32_t slab_init(struct slab_t *slab, size_t obj_size) {
+
+    int32_t id = __atomic_fetch_add(&num_slabs, 1, __ATOMIC_RELAXED);
+    if (id >= SLAB_MAX_SLABS) {
+        log_error("slab_init(): too many slabs, raise SLAB_MAX_SLABS");
+        return -1;
+    }
+
+    memset(slab, 0, sizeof(struct slab_t));
+    slab->id = id;
+    // room for the free list link, and keep objects pointer aligned
+    if (obj_size < sizeof(void *)) {
+        obj_size = sizeof(void *);
+    }
+    slab->obj_size = CEIL(obj_size, sizeof(void *));
+    slab->objs_per_chunk = SLAB_CHUNK_SIZE / slab->obj_size;
+    if (!slab->objs_per_chunk) {
+        slab->objs_per_chunk = 1;
+    }
+    if (sem_init(&slab->lock, 0, 1)) {
+        return -1;
+    }
+
+    return 0;
+
+}
+
+void slab_dealloc(struct slab_t *slab) {
+    // frees every chunk, only call once no object of the slab is in use and
+    // no other thread will touch it again
+
+    for (uint32_t ix = 0; ix < slab->num_chunks; ix++) {
+        PyMem_RawFree(slab->chunks[ix]);
+    }
+    PyMem_RawFree(slab->chunks);
+    sem_destroy(&slab->lock);
+    memset(thread_cache + slab->id, 0, sizeof(struct slab_cache_t));
+
+}
+
+static int32_t slab_lock(struct slab_t *slab) {
+
+    // the lock is only ever held to move a few pointers, so try before giving up the GIL
+    if (!sem_trywait(&slab->lock)) {
+        return 0;
+    }
+    return threadsafe_sem_wait(&slab->lock);
+
+}
+
+static inline void freelist_push(void **head, uint32_t *count, void *obj) {
+    *(void **)obj = *head;
+    *head = obj;
+    (*count)++;
+}
+
+static inline void *freelist_pop(void **head, uint32_t *count) {
+    void *obj = *head;
+    if (obj) {
+        *head = *(void **)obj;
+        (*count)--;
+    }
+    return obj;
+}
+
+static int32_t slab_grow(struct slab_t *slab) {
+    // carves a new chunk into the depot, call with the lock held
+
+    if (slab->num_chunks == slab->max_chunks) {
+        uint32_t new_max = slab->max_chunks ? 2 * slab->max_chunks : 8;
+        void **new_chunks = PyMem_RawRealloc(slab->chunks, new_max * sizeof(void *));
+        if (!new_chunks) {
+            return -1;
+        }
+        slab->chunks = new_chunks;
+        slab->max_chunks = new_max;
+    }
+
+    uint8_t *chunk = PyMem_RawMalloc(slab->objs_per_chunk * slab->obj_size);
+    if (!chunk) {
+        return -1;
+    }
+    slab->chunks[slab->num_chunks++] = chunk;
+
+    // push in reverse so objects are handed out in address order
+    for (uint32_t ix = slab->objs_per_chunk; ix > 0; ix--) {
+        freelist_push(&slab->head, &slab->count, chunk + (ix - 1) * slab->obj_size);
+    }
+
+    #if _FOO_KV_DEBUG == 1
+    char debug_buff[256];
+    sprintf(debug_buff, "slab_grow(): slab %d: now has %u chunks of %u objects", slab->id, slab->num_chunks, slab->objs_per_chunk);
+    log_debug(debug_buff);
+    #endif
+
+    return 0;
+
+}
+
+void *slab_alloc(struct slab_t *slab) {
+    // returns a zeroed object, or NULL if out of memory
+
+    struct slab_cache_t *cache = &thread_cache[slab->id];
+
+    void *obj = freelist_pop(&cache->head, &cache->count);
+    if (!obj) {
+        // refill half of the cache from the depot
+        if (slab_lock(slab)) {
+            return NULL;
+        }
+        if (!slab->head && slab_grow(slab)) {
+            sem_post(&slab->lock);
+            return NULL;
+        }
+        uint32_t want = SLAB_THREAD_CACHE_OBJS / 2;
+        while (want-- && slab->head) {
+            freelist_push(&cache->head, &cache->count, freelist_pop(&slab->head, &slab->count));
+        }
+        sem_post(&slab->lock);
+        obj = freelist_pop(&cache->head, &cache->count);
+    }
+
+    memset(obj, 0, slab->obj_size);
+
+    return obj;
+
+}
+
+void slab_free(struct slab_t *slab, void *obj) {
+
+    if (!obj) {
+        return;
+    }
+
+    struct slab_cache_t *cache = &thread_cache[slab->id];
+    freelist_push(&cache->head, &cache->count, obj);
+    if (cache->count <= SLAB_THREAD_CACHE_OBJS) {
+        return;
+    }
+
+    // the cache is full, which happens on threads that free more objects than
+    // they allocate: move half of it to the depot
+    if (slab_lock(slab)) {
+        return;
+    }
+    while (cache->count > SLAB_THREAD_CACHE_OBJS / 2) {
+        freelist_push(&slab->head, &slab->count, freelist_pop(&cache->head, &cache->count));
+    }
+    sem_post(&slab->lock);
+
+}
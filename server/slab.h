@@ -0,0 +1,44 @@
+#ifndef _FOO_KV_SLAB
+#define _FOO_KV_SLAB
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <semaphore.h>
+
+#include <Python.h>
+
+// how many slabs can exist, each one takes a slot in every thread's caches
+#define SLAB_MAX_SLABS 8
+#define SLAB_CHUNK_SIZE (64 * 1024)
+// how many objects of a slab a thread keeps for itself before spilling half of
+// them into the slab's depot
+#define SLAB_THREAD_CACHE_OBJS 64
+
+// fixed size object allocator for the server's internal structs.
+// objects are carved out of SLAB_CHUNK_SIZE chunks and are recycled, not freed:
+// a freed object goes to the freeing thread's cache, caches that overflow spill
+// into the shared depot, and empty caches refill from it, carving a new chunk
+// only when the depot is empty as well. so once the server has seen its peak
+// number of objects, allocating and freeing them makes no allocator calls.
+// free objects are kept on intrusive lists, linked through their first bytes,
+// which is the same scheme as the buffer pool (see struct bufpool_depot_t).
+struct slab_t {
+    int32_t id;
+    size_t obj_size;
+    uint32_t objs_per_chunk;
+    sem_t lock;
+    // depot
+    void *head;
+    uint32_t count;
+    // every chunk, so slab_dealloc() can free them
+    void **chunks;
+    uint32_t num_chunks;
+    uint32_t max_chunks;
+};
+
+int32_t slab_init(struct slab_t *slab, size_t obj_size);
+void slab_dealloc(struct slab_t *slab);
+void *slab_alloc(struct slab_t *slab);
+void slab_free(struct slab_t *slab, void *obj);
+
+#endif
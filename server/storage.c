@@ -0,0 +1,1196 @@
+// native key/value storage, usable without the GIL
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "util.h"
+#include "storage.h"
+
+// CHANGE ME
+#define _FOO_KV_DEBUG 1
+
+static int32_t table_init(struct storage_table_t *table, uint64_t num_slots);
+static void table_dealloc(struct storage_table_t *table, int32_t free_entries);
+
+// the shards a transaction holds on this thread, see storage_hold_shards()
+static __thread struct storage_shard_t **held_shards = NULL;
+static __thread int32_t num_held_shards = 0;
+
+static inline uint64_t table_bytes(uint64_t num_slots) {
+
+    return num_slots * STORAGE_SLOT_SIZE;
+
+}
+
+static inline void shard_add_memory(struct storage_shard_t *shard, int64_t bytes) {
+    // the shard's memory is only written under its lock, the storage's by
+    // writers of any shard
+
+    shard->memory += bytes;
+    __atomic_fetch_add(shard->storage_memory, bytes, __ATOMIC_RELAXED);
+
+}
+
+static int32_t storage_shard_init(struct storage_shard_t *shard, uint64_t *storage_memory) {
+
+    memset(shard, 0, sizeof(struct storage_shard_t));
+    if (table_init(&shard->table, STORAGE_MIN_SLOTS)) {
+        return -1;
+    }
+    shard->storage_memory = storage_memory;
+    shard_add_memory(shard, table_bytes(STORAGE_MIN_SLOTS));
+
+    // reads vastly outnumber writes, so don't let a stream of readers keep a
+    // writer out
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    int32_t err = pthread_rwlock_init(&shard->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    if (err) {
+        table_dealloc(&shard->table, 0);
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static void storage_shard_dealloc(struct storage_shard_t *shard) {
+
+    table_dealloc(&shard->table, 1);
+    table_dealloc(&shard->old, 1);
+    pthread_rwlock_destroy(&shard->lock);
+
+}
+
+struct storage_t *storage_new(void) {
+
+    struct storage_t *storage = PyMem_RawCalloc(1, sizeof(struct storage_t));
+    if (!storage) {
+        return NULL;
+    }
+    storage->shards = PyMem_RawCalloc(STORAGE_NUM_SHARDS, sizeof(struct storage_shard_t));
+    if (!storage->shards) {
+        PyMem_RawFree(storage);
+        return NULL;
+    }
+    for (uint32_t ix = 0; ix < STORAGE_NUM_SHARDS; ix++) {
+        if (storage_shard_init(storage->shards + ix, &storage->memory)) {
+            while (ix-- > 0) {
+                storage_shard_dealloc(storage->shards + ix);
+            }
+            PyMem_RawFree(storage->shards);
+            PyMem_RawFree(storage);
+            return NULL;
+        }
+    }
+    storage->num_shards = STORAGE_NUM_SHARDS;
+    storage->shard_shift = 64 - __builtin_ctz(STORAGE_NUM_SHARDS);
+
+    return storage;
+
+}
+
+void storage_dealloc(struct storage_t *storage) {
+
+    for (uint32_t ix = 0; ix < storage->num_shards; ix++) {
+        storage_shard_dealloc(storage->shards + ix);
+    }
+    if (storage->index) {
+        index_dealloc(storage->index);
+    }
+    PyMem_RawFree(storage->shards);
+    PyMem_RawFree(storage);
+
+}
+
+void storage_set_maxmemory(struct storage_t *storage, uint64_t maxmemory, int32_t policy) {
+
+    storage->maxmemory = maxmemory;
+    storage->policy = policy;
+
+}
+
+int32_t storage_enable_index(struct storage_t *storage) {
+
+    storage->index = index_new();
+    if (!storage->index) {
+        return -1;
+    }
+    for (uint32_t ix = 0; ix < storage->num_shards; ix++) {
+        storage->shards[ix].index = storage->index;
+    }
+
+    return 0;
+
+}
+
+uint64_t storage_used_memory(struct storage_t *storage) {
+
+    return __atomic_load_n(&storage->memory, __ATOMIC_RELAXED);
+
+}
+
+uint64_t storage_num_keys(struct storage_t *storage) {
+
+    uint64_t num_keys = 0;
+    for (uint32_t ix = 0; ix < storage->num_shards; ix++) {
+        num_keys += __atomic_load_n(&storage->shards[ix].size, __ATOMIC_RELAXED);
+    }
+
+    return num_keys;
+
+}
+
+struct storage_shard_t *storage_shard(struct storage_t *storage, uint64_t hash) {
+
+    // buckets are picked by the low bits, so use the high ones here
+    if (storage->shard_shift == 64) {
+        return storage->shards;
+    }
+    return storage->shards + (hash >> storage->shard_shift);
+
+}
+
+static int32_t storage_shard_wait(struct storage_shard_t *shard, int (*acquire)(pthread_rwlock_t *)) {
+    // like threadsafe_sem_wait(), gives up the GIL while waiting if the caller
+    // holds it
+
+    int32_t res;
+
+    if (!PyGILState_Check()) {
+        res = acquire(&shard->lock);
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        res = acquire(&shard->lock);
+        Py_END_ALLOW_THREADS
+    }
+
+    return res ? -1 : 0;
+
+}
+
+static int32_t storage_shard_is_held(const struct storage_shard_t *shard) {
+
+    for (int32_t ix = 0; ix < num_held_shards; ix++) {
+        if (held_shards[ix] == shard) {
+            return 1;
+        }
+    }
+
+    return 0;
+
+}
+
+int32_t storage_shard_lock(struct storage_shard_t *shard) {
+
+    if (num_held_shards && storage_shard_is_held(shard)) {
+        return 0;
+    }
+    // the lock is only held for a lookup and a memcpy, so try before waiting
+    if (!pthread_rwlock_trywrlock(&shard->lock)) {
+        return 0;
+    }
+    return storage_shard_wait(shard, pthread_rwlock_wrlock);
+
+}
+
+int32_t storage_shard_read_lock(struct storage_shard_t *shard) {
+    // readers only wait for writers, never for each other
+
+    if (num_held_shards && storage_shard_is_held(shard)) {
+        return 0;
+    }
+    if (!pthread_rwlock_tryrdlock(&shard->lock)) {
+        return 0;
+    }
+    return storage_shard_wait(shard, pthread_rwlock_rdlock);
+
+}
+
+void storage_shard_unlock(struct storage_shard_t *shard) {
+
+    if (num_held_shards && storage_shard_is_held(shard)) {
+        return;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+}
+
+static int shard_cmp(const void *a, const void *b) {
+
+    uintptr_t x = (uintptr_t)*(struct storage_shard_t * const *)a;
+    uintptr_t y = (uintptr_t)*(struct storage_shard_t * const *)b;
+    return (x > y) - (x < y);
+
+}
+
+static int32_t lock_shards(struct storage_shard_t **shards, int32_t num_shards, int32_t (*lock)(struct storage_shard_t *)) {
+
+    qsort(shards, num_shards, sizeof(struct storage_shard_t *), shard_cmp);
+
+    for (int32_t ix = 0; ix < num_shards; ix++) {
+        if (ix > 0 && shards[ix] == shards[ix - 1]) {
+            continue;
+        }
+        if (lock(shards[ix])) {
+            storage_unlock_shards(shards, ix);
+            return -1;
+        }
+    }
+
+    return 0;
+
+}
+
+int32_t storage_lock_shards(struct storage_shard_t **shards, int32_t num_shards) {
+
+    return lock_shards(shards, num_shards, storage_shard_lock);
+
+}
+
+int32_t storage_read_lock_shards(struct storage_shard_t **shards, int32_t num_shards) {
+
+    return lock_shards(shards, num_shards, storage_shard_read_lock);
+
+}
+
+int32_t storage_hold_shards(struct storage_shard_t **shards, int32_t num_shards) {
+
+    if (storage_lock_shards(shards, num_shards)) {
+        return -1;
+    }
+    held_shards = shards;
+    num_held_shards = num_shards;
+
+    return 0;
+
+}
+
+void storage_release_shards(void) {
+
+    struct storage_shard_t **shards = held_shards;
+    int32_t num_shards = num_held_shards;
+    held_shards = NULL;
+    num_held_shards = 0;
+    storage_unlock_shards(shards, num_shards);
+
+}
+
+void storage_unlock_shards(struct storage_shard_t **shards, int32_t num_shards) {
+    // expects `shards` as sorted by storage_lock_shards()
+
+    for (int32_t ix = 0; ix < num_shards; ix++) {
+        if (ix > 0 && shards[ix] == shards[ix - 1]) {
+            continue;
+        }
+        storage_shard_unlock(shards[ix]);
+    }
+
+}
+
+uint64_t storage_hash(const uint8_t *key, uint16_t len) {
+
+    // seeded per process, so clients can't pick keys that pile up in one
+    // shard or probe sequence
+    return hash64(key, len, hash64_seed);
+
+}
+
+struct storage_entry_t *storage_entry_new(const uint8_t *key, uint16_t key_len, const uint8_t *val, uint32_t val_len, int32_t type) {
+    // returns NULL if out of memory
+
+    struct storage_entry_t *entry = PyMem_RawMalloc(sizeof(struct storage_entry_t) + key_len + val_len);
+    if (!entry) {
+        return NULL;
+    }
+    memset(entry, 0, sizeof(struct storage_entry_t));
+    entry->hash = storage_hash(key, key_len);
+    entry->key_len = key_len;
+    entry->val_len = val_len;
+    entry->type = type;
+    memcpy(entry->data, key, key_len);
+    if (val_len) {
+        memcpy(entry->data + key_len, val, val_len);
+    }
+
+    return entry;
+
+}
+
+void storage_entry_free(struct storage_entry_t *entry) {
+
+    if (!entry) {
+        return;
+    }
+    struct storage_blob_t *blob = entry->queue.head;
+    while (blob) {
+        struct storage_blob_t *next = blob->next;
+        PyMem_RawFree(blob);
+        blob = next;
+    }
+    PyMem_RawFree(entry);
+
+}
+
+struct storage_blob_t *storage_blob_new(const uint8_t *data, uint32_t len) {
+
+    struct storage_blob_t *blob = PyMem_RawMalloc(sizeof(struct storage_blob_t) + len);
+    if (!blob) {
+        return NULL;
+    }
+    blob->next = NULL;
+    blob->len = len;
+    memcpy(blob->data, data, len);
+
+    return blob;
+
+}
+
+uint64_t storage_entry_size(const struct storage_entry_t *entry) {
+    // what the entry and its queue items take from maxmemory, its slot is
+    // counted with the table
+
+    return sizeof(struct storage_entry_t) + entry->key_len + entry->val_len + entry->queue.bytes;
+
+}
+
+const char *const storage_kind_names[] = {"int", "float", "str", "bytes", "tuple", "list", "bool", "datetime", "queue"};
+
+int32_t storage_entry_kind(const struct storage_entry_t *entry) {
+
+    if (entry->type == STORAGE_QUEUE) {
+        return STORAGE_KIND_QUEUE;
+    }
+    // values are validated, so they have at least their symbol
+    switch (entry->data[entry->key_len]) {
+        case INT_SYMBOL:
+            return STORAGE_KIND_INT;
+        case FLOAT_SYMBOL:
+            return STORAGE_KIND_FLOAT;
+        case STRING_SYMBOL:
+            return STORAGE_KIND_STR;
+        case TUPLE_SYMBOL:
+            return STORAGE_KIND_TUPLE;
+        case LIST_SYMBOL:
+            return STORAGE_KIND_LIST;
+        case BOOL_SYMBOL:
+            return STORAGE_KIND_BOOL;
+        case DATETIME_SYMBOL:
+            return STORAGE_KIND_DATETIME;
+        default:
+            return STORAGE_KIND_BYTES;
+    }
+
+}
+
+static inline void shard_count(struct storage_shard_t *shard, const struct storage_entry_t *entry) {
+    // adds an entry that was put in the shard to its memory and stats
+
+    uint64_t size = storage_entry_size(entry);
+    int32_t kind = storage_entry_kind(entry);
+    shard_add_memory(shard, size);
+    shard->kind_keys[kind]++;
+    shard->kind_bytes[kind] += size;
+
+}
+
+static inline void shard_uncount(struct storage_shard_t *shard, const struct storage_entry_t *entry) {
+
+    uint64_t size = storage_entry_size(entry);
+    int32_t kind = storage_entry_kind(entry);
+    shard_add_memory(shard, -(int64_t)size);
+    shard->kind_keys[kind]--;
+    shard->kind_bytes[kind] -= size;
+
+}
+
+// control bytes, full slots have the top bit set
+#define CTRL_EMPTY 0x00
+#define CTRL_DELETED 0x01
+
+static inline uint8_t ctrl_of(uint64_t hash) {
+
+    // the top bits pick the shard and the bits above the lowest 7 pick the group
+    return 0x80 | (hash & 0x7F);
+
+}
+
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t byte) {
+    // returns a mask with bit i set if ctrl[i] == byte
+
+    #ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+    #else
+    uint32_t mask = 0;
+    for (uint32_t ix = 0; ix < STORAGE_GROUP_SIZE; ix++) {
+        mask |= (uint32_t)(ctrl[ix] == byte) << ix;
+    }
+    return mask;
+    #endif
+
+}
+
+static int32_t table_init(struct storage_table_t *table, uint64_t num_slots) {
+
+    // a zeroed control byte is empty, so big tables come as untouched pages
+    // from calloc() and are only faulted in as they fill up
+    table->ctrl = PyMem_RawCalloc(num_slots, sizeof(uint8_t));
+    if (!table->ctrl) {
+        return -1;
+    }
+    // only slots with a full control byte are ever read
+    table->slots = PyMem_RawMalloc(num_slots * sizeof(struct storage_entry_t *));
+    if (!table->slots) {
+        PyMem_RawFree(table->ctrl);
+        table->ctrl = NULL;
+        return -1;
+    }
+    table->num_slots = num_slots;
+    table->size = 0;
+    table->num_deleted = 0;
+
+    return 0;
+
+}
+
+static void table_dealloc(struct storage_table_t *table, int32_t free_entries) {
+
+    if (free_entries) {
+        for (uint64_t ix = 0; ix < table->num_slots; ix++) {
+            if (table->ctrl[ix] & 0x80) {
+                storage_entry_free(table->slots[ix]);
+            }
+        }
+    }
+    PyMem_RawFree(table->ctrl);
+    PyMem_RawFree(table->slots);
+    memset(table, 0, sizeof(struct storage_table_t));
+
+}
+
+static int64_t table_find(struct storage_table_t *table, uint64_t hash, const uint8_t *key, uint16_t key_len) {
+    // returns the slot of `key`, or -1 if it is not in the table
+
+    if (!table->num_slots) {
+        return -1;
+    }
+
+    uint64_t group_mask = table->num_slots / STORAGE_GROUP_SIZE - 1;
+    uint64_t group = (hash >> 7) & group_mask;
+    uint8_t ctrl = ctrl_of(hash);
+
+    // triangular probing visits every group once
+    for (uint64_t step = 1; step <= group_mask + 1; step++) {
+        const uint8_t *group_ctrl = table->ctrl + group * STORAGE_GROUP_SIZE;
+        uint32_t match = group_match(group_ctrl, ctrl);
+        while (match) {
+            uint64_t ix = group * STORAGE_GROUP_SIZE + __builtin_ctz(match);
+            struct storage_entry_t *entry = table->slots[ix];
+            if (entry->hash == hash && entry->key_len == key_len && !memcmp(entry->data, key, key_len)) {
+                return ix;
+            }
+            match &= match - 1;
+        }
+        // inserts take the first free slot of the probe sequence, so the key
+        // can't be past a group that was never full
+        if (group_match(group_ctrl, CTRL_EMPTY)) {
+            return -1;
+        }
+        group = (group + step) & group_mask;
+    }
+
+    return -1;
+
+}
+
+static void table_put(struct storage_table_t *table, struct storage_entry_t *entry) {
+    // puts an entry that is not in the table yet in the first free slot of its
+    // probe sequence, the caller makes sure there is one
+
+    uint64_t group_mask = table->num_slots / STORAGE_GROUP_SIZE - 1;
+    uint64_t group = (entry->hash >> 7) & group_mask;
+
+    for (uint64_t step = 1; ; step++) {
+        const uint8_t *group_ctrl = table->ctrl + group * STORAGE_GROUP_SIZE;
+        uint32_t free_slots = group_match(group_ctrl, CTRL_EMPTY) | group_match(group_ctrl, CTRL_DELETED);
+        if (free_slots) {
+            uint64_t ix = group * STORAGE_GROUP_SIZE + __builtin_ctz(free_slots);
+            if (table->ctrl[ix] == CTRL_DELETED) {
+                table->num_deleted--;
+            }
+            table->ctrl[ix] = ctrl_of(entry->hash);
+            table->slots[ix] = entry;
+            table->size++;
+            return;
+        }
+        group = (group + step) & group_mask;
+    }
+
+}
+
+static void table_erase(struct storage_table_t *table, uint64_t ix) {
+
+    // a group with an empty slot has had one ever since the table was made, so
+    // no probe sequence ever went past it and the slot can be empty again
+    const uint8_t *group_ctrl = table->ctrl + (ix & ~(uint64_t)(STORAGE_GROUP_SIZE - 1));
+    if (group_match(group_ctrl, CTRL_EMPTY)) {
+        table->ctrl[ix] = CTRL_EMPTY;
+    } else {
+        table->ctrl[ix] = CTRL_DELETED;
+        table->num_deleted++;
+    }
+    table->size--;
+
+}
+
+static void storage_migrate(struct storage_shard_t *shard, uint64_t num_slots) {
+    // moves the entries of the next `num_slots` slots of the old table to the
+    // new one, and frees the old table once it is empty
+
+    struct storage_table_t *old = &shard->old;
+    if (!old->num_slots) {
+        return;
+    }
+
+    uint64_t end = shard->migrated + num_slots;
+    if (!num_slots || end > old->num_slots) {
+        end = old->num_slots;
+    }
+    for (uint64_t ix = shard->migrated; ix < end; ix++) {
+        if (old->ctrl[ix] & 0x80) {
+            table_put(&shard->table, old->slots[ix]);
+            old->ctrl[ix] = CTRL_DELETED;
+            old->size--;
+        }
+    }
+    shard->migrated = end;
+
+    if (shard->migrated == old->num_slots) {
+        table_dealloc(old, 0);
+        shard->migrated = 0;
+    }
+
+}
+
+static inline int32_t table_is_full(struct storage_table_t *table) {
+    // a table that is 7/8 full, counting deleted slots, has to be replaced
+    // before one more entry is put in it
+
+    return 16 * (table->size + table->num_deleted + 1) > 14 * table->num_slots;
+
+}
+
+static inline uint64_t table_grown_slots(struct storage_table_t *table) {
+    // the slots of the table that replaces a full one, at most 7/16 full.
+    // with many deleted slots that is a table of the same size.
+
+    uint64_t num_slots = table->num_slots;
+    while (16 * (table->size + 1) > 7 * num_slots) {
+        num_slots *= 2;
+    }
+
+    return num_slots;
+
+}
+
+static int32_t storage_grow(struct storage_shard_t *shard) {
+    // makes room for one more entry by replacing a full table
+
+    struct storage_table_t *table = &shard->table;
+    if (!table_is_full(table)) {
+        return 0;
+    }
+
+    // every write moves STORAGE_MIGRATE_SLOTS slots, which is done long before
+    // the new table fills up, but make sure anyway
+    storage_migrate(shard, 0);
+
+    uint64_t num_slots = table_grown_slots(table);
+    struct storage_table_t new_table;
+    if (table_init(&new_table, num_slots)) {
+        return -1;
+    }
+    // the old table is on its way out and isn't counted while it is migrated
+    shard_add_memory(shard, table_bytes(num_slots) - table_bytes(table->num_slots));
+    shard->old = *table;
+    shard->table = new_table;
+    shard->migrated = 0;
+
+    #if STORAGE_MIGRATE_SLOTS == 0
+    storage_migrate(shard, 0);
+    #endif
+
+    return 0;
+
+}
+
+void storage_prefetch(struct storage_shard_t *shard, uint64_t hash) {
+    // starts loading the control bytes and slots of the first group `key` is
+    // probed in, so looking up a batch of keys waits on memory once instead of
+    // once per key. the old table is left alone, it is rarely around.
+
+    struct storage_table_t *table = &shard->table;
+    if (!table->num_slots) {
+        return;
+    }
+    uint64_t group = (hash >> 7) & (table->num_slots / STORAGE_GROUP_SIZE - 1);
+    __builtin_prefetch(table->ctrl + group * STORAGE_GROUP_SIZE);
+    __builtin_prefetch(table->slots + group * STORAGE_GROUP_SIZE);
+
+}
+
+struct storage_entry_t *storage_find(struct storage_shard_t *shard, uint64_t hash, const uint8_t *key, uint16_t key_len) {
+
+    int64_t ix = table_find(&shard->table, hash, key, key_len);
+    if (ix >= 0) {
+        return shard->table.slots[ix];
+    }
+    ix = table_find(&shard->old, hash, key, key_len);
+    if (ix >= 0) {
+        return shard->old.slots[ix];
+    }
+
+    return NULL;
+
+}
+
+int32_t storage_insert(struct storage_shard_t *shard, struct storage_entry_t *entry, struct storage_entry_t **replaced) {
+    // inserts `entry` and sets `replaced` to the entry it replaced, or NULL, for
+    // the caller to free once the lock is released. returns -1 if out of memory,
+    // in which case the storage is unchanged.
+
+    *replaced = NULL;
+    storage_migrate(shard, STORAGE_MIGRATE_SLOTS);
+
+    struct storage_table_t *table = &shard->table;
+    int64_t ix = table_find(table, entry->hash, entry->data, entry->key_len);
+    if (ix >= 0) {
+        *replaced = table->slots[ix];
+        table->slots[ix] = entry;
+        entry->version = ++shard->version;
+        shard_uncount(shard, *replaced);
+        shard_count(shard, entry);
+        return 0;
+    }
+
+    if (storage_grow(shard)) {
+        return -1;
+    }
+
+    // new entries only go to the new table
+    ix = table_find(&shard->old, entry->hash, entry->data, entry->key_len);
+    if (ix < 0 && shard->index && index_add(shard->index, entry->data, entry->key_len)) {
+        return -1;
+    }
+    if (ix >= 0) {
+        *replaced = shard->old.slots[ix];
+        table_erase(&shard->old, ix);
+    }
+    table_put(&shard->table, entry);
+    entry->version = ++shard->version;
+    shard_count(shard, entry);
+    if (*replaced) {
+        shard_uncount(shard, *replaced);
+    } else {
+        shard->size++;
+    }
+
+    return 0;
+
+}
+
+struct storage_entry_t *storage_set_value(struct storage_shard_t *shard, struct storage_entry_t *entry, const uint8_t *val, uint32_t val_len) {
+    // replaces the value of `entry`, keeping its ttl and access, and returns the
+    // entry that now holds the key: `entry` itself if the value has the same
+    // length, which is most increments, or else a copy that replaced it. returns
+    // NULL if out of memory, in which case `entry` is unchanged.
+
+    if (val_len == entry->val_len) {
+        // the kind can still change, ex. an int incremented by a float
+        shard_uncount(shard, entry);
+        memcpy(entry->data + entry->key_len, val, val_len);
+        entry->version = ++shard->version;
+        shard_count(shard, entry);
+        return entry;
+    }
+
+    struct storage_entry_t *copy = storage_entry_new(entry->data, entry->key_len, val, val_len, STORAGE_VALUE);
+    if (!copy) {
+        return NULL;
+    }
+    copy->has_ttl = entry->has_ttl;
+    copy->access = entry->access;
+    copy->expires = entry->expires;
+
+    struct storage_entry_t *replaced;
+    if (storage_insert(shard, copy, &replaced)) {
+        PyMem_RawFree(copy);
+        return NULL;
+    }
+    storage_entry_free(replaced);
+
+    return copy;
+
+}
+
+struct storage_entry_t *storage_remove(struct storage_shard_t *shard, uint64_t hash, const uint8_t *key, uint16_t key_len) {
+    // unlinks the entry for `key` and returns it, or NULL if there is none
+
+    storage_migrate(shard, STORAGE_MIGRATE_SLOTS);
+
+    struct storage_entry_t *entry = NULL;
+    int64_t ix = table_find(&shard->table, hash, key, key_len);
+    if (ix >= 0) {
+        entry = shard->table.slots[ix];
+        table_erase(&shard->table, ix);
+    } else {
+        ix = table_find(&shard->old, hash, key, key_len);
+        if (ix >= 0) {
+            entry = shard->old.slots[ix];
+            table_erase(&shard->old, ix);
+        }
+    }
+    if (entry) {
+        shard->size--;
+        shard_uncount(shard, entry);
+        if (shard->index) {
+            index_remove(shard->index, entry->data, entry->key_len);
+        }
+    }
+
+    return entry;
+
+}
+
+void storage_queue_push(struct storage_shard_t *shard, struct storage_entry_t *entry, struct storage_blob_t *blob) {
+
+    uint32_t bytes = sizeof(struct storage_blob_t) + blob->len;
+    entry->queue.bytes += bytes;
+    shard_add_memory(shard, bytes);
+    shard->kind_bytes[STORAGE_KIND_QUEUE] += bytes;
+
+    blob->next = NULL;
+    if (entry->queue.tail) {
+        entry->queue.tail->next = blob;
+    } else {
+        entry->queue.head = blob;
+    }
+    entry->queue.tail = blob;
+    entry->queue.size++;
+    entry->version = ++shard->version;
+
+}
+
+struct storage_blob_t *storage_queue_pop(struct storage_shard_t *shard, struct storage_entry_t *entry) {
+    // returns NULL if the queue is empty, the caller frees the blob
+
+    struct storage_blob_t *blob = entry->queue.head;
+    if (!blob) {
+        return NULL;
+    }
+    entry->queue.head = blob->next;
+    if (!entry->queue.head) {
+        entry->queue.tail = NULL;
+    }
+    entry->queue.size--;
+    entry->version = ++shard->version;
+
+    uint32_t bytes = sizeof(struct storage_blob_t) + blob->len;
+    entry->queue.bytes -= bytes;
+    shard_add_memory(shard, -(int64_t)bytes);
+    shard->kind_bytes[STORAGE_KIND_QUEUE] -= bytes;
+
+    return blob;
+
+}
+
+
+// scanning
+// a scan visits the keys by their home group, the first group of their probe
+// sequence, in the order of Redis's reverse binary cursor: the cursor counts
+// up from the highest bit of the group index down. when a table doubles, the
+// keys of a home group are split between the group and the one its index plus
+// the old size, which share the bits the cursor has already counted through,
+// so a scan never misses a key that was there for all of it, however much the
+// tables grow in between.
+
+static inline uint64_t reverse_bits(uint64_t x) {
+
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+
+    return __builtin_bswap64(x);
+
+}
+
+static uint64_t scan_home_group(struct storage_table_t *table, uint64_t home, void (*emit)(struct storage_entry_t *, void *), void *arg) {
+    // emits the entries whose home group is `home`. like table_find(), they
+    // can't be past the first group of the probe sequence that has never been
+    // full. returns how many there were.
+
+    uint64_t group_mask = table->num_slots / STORAGE_GROUP_SIZE - 1;
+    uint64_t group = home;
+    uint64_t num_emitted = 0;
+
+    for (uint64_t step = 1; step <= group_mask + 1; step++) {
+        const uint8_t *group_ctrl = table->ctrl + group * STORAGE_GROUP_SIZE;
+        uint32_t full = ~(group_match(group_ctrl, CTRL_EMPTY) | group_match(group_ctrl, CTRL_DELETED)) & 0xFFFF;
+        while (full) {
+            struct storage_entry_t *entry = table->slots[group * STORAGE_GROUP_SIZE + __builtin_ctz(full)];
+            if (((entry->hash >> 7) & group_mask) == home) {
+                emit(entry, arg);
+                num_emitted++;
+            }
+            full &= full - 1;
+        }
+        if (group_match(group_ctrl, CTRL_EMPTY)) {
+            break;
+        }
+        group = (group + step) & group_mask;
+    }
+
+    return num_emitted;
+
+}
+
+uint64_t storage_scan(struct storage_shard_t *shard, uint64_t cursor, uint64_t *num_emitted, void (*emit)(struct storage_entry_t *, void *), void *arg) {
+
+    struct storage_table_t *small = &shard->table;
+    struct storage_table_t *large = &shard->old;
+    if (!small->num_slots) {
+        *num_emitted = 0;
+        return 0;
+    }
+    if (large->num_slots && large->num_slots < small->num_slots) {
+        small = &shard->old;
+        large = &shard->table;
+    }
+
+    uint64_t small_mask = small->num_slots / STORAGE_GROUP_SIZE - 1;
+    *num_emitted = scan_home_group(small, cursor & small_mask, emit, arg);
+
+    // while the shard migrates, the keys of the group are also in the groups
+    // of the larger table it splits into
+    if (large->num_slots) {
+        uint64_t large_mask = large->num_slots / STORAGE_GROUP_SIZE - 1;
+        do {
+            *num_emitted += scan_home_group(large, cursor & large_mask, emit, arg);
+            cursor = (((cursor | small_mask) + 1) & ~small_mask) | (cursor & small_mask);
+        } while (cursor & (small_mask ^ large_mask));
+    }
+
+    // count up from the highest bit of the smaller table's group index, it
+    // wraps around to 0 once every group has been visited
+    cursor |= ~small_mask;
+    cursor = reverse_bits(cursor);
+    cursor++;
+
+    return reverse_bits(cursor);
+
+}
+
+// sampling and eviction
+
+const char *const storage_policy_names[] = {"noeviction", "allkeys-lru", "allkeys-lfu", "volatile-ttl"};
+
+// new keys start with some accesses, so they aren't the first to be evicted
+// before they have had a chance to be read
+#define LFU_INIT 5
+// the higher the counter, the less likely an access increments it, it takes
+// about a million accesses to reach 255
+#define LFU_LOG_FACTOR 10
+// the counter is decremented once for every this many minutes without an access
+#define LFU_DECAY_MINUTES 1
+
+static inline uint64_t storage_random(void) {
+    // xorshift, per thread since writers of different shards evict at once
+
+    static __thread uint64_t state = 0;
+    if (!state) {
+        state = (hash64_seed ^ (uintptr_t)&state) | 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    return state;
+
+}
+
+static inline uint32_t storage_clock_ms(void) {
+
+    // the coarse clock is a few milliseconds behind, which is plenty to order
+    // accesses by, and wraps around every 49 days, which is what the unsigned
+    // subtractions of lru_idle() expect
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+
+}
+
+static inline uint32_t storage_clock_minutes(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec / 60) & 0xFFFFFF;
+
+}
+
+static inline uint32_t lfu_decayed(uint32_t access, uint32_t now_minutes) {
+    // the counter of `access`, less a decrement for every decay period since
+
+    uint32_t counter = access & 0xFF;
+    uint32_t elapsed = (now_minutes - (access >> 8)) & 0xFFFFFF;
+    uint32_t num_periods = elapsed / LFU_DECAY_MINUTES;
+
+    return num_periods > counter ? 0 : counter - num_periods;
+
+}
+
+void storage_touch(struct storage_t *storage, struct storage_entry_t *entry) {
+
+    // GETs touch entries under a shared lock, so the access is read and
+    // written atomically, and two GETs racing can lose an increment
+    switch (storage->policy) {
+        case STORAGE_ALLKEYS_LRU:
+            __atomic_store_n(&entry->access, storage_clock_ms(), __ATOMIC_RELAXED);
+            break;
+        case STORAGE_ALLKEYS_LFU: {
+            uint32_t now = storage_clock_minutes();
+            uint32_t counter = lfu_decayed(__atomic_load_n(&entry->access, __ATOMIC_RELAXED), now);
+            if (counter < 255) {
+                uint32_t base = counter > LFU_INIT ? counter - LFU_INIT : 0;
+                // increments with probability 1 / (base * LFU_LOG_FACTOR + 1)
+                if ((storage_random() >> 11) * (1.0 / 9007199254740992.0) * (base * LFU_LOG_FACTOR + 1) < 1.0) {
+                    counter++;
+                }
+            }
+            __atomic_store_n(&entry->access, (now << 8) | counter, __ATOMIC_RELAXED);
+            break;
+        }
+        default:
+            // nothing to record, and GETs don't write to the entries they read
+            break;
+    }
+
+}
+
+void storage_track(struct storage_t *storage, struct storage_entry_t *entry, const struct storage_entry_t *replaced) {
+
+    if (replaced) {
+        entry->access = replaced->access;
+        storage_touch(storage, entry);
+        return;
+    }
+    switch (storage->policy) {
+        case STORAGE_ALLKEYS_LRU:
+            entry->access = storage_clock_ms();
+            break;
+        case STORAGE_ALLKEYS_LFU:
+            entry->access = (storage_clock_minutes() << 8) | LFU_INIT;
+            break;
+    }
+
+}
+
+static int64_t eviction_score(struct storage_t *storage, const struct storage_entry_t *entry, uint32_t now) {
+    // the higher the score, the sooner the entry should be evicted, or -1 if
+    // the policy never evicts it
+
+    switch (storage->policy) {
+        case STORAGE_ALLKEYS_LRU:
+            // idle time, unsigned so the clock can wrap around
+            return (uint32_t)(now - entry->access);
+        case STORAGE_ALLKEYS_LFU:
+            return 255 - lfu_decayed(entry->access, now);
+        case STORAGE_VOLATILE_TTL:
+            if (!entry->has_ttl) {
+                return -1;
+            }
+            return (int64_t)UINT32_MAX - entry->expires;
+        default:
+            return -1;
+    }
+
+}
+
+static struct storage_table_t *shard_random_slot(struct storage_shard_t *shard, uint64_t *ix) {
+    // picks a random entry of the first group with entries from a random group
+    // on, or returns NULL if the shard is empty. tables don't shrink, so after
+    // many deletes most groups can be empty. one random entry of the group,
+    // taking several would mostly take the first slots, which new keys fill as
+    // soon as evictions free them.
+
+    // pick the table that is still being migrated by its share of the entries
+    struct storage_table_t *table = &shard->table;
+    if (shard->old.size && storage_random() % shard->size < shard->old.size) {
+        table = &shard->old;
+    }
+    if (!table->size) {
+        return NULL;
+    }
+
+    uint64_t group_mask = table->num_slots / STORAGE_GROUP_SIZE - 1;
+    uint64_t group = storage_random() & group_mask;
+    uint32_t full;
+    while (1) {
+        const uint8_t *group_ctrl = table->ctrl + group * STORAGE_GROUP_SIZE;
+        full = ~(group_match(group_ctrl, CTRL_EMPTY) | group_match(group_ctrl, CTRL_DELETED)) & 0xFFFF;
+        if (full) {
+            break;
+        }
+        group = (group + 1) & group_mask;
+    }
+    for (int32_t skip = storage_random() % __builtin_popcount(full); skip > 0; skip--) {
+        full &= full - 1;
+    }
+    *ix = group * STORAGE_GROUP_SIZE + __builtin_ctz(full);
+
+    return table;
+
+}
+
+struct storage_entry_t *storage_random_entry(struct storage_shard_t *shard) {
+
+    uint64_t ix;
+    struct storage_table_t *table = shard_random_slot(shard, &ix);
+
+    return table ? table->slots[ix] : NULL;
+
+}
+
+static int32_t storage_evict(struct storage_t *storage, struct storage_shard_t *shard, const struct storage_entry_t *keep) {
+    // evicts the entry with the highest score out of STORAGE_EVICTION_SAMPLES
+    // random entries of the shard other than `keep`, so an eviction takes
+    // about the same time however big the shard is. returns -1 if no sampled
+    // entry can be evicted.
+
+    if (!shard->size) {
+        return -1;
+    }
+
+    uint32_t now = 0;
+    if (storage->policy == STORAGE_ALLKEYS_LRU) {
+        now = storage_clock_ms();
+    } else if (storage->policy == STORAGE_ALLKEYS_LFU) {
+        now = storage_clock_minutes();
+    }
+
+    struct storage_table_t *best_table = NULL;
+    uint64_t best_ix = 0;
+    int64_t best_score = -1;
+    int32_t num_sampled = 0;
+
+    // a policy that skips most keys can take a few more entries than samples
+    for (int32_t visit = 0; visit < 4 * STORAGE_EVICTION_SAMPLES && num_sampled < STORAGE_EVICTION_SAMPLES; visit++) {
+        uint64_t ix;
+        struct storage_table_t *table = shard_random_slot(shard, &ix);
+        if (!table || table->slots[ix] == keep) {
+            continue;
+        }
+        int64_t score = eviction_score(storage, table->slots[ix], now);
+        if (score < 0) {
+            continue;
+        }
+        num_sampled++;
+        if (score > best_score) {
+            best_table = table;
+            best_ix = ix;
+            best_score = score;
+        }
+    }
+
+    if (!best_table) {
+        return -1;
+    }
+
+    struct storage_entry_t *entry = best_table->slots[best_ix];
+    table_erase(best_table, best_ix);
+    shard->size--;
+    shard_uncount(shard, entry);
+    if (shard->index) {
+        index_remove(shard->index, entry->data, entry->key_len);
+    }
+    // there is no one to hand the entry to, so it is freed under the lock.
+    // its ttl stays in the ttl heap, but a key is only expired while it has
+    // one, and giving the key a ttl again replaces the old one.
+    storage_entry_free(entry);
+    __atomic_fetch_add(&storage->evicted, 1, __ATOMIC_RELAXED);
+
+    return 0;
+
+}
+
+static int32_t storage_evict_elsewhere(struct storage_t *storage, struct storage_shard_t *shard) {
+    // evicts an entry of another shard, for a writer whose own shard has none
+    // to evict. the writer holds its shard, so the others are only tried, a
+    // shard locked by anyone else is skipped. returns -1 if none can evict.
+
+    uint32_t start = storage_random() % storage->num_shards;
+    for (uint32_t step = 0; step < storage->num_shards; step++) {
+        struct storage_shard_t *other = &storage->shards[(start + step) % storage->num_shards];
+        if (other == shard || !__atomic_load_n(&other->size, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        // the shards of a transaction are held by this thread already
+        int32_t held = num_held_shards && storage_shard_is_held(other);
+        if (!held && pthread_rwlock_trywrlock(&other->lock)) {
+            continue;
+        }
+        int32_t err = storage_evict(storage, other, NULL);
+        if (!held) {
+            pthread_rwlock_unlock(&other->lock);
+        }
+        if (!err) {
+            return 0;
+        }
+    }
+
+    return -1;
+
+}
+
+static uint64_t storage_growth(struct storage_shard_t *shard) {
+    // how many bytes the shard's table grows by if one more entry is inserted
+
+    struct storage_table_t *table = &shard->table;
+    if (!table_is_full(table)) {
+        return 0;
+    }
+
+    return table_bytes(table_grown_slots(table)) - table_bytes(table->num_slots);
+
+}
+
+int32_t storage_reserve(struct storage_t *storage, struct storage_shard_t *shard, uint64_t size, const struct storage_entry_t *keep) {
+
+    if (!storage->maxmemory) {
+        return 0;
+    }
+    int32_t num_evicted = 0;
+    // a write that keeps an entry doesn't take a slot of the table
+    uint64_t growth = keep ? 0 : storage_growth(shard);
+    while (storage_used_memory(storage) + size + growth > storage->maxmemory) {
+        if (storage->policy == STORAGE_NOEVICTION) {
+            return -1;
+        }
+        if (storage_evict(storage, shard, keep) && storage_evict_elsewhere(storage, shard)) {
+            return -1;
+        }
+        num_evicted++;
+    }
+
+    return num_evicted;
+
+}
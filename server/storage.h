@@ -0,0 +1,244 @@
+#ifndef _FOO_KV_STORAGE
+#define _FOO_KV_STORAGE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <Python.h>
+
+#include "index.h"
+
+// the keyspace is split into this many shards by key hash, a power of 2
+#define STORAGE_NUM_SHARDS 64
+
+// every shard's table starts with this many slots, a power of 2 and a
+// multiple of STORAGE_GROUP_SIZE
+#define STORAGE_MIN_SLOTS 64
+
+// slots are probed a group at a time, with one SSE2 compare of their control
+// bytes
+#define STORAGE_GROUP_SIZE 16
+
+// when a table grows, every write to its shard moves this many slots of the old
+// table to the new one, instead of moving them all at once. 0 moves them all at
+// once.
+#ifndef STORAGE_MIGRATE_SLOTS
+#define STORAGE_MIGRATE_SLOTS 32
+#endif
+
+// entries sampled by every eviction, the one the policy likes least is evicted
+#ifndef STORAGE_EVICTION_SAMPLES
+#define STORAGE_EVICTION_SAMPLES 5
+#endif
+
+enum {
+    STORAGE_VALUE = 0,
+    STORAGE_QUEUE = 1,
+};
+
+// what an entry holds, by the type symbol its value starts with, for stats
+enum {
+    STORAGE_KIND_INT = 0,
+    STORAGE_KIND_FLOAT = 1,
+    STORAGE_KIND_STR = 2,
+    STORAGE_KIND_BYTES = 3,
+    STORAGE_KIND_TUPLE = 4,
+    STORAGE_KIND_LIST = 5,
+    STORAGE_KIND_BOOL = 6,
+    STORAGE_KIND_DATETIME = 7,
+    STORAGE_KIND_QUEUE = 8,
+};
+#define STORAGE_NUM_KINDS 9
+
+// the names of the kinds, by value
+extern const char *const storage_kind_names[];
+
+// what storage_reserve() does when a write doesn't fit in maxmemory
+enum {
+    // refuse the write
+    STORAGE_NOEVICTION = 0,
+    // evict the least recently used key
+    STORAGE_ALLKEYS_LRU = 1,
+    // evict the least frequently used key
+    STORAGE_ALLKEYS_LFU = 2,
+    // evict the key with a ttl that expires first
+    STORAGE_VOLATILE_TTL = 3,
+};
+
+// the names of the policies, by value
+extern const char *const storage_policy_names[];
+#define STORAGE_NUM_POLICIES 4
+
+// an item of a queue, in its wire encoded form
+struct storage_blob_t {
+    struct storage_blob_t *next;
+    uint32_t len;
+    uint8_t data[];
+};
+
+struct storage_queue_t {
+    struct storage_blob_t *head;
+    struct storage_blob_t *tail;
+    uint32_t size;
+    // allocated for the items, headers included
+    uint32_t bytes;
+};
+
+// keys and values are stored as the bytes the client sent, so two keys are the
+// same key if and only if they are encoded the same way. the key is stored at
+// `data`, followed by the value unless the entry is a queue.
+struct storage_entry_t {
+    uint64_t hash;
+    uint32_t val_len;
+    uint16_t key_len;
+    uint8_t type;
+    // set while a ttl is pending for the key, so the ttl heap only has to be
+    // touched for keys that have one
+    uint8_t has_ttl;
+    // the last access in milliseconds for LRU, or the access counter in the
+    // low 8 bits and the minute it was last decayed in the rest for LFU. see
+    // storage_touch().
+    uint32_t access;
+    // when the ttl expires, in seconds since the epoch, if has_ttl is set
+    uint32_t expires;
+    // set by every write of the key, from its shard's counter, so a key's
+    // version only goes up, even if it is deleted and stored again
+    uint64_t version;
+    struct storage_queue_t queue;
+    uint8_t data[];
+};
+
+// an open addressing table in the style of abseil's swiss tables. every slot
+// has a control byte, which is empty, deleted, or 0x80 ORed with 7 bits of the
+// hash of the slot's key, so a lookup compares 16 control bytes at once and only
+// looks at the keys of the slots that match.
+struct storage_table_t {
+    uint8_t *ctrl;
+    struct storage_entry_t **slots;
+    uint64_t num_slots;
+    uint64_t size;
+    uint64_t num_deleted;
+};
+
+// a part of the keyspace with its own table.
+// while `table` grows, the entries that have not been moved out of the previous
+// table yet are still in `old`, from slot `migrated` on.
+// `lock` guards the tables: lookups that only read take it shared with
+// storage_shard_read_lock(), everything else takes it exclusive with
+// storage_shard_lock(). don't log or take the GIL while holding it.
+struct storage_shard_t {
+    pthread_rwlock_t lock;
+    struct storage_table_t table;
+    struct storage_table_t old;
+    uint64_t migrated;
+    uint64_t size;
+    // allocated for the table, entries and queue items. `old` is only around
+    // for a while and isn't counted.
+    uint64_t memory;
+    // the storage's memory, which the shard's is added to
+    uint64_t *storage_memory;
+    // the entries and their bytes, by kind
+    uint64_t kind_keys[STORAGE_NUM_KINDS];
+    uint64_t kind_bytes[STORAGE_NUM_KINDS];
+    // the last version given to an entry of the shard
+    uint64_t version;
+    // the storage's index, or NULL, which keys are added to and removed from
+    // while the shard's lock is held
+    struct index_t *index;
+};
+
+// native storage engine that never touches python objects, so it can be used
+// without holding the GIL. a key belongs to the shard picked by the top bits of
+// its hash, and the low bits pick its slot within the shard, so requests for
+// keys in different shards don't wait on each other.
+//
+// with a maxmemory, a write that doesn't fit in what all of the shards take
+// evicts entries of its own shard, so eviction never takes more than the lock
+// the write already holds. keys are spread evenly by their seeded hash, so
+// evictions are spread evenly over the shards too, while one shard can still
+// hold a value or a queue far larger than its share of maxmemory.
+struct storage_t {
+    struct storage_shard_t *shards;
+    uint32_t num_shards;
+    uint32_t shard_shift;
+    // 0 for no limit
+    uint64_t maxmemory;
+    int32_t policy;
+    // what all of the shards take, updated atomically by writers of any shard
+    uint64_t memory;
+    // updated atomically, by writers of any shard
+    uint64_t evicted;
+    // the ordered index of the keys, NULL unless enabled
+    struct index_t *index;
+};
+
+struct storage_t *storage_new(void);
+void storage_dealloc(struct storage_t *storage);
+void storage_set_maxmemory(struct storage_t *storage, uint64_t maxmemory, int32_t policy);
+// keeps an ordered index of the keys from now on, call before any are stored
+int32_t storage_enable_index(struct storage_t *storage);
+// these read the shards without their locks, so they are only approximate
+// while writes are going on
+uint64_t storage_used_memory(struct storage_t *storage);
+uint64_t storage_num_keys(struct storage_t *storage);
+uint64_t storage_hash(const uint8_t *key, uint16_t len);
+struct storage_shard_t *storage_shard(struct storage_t *storage, uint64_t hash);
+int32_t storage_shard_lock(struct storage_shard_t *shard);
+int32_t storage_shard_read_lock(struct storage_shard_t *shard);
+void storage_shard_unlock(struct storage_shard_t *shard);
+// for requests that touch several keys: sorts `shards` and locks each
+// distinct shard in address order, so two of them can never deadlock
+int32_t storage_lock_shards(struct storage_shard_t **shards, int32_t num_shards);
+int32_t storage_read_lock_shards(struct storage_shard_t **shards, int32_t num_shards);
+void storage_unlock_shards(struct storage_shard_t **shards, int32_t num_shards);
+// for transactions: storage_hold_shards() locks `shards` like
+// storage_lock_shards(), and until storage_release_shards() unlocks them,
+// locking or unlocking one of them on this thread does nothing, so the
+// commands of the transaction run under the locks it holds. their ttl updates
+// wait until the locks are let go of, but a command that fails still logs
+// under them, which doesn't deadlock since whoever waits for a shard with the
+// GIL lets go of it while it waits.
+int32_t storage_hold_shards(struct storage_shard_t **shards, int32_t num_shards);
+void storage_release_shards(void);
+
+// entries are allocated and freed outside of the lock
+struct storage_entry_t *storage_entry_new(const uint8_t *key, uint16_t key_len, const uint8_t *val, uint32_t val_len, int32_t type);
+void storage_entry_free(struct storage_entry_t *entry);
+struct storage_blob_t *storage_blob_new(const uint8_t *data, uint32_t len);
+uint64_t storage_entry_size(const struct storage_entry_t *entry);
+int32_t storage_entry_kind(const struct storage_entry_t *entry);
+
+// what a slot of a table takes, its control byte and its pointer
+#define STORAGE_SLOT_SIZE (sizeof(uint8_t) + sizeof(struct storage_entry_t *))
+
+// the following expect the lock of the key's shard to be held, exclusive
+// except for storage_prefetch(), storage_find(), storage_touch(),
+// storage_random_entry() and storage_scan()
+void storage_prefetch(struct storage_shard_t *shard, uint64_t hash);
+struct storage_entry_t *storage_find(struct storage_shard_t *shard, uint64_t hash, const uint8_t *key, uint16_t key_len);
+int32_t storage_insert(struct storage_shard_t *shard, struct storage_entry_t *entry, struct storage_entry_t **replaced);
+struct storage_entry_t *storage_set_value(struct storage_shard_t *shard, struct storage_entry_t *entry, const uint8_t *val, uint32_t val_len);
+struct storage_entry_t *storage_remove(struct storage_shard_t *shard, uint64_t hash, const uint8_t *key, uint16_t key_len);
+void storage_queue_push(struct storage_shard_t *shard, struct storage_entry_t *entry, struct storage_blob_t *blob);
+struct storage_blob_t *storage_queue_pop(struct storage_shard_t *shard, struct storage_entry_t *entry);
+// evicts entries of `shard` by the storage's policy until `size` more bytes fit
+// in maxmemory, and of the other shards that aren't locked once `shard` has
+// none left to evict. `keep` is the entry the write replaces or adds to, which is
+// never evicted, or NULL if the write inserts a new one. returns the number of
+// entries evicted, or -1 if they can't be made to fit.
+int32_t storage_reserve(struct storage_t *storage, struct storage_shard_t *shard, uint64_t size, const struct storage_entry_t *keep);
+// record an access to `entry` for the eviction policy. storage_track() starts
+// the history of an entry that was just inserted, or carries over the history
+// of the entry it replaced.
+void storage_touch(struct storage_t *storage, struct storage_entry_t *entry);
+void storage_track(struct storage_t *storage, struct storage_entry_t *entry, const struct storage_entry_t *replaced);
+// a random entry of the shard, or NULL if the shard is empty
+struct storage_entry_t *storage_random_entry(struct storage_shard_t *shard);
+// emits the entries of one step of a scan of the shard, starting at cursor 0,
+// and returns the cursor of the next step, or 0 once the scan is done. sets
+// `num_emitted` to how many entries it emitted, which may include ones an
+// earlier step emitted if the tables grew in between.
+uint64_t storage_scan(struct storage_shard_t *shard, uint64_t cursor, uint64_t *num_emitted, void (*emit)(struct storage_entry_t *, void *), void *arg);
+
+#endif
@@ -102,9 +102,22 @@ void foo_kv_ttl_tp_clear(foo_kv_ttl *self) {
     Py_XDECREF(self->key);
 }
 
+// freed ttl entries are kept here for foo_kv_ttl_new() to reuse, linked through
+// their `key`, like CPython's own free lists. only touched with the GIL held.
+static foo_kv_ttl *ttl_free_list = NULL;
+static int32_t ttl_free_list_size = 0;
+
 void foo_kv_ttl_tp_dealloc(foo_kv_ttl *self) {
     foo_kv_ttl_tp_clear(self);
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    if (Py_IS_TYPE(self, &FooKVTTLType) && ttl_free_list_size < TTL_FREE_LIST_MAX) {
+        self->key = (PyObject *)ttl_free_list;
+        ttl_free_list = self;
+        ttl_free_list_size++;
+        return;
+    }
+    // FooKVTTLType is never readied, so it has no tp_free. entries come from
+    // PyObject_New() in foo_kv_ttl_new()
+    PyObject_Free(self);
 }
 
 int32_t foo_kv_ttl_tp_init(foo_kv_ttl *self, PyObject *args, PyObject *kwargs) {
@@ -113,8 +126,17 @@ int32_t foo_kv_ttl_tp_init(foo_kv_ttl *self, PyObject *args, PyObject *kwargs) {
 
 foo_kv_ttl *foo_kv_ttl_new(PyObject *key, time_t seconds) {
 
-    PyObject *py_result = (PyObject *)PyObject_New(foo_kv_ttl, &FooKVTTLType);
-    foo_kv_ttl *result = (foo_kv_ttl *)py_result;
+    foo_kv_ttl *result = ttl_free_list;
+    if (result) {
+        ttl_free_list = (foo_kv_ttl *)result->key;
+        ttl_free_list_size--;
+        PyObject_Init((PyObject *)result, &FooKVTTLType);
+    } else {
+        result = PyObject_New(foo_kv_ttl, &FooKVTTLType);
+        if (!result) {
+            return NULL;
+        }
+    }
     result->ttl = seconds;
     Py_INCREF(key);
     result->key = key;
@@ -313,6 +335,10 @@ int32_t foo_kv_ttl_heap_put(foo_kv_ttl_heap *self, PyObject *key, time_t ttl) {
     }
 
     ttl_item = foo_kv_ttl_new(key, ttl);
+    if (!ttl_item) {
+        sem_post(self->lock);
+        return -1;
+    }
     #if _FOO_KV_DEBUG == 1
     log_debug("foo_kv_ttl_heap_put(): created new ttl");
     #endif
@@ -323,16 +349,19 @@ int32_t foo_kv_ttl_heap_put(foo_kv_ttl_heap *self, PyObject *key, time_t ttl) {
     if (final_ix == 0) {
         cond_notify(self->notifier);
     }
+    int32_t err = 0;
     if (PyDict_SetItem(self->key_to_ttl, key, (PyObject *)ttl_item) < 0) {
         ttl_item->is_valid = 0;
-        return -1;
+        err = -1;
     }
+    // the heap and key_to_ttl hold their own references
+    Py_DECREF(ttl_item);
 
     Py_BEGIN_ALLOW_THREADS
     sem_post(self->lock);
     Py_END_ALLOW_THREADS
 
-    return 0;
+    return err;
 
 }
 
@@ -356,24 +385,13 @@ int32_t foo_kv_ttl_heap_put_dt(foo_kv_ttl_heap *self, PyObject *key, PyObject *t
 
     #if _FOO_KV_DEBUG == 1
     char debug_buffer[256];
-    PyObject *ks = PyUnicode_FromFormat("%U", key);
-    PyObject *dts = PyUnicode_FromFormat("%d", (time_t)epoch);
-    if (!ks || !dts) {
-        log_debug("storage_ttl_loop(): unable to convert key or ttl to text!");
+    // keys are the wire encoded bytes of the client's key
+    if (result) {
+        sprintf(debug_buffer, "ttl_heap_put_dt(): failure: key: %.128s, ttl: %ld", PyBytes_AS_STRING(key), (long)epoch);
     } else {
-        PyObject *kb = PyUnicode_AsASCIIString(ks);
-        PyObject *dtb = PyUnicode_AsASCIIString(dts);
-        Py_DECREF(ks);
-        Py_DECREF(dts);
-        if (result) {
-            sprintf(debug_buffer, "ttl_heap_put_dt(): failure: key: %s, ttl: %s", PyBytes_AS_STRING(kb), PyBytes_AS_STRING(dtb));
-        } else {
-            sprintf(debug_buffer, "ttl_heap_put_dt(): success: key: %s, ttl: %s", PyBytes_AS_STRING(kb), PyBytes_AS_STRING(dtb));
-        }
-        Py_DECREF(kb);
-        Py_DECREF(dtb);
-        log_debug(debug_buffer);
+        sprintf(debug_buffer, "ttl_heap_put_dt(): success: key: %.128s, ttl: %ld", PyBytes_AS_STRING(key), (long)epoch);
     }
+    log_debug(debug_buffer);
     #endif
 
     return result;
@@ -477,25 +495,20 @@ PyObject *foo_kv_ttl_heap_get(foo_kv_ttl_heap *self) {
     }
 
     #if _FOO_KV_DEBUG == 1
-    PyObject *ks = PyUnicode_FromFormat("%U", next_ttl->key);
-    if (!ks) {
-        log_debug("storage_ttl_loop(): unable to convert expired key to text!");
-    } else {
-        PyObject *kb = PyUnicode_AsASCIIString(ks);
-        Py_DECREF(ks);
-        sprintf(debug_buffer, "ttl_heap_get(): got expired key: %s", PyBytes_AS_STRING(kb));
-        Py_DECREF(kb);
-        log_debug(debug_buffer);
-    }
+    sprintf(debug_buffer, "ttl_heap_get(): got expired key: %.128s", PyBytes_AS_STRING(next_ttl->key));
+    log_debug(debug_buffer);
     #endif
 
     Py_BEGIN_ALLOW_THREADS
     sem_post(self->lock);
     Py_END_ALLOW_THREADS
 
+    // the ttl may go back to the free list, so take the key out first
+    PyObject *expired_key = next_ttl->key;
+    Py_INCREF(expired_key);
     Py_DECREF(next_ttl);
 
-    return next_ttl->key;
+    return expired_key;
 
 }
 
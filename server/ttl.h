@@ -10,6 +10,8 @@
 #include "pythontypes.h"
 
 #define TTL_HEAP_DEFAULT_SIZE 4096
+// how many freed ttl entries are kept for reuse
+#define TTL_FREE_LIST_MAX 1024
 
 // allocation method declarations
 PyObject *foo_kv_ttl_tp_new(PyTypeObject *subtype, PyObject *args, PyObject *kwargs);
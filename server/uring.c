@@ -0,0 +1,416 @@
+// minimal io_uring bindings on top of the raw syscalls
+// only what the reactor needs: multishot poll, multishot recv from a ring of
+// provided buffers, send, read and cancel
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/time_types.h>
+#include <linux/io_uring.h>
+
+#include "util.h"
+#include "uring.h"
+
+// CHANGE ME
+#define _FOO_KV_DEBUG 1
+
+static int sys_io_uring_setup(uint32_t entries, struct io_uring_params *params) {
+
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+
+}
+
+static int sys_io_uring_enter(int ring_fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags, void *arg, size_t argsz) {
+
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, argsz);
+
+}
+
+static int sys_io_uring_register(int ring_fd, uint32_t opcode, void *arg, uint32_t nr_args) {
+
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+
+}
+
+static int32_t uring_self_test(struct uring_t *uring) {
+    // setting up the ring and registering the buffers does not prove that the
+    // kernel supports multishot recv (6.0+), so receive a byte over a socketpair
+    // returns 0 if it works, -1 otherwise
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv)) {
+        return -1;
+    }
+
+    int32_t ok = 0;
+    struct io_uring_cqe cqe;
+
+    if (uring_prep_recv(uring, sv[0], 0) < 0 || write(sv[1], "x", 1) != 1) {
+        goto URING_SELF_TEST_END;
+    }
+    if (uring_submit_and_wait(uring, 1000) < 0 || !uring_pop_cqe(uring, &cqe)) {
+        goto URING_SELF_TEST_END;
+    }
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        uring_buf_recycle(uring, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    ok = cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER) && (cqe.flags & IORING_CQE_F_MORE);
+
+URING_SELF_TEST_END:
+
+    // shutting the socket down terminates the receive, wait for its final completion
+    shutdown(sv[0], SHUT_RDWR);
+    for (int32_t ix = 0; ix < 10; ix++) {
+        if (!uring_pop_cqe(uring, &cqe)) {
+            if (uring_submit_and_wait(uring, 100) < 0) {
+                break;
+            }
+            continue;
+        }
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            uring_buf_recycle(uring, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            break;
+        }
+    }
+    close(sv[0]);
+    close(sv[1]);
+
+    return ok ? 0 : -1;
+
+}
+
+struct uring_t *uring_new(void) {
+    // returns NULL if the kernel does not support everything the reactor needs
+    // does not set a python error, the caller is expected to fall back to epoll
+
+    struct uring_t *uring = PyMem_RawCalloc(1, sizeof(struct uring_t));
+    if (!uring) {
+        return NULL;
+    }
+    uring->ring_fd = -1;
+    uring->ring_ptr = MAP_FAILED;
+    uring->sqes = MAP_FAILED;
+    uring->buf_ring = MAP_FAILED;
+
+    struct io_uring_params params = {};
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    uring->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (uring->ring_fd < 0 && errno == EINVAL) {
+        // IORING_SETUP_COOP_TASKRUN needs 5.19, retry without it and let the
+        // feature checks below decide
+        memset(&params, 0, sizeof(params));
+        uring->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (uring->ring_fd < 0) {
+        log_info("uring_new(): io_uring_setup() failed");
+        goto URING_NEW_ERROR;
+    }
+
+    uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        log_info("uring_new(): kernel lacks required io_uring features");
+        goto URING_NEW_ERROR;
+    }
+
+    // with IORING_FEAT_SINGLE_MMAP the submission and completion rings share one mapping
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    uring->ring_ptr = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+    if (uring->ring_ptr == MAP_FAILED) {
+        log_error("uring_new(): failed to map rings");
+        goto URING_NEW_ERROR;
+    }
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        log_error("uring_new(): failed to map submission queue entries");
+        goto URING_NEW_ERROR;
+    }
+
+    uint8_t *ring = uring->ring_ptr;
+    uring->sq_head = (uint32_t *)(ring + params.sq_off.head);
+    uring->sq_tail = (uint32_t *)(ring + params.sq_off.tail);
+    uring->sq_mask = *(uint32_t *)(ring + params.sq_off.ring_mask);
+    uring->sq_entries = *(uint32_t *)(ring + params.sq_off.ring_entries);
+    uring->sq_local_tail = *uring->sq_tail;
+    uring->sq_unsubmitted = 0;
+    uring->cq_head = (uint32_t *)(ring + params.cq_off.head);
+    uring->cq_tail = (uint32_t *)(ring + params.cq_off.tail);
+    uring->cq_mask = *(uint32_t *)(ring + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    // submission slots are always used in order, so the index array is the identity
+    uint32_t *sq_array = (uint32_t *)(ring + params.sq_off.array);
+    for (uint32_t ix = 0; ix < uring->sq_entries; ix++) {
+        sq_array[ix] = ix;
+    }
+
+    // provided buffers (5.19+)
+    uring->buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    uring->buf_ring = mmap(NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->buf_ring == MAP_FAILED) {
+        log_error("uring_new(): failed to map provided buffer ring");
+        goto URING_NEW_ERROR;
+    }
+    uring->bufs = PyMem_RawMalloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!uring->bufs) {
+        log_error("uring_new(): failed to allocate provided buffers");
+        goto URING_NEW_ERROR;
+    }
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)(uintptr_t)uring->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_io_uring_register(uring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        log_info("uring_new(): kernel does not support provided buffer rings");
+        goto URING_NEW_ERROR;
+    }
+    uring->buf_tail = 0;
+    for (uint32_t ix = 0; ix < URING_BUF_COUNT; ix++) {
+        uring_buf_recycle(uring, (uint16_t)ix);
+    }
+
+    if (uring_self_test(uring) < 0) {
+        log_info("uring_new(): kernel does not support multishot recv");
+        goto URING_NEW_ERROR;
+    }
+
+    return uring;
+
+URING_NEW_ERROR:
+
+    uring_dealloc(uring);
+
+    return NULL;
+
+}
+
+void uring_dealloc(struct uring_t *uring) {
+
+    // closing the ring also unregisters the provided buffers
+    if (uring->ring_fd >= 0) {
+        close(uring->ring_fd);
+    }
+    if (uring->sqes != MAP_FAILED) {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+    if (uring->ring_ptr != MAP_FAILED) {
+        munmap(uring->ring_ptr, uring->ring_size);
+    }
+    if (uring->buf_ring != MAP_FAILED) {
+        munmap(uring->buf_ring, uring->buf_ring_size);
+    }
+    PyMem_RawFree(uring->bufs);
+    PyMem_RawFree(uring);
+
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring_t *uring) {
+
+    uint32_t head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    if (uring->sq_local_tail - head >= uring->sq_entries) {
+        // the submission queue is full, hand what we have to the kernel first
+        if (uring_submit_and_wait(uring, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+        if (uring->sq_local_tail - head >= uring->sq_entries) {
+            log_error("uring_get_sqe(): submission queue is full");
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &uring->sqes[uring->sq_local_tail & uring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    return sqe;
+
+}
+
+static void uring_commit_sqe(struct uring_t *uring) {
+
+    uring->sq_local_tail++;
+    uring->sq_unsubmitted++;
+    __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+
+}
+
+int32_t uring_prep_poll(struct uring_t *uring, int fd) {
+    // multishot poll for readability, used for the listening socket and the wake-up eventfd
+
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_UD(URING_OP_POLL, fd, 0);
+    uring_commit_sqe(uring);
+
+    return 0;
+
+}
+
+int32_t uring_prep_recv(struct uring_t *uring, int fd, int32_t connid) {
+    // multishot recv: posts one completion per chunk received, each one in a
+    // provided buffer, until it fails, runs out of buffers, or hits EOF
+
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = URING_UD(URING_OP_RECV, fd, connid);
+    uring_commit_sqe(uring);
+
+    return 0;
+
+}
+
+int32_t uring_prep_send(struct uring_t *uring, int fd, int32_t connid, const uint8_t *buff, size_t len) {
+    // `buff` must stay valid until the completion arrives
+
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buff;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_UD(URING_OP_SEND, fd, connid);
+    uring_commit_sqe(uring);
+
+    return 0;
+
+}
+
+int32_t uring_prep_read(struct uring_t *uring, int fd, void *buff, size_t len) {
+    // a single read, used for the wake-up eventfd so that consuming it costs no syscall
+
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buff;
+    sqe->len = (uint32_t)len;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = URING_UD(URING_OP_READ, fd, 0);
+    uring_commit_sqe(uring);
+
+    return 0;
+
+}
+
+int32_t uring_prep_cancel(struct uring_t *uring, uint64_t user_data) {
+
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = URING_UD(URING_OP_CANCEL, URING_UD_FD(user_data), URING_UD_CONNID(user_data));
+    uring_commit_sqe(uring);
+
+    return 0;
+
+}
+
+int32_t uring_submit_and_wait(struct uring_t *uring, int32_t timeout) {
+    // submits everything prepared since the last call in a single syscall, then
+    // waits up to `timeout` milliseconds for at least one completion
+    // a timeout of 0 only submits
+
+    if (timeout <= 0 && !uring->sq_unsubmitted) {
+        return 0;
+    }
+
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    uint32_t flags = 0;
+    uint32_t min_complete = 0;
+    if (timeout > 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        min_complete = 1;
+    }
+
+    int rv;
+    do {
+        Py_BEGIN_ALLOW_THREADS
+        rv = sys_io_uring_enter(uring->ring_fd, uring->sq_unsubmitted, min_complete, flags, flags ? &arg : NULL, flags ? sizeof(arg) : 0);
+        Py_END_ALLOW_THREADS
+    } while (rv < 0 && errno == EINTR);
+
+    if (rv >= 0) {
+        uring->sq_unsubmitted -= ((uint32_t)rv < uring->sq_unsubmitted) ? (uint32_t)rv : uring->sq_unsubmitted;
+        return 0;
+    }
+
+    // ETIME: nothing completed before the timeout
+    // EBUSY/EAGAIN: completions are backed up, the caller has to reap some first
+    if (errno == ETIME || errno == EBUSY || errno == EAGAIN) {
+        return 0;
+    }
+
+    log_error("uring_submit_and_wait(): io_uring_enter() failed");
+    return -1;
+
+}
+
+int32_t uring_pop_cqe(struct uring_t *uring, struct io_uring_cqe *cqe) {
+    // copies the oldest completion into `cqe` and frees its slot
+    // returns 1 if there was a completion, 0 otherwise
+
+    uint32_t head = *uring->cq_head;
+    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    *cqe = uring->cqes[head & uring->cq_mask];
+    __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+
+}
+
+uint8_t *uring_buf(struct uring_t *uring, uint16_t bid) {
+
+    return uring->bufs + (size_t)bid * URING_BUF_SIZE;
+
+}
+
+void uring_buf_recycle(struct uring_t *uring, uint16_t bid) {
+    // gives a provided buffer back to the kernel
+
+    struct io_uring_buf *buf = &uring->buf_ring->bufs[uring->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(uring, bid);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    uring->buf_tail++;
+    __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+
+}
@@ -0,0 +1,72 @@
+#ifndef _FOO_KV_URING
+#define _FOO_KV_URING
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#include <Python.h>
+
+#define URING_ENTRIES 1024
+// number of provided receive buffers, must be a power of 2
+#define URING_BUF_COUNT 256
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+
+// user_data layout: | op (8 bits) | fd (24 bits) | connid (32 bits) |
+// the connid tells completions for a closed connection apart from completions
+// for a new connection that was given the same fd
+#define URING_OP_POLL 1
+#define URING_OP_RECV 2
+#define URING_OP_SEND 3
+#define URING_OP_CANCEL 4
+#define URING_OP_READ 5
+
+#define URING_UD(op, fd, connid) \
+    (((uint64_t)(op) << 56) | (((uint64_t)(fd) & 0xffffff) << 32) | (uint64_t)(uint32_t)(connid))
+#define URING_UD_OP(ud) ((int32_t)((ud) >> 56))
+#define URING_UD_FD(ud) ((int)(((ud) >> 32) & 0xffffff))
+#define URING_UD_CONNID(ud) ((int32_t)(uint32_t)(ud))
+
+// a raw io_uring instance (no liburing) plus one ring of provided buffers that
+// multishot receives pick from.
+// a uring_t has a single submitter: only the thread that owns it may prepare
+// submissions, submit, or consume completions.
+struct uring_t {
+    int ring_fd;
+    // submission queue
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t sq_local_tail;
+    uint32_t sq_unsubmitted;
+    struct io_uring_sqe *sqes;
+    // completion queue
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+    // mappings
+    void *ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+    // provided buffers
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint8_t *bufs;
+    uint16_t buf_tail;
+};
+
+struct uring_t *uring_new(void);
+void uring_dealloc(struct uring_t *uring);
+int32_t uring_prep_poll(struct uring_t *uring, int fd);
+int32_t uring_prep_recv(struct uring_t *uring, int fd, int32_t connid);
+int32_t uring_prep_send(struct uring_t *uring, int fd, int32_t connid, const uint8_t *buff, size_t len);
+int32_t uring_prep_read(struct uring_t *uring, int fd, void *buff, size_t len);
+int32_t uring_prep_cancel(struct uring_t *uring, uint64_t user_data);
+int32_t uring_submit_and_wait(struct uring_t *uring, int32_t timeout);
+int32_t uring_pop_cqe(struct uring_t *uring, struct io_uring_cqe *cqe);
+uint8_t *uring_buf(struct uring_t *uring, uint16_t bid);
+void uring_buf_recycle(struct uring_t *uring, uint16_t bid);
+
+#endif
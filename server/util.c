@@ -5,6 +5,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <linux/futex.h>
 #include <pthread.h>
 
 #include "util.h"
@@ -72,8 +76,16 @@ PyObject *_timestamp_str = NULL;
 PyObject *_isinstance_f = NULL;
 
 
+// 1 if the logger handles debug messages, see log_refresh_level()
+int32_t _log_debug_enabled = 1;
+
 // error handling
 void log_msg(const char *msg, PyObject *method) {
+    // callable with or without the GIL, dispatch runs without it
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    // don't lose an exception the caller is about to raise
+    PyObject *err_type, *err_value, *err_traceback;
+    PyErr_Fetch(&err_type, &err_value, &err_traceback);
     Py_INCREF(_logger);
     Py_INCREF(method);
     PyObject *py_msg = PyUnicode_FromString(msg);
@@ -115,10 +127,25 @@ void log_msg(const char *msg, PyObject *method) {
             fprintf(stderr, "log_msg(): no python error was raised by logger\n");
         }
     }
-    Py_DECREF(res);
+    Py_XDECREF(res);
+    PyErr_Restore(err_type, err_value, err_traceback);
+    PyGILState_Release(gstate);
     return;
 }
 
+void log_refresh_level(void) {
+    // call with the GIL held, after logging has been configured
+
+    PyObject *res = PyObject_CallMethod(_logger, "isEnabledFor", "i", 10);
+    if (!res) {
+        PyErr_Clear();
+        return;
+    }
+    _log_debug_enabled = PyObject_IsTrue(res) == 1;
+    Py_DECREF(res);
+
+}
+
 void log_error(const char *msg) {
     log_msg(msg, _error_str);
 }
@@ -132,6 +159,10 @@ void log_info(const char *msg) {
 }
 
 void log_debug(const char *msg) {
+    // debug messages are dropped before they need the GIL
+    if (!_log_debug_enabled) {
+        return;
+    }
     log_msg(msg, _debug_str);
 }
 
@@ -169,6 +200,96 @@ int32_t hash_given_len(const uint8_t *s, size_t n) {
 
 }
 
+// picked by hash64_seed_init() when the module is loaded, so clients can't
+// know which keys collide
+uint64_t hash64_seed = 0;
+
+void hash64_seed_init(void) {
+
+    uint64_t seed;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+        // early in boot, the entropy pool may not be ready yet
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 16);
+    }
+    hash64_seed = seed;
+
+}
+
+// wyhash (final version 4, by Wang Yi), which reads 8 bytes at a time and
+// mixes them with 64x64->128 bit multiplies
+static const uint64_t wy_secret[4] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
+
+static inline void wy_mum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wy_read8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t wy_read4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t hash64(const uint8_t *s, size_t n, uint64_t seed) {
+
+    const uint8_t *p = s;
+    uint64_t a, b;
+    seed ^= wy_mix(seed ^ wy_secret[0], wy_secret[1]);
+
+    if (n <= 16) {
+        if (n >= 4) {
+            a = (wy_read4(p) << 32) | wy_read4(p + ((n >> 3) << 2));
+            b = (wy_read4(p + n - 4) << 32) | wy_read4(p + n - 4 - ((n >> 3) << 2));
+        } else if (n > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[n >> 1] << 8) | p[n - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t left = n;
+        if (left > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = wy_mix(wy_read8(p) ^ wy_secret[1], wy_read8(p + 8) ^ seed);
+                seed1 = wy_mix(wy_read8(p + 16) ^ wy_secret[2], wy_read8(p + 24) ^ seed1);
+                seed2 = wy_mix(wy_read8(p + 32) ^ wy_secret[3], wy_read8(p + 40) ^ seed2);
+                p += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (left > 16) {
+            seed = wy_mix(wy_read8(p) ^ wy_secret[1], wy_read8(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        a = wy_read8(p + left - 16);
+        b = wy_read8(p + left - 8);
+    }
+
+    a ^= wy_secret[1];
+    b ^= seed;
+    wy_mum(&a, &b);
+
+    return wy_mix(a ^ wy_secret[0] ^ n, b ^ wy_secret[1]);
+
+}
+
 int32_t hash(const uint8_t *s) {
 
     int32_t x = *s << 7;
@@ -187,6 +308,92 @@ int32_t hash(const uint8_t *s) {
 
 }
 
+static int32_t glob_class(const uint8_t *pattern, int32_t pattern_len, int32_t start, uint8_t c, int32_t *end) {
+    // matches `c` against the class that starts after a '[' at `start`, and
+    // sets `end` to its closing ']', or the last byte if it has none
+
+    int32_t ix = start;
+    int32_t negate = ix < pattern_len && pattern[ix] == '^';
+    int32_t matched = 0;
+    if (negate) {
+        ix++;
+    }
+    for (; ix < pattern_len && pattern[ix] != ']'; ix++) {
+        if (pattern[ix] == '\\' && ix + 1 < pattern_len) {
+            ix++;
+            matched |= pattern[ix] == c;
+        } else if (ix + 2 < pattern_len && pattern[ix + 1] == '-' && pattern[ix + 2] != ']') {
+            uint8_t lo = pattern[ix] < pattern[ix + 2] ? pattern[ix] : pattern[ix + 2];
+            uint8_t hi = pattern[ix] < pattern[ix + 2] ? pattern[ix + 2] : pattern[ix];
+            matched |= c >= lo && c <= hi;
+            ix += 2;
+        } else {
+            matched |= pattern[ix] == c;
+        }
+    }
+    *end = ix < pattern_len ? ix : pattern_len - 1;
+
+    return matched != negate;
+
+}
+
+int32_t glob_match(const uint8_t *pattern, int32_t pattern_len, const uint8_t *s, int32_t len) {
+    // matches `s` against `pattern` like Redis's SCAN MATCH: `*` is any run of
+    // bytes, `?` any byte, `[abc]`, `[a-z]` and `[^abc]` classes, and `\` makes
+    // the next byte literal. returns 1 if it matches. only the last `*` is
+    // backtracked to, so it takes O(pattern_len * len) at worst.
+
+    int32_t p = 0;
+    int32_t ix = 0;
+    int32_t star_p = -1;
+    int32_t star_ix = 0;
+
+    while (ix < len) {
+        if (p < pattern_len) {
+            uint8_t c = pattern[p];
+            int32_t end;
+            if (c == '*') {
+                star_p = p++;
+                star_ix = ix;
+                continue;
+            }
+            if (c == '?') {
+                p++;
+                ix++;
+                continue;
+            }
+            if (c == '[') {
+                if (glob_class(pattern, pattern_len, p + 1, s[ix], &end)) {
+                    p = end + 1;
+                    ix++;
+                    continue;
+                }
+            } else {
+                if (c == '\\' && p + 1 < pattern_len) {
+                    c = pattern[++p];
+                }
+                if (c == s[ix]) {
+                    p++;
+                    ix++;
+                    continue;
+                }
+            }
+        }
+        // let the last `*` take one more byte
+        if (star_p < 0) {
+            return 0;
+        }
+        p = star_p + 1;
+        ix = ++star_ix;
+    }
+    while (p < pattern_len && pattern[p] == '*') {
+        p++;
+    }
+
+    return p == pattern_len;
+
+}
+
 int32_t read_full(int fd, char *buff, size_t n) {
     while (n > 0) {
         ssize_t rv = read(fd, buff, n);
@@ -663,15 +870,28 @@ void intq_destroy(struct intq_t *intq) {
         PyMem_RawFree(node);
         node = next;
     }
+    node = intq->spare;
+    while (node) {
+        next = node->next;
+        PyMem_RawFree(node);
+        node = next;
+    }
     PyMem_RawFree(intq);
 }
 
 int32_t intq_put(struct intq_t *intq, int32_t val) {
 
     if (intq->back_ix >= INTQ_NODE_SIZE) {
-        struct intq_node_t *newnode = PyMem_RawCalloc(1, sizeof(struct intq_node_t));
-        if (!newnode) {
-            return -1;
+        struct intq_node_t *newnode = intq->spare;
+        if (newnode) {
+            intq->spare = newnode->next;
+            intq->num_spare--;
+            newnode->next = NULL;
+        } else {
+            newnode = PyMem_RawCalloc(1, sizeof(struct intq_node_t));
+            if (!newnode) {
+                return -1;
+            }
         }
         intq->back->next = newnode;
         intq->back = newnode;
@@ -701,7 +921,13 @@ int32_t intq_get(struct intq_t *intq) {
         } else {
             struct intq_node_t *oldnode = intq->front;
             intq->front = intq->front->next;
-            PyMem_RawFree(oldnode);
+            if (intq->num_spare < INTQ_MAX_SPARE) {
+                oldnode->next = intq->spare;
+                intq->spare = oldnode;
+                intq->num_spare++;
+            } else {
+                PyMem_RawFree(oldnode);
+            }
             intq->front_ix = 0;
         }
     }
@@ -886,10 +1112,174 @@ int32_t cond_notify(struct cond_t *cond) {
 
 }
 
+struct connring_t *connring_new(uint32_t capacity) {
+    // capacity is rounded up to a power of 2
+
+    uint32_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    struct connring_t *ring = PyMem_RawCalloc(1, sizeof(struct connring_t));
+    if (!ring) {
+        return NULL;
+    }
+    ring->cells = PyMem_RawCalloc(size, sizeof(struct connring_cell_t));
+    if (!ring->cells) {
+        PyMem_RawFree(ring);
+        return NULL;
+    }
+    for (uint32_t ix = 0; ix < size; ix++) {
+        ring->cells[ix].seq = ix;
+    }
+    ring->mask = size - 1;
+
+    return ring;
+
+}
+
+void connring_destroy(struct connring_t *ring) {
+    PyMem_RawFree(ring->cells);
+    PyMem_RawFree(ring);
+}
+
+int32_t connring_push(struct connring_t *ring, int32_t val) {
+    // returns -1 if the ring is full
+    // does not wake anyone up, see connring_notify()
+
+    uint32_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+
+    while (1) {
+        struct connring_cell_t *cell = &ring->cells[pos & ring->mask];
+        uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            // the cell is free for this lap, try to claim it
+            if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->val = val;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+            // a failed CAS reloads `pos`
+        } else if (diff < 0) {
+            // the cell still holds the value from the previous lap
+            return -1;
+        } else {
+            // another producer got here first
+            pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+}
+
+int32_t connring_pop(struct connring_t *ring) {
+    // returns -1 if the ring is empty, so only non-negative values may be pushed
+
+    uint32_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+
+    while (1) {
+        struct connring_cell_t *cell = &ring->cells[pos & ring->mask];
+        uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)(seq - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                int32_t val = cell->val;
+                // free the cell for the next lap
+                __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+                return val;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+}
+
+int32_t connring_pop_wait(struct connring_t *ring, int32_t timeout) {
+    // pops a value, parking the calling thread for up to `timeout` milliseconds
+    // if the ring is empty
+    // returns -1 if nothing could be popped, which is not necessarily a timeout:
+    // another consumer may have taken the value this thread was woken up for
+
+    int32_t val = connring_pop(ring);
+    if (val >= 0) {
+        return val;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+
+    // read the futex word before announcing ourselves and checking again:
+    // a push that we miss on the second check bumps the word, and then the
+    // futex wait returns right away
+    uint32_t seq = __atomic_load_n(&ring->futex_seq, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&ring->nparked, 1, __ATOMIC_SEQ_CST);
+
+    val = connring_pop(ring);
+    if (val < 0) {
+        Py_BEGIN_ALLOW_THREADS
+        syscall(SYS_futex, &ring->futex_seq, FUTEX_WAIT_PRIVATE, seq, &ts, NULL, 0);
+        Py_END_ALLOW_THREADS
+        // EAGAIN, ETIMEDOUT and EINTR all mean the same thing here: look again
+        val = connring_pop(ring);
+    }
+
+    __atomic_sub_fetch(&ring->nparked, 1, __ATOMIC_SEQ_CST);
+
+    return val;
+
+}
+
+int32_t connring_notify(struct connring_t *ring) {
+    // wakes up one parked consumer, call after connring_push()
+    // costs a fence and a load when nobody is parked
+
+    // pairs with the increment of `nparked` in connring_pop_wait(): either the
+    // consumer sees the pushed value, or we see the consumer
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&ring->nparked, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    __atomic_add_fetch(&ring->futex_seq, 1, __ATOMIC_RELEASE);
+    if (syscall(SYS_futex, &ring->futex_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0) < 0) {
+        log_error("connring_notify(): futex wake failed");
+        return -1;
+    }
+
+    return 0;
+
+}
+
+uint32_t max_open_fds() {
+    // the soft RLIMIT_NOFILE, which bounds how many connections can exist at once
+    // clamped to [1024, 2**20]
+
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) || rlim.rlim_cur == RLIM_INFINITY || rlim.rlim_cur > (1 << 20)) {
+        return 1 << 20;
+    }
+    if (rlim.rlim_cur < 1024) {
+        return 1024;
+    }
+
+    return (uint32_t)rlim.rlim_cur;
+
+}
+
 int32_t threadsafe_sem_wait(sem_t *sem) {
+    // gives up the GIL while waiting if the caller holds it, dispatch calls
+    // this without the GIL
 
     int32_t res;
 
+    if (!PyGILState_Check()) {
+        return sem_wait(sem);
+    }
+
     Py_BEGIN_ALLOW_THREADS
     res = sem_wait(sem);
     Py_END_ALLOW_THREADS
@@ -912,3 +1302,79 @@ int32_t threadsafe_sem_timedwait_onesec(sem_t *sem) {
     return res;
 
 }
+
+// allocator call counters
+// the hooks wrap the allocators that were installed before them and count every
+// call, so the benchmarks can tell how many allocations a request costs. they are
+// installed once and never removed, since memory allocated through them may be
+// freed at any time later.
+struct alloc_hook_t {
+    PyMemAllocatorEx prev;
+    uint64_t calls;
+};
+
+static struct alloc_hook_t alloc_hooks[ALLOC_NUM_DOMAINS];
+static const PyMemAllocatorDomain alloc_domains[ALLOC_NUM_DOMAINS] = {
+    PYMEM_DOMAIN_RAW,
+    PYMEM_DOMAIN_MEM,
+    PYMEM_DOMAIN_OBJ,
+};
+static int32_t alloc_counts_installed = 0;
+
+static void *alloc_hook_malloc(void *ctx, size_t size) {
+    struct alloc_hook_t *hook = ctx;
+    __atomic_add_fetch(&hook->calls, 1, __ATOMIC_RELAXED);
+    return hook->prev.malloc(hook->prev.ctx, size);
+}
+
+static void *alloc_hook_calloc(void *ctx, size_t nelem, size_t elsize) {
+    struct alloc_hook_t *hook = ctx;
+    __atomic_add_fetch(&hook->calls, 1, __ATOMIC_RELAXED);
+    return hook->prev.calloc(hook->prev.ctx, nelem, elsize);
+}
+
+static void *alloc_hook_realloc(void *ctx, void *ptr, size_t new_size) {
+    struct alloc_hook_t *hook = ctx;
+    __atomic_add_fetch(&hook->calls, 1, __ATOMIC_RELAXED);
+    return hook->prev.realloc(hook->prev.ctx, ptr, new_size);
+}
+
+static void alloc_hook_free(void *ctx, void *ptr) {
+    // frees are not counted, every counted allocation is freed eventually
+    struct alloc_hook_t *hook = ctx;
+    hook->prev.free(hook->prev.ctx, ptr);
+}
+
+int32_t alloc_counts_track(void) {
+    // call with the GIL held, installing twice is a no-op
+
+    if (alloc_counts_installed) {
+        return 0;
+    }
+
+    for (int32_t ix = 0; ix < ALLOC_NUM_DOMAINS; ix++) {
+        PyMemAllocatorEx hook = {
+            &alloc_hooks[ix],
+            alloc_hook_malloc,
+            alloc_hook_calloc,
+            alloc_hook_realloc,
+            alloc_hook_free,
+        };
+        PyMem_GetAllocator(alloc_domains[ix], &alloc_hooks[ix].prev);
+        PyMem_SetAllocator(alloc_domains[ix], &hook);
+    }
+    alloc_counts_installed = 1;
+
+    return 0;
+
+}
+
+uint64_t alloc_counts_get(int32_t domain) {
+
+    if (domain < 0 || domain >= ALLOC_NUM_DOMAINS) {
+        return 0;
+    }
+
+    return __atomic_load_n(&alloc_hooks[domain].calls, __ATOMIC_RELAXED);
+
+}
@@ -18,6 +18,7 @@
 #define CEIL(x, y) ((y) * ((x) / (y) + ((x) % (y) != 0)))
 
 #define INTQ_NODE_SIZE 16
+#define CACHELINE_SIZE 64
 
 // cached python objects
 extern int32_t is_py_deps_init;
@@ -78,6 +79,7 @@ extern PyObject *_strptime_str;
 extern PyObject *_strftime_str;
 extern PyObject *_timestamp_str;
 extern PyObject *_isinstance_f;
+extern int32_t _log_debug_enabled;
 
 #define INT_SYMBOL '#'
 #define FLOAT_SYMBOL '%'
@@ -106,6 +108,10 @@ enum {
     STATE_RES_WAITING = 4,
     STATE_END = 5,
     STATE_TERM = 6,
+    // parked on a user lock, and resumed once it is granted or times out, see
+    // struct lock_waiter_t
+    STATE_LOCK_WAITING = 7,
+    STATE_LOCK_READY = 8,
 };
 
 // expected result
@@ -116,6 +122,8 @@ enum {
 #define RES_ERR_SERVER 21 
 // server blames client
 #define RES_ERR_CLIENT 22 
+// write refused, the storage is at maxmemory and can't evict
+#define RES_ERR_MEMORY 23
 // command not found
 #define RES_BAD_CMD 31 
 // type not found
@@ -132,17 +140,35 @@ enum {
 #define RES_BAD_HASH 37
 // embedded collection
 #define RES_BAD_COLLECTION 38
+// result out of range, ex. INCR past 2**63 - 1
+#define RES_BAD_RANGE 39
+// conditional write refused, the key's version or value didn't match
+#define RES_BAD_VERSION 40
+// the lock is held by another owner, or not by the token that tried to release it
+#define RES_BAD_LOCK 41
+// never sent: the handler parked the connection on a user lock, and its
+// response is written when the connection is resumed
+#define RES_PARKED -2
 
 // basic utils
 void log_error(const char *msg);
 void log_warning(const char *msg);
 void log_info(const char *msg);
 void log_debug(const char *msg);
+void log_refresh_level(void);
 void die(const char *msg);
 int32_t randint(int32_t min, int32_t max);
 int32_t hash_given_len(const uint8_t *s, size_t n);
 int32_t hash(const uint8_t *s);
 
+// seeded 64 bit hash for anything keyed by client data, see hash64()
+extern uint64_t hash64_seed;
+void hash64_seed_init(void);
+uint64_t hash64(const uint8_t *s, size_t n, uint64_t seed);
+
+// glob matching of client data, see glob_match()
+int32_t glob_match(const uint8_t *pattern, int32_t pattern_len, const uint8_t *s, int32_t len);
+
 // read/write
 int32_t read_full(int fd, char *buff, size_t n); 
 int32_t write_all(int fd, const char *buff, size_t n);
@@ -152,11 +178,17 @@ struct intq_node_t {
     int32_t vals[INTQ_NODE_SIZE];
 };
 
+// drained nodes are kept on `spare` (up to INTQ_MAX_SPARE of them) and reused,
+// so a queue that stays around the same length makes no allocations
+#define INTQ_MAX_SPARE 4
+
 struct intq_t {
     struct intq_node_t *front;
     struct intq_node_t *back;
     int32_t front_ix;
     int32_t back_ix;
+    struct intq_node_t *spare;
+    int32_t num_spare;
 };
 
 struct intq_t *intq_new();
@@ -176,8 +208,51 @@ int32_t cond_wait(struct cond_t *cond);
 int32_t cond_timedwait(struct cond_t *cond, struct timespec *ttl);
 int32_t cond_notify(struct cond_t *cond);
 
+// bounded lock-free multi-producer multi-consumer ring of connection fds
+// (Dmitry Vyukov's bounded MPMC queue). every cell carries a sequence number
+// that tells producers and consumers whether it is free or full for their lap,
+// so pushes and pops are one CAS each and nothing is allocated after
+// connring_new(). consumers with nothing to do park on a futex instead of a
+// condition variable, and producers only make a syscall if someone is parked.
+struct connring_cell_t {
+    uint32_t seq;
+    int32_t val;
+};
+
+struct connring_t {
+    uint32_t mask;
+    struct connring_cell_t *cells;
+    char _pad0[CACHELINE_SIZE - sizeof(uint32_t) - sizeof(struct connring_cell_t *)];
+    // producers and consumers each get their own cache line
+    uint32_t enqueue_pos;
+    char _pad1[CACHELINE_SIZE - sizeof(uint32_t)];
+    uint32_t dequeue_pos;
+    char _pad2[CACHELINE_SIZE - sizeof(uint32_t)];
+    uint32_t futex_seq;
+    int32_t nparked;
+};
+
+struct connring_t *connring_new(uint32_t capacity);
+void connring_destroy(struct connring_t *ring);
+int32_t connring_push(struct connring_t *ring, int32_t val);
+int32_t connring_pop(struct connring_t *ring);
+int32_t connring_pop_wait(struct connring_t *ring, int32_t timeout);
+int32_t connring_notify(struct connring_t *ring);
+uint32_t max_open_fds();
+
 // threadsafe wrappers for sem
 int32_t threadsafe_sem_wait(sem_t *sem);
 int32_t threadsafe_sem_timedwait_onesec(sem_t *sem);
 
+// allocator call counters, see benchmarks/bench_allocs.py
+enum {
+    ALLOC_DOMAIN_RAW = 0,
+    ALLOC_DOMAIN_MEM = 1,
+    ALLOC_DOMAIN_OBJ = 2,
+    ALLOC_NUM_DOMAINS = 3,
+};
+
+int32_t alloc_counts_track(void);
+uint64_t alloc_counts_get(int32_t domain);
+
 #endif
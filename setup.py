@@ -15,9 +15,17 @@ setuptools.setup(
             "five_one_one_kv.c",
             [
                 "server/util.c",
+                "server/bufpool.c",
+                "server/slab.c",
+                "server/index.c",
+                "server/storage.c",
                 "server/connection.c",
                 "server/ttl.c",
                 "server/connection_io.c",
+                "server/uring.c",
+                "server/reactor.c",
+                "server/locks.c",
+                "server/scheduler.c",
                 "server/dispatch.c",
                 "server/module.c",
             ],
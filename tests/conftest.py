@@ -5,7 +5,7 @@ import time
 
 import pytest
 
-from five_one_one_kv import Client, Pipeline
+from five_one_one_kv import Client, Pipeline, Transaction
 
 logger = logging.getLogger()
 logger.handlers.clear()
@@ -31,3 +31,10 @@ def pipeline():
     client = Pipeline()
     yield client
     client.close()
+
+
+@pytest.fixture(scope="function")
+def transaction():
+    client = Transaction()
+    yield client
+    client.close()
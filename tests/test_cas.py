@@ -0,0 +1,126 @@
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import pytest
+
+from five_one_one_kv import Client
+from five_one_one_kv.c import RES_BAD_ARGS, RES_BAD_TYPE, RES_BAD_VERSION, dumps
+
+from .test_storage import _request
+from .utils import randostrs
+
+
+def test_versions_go_up(client):
+    key = randostrs()
+    assert client.get(key, version=True) == (None, 0)
+    client[key] = 1
+    val, first = client.get(key, version=True)
+    assert val == 1
+    assert first > 0
+    # reads don't change it
+    assert client.get(key, version=True) == (1, first)
+    client.incr(key)
+    val, second = client.get(key, version=True)
+    assert val == 2
+    assert second > first
+    client.mset({key: [1, "two"]})
+    val, third = client.get(key, version=True)
+    assert val == [1, "two"]
+    assert third > second
+    # not even back down once the key is gone
+    del client[key]
+    client[key] = 1
+    assert client.get(key, version=True)[1] > third
+    del client[key]
+
+
+def test_cas(client):
+    key = randostrs()
+    # 0 is the version of a key that doesn't exist
+    version = client.cas(key, 0, "first")
+    assert version > 0
+    assert client.cas(key, 0, "again") is None
+    assert client.get(key, version=True) == ("first", version)
+    new_version = client.cas(key, version, ("second", 2))
+    assert new_version > version
+    assert client.cas(key, version, "stale") is None
+    assert client[key] == ("second", 2)
+    del client[key]
+    assert client.cas(key, new_version, "gone") is None
+    assert client.get(key) is None
+
+
+def test_cas_ttl(client):
+    key = randostrs()
+    assert client.cas(key, 0, 1, ttl=1)
+    assert client[key] == 1
+    time.sleep(2.5)
+    assert client.get(key) is None
+
+
+def test_setif(client):
+    key = randostrs()
+    # nothing to compare with
+    assert client.setif(key, 1, 1) is None
+    client[key] = 1
+    version = client.setif(key, 1, "two")
+    assert version == client.get(key, version=True)[1]
+    assert client.setif(key, 1, "three") is None
+    # values are compared as stored, 1 and 1.0 differ
+    client[key] = 1.0
+    assert client.setif(key, 1, 2) is None
+    assert client.setif(key, 1.0, 2)
+    assert client[key] == 2
+    client.queue(key)
+    assert client.setif(key, 2, 3) is None
+    del client[key]
+
+
+def test_get_version_of_a_queue(client):
+    key = randostrs()
+    client.queue(key)
+    with pytest.raises(AttributeError):
+        client.get(key, version=True)
+    del client[key]
+
+
+def test_concurrent_cas():
+    # every increment retries until its cas wins, so none are lost
+    key = randostrs()
+
+    def _count(num):
+        client = Client()
+        for _ in range(num):
+            while True:
+                val, version = client.get(key, version=True)
+                if client.cas(key, version, (val or 0) + 1) is not None:
+                    break
+        client.close()
+
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        futures = [executor.submit(_count, 500) for _ in range(4)]
+        for future in futures:
+            future.result()
+    client = Client()
+    assert client[key] == 2000
+    del client[key]
+    client.close()
+
+
+@pytest.mark.parametrize(
+    ("args", "status"),
+    (
+        ((b"get", dumps("k"), dumps("version")), RES_BAD_ARGS),
+        ((b"get", dumps("k"), dumps("versions"), dumps(True)), RES_BAD_ARGS),
+        ((b"get", dumps("k"), dumps("version"), dumps(1)), RES_BAD_ARGS),
+        ((b"cas", dumps("k"), dumps(0)), RES_BAD_ARGS),
+        ((b"cas", dumps("k"), dumps("0"), dumps(1)), RES_BAD_TYPE),
+        ((b"cas", dumps("k"), dumps(-1), dumps(1)), RES_BAD_ARGS),
+        ((b"cas", dumps("k"), dumps(2**64), dumps(1)), RES_BAD_ARGS),
+        ((b"cas", dumps(randostrs()), dumps(1), dumps(1)), RES_BAD_VERSION),
+        ((b"setif", dumps("k"), dumps(1)), RES_BAD_ARGS),
+        ((b"setif", dumps(randostrs()), dumps(1), dumps(1)), RES_BAD_VERSION),
+    ),
+)
+def test_cas_bad_args(client, args, status):
+    assert _request(client, *args)[0] == status
@@ -105,3 +105,17 @@ def test_many(client):
                     del client[k]
     for k in control.keys():
         del client[k]
+
+
+def test_large_then_small(client):
+    # the connection's buffers grow for the large value, and the large buffer
+    # goes back to the pool once it is empty, the values must survive both
+    big = randobytes(size=40000)
+    client["large_then_small"] = big
+    assert client.get("large_then_small") == big
+    for ix in range(64):
+        client[f"large_then_small_{ix}"] = ix
+        assert client.get(f"large_then_small_{ix}") == ix
+    assert client.get("large_then_small") == big
+    for ix in range(64):
+        assert client.get(f"large_then_small_{ix}") == ix
@@ -0,0 +1,191 @@
+import time
+from contextlib import contextmanager
+
+import pytest
+
+from five_one_one_kv import Pipeline
+from five_one_one_kv.c import server
+from five_one_one_kv.exceptions import OutOfMemoryError
+
+from .utils import execute, randostrs, spawn_server
+
+MAXMEMORY = 1 << 20
+
+
+@contextmanager
+def _server(port, policy, maxmemory=MAXMEMORY):
+    # the server the other tests use has no limit
+    with spawn_server(port, "--maxmemory", str(maxmemory), "--maxmemory-policy", policy) as client:
+        pipeline = Pipeline(port=port)
+        yield client, pipeline
+        pipeline.close()
+
+
+def _fill(pipeline, name, num_keys, ttl=None, on_batch=None, batch=500):
+    # returns the keys that were stored
+    stored = []
+    for start in range(0, num_keys, batch):
+        keys = [f"{name}_{ix}" for ix in range(start, min(start + batch, num_keys))]
+        for key in keys:
+            pipeline.set(key, key, ttl=ttl)
+        for key, result in zip(keys, execute(pipeline)):
+            if result is None:
+                stored.append(key)
+        if on_batch:
+            on_batch()
+    return stored
+
+
+def _present(pipeline, keys):
+    for key in keys:
+        pipeline.get(key)
+    return [key for key, result in zip(keys, execute(pipeline)) if result == key]
+
+
+def test_info(client):
+    info = client.info()
+    assert info["maxmemory"] == 0
+    assert info["maxmemory_policy"] == "noeviction"
+    assert info["evicted_keys"] == 0
+
+    key = randostrs()
+    client[key] = "x" * 20000
+    used = client.info()["used_memory"]
+    assert used - info["used_memory"] >= 20000
+    del client[key]
+    assert client.info()["used_memory"] <= used - 20000
+
+
+@pytest.mark.parametrize(("port", "policy"), ((8601, "noeviction"), (8602, "volatile-ttl")))
+def test_refuses_writes_at_maxmemory(port, policy):
+    # neither policy can evict keys without a ttl
+    with _server(port, policy) as (client, pipeline):
+        results = []
+        for start in range(0, 30000, 500):
+            for ix in range(start, start + 500):
+                pipeline.set(f"refuse_{ix}", ix)
+            results += execute(pipeline)
+        stored = [ix for ix, result in enumerate(results) if result is None]
+        assert len(stored) < len(results)
+        assert all(isinstance(result, OutOfMemoryError) for result in results if result is not None)
+
+        info = client.info()
+        assert info["evicted_keys"] == 0
+        assert info["keys"] == len(stored)
+        assert info["used_memory"] <= MAXMEMORY
+        assert client[f"refuse_{stored[-1]}"] == stored[-1]
+
+        # deleting keys makes room again
+        for ix in stored:
+            del pipeline[f"refuse_{ix}"]
+        execute(pipeline)
+        client["refuse_again"] = 1
+        assert client["refuse_again"] == 1
+
+
+def test_allkeys_lru():
+    with _server(8603, "allkeys-lru") as (client, pipeline):
+        hot = _fill(pipeline, "hot", 50)
+
+        def read_hot():
+            _present(pipeline, hot)
+            # the lru clock ticks every few milliseconds, let the next batch be
+            # written after the reads
+            time.sleep(0.005)
+
+        # the hot keys are read after every batch, so they are never the least
+        # recently used. eviction only compares a few sampled keys, so keep the
+        # batches small, or the other keys sampled with a hot key can all be ones
+        # written since it was read.
+        _fill(pipeline, "cold", 40000, on_batch=read_hot, batch=100)
+
+        info = client.info()
+        assert info["evicted_keys"] > 0
+        assert info["used_memory"] <= MAXMEMORY
+        assert _present(pipeline, hot) == hot
+
+
+def test_allkeys_lfu():
+    with _server(8604, "allkeys-lfu") as (client, pipeline):
+        hot = _fill(pipeline, "hot", 50)
+        for _ in range(30):
+            _present(pipeline, hot)
+        # written once and never read
+        _fill(pipeline, "cold", 40000)
+
+        info = client.info()
+        assert info["evicted_keys"] > 0
+        assert info["used_memory"] <= MAXMEMORY
+        assert _present(pipeline, hot) == hot
+
+
+def test_volatile_ttl():
+    with _server(8605, "volatile-ttl") as (client, pipeline):
+        persistent = _fill(pipeline, "persistent", 2000)
+        soon = _fill(pipeline, "soon", 20000, ttl=3600)
+        late = _fill(pipeline, "late", 20000, ttl=30 * 86400)
+
+        info = client.info()
+        assert info["evicted_keys"] > 0
+        assert info["used_memory"] <= MAXMEMORY
+        assert _present(pipeline, persistent) == persistent
+        # keys that expire soonest go first
+        assert len(_present(pipeline, soon)) < len(_present(pipeline, late))
+
+
+def test_bad_policy():
+    with pytest.raises(ValueError):
+        server(port=8606, num_threads=4, maxmemory_policy="allkeys-random")
+
+
+def test_mset_is_all_or_nothing():
+    with _server(8607, "noeviction") as (client, pipeline):
+        _fill(pipeline, "full", 30000)
+        mapping = {f"mset_{ix}": "x" * 1000 for ix in range(40)}
+        with pytest.raises(OutOfMemoryError):
+            client.mset(mapping)
+        assert client.mget(mapping) == [None] * len(mapping)
+        assert client.info()["used_memory"] <= MAXMEMORY
+
+
+def test_large_value_fits():
+    # maxmemory is for all of the shards, not a share of it for each
+    with _server(8608, "allkeys-lru") as (client, pipeline):
+        client["large"] = "x" * 60000
+        assert client["large"] == "x" * 60000
+        assert client.info()["evicted_keys"] == 0
+
+
+@pytest.mark.parametrize(("port", "policy"), ((8613, "allkeys-lru"), (8614, "allkeys-lfu")))
+def test_evicts_from_other_shards(port, policy):
+    # a write whose shard has nothing to evict evicts the keys of other shards
+    with _server(port, policy, maxmemory=200000) as (client, pipeline):
+        for ix in range(10):
+            client[f"large_{ix}"] = str(ix) * 40000
+        assert client.info()["evicted_keys"] > 0
+        for ix in range(200):
+            pipeline.set(f"small_{ix}", ix)
+        assert execute(pipeline) == [None] * 200
+        assert client.info()["used_memory"] <= 200000
+
+
+def test_overwrite_at_maxmemory():
+    # replacing a key only needs room for what the new value adds
+    with _server(8609, "noeviction") as (client, pipeline):
+        client["overwritten"] = "x" * 9000
+        _fill(pipeline, "full", 30000)
+        for ix in range(10):
+            client["overwritten"] = str(ix) * 9000
+        assert client["overwritten"] == "9" * 9000
+
+
+def test_push_never_evicts_its_queue():
+    with _server(8610, "allkeys-lru", maxmemory=1 << 22) as (client, pipeline):
+        client.queue("queue")
+        for start in range(0, 2000, 500):
+            for ix in range(start, start + 500):
+                pipeline.push("queue", str(ix).zfill(1000))
+            assert execute(pipeline) == [None] * 500
+        # the queue takes half of maxmemory, far more than a shard's share
+        assert client.info()["evicted_keys"] == 0
+        assert client.pop("queue") == "0".zfill(1000)
@@ -0,0 +1,62 @@
+import random
+
+import pytest
+
+from five_one_one_kv.c import dumps_hashable, hash64
+
+
+def test_reference_vectors():
+    # from the wyhash test vectors, the seed is the index
+    assert hash64(b"", 0) == 0x0409638EE2BDE459
+    assert hash64(b"a", 1) == 0xA8412D091B5FE0A9
+    assert hash64(b"abc", 2) == 0x32DD92E4B2915153
+
+
+def test_seed():
+    x = dumps_hashable("mel ott homeruns")
+    assert hash64(x) == hash64(x)
+    assert hash64(x, 1) != hash64(x, 2)
+
+
+def test_bad_args():
+    with pytest.raises(TypeError):
+        hash64("not bytes")
+    with pytest.raises(TypeError):
+        hash64()
+
+
+def test_no_collisions():
+    # keys that only differ in a few bytes, like sequential ids
+    hashes = set()
+    for ix in range(200000):
+        hashes.add(hash64(dumps_hashable(f"key_{ix}")))
+    assert len(hashes) == 200000
+
+
+@pytest.mark.parametrize(("size",), ((3,), (8,), (16,), (40,), (100,)))
+def test_avalanche(size):
+    # flipping any input bit should flip about half of the output bits
+    rng = random.Random(511)
+    flipped = []
+    for _ in range(200):
+        x = bytearray(rng.randbytes(size))
+        h = hash64(bytes(x))
+        bit = rng.randrange(size * 8)
+        x[bit // 8] ^= 1 << (bit % 8)
+        flipped.append(bin(h ^ hash64(bytes(x))).count("1"))
+    assert 28 < sum(flipped) / len(flipped) < 36
+
+
+def test_spread():
+    # the storage picks shards with the top bits and slots with the low ones,
+    # both should be used evenly by similar keys
+    num_keys = 64000
+    shards = [0] * 64
+    groups = [0] * 64
+    for ix in range(num_keys):
+        h = hash64(dumps_hashable(ix))
+        shards[h >> 58] += 1
+        groups[(h >> 7) & 63] += 1
+    for counts in (shards, groups):
+        assert min(counts) > 0.85 * num_keys / 64
+        assert max(counts) < 1.15 * num_keys / 64
@@ -0,0 +1,126 @@
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import pytest
+
+from five_one_one_kv import Client
+from five_one_one_kv.c import RES_BAD_ARGS, RES_BAD_RANGE, RES_BAD_TYPE
+
+from .test_storage import _request
+from .utils import randostrs
+
+
+def test_incr(client):
+    key = randostrs()
+    assert client.incr(key) == 1
+    assert client.incr(key) == 2
+    assert client.incr(key, 10) == 12
+    assert client.decr(key) == 11
+    assert client.decr(key, 20) == -9
+    assert client[key] == -9
+    del client[key]
+
+
+def test_incr_changes_length(client):
+    key = randostrs()
+    client[key] = 99
+    assert client.incr(key) == 100
+    size = client.memory(key)
+    assert client.incr(key, -99) == 1
+    assert client.memory(key) == size - 2
+    assert client[key] == 1
+    client[key] = -1
+    assert client.decr(key, 999) == -1000
+    del client[key]
+
+
+def test_incrbyfloat(client):
+    key = randostrs()
+    assert client.incr(key, 0.5) == 0.5
+    assert client.incr(key, 0.1) == 0.6
+    assert client[key] == 0.6
+    client[key] = 10
+    assert client.incr(key, 1.5) == 11.5
+    assert isinstance(client[key], float)
+    client[key] = 1.7e308
+    with pytest.raises(OverflowError):
+        client.incr(key, 1e308)
+    assert client[key] == 1.7e308
+    del client[key]
+
+
+def test_incr_keeps_ttl(client):
+    key = randostrs()
+    client.set(key, 5, ttl=1)
+    # in place, then into a longer value
+    assert client.incr(key) == 6
+    assert client.incr(key, 1000) == 1006
+    time.sleep(2.5)
+    with pytest.raises(KeyError):
+        client[key]
+
+
+def test_incr_overflow(client):
+    key = randostrs()
+    client[key] = 2**63 - 1
+    with pytest.raises(OverflowError):
+        client.incr(key)
+    assert client[key] == 2**63 - 1
+    client[key] = -(2**63)
+    with pytest.raises(OverflowError):
+        client.decr(key)
+    assert client.incr(key, 2**63 - 1) == -1
+    # python ints can be larger than the server's
+    client[key] = 2**64
+    with pytest.raises(OverflowError):
+        client.incr(key)
+    del client[key]
+
+
+def test_incr_not_a_number(client):
+    key = randostrs()
+    client[key] = "one"
+    with pytest.raises(AttributeError):
+        client.incr(key)
+    client[key] = 1.5
+    with pytest.raises(AttributeError):
+        client.incr(key)
+    client.queue(key)
+    with pytest.raises(AttributeError):
+        client.incr(key, 0.5)
+    del client[key]
+
+
+@pytest.mark.parametrize(
+    ("args", "status"),
+    (
+        ((b"incr",), RES_BAD_ARGS),
+        ((b"incr", b'"k', b"#1"), RES_BAD_ARGS),
+        ((b"incrby", b'"k'), RES_BAD_ARGS),
+        ((b"incrby", b'"k', b"%1.5"), RES_BAD_TYPE),
+        ((b"incrby", b'"k', b'"1'), RES_BAD_TYPE),
+        ((b"incrby", b'"k', b"#99999999999999999999"), RES_BAD_RANGE),
+        ((b"incrbyfloat", b'"k', b"%inf"), RES_BAD_RANGE),
+    ),
+)
+def test_incr_bad_args(client, args, status):
+    assert _request(client, *args)[0] == status
+
+
+def _count(key, num_incrs):
+    client = Client()
+    try:
+        for _ in range(num_incrs):
+            client.incr(key)
+    finally:
+        client.close()
+
+
+def test_concurrent_incrs(client):
+    key = randostrs()
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        futures = [executor.submit(_count, key, 2000) for _ in range(4)]
+        for future in futures:
+            future.result()
+    assert client[key] == 8000
+    del client[key]
@@ -0,0 +1,263 @@
+import threading
+import time
+
+import pytest
+
+from five_one_one_kv import Client, Pipeline
+from five_one_one_kv.c import RES_BAD_ARGS, RES_BAD_HASH, RES_BAD_LOCK, RES_BAD_TYPE, dumps
+
+from .test_storage import _request
+from .utils import randostrs, spawn_server
+
+
+def test_lock_unlock(client):
+    name = randostrs()
+    fence = client.lock(name, "me")
+    assert fence > 0
+    assert client.lock(name, "you") is None
+    # locking again renews the lease, with the same fencing token
+    assert client.lock(name, "me") == fence
+    assert not client.unlock(name, "you")
+    assert client.unlock(name, "me")
+    assert not client.unlock(name, "me")
+    assert client.lock(name, "you") > fence
+    assert client.unlock(name, "you")
+
+
+def test_locks_are_not_keys(client):
+    name = randostrs()
+    client[name] = 1
+    assert client.lock(name, "me")
+    assert client[name] == 1
+    del client[name]
+    assert client.unlock(name, "me")
+
+
+def test_tokens(client):
+    # any hashable, compared as sent
+    name = randostrs()
+    assert client.lock(name, ("worker", 1))
+    assert client.lock(name, ("worker", 1.0)) is None
+    assert not client.unlock(name, ("worker", 2))
+    assert client.unlock(name, ("worker", 1))
+
+
+def test_lease_expires(client):
+    name = randostrs()
+    fence = client.lock(name, "me", lease=1)
+    time.sleep(2.5)
+    assert client.lock(name, "you") > fence
+    # the lease ran out, unlocking is too late
+    assert not client.unlock(name, "me")
+    assert not client.extend(name, "me", 10)
+    assert client.unlock(name, "you")
+
+
+def test_relock_before_lease_expiry(client):
+    # an unlocked lock is kept until its lease expiry fires, locking it again
+    # before then grants it like a new one
+    name = randostrs()
+    fence = client.lock(name, "me", lease=1)
+    for _ in range(100):
+        assert client.unlock(name, "me")
+        assert not client.unlock(name, "me")
+        assert not client.extend(name, "me", 1)
+        next_fence = client.lock(name, "you", lease=1)
+        assert next_fence > fence
+        assert client.lock(name, "me", lease=1) is None
+        assert client.unlock(name, "you")
+        fence = client.lock(name, "me", lease=1)
+        assert fence > next_fence
+    # the first expiry fires on the lock that is held again and puts the next
+    time.sleep(2.5)
+    assert client.lock(name, "you") > fence
+    assert client.unlock(name, "you")
+    time.sleep(2.5)
+    assert client.lock(name, "me") > fence
+    assert client.unlock(name, "me")
+
+
+def test_extend(client):
+    name = randostrs()
+    assert client.lock(name, "me", lease=1)
+    assert not client.extend(name, "you", 10)
+    assert client.extend(name, "me", 10)
+    time.sleep(2.5)
+    assert client.lock(name, "you") is None
+    assert client.unlock(name, "me")
+    assert not client.extend(name, "me", 10)
+
+
+def test_wait_for_unlock(client):
+    name = randostrs()
+    fence = client.lock(name, "me")
+    results = []
+
+    def _wait():
+        other = Client()
+        results.append(other.lock(name, "you", wait=10))
+        other.close()
+
+    thread = threading.Thread(target=_wait)
+    thread.start()
+    time.sleep(0.5)
+    assert client.info()["lock_waiters"] >= 1
+    start = time.monotonic()
+    assert client.unlock(name, "me")
+    thread.join()
+    assert time.monotonic() - start < 1
+    assert results[0] > fence
+    assert client.lock(name, "me") is None
+    assert client.unlock(name, "you")
+
+
+def test_wait_for_lease(client):
+    name = randostrs()
+    client.lock(name, "me", lease=1)
+    start = time.monotonic()
+    assert client.lock(name, "you", wait=10)
+    assert time.monotonic() - start < 3
+    assert client.unlock(name, "you")
+
+
+def test_wait_times_out(client):
+    name = randostrs()
+    client.lock(name, "me")
+    start = time.monotonic()
+    assert client.lock(name, "you", wait=1) is None
+    assert 0.5 < time.monotonic() - start < 3
+    # the lock is still held, and nobody waits for it
+    assert client.unlock(name, "me")
+    assert client.lock(name, "you")
+    assert client.unlock(name, "you")
+
+
+def test_waiters_in_order():
+    name = randostrs()
+    holder = Client()
+    holder.lock(name, "holder")
+    order = []
+    order_lock = threading.Lock()
+
+    def _wait(token):
+        waiter = Client()
+        assert waiter.lock(name, token, wait=30)
+        with order_lock:
+            order.append(token)
+        assert waiter.unlock(name, token)
+        waiter.close()
+
+    threads = []
+    for ix in range(10):
+        # each in line before the next
+        threads.append(threading.Thread(target=_wait, args=(ix,)))
+        threads[-1].start()
+        deadline = time.monotonic() + 5
+        while holder.info()["lock_waiters"] < ix + 1 and time.monotonic() < deadline:
+            time.sleep(0.01)
+    assert holder.unlock(name, "holder")
+    for thread in threads:
+        thread.join()
+    assert order == list(range(10))
+    holder.close()
+
+
+def test_fencing_tokens_go_up():
+    # every grant gets a higher one, and one client at a time holds the lock
+    name = randostrs()
+    fences = {}
+    inside = []
+    most_inside = []
+
+    def _count(token):
+        client = Client()
+        fences[token] = []
+        for _ in range(50):
+            fences[token].append(client.lock(name, token, wait=30))
+            inside.append(token)
+            most_inside.append(len(inside))
+            time.sleep(0.001)
+            inside.remove(token)
+            client.unlock(name, token)
+        client.close()
+
+    threads = [threading.Thread(target=_count, args=(ix,)) for ix in range(4)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert max(most_inside) == 1
+    for found in fences.values():
+        assert None not in found
+        assert found == sorted(found)
+    assert len({fence for found in fences.values() for fence in found}) == 200
+
+
+def test_pipeline_after_wait(client):
+    # the requests sent after a lock that waits are answered after it, in order
+    name = randostrs()
+    key = randostrs()
+    client.lock(name, "me", lease=1)
+    pipeline = Pipeline()
+    pipeline.set(key, 1)
+    pipeline.lock(name, "you", wait=10)
+    pipeline.get(key)
+    pipeline.unlock(name, "you")
+    results = pipeline.execute()
+    assert results[0] is None
+    assert results[1] > 0
+    assert results[2] == 1
+    assert results[3] is None
+    pipeline.close()
+    del client[key]
+
+
+def test_contention_with_reuseport():
+    # with an event loop per io thread, a lock granted before its waiter's
+    # connection is parked must still be answered. two clients, so no other
+    # connection wakes a loop that missed it.
+    port = 8612
+    with spawn_server(port, "--reuseport") as client:
+        name = randostrs()
+        done = []
+
+        def _contend(token):
+            contender = Client(port=port)
+            # a connection that is never answered fails the test instead of
+            # hanging it
+            contender._sock.settimeout(30)
+            deadline = time.monotonic() + 10
+            while time.monotonic() < deadline:
+                assert contender.lock(name, token, wait=10)
+                assert contender.unlock(name, token)
+            contender.close()
+            done.append(token)
+
+        threads = [threading.Thread(target=_contend, args=(token,)) for token in range(2)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        assert sorted(done) == [0, 1]
+        assert client.info()["locks"] == 0
+
+
+@pytest.mark.parametrize(
+    ("args", "status"),
+    (
+        ((b"lock", dumps("n"), dumps("t")), RES_BAD_ARGS),
+        ((b"lock", dumps("n"), dumps("t"), dumps(0)), RES_BAD_ARGS),
+        ((b"lock", dumps("n"), dumps("t"), dumps(31 * 24 * 3600)), RES_BAD_ARGS),
+        ((b"lock", dumps("n"), dumps("t"), dumps("1")), RES_BAD_TYPE),
+        ((b"lock", dumps("n"), dumps("t"), dumps(1), dumps(-1)), RES_BAD_ARGS),
+        ((b"lock", dumps("n"), dumps("t"), dumps(1), dumps(3601)), RES_BAD_ARGS),
+        ((b"lock", dumps([1]), dumps("t"), dumps(1)), RES_BAD_HASH),
+        ((b"lock", dumps("n"), dumps("t" * 100), dumps(1)), RES_BAD_ARGS),
+        ((b"unlock", dumps("n")), RES_BAD_ARGS),
+        ((b"unlock", dumps(randostrs()), dumps("t")), RES_BAD_LOCK),
+        ((b"extend", dumps("n"), dumps("t")), RES_BAD_ARGS),
+        ((b"extend", dumps(randostrs()), dumps("t"), dumps(1)), RES_BAD_LOCK),
+    ),
+)
+def test_lock_bad_args(client, args, status):
+    assert _request(client, *args)[0] == status
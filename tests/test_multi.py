@@ -0,0 +1,95 @@
+import time
+from datetime import datetime, timezone
+
+import pytest
+
+from five_one_one_kv.c import RES_BAD_ARGS, RES_BAD_HASH, dumps
+
+from .test_storage import _request
+from .utils import randostrs
+
+
+def test_mset_mget(client):
+    mapping = {
+        randostrs(): 1,
+        randostrs(): 2.5,
+        randostrs(): "three",
+        randostrs(): b"four",
+        (randostrs(), 5): [1, "two"],
+        randostrs(): (1, "two", 3.0),
+        randostrs(): True,
+        randostrs(): datetime(2020, 1, 1, tzinfo=timezone.utc),
+    }
+    assert client.mset(mapping) is None
+    missing = randostrs()
+    keys = list(mapping) + [missing]
+    assert client.mget(keys) == list(mapping.values()) + [None]
+    for key, val in mapping.items():
+        assert client[key] == val
+    assert client.mdel(keys) == len(mapping)
+    assert client.mget(keys) == [None] * len(keys)
+
+
+def test_mget_queue(client):
+    key = randostrs()
+    client.queue(key)
+    assert client.mget([key]) == [None]
+    del client[key]
+
+
+def test_many_keys(client):
+    # spread over every shard, and small enough for one request
+    prefix = randostrs()
+    mapping = {f"{prefix}_{ix}": ix for ix in range(1000)}
+    client.mset(mapping)
+    keys = list(mapping)
+    assert client.mget(keys) == list(mapping.values())
+    assert client.mget(keys[::-1]) == list(mapping.values())[::-1]
+    assert client.mdel(keys + keys) == len(keys)
+
+
+def test_duplicate_keys(client):
+    key = randostrs()
+    status, _ = _request(client, b"mset", dumps(key), dumps(1), dumps(key), dumps(2))
+    assert client[key] == 2
+    assert client.mget([key, key]) == [2, 2]
+    assert client.mdel([key, key]) == 1
+
+
+def test_mset_drops_ttl(client):
+    key = randostrs()
+    client.set(key, 1, ttl=1)
+    client.mset({key: 2})
+    time.sleep(2.5)
+    assert client[key] == 2
+    client.set(key, 1, ttl=1)
+    assert client.mdel([key]) == 1
+    client[key] = 3
+    time.sleep(2.5)
+    assert client[key] == 3
+    del client[key]
+
+
+def test_mget_too_large(client):
+    keys = [randostrs() for _ in range(3)]
+    for key in keys:
+        client[key] = "x" * 30000
+    with pytest.raises(TypeError):
+        client.mget(keys)
+    assert client.mget(keys[:2]) == ["x" * 30000] * 2
+    client.mdel(keys)
+
+
+@pytest.mark.parametrize(
+    ("args", "status"),
+    (
+        ((b"mget",), RES_BAD_ARGS),
+        ((b"mdel",), RES_BAD_ARGS),
+        ((b"mset", b'"k'), RES_BAD_ARGS),
+        ((b"mset", b'"k', b"#1", b'"j'), RES_BAD_ARGS),
+        ((b"mget", b'"k', dumps([1])), RES_BAD_HASH),
+        ((b"mset", b'"k', b"#1", dumps([1]), b"#1"), RES_BAD_HASH),
+    ),
+)
+def test_multi_bad_args(client, args, status):
+    assert _request(client, *args)[0] == status
@@ -89,3 +89,19 @@ def test_types(pipeline, k, v):
 def test_unhashable_types(pipeline, k):
     with pytest.raises(NotHashableError):
         pipeline[k] = "bar"
+
+
+def test_many(pipeline):
+    # far more requests than fit in one read, and responses than fit in one batch
+    num = 3000
+    for ix in range(num):
+        pipeline[f"pipeline_many_{ix}"] = randobytes() * 8
+    for ix in range(num):
+        pipeline.get(f"pipeline_many_{ix}")
+    for ix in range(num):
+        del pipeline[f"pipeline_many_{ix}"]
+    results = pipeline.execute()
+    assert len(results) == 3 * num
+    assert results[:num] == [None] * num
+    assert all(isinstance(res, bytes) and len(res) == 64 for res in results[num : 2 * num])
+    assert results[2 * num :] == [None] * num
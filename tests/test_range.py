@@ -0,0 +1,186 @@
+import random
+import time
+
+import pytest
+
+from five_one_one_kv.c import RES_BAD_ARGS, RES_BAD_HASH, RES_BAD_OP, dumps
+
+from .test_storage import _request
+from .utils import randostrs, spawn_server
+
+PORT = 8611
+
+
+@pytest.fixture(scope="module")
+def indexed():
+    # the server the other tests use has no index
+    with spawn_server(PORT, "--index") as client:
+        yield client
+
+
+def _mset(client, mapping):
+    # in batches that fit in a request
+    items = list(mapping.items())
+    for start in range(0, len(items), 500):
+        client.mset(dict(items[start : start + 500]))
+
+
+def _mdel(client, keys):
+    keys = list(keys)
+    for start in range(0, len(keys), 500):
+        client.mdel(keys[start : start + 500])
+
+
+def test_prefix(indexed):
+    user = randostrs()
+    keys = [(user, 42, "session", ix) for ix in range(20)]
+    others = [(user, 41, "session", 1), (user, 43), (user,), (user, 42)]
+    _mset(indexed, {key: ix for ix, key in enumerate(keys + others)})
+    after, found = indexed.range(prefix=(user, 42, "session"))
+    assert after is None
+    assert found == keys
+    # the prefix itself is a key under it
+    assert list(indexed.range_iter(prefix=(user, 42))) == [(user, 42)] + keys
+    assert list(indexed.range_iter(prefix=(user,))) == sorted(keys + others)
+    _mdel(indexed, keys + others)
+    assert indexed.range(prefix=(user,)) == (None, [])
+
+
+def test_order(indexed):
+    # numbers by value, ints of any size and floats mixed
+    user = randostrs()
+    items = [-(2**70), -3, -2.5, -1, 0, 0.5, 1, 1.5, 10, 99, 100, 2**64, 1e300, float("inf")]
+    strs = ["", "a", "ab", "b", "z" * 10, "é", "\U0001f600"]
+    keys = [(user, item) for item in items + strs]
+    shuffled = keys[:]
+    random.shuffle(shuffled)
+    _mset(indexed, {key: 1 for key in shuffled})
+    assert list(indexed.range_iter(prefix=(user,))) == keys
+    _mdel(indexed, keys)
+
+
+def test_str_and_bytes(indexed):
+    prefix = randostrs()
+    keys = [f"{prefix}:{ix:03}" for ix in range(50)]
+    _mset(indexed, {key: 1 for key in keys})
+    _mset(indexed, {key.encode("ascii"): 1 for key in keys})
+    assert list(indexed.range_iter(prefix=f"{prefix}:")) == keys
+    assert list(indexed.range_iter(prefix=f"{prefix}:".encode("ascii"))) == [key.encode("ascii") for key in keys]
+    assert list(indexed.range_iter(prefix=f"{prefix}:01")) == keys[10:20]
+    _mdel(indexed, keys + [key.encode("ascii") for key in keys])
+
+
+def test_bounds_and_pages(indexed):
+    user = randostrs()
+    keys = [(user, ix) for ix in range(250)]
+    _mset(indexed, {key: ix for ix, key in enumerate(keys)})
+    assert indexed.range(start=(user, 10), stop=(user, 20))[1] == keys[10:20]
+    assert indexed.range(after=(user, 10), stop=(user, 20))[1] == keys[11:20]
+    # bounds don't have to be keys
+    assert indexed.range(start=(user, 9.5), stop=(user, 12.5))[1] == keys[10:13]
+
+    after, found = indexed.range(prefix=(user,), count=100)
+    assert after == keys[99]
+    assert found == keys[:100]
+    after, found = indexed.range(prefix=(user,), after=after, count=100)
+    assert found == keys[100:200]
+    after, found = indexed.range(prefix=(user,), after=after, count=100)
+    assert after is None
+    assert found == keys[200:]
+    assert list(indexed.range_iter(prefix=(user,), count=7)) == keys
+    _mdel(indexed, keys)
+
+
+def test_values(indexed):
+    user = randostrs()
+    mapping = {(user, 1): 1, (user, 2): "two", (user, 3): (1, 2.5), (user, 4): [1, "two"]}
+    indexed.mset(mapping)
+    indexed.queue((user, 5))
+    found = list(indexed.range_iter(prefix=(user,), values=True, count=2))
+    assert found == list(mapping.items()) + [((user, 5), None)]
+    indexed.mdel(list(mapping) + [(user, 5)])
+
+
+def test_values_too_large_for_one_response(indexed):
+    user = randostrs()
+    keys = [(user, ix) for ix in range(5)]
+    for key in keys:
+        indexed[key] = "x" * 20000
+    after, found = indexed.range(prefix=(user,), values=True)
+    assert 0 < len(found) < len(keys)
+    assert after == found[-1][0]
+    assert [key for key, _ in indexed.range_iter(prefix=(user,), values=True)] == keys
+    indexed.mdel(keys)
+
+
+def test_index_follows_writes(indexed):
+    user = randostrs()
+    key = (user, "counter")
+    assert indexed.incr(key) == 1
+    indexed.set((user, "ttl"), 1, ttl=1)
+    indexed[user] = 1
+    assert indexed.range(prefix=(user,))[1] == [key, (user, "ttl")]
+    # replacing a key doesn't add it again
+    indexed.incr(key, 1000)
+    indexed[key] = "x" * 100
+    assert indexed.range(prefix=(user,))[1] == [key, (user, "ttl")]
+    time.sleep(2.5)
+    assert indexed.range(prefix=(user,))[1] == [key]
+    del indexed[key]
+    assert indexed.range(prefix=(user,))[1] == []
+    info = indexed.info()
+    assert info["index_keys"] >= 1
+    assert info["index_memory"] > 0
+    del indexed[user]
+
+
+def test_many_keys(indexed):
+    # enough keys for a tree a few levels deep, then removed in random order
+    user = randostrs()
+    keys = [(user, ix) for ix in range(20000)]
+    shuffled = keys[:]
+    random.shuffle(shuffled)
+    _mset(indexed, {key: 1 for key in shuffled})
+    assert list(indexed.range_iter(prefix=(user,), count=1000)) == keys
+    random.shuffle(shuffled)
+    _mdel(indexed, shuffled[:15000])
+    assert list(indexed.range_iter(prefix=(user,), count=1000)) == sorted(shuffled[15000:])
+    _mdel(indexed, shuffled[15000:])
+    assert indexed.range(prefix=(user,)) == (None, [])
+
+
+def test_eviction_updates_index():
+    with spawn_server(PORT + 1, "--index", "--maxmemory", str(1 << 20), "--maxmemory-policy", "allkeys-lru") as client:
+        _mset(client, {f"key_{ix:05}": "x" * 50 for ix in range(20000)})
+        info = client.info()
+        assert info["evicted_keys"] > 0
+        assert info["index_keys"] == info["keys"]
+        found = list(client.range_iter(prefix="key_", count=1000))
+        assert len(found) == info["keys"]
+        assert client.mget(found[:500]) == ["x" * 50] * 500
+
+
+def test_without_index(client):
+    with pytest.raises(AttributeError):
+        client.range(prefix=("user",))
+
+
+@pytest.mark.parametrize(
+    ("args", "status"),
+    (
+        ((b"range", dumps("prefix")), RES_BAD_ARGS),
+        ((b"range", dumps("prefix"), dumps(1)), RES_BAD_ARGS),
+        ((b"range", dumps("prefix"), dumps([1])), RES_BAD_HASH),
+        ((b"range", dumps("start"), dumps(1), dumps("after"), dumps(1)), RES_BAD_ARGS),
+        ((b"range", dumps("count"), dumps(0)), RES_BAD_ARGS),
+        ((b"range", dumps("count"), dumps(100000)), RES_BAD_ARGS),
+        ((b"range", dumps("values"), dumps(1)), RES_BAD_ARGS),
+        ((b"range", dumps("limit"), dumps(1)), RES_BAD_ARGS),
+    ),
+)
+def test_range_bad_args(indexed, args, status):
+    assert _request(indexed, *args)[0] == status
+
+
+def test_range_bad_op(client):
+    assert _request(client, b"range")[0] == RES_BAD_OP
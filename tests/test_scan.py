@@ -0,0 +1,134 @@
+import pytest
+
+from five_one_one_kv.c import RES_BAD_ARGS, dumps
+
+from .test_storage import _request
+from .utils import randostrs
+
+
+def _mset(client, keys, val=1):
+    # in batches that fit in a request
+    keys = list(keys)
+    for start in range(0, len(keys), 500):
+        client.mset({key: val for key in keys[start : start + 500]})
+
+
+def _mdel(client, keys):
+    keys = list(keys)
+    for start in range(0, len(keys), 500):
+        client.mdel(keys[start : start + 500])
+
+
+def test_scan_finds_every_key(client):
+    prefix = randostrs()
+    keys = {f"{prefix}_{ix}" for ix in range(3000)}
+    _mset(client, keys)
+    found = list(client.scan_iter(match=f"{prefix}_*"))
+    assert set(found) == keys
+    # no table grew, so no key was returned twice
+    assert len(found) == len(keys)
+    _mdel(client, keys)
+
+
+def test_scan_batches(client):
+    prefix = randostrs()
+    keys = {f"{prefix}_{ix}" for ix in range(500)}
+    _mset(client, keys)
+    cursor, batch = client.scan(0, count=10)
+    assert cursor != 0
+    # a step returns all the keys of a group, so a batch can be a little larger
+    assert len(batch) < 100
+    found = set()
+    cursor = 0
+    while True:
+        cursor, batch = client.scan(cursor, match=f"{prefix}_*", count=1000)
+        found.update(batch)
+        if not cursor:
+            break
+    assert found == keys
+    _mdel(client, keys)
+
+
+def test_scan_while_tables_grow(client):
+    prefix = randostrs()
+    keys = {f"{prefix}_{ix}" for ix in range(2000)}
+    _mset(client, keys)
+    found = set()
+    cursor, batch = client.scan(0, match=f"{prefix}_*")
+    found.update(batch)
+    # enough new keys to grow the tables of every shard, some of them more
+    # than once
+    more = [f"{prefix}_more_{ix}" for ix in range(30000)]
+    _mset(client, more)
+    while cursor:
+        cursor, batch = client.scan(cursor, match=f"{prefix}_*")
+        found.update(batch)
+    assert keys <= found
+    _mdel(client, list(keys) + more)
+
+
+def test_scan_type(client):
+    prefix = randostrs()
+    client[f"{prefix}_int"] = 1
+    client[f"{prefix}_str"] = "one"
+    client.queue(f"{prefix}_queue")
+    match = f"{prefix}_*"
+    assert list(client.scan_iter(match=match, type="int")) == [f"{prefix}_int"]
+    assert list(client.scan_iter(match=match, type="str")) == [f"{prefix}_str"]
+    assert list(client.scan_iter(match=match, type="queue")) == [f"{prefix}_queue"]
+    assert list(client.scan_iter(match=match, type="float")) == []
+    client.mdel([f"{prefix}_int", f"{prefix}_str", f"{prefix}_queue"])
+
+
+@pytest.mark.parametrize(
+    ("pattern", "expected"),
+    (
+        ("*", {"a1", "b2", "c3", "*x", "[y]"}),
+        ("?1", {"a1"}),
+        ("[ab]*", {"a1", "b2"}),
+        ("[^ab]?", {"c3", "*x"}),
+        ("[a-b]?", {"a1", "b2"}),
+        ("[b-a]2", {"b2"}),
+        ("\\**", {"*x"}),
+        ("\\[*", {"[y]"}),
+        ("*3", {"c3"}),
+        ("a", set()),
+    ),
+)
+def test_scan_match(client, pattern, expected):
+    prefix = randostrs()
+    suffixes = ("a1", "b2", "c3", "*x", "[y]")
+    client.mset({prefix + suffix: 1 for suffix in suffixes})
+    found = {key[len(prefix) :] for key in client.scan_iter(match=prefix + pattern)}
+    assert found == expected
+    client.mdel([prefix + suffix for suffix in suffixes])
+
+
+def test_scan_key_types(client):
+    prefix = randostrs()
+    keys = [f"{prefix}_str", prefix.encode("ascii"), (prefix, 1)]
+    _mset(client, keys)
+    found = [key for key in client.scan_iter() if key in keys]
+    assert sorted(found, key=repr) == sorted(keys, key=repr)
+    # str and bytes keys are matched by their contents, tuples never match
+    assert set(client.scan_iter(match=f"{prefix}*")) == {f"{prefix}_str", prefix.encode("ascii")}
+    client.mdel(keys)
+
+
+@pytest.mark.parametrize(
+    ("args",),
+    (
+        ((b"scan",),),
+        ((b"scan", b"#-1"),),
+        ((b"scan", b'"0'),),
+        ((b"scan", b"#" + str(64 << 56).encode("ascii")),),
+        ((b"scan", b"#0", dumps("count")),),
+        ((b"scan", b"#0", dumps("count"), dumps(0)),),
+        ((b"scan", b"#0", dumps("count"), dumps(100000)),),
+        ((b"scan", b"#0", dumps("type"), dumps("set")),),
+        ((b"scan", b"#0", dumps("match"), dumps(1)),),
+        ((b"scan", b"#0", dumps("limit"), dumps(1)),),
+    ),
+)
+def test_scan_bad_args(client, args):
+    assert _request(client, *args)[0] == RES_BAD_ARGS
@@ -1,13 +1,15 @@
 import json
 import random
+from concurrent.futures import ThreadPoolExecutor
 
 import pytest
 
+from five_one_one_kv import Client, Pipeline
 from five_one_one_kv.c import RES_BAD_COLLECTION, RES_BAD_TYPE, dumps
 from five_one_one_kv.client import _pack, _unpack
 from five_one_one_kv.exceptions import TooLargeError
 
-from .utils import randostrs
+from .utils import execute, randostrs
 
 
 @pytest.mark.skip(reason="list implementation was changed")
@@ -41,3 +43,36 @@ def test_msg_too_large(client):
         my_list.append(dumps(elem).decode("ascii"))
     with pytest.raises(TooLargeError):
         data = _pack(b"put", b"bbazoon", b"[" + json.dumps(my_list).encode("ascii"))
+
+
+def _light_client(name, num_requests):
+    client = Client()
+    try:
+        for ix in range(num_requests):
+            client[f"{name}_{ix % 4}"] = ix
+            assert client.get(f"{name}_{ix % 4}") == ix
+    finally:
+        client.close()
+
+
+def _heavy_client(name, num_bursts, depth):
+    pipeline = Pipeline()
+    try:
+        for burst in range(num_bursts):
+            for ix in range(depth):
+                pipeline[f"{name}_{ix}"] = burst
+            for ix in range(depth):
+                pipeline.get(f"{name}_{ix}")
+            assert execute(pipeline) == [None] * depth + [burst] * depth
+    finally:
+        pipeline.close()
+
+
+def test_skewed_concurrent_clients():
+    # a few connections send bursts while many others send one request at a
+    # time, so connections keep moving between busy and idle io workers
+    with ThreadPoolExecutor(max_workers=10) as executor:
+        futures = [executor.submit(_heavy_client, f"heavy_{ix}", 5, 8) for ix in range(2)]
+        futures += [executor.submit(_light_client, f"light_{ix}", 50) for ix in range(8)]
+        for future in futures:
+            future.result()
@@ -0,0 +1,103 @@
+import struct
+from datetime import datetime, timezone
+
+import pytest
+
+from five_one_one_kv.c import RES_BAD_ARGS, RES_BAD_KEY, dumps
+
+from .test_storage import _request
+from .utils import randostrs
+
+
+def test_memory(client):
+    key = randostrs()
+    client[key] = "x" * 1000
+    small = client.memory(key)
+    assert small > 1000
+    client[key] = "x" * 5000
+    assert client.memory(key) == small + 4000
+    del client[key]
+    with pytest.raises(KeyError):
+        client.memory(key)
+
+
+def test_memory_of_queue(client):
+    key = randostrs()
+    client.queue(key)
+    empty = client.memory(key)
+    client.push(key, "x" * 1000)
+    client.push(key, "y" * 1000)
+    full = client.memory(key)
+    assert full > empty + 2000
+    client.pop(key)
+    assert empty < client.memory(key) < full
+    client.pop(key)
+    assert client.memory(key) == empty
+    del client[key]
+
+
+@pytest.mark.parametrize(
+    ("kind", "val"),
+    (
+        ("int", 1),
+        ("float", 1.5),
+        ("str", "one"),
+        ("bytes", b"one"),
+        ("tuple", (1, "two")),
+        ("list", [1, "two"]),
+        ("bool", True),
+        ("datetime", datetime(2020, 1, 1, tzinfo=timezone.utc)),
+    ),
+)
+def test_stats_by_type(client, kind, val):
+    before = client.stats(samples=0)["types"][kind]
+    key = randostrs()
+    client[key] = val
+    after = client.stats(samples=0)["types"][kind]
+    assert after["keys"] == before["keys"] + 1
+    # memory() also counts the key's slot, which is counted with the table
+    assert after["bytes"] == before["bytes"] + client.memory(key) - 1 - struct.calcsize("P")
+    del client[key]
+    assert client.stats(samples=0)["types"][kind] == before
+
+
+def test_stats_queue(client):
+    before = client.stats(samples=0)["types"]["queue"]
+    key = randostrs()
+    client.queue(key)
+    client.push(key, "x" * 1000)
+    after = client.stats(samples=0)["types"]["queue"]
+    assert after["keys"] == before["keys"] + 1
+    assert after["bytes"] >= before["bytes"] + 1000
+    client.pop(key)
+    del client[key]
+    assert client.stats(samples=0)["types"]["queue"] == before
+
+
+def test_stats_finds_large_keys(client):
+    keys = [randostrs() for _ in range(100)]
+    for key in keys:
+        client[key] = 1
+    big = randostrs()
+    client[big] = "x" * 50000
+    # with this many samples the big key is all but certain to be sampled,
+    # whatever the other tests left in the server
+    stats = client.stats(samples=1000000)
+    assert 0 < stats["sampled"] <= 1000000
+    assert sum(stats["histogram"].values()) == stats["sampled"]
+    assert stats["histogram"][65536] > 0
+    assert stats["largest"][0] == (big, client.memory(big))
+    sizes = [size for _, size in stats["largest"]]
+    assert sizes == sorted(sizes, reverse=True)
+    assert len(set(key for key, _ in stats["largest"])) == len(sizes)
+    assert stats["keys"] == client.info()["keys"]
+    for key in keys + [big]:
+        del client[key]
+
+
+def test_stats_bad_args(client):
+    for samples in (b"#-1", b"#01", b"#10000000", b'"10', b"#1.5"):
+        status, _ = _request(client, b"stats", samples)
+        assert status == RES_BAD_ARGS
+    status, _ = _request(client, b"memory", dumps(randostrs()))
+    assert status == RES_BAD_KEY
@@ -0,0 +1,177 @@
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import pytest
+
+from five_one_one_kv import Client
+
+from five_one_one_kv.c import (
+    RES_BAD_ARGS,
+    RES_BAD_COLLECTION,
+    RES_BAD_HASH,
+    RES_BAD_KEY,
+    RES_BAD_OP,
+    RES_BAD_TYPE,
+    RES_ERR_CLIENT,
+    RES_OK,
+    dumps,
+)
+from five_one_one_kv.client import _pack, _unpack
+
+from .utils import randostrs
+
+
+def _request(client, *args):
+    client._sock.send(_pack(*args))
+    return _unpack(client._sock.recv(1024))
+
+
+@pytest.mark.parametrize(
+    ("v",),
+    (
+        (b"#",),
+        (b"#12a",),
+        (b"# 12",),
+        (b"#012",),
+        (b"#0x12",),
+        (b"%",),
+        (b"%1.5.5",),
+        (b"%0x1p3",),
+        (b'"\xff',),
+        (b'"\xed\xa0\x80',),
+        (b"?2",),
+        (b"+2020-13-01 00:00:00 +0000",),
+        (b"+2021-02-29 00:00:00 +0000",),
+        (b"+2020-01-01 00:00:00 +2500",),
+        (b"+2020-01-01 00:00:00 +00:0000",),
+        (b"*foo",),
+    ),
+)
+def test_malformed_value(client, v):
+    status, _ = _request(client, b"put", b'"' + randostrs().encode("ascii"), v)
+    assert status == RES_BAD_TYPE
+
+
+@pytest.mark.parametrize(
+    ("v",),
+    (
+        (b"#-0",),
+        (b"%-1e-5",),
+        (b"%inf",),
+        (b'"\xe2\x82\xac',),
+        (b"+2020-02-29 23:59:59 Z",),
+        (b"+2020-01-01 00:00:00 -05:30",),
+        (b"+2020-01-01 00:00:00 +013015.5",),
+    ),
+)
+def test_wellformed_value(client, v):
+    key = b'"' + randostrs().encode("ascii")
+    status, _ = _request(client, b"put", key, v)
+    assert status == RES_OK
+    status, data = _request(client, b"get", key)
+    assert status == RES_OK
+    assert data == v
+
+
+@pytest.mark.parametrize(
+    ("v",),
+    (
+        ([1, 2.5, "three", b"four", True],),
+        ((1, "two", 3.0),),
+    ),
+)
+def test_collection_value_is_stored_as_sent(client, v):
+    key = dumps(randostrs())
+    status, _ = _request(client, b"put", key, dumps(v))
+    assert status == RES_OK
+    status, data = _request(client, b"get", key)
+    assert status == RES_OK
+    assert data == dumps(v)
+
+
+def test_unhashable_key(client):
+    status, _ = _request(client, b"put", dumps([1, 2]), dumps(1))
+    assert status == RES_BAD_HASH
+    # dumps() refuses to build a tuple holding a list, so encode it by hand
+    status, _ = _request(client, b"get", b"(\x01\x00\x03\x00[\x00\x00")
+    assert status == RES_BAD_HASH
+
+
+def test_embedded_collection(client):
+    status, _ = _request(client, b"queue", b"'storage_embedded")
+    assert status == RES_OK
+    status, _ = _request(client, b"push", b"'storage_embedded", dumps([1, 2]))
+    assert status == RES_BAD_COLLECTION
+
+
+@pytest.mark.parametrize(
+    ("args",),
+    (
+        ((b"get",),),
+        ((b"put", b"'foo"),),
+        ((b"queue", b"'foo", b"'bar", b"'baz"),),
+    ),
+)
+def test_bad_args(client, args):
+    status, _ = _request(client, *args)
+    assert status == RES_BAD_ARGS
+
+
+def test_truncated_tuple(client):
+    status, _ = _request(client, b"get", b"(\x02\x00\x02\x00#1")
+    assert status == RES_ERR_CLIENT
+
+
+def test_keys_compare_by_encoding(client):
+    client[1] = "int"
+    client[1.0] = "float"
+    assert client[1] == "int"
+    assert client[1.0] == "float"
+    del client[1]
+    del client[1.0]
+
+
+def test_get_queue(client):
+    key = randostrs()
+    client.queue(key)
+    with pytest.raises(AttributeError):
+        client[key]
+    status, _ = _request(client, b"push", dumps(randostrs()), dumps(1))
+    assert status == RES_BAD_KEY
+
+
+def test_queue_ttl(client):
+    key = randostrs()
+    client.queue(key, ttl=1)
+    client.push(key, 1)
+    time.sleep(2.5)
+    with pytest.raises(KeyError):
+        client.pop(key)
+
+
+def test_overwrite_drops_ttl(client):
+    key = randostrs()
+    client.set(key, 1, ttl=1)
+    client[key] = 2
+    time.sleep(2.5)
+    assert client[key] == 2
+    del client[key]
+
+
+def _fill(name, num_keys):
+    client = Client()
+    try:
+        for ix in range(num_keys):
+            client[f"{name}_{ix}"] = ix
+        for ix in range(num_keys):
+            assert client[f"{name}_{ix}"] == ix
+    finally:
+        client.close()
+
+
+def test_concurrent_writers():
+    # enough keys to spread over every shard and grow their tables
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        futures = [executor.submit(_fill, f"writer_{ix}", 2000) for ix in range(4)]
+        for future in futures:
+            future.result()
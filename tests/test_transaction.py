@@ -0,0 +1,169 @@
+import threading
+import time
+
+import pytest
+
+from five_one_one_kv import Client, Transaction
+from five_one_one_kv.c import RES_BAD_ARGS, RES_BAD_CMD, RES_BAD_TYPE, RES_ERR_CLIENT, RES_OK, dumps
+from five_one_one_kv.client import _pack
+from five_one_one_kv.exceptions import ServerError
+
+from .test_storage import _request
+from .utils import randostrs
+
+
+def test_basics(transaction):
+    key = randostrs()
+    other = randostrs()
+    transaction[key] = 1
+    transaction.incr(key)
+    transaction.get(key)
+    transaction.mset({other: "two"})
+    transaction.mget([key, other])
+    del transaction[key]
+    transaction.get(key)
+    results = transaction.execute()
+    assert results[:4] == [None, 2, 2, None]
+    # values in a list come as their encoding, like in a pipeline
+    assert results[4] == [dumps(2), dumps("two")]
+    assert results[5] is None
+    assert isinstance(results[6], KeyError)
+    client = Client()
+    assert client[other] == "two"
+    del client[other]
+    client.close()
+
+
+def test_empty(transaction):
+    assert transaction.execute() == []
+
+
+def test_failures_dont_undo(transaction):
+    key = randostrs()
+    transaction[key] = 1
+    transaction.pop(key)
+    transaction.incr(key)
+    results = transaction.execute()
+    assert results[0] is None
+    assert isinstance(results[1], AttributeError)
+    assert results[2] == 2
+    client = Client()
+    assert client[key] == 2
+    del client[key]
+    client.close()
+
+
+def test_ttls(transaction):
+    # the ttls are put on the heap after the transaction, as it left them
+    kept = randostrs()
+    expired = randostrs()
+    transaction.set(kept, 1, 2)
+    transaction.set(expired, 1)
+    transaction.ttl(expired, 2)
+    transaction.ttl(kept)
+    transaction.set(expired, 2, 2)
+    assert transaction.execute() == [None] * 5
+    time.sleep(3.5)
+    client = Client()
+    assert client[kept] == 1
+    assert client.get(expired) is None
+    del client[kept]
+    client.close()
+
+
+@pytest.mark.parametrize("method", ("scan", "info", "stats"))
+def test_rejected_commands(transaction, method):
+    # nothing runs if a command can't be part of a transaction
+    key = randostrs()
+    transaction[key] = 1
+    getattr(transaction, method)()
+    with pytest.raises(Exception):
+        transaction.execute()
+    client = Client()
+    assert client.get(key) is None
+    client.close()
+
+
+def test_responses_too_large(transaction):
+    key = randostrs()
+    transaction[key] = "x" * 40000
+    transaction.get(key)
+    transaction.get(key)
+    transaction.incr(randostrs())
+    results = transaction.execute()
+    assert results[1] == "x" * 40000
+    # ran, but there was no room for its response
+    assert isinstance(results[2], ServerError)
+    assert results[3] == 1
+    client = Client()
+    del client[key]
+    client.close()
+
+
+def test_many_shards(transaction):
+    prefix = randostrs()
+    keys = [f"{prefix}_{ix}" for ix in range(500)]
+    transaction.mset({key: 1 for key in keys})
+    for key in keys[:10]:
+        transaction.incr(key)
+    transaction.mdel(keys)
+    results = transaction.execute()
+    assert results[1:11] == [2] * 10
+    assert results[11] == len(keys)
+
+
+def test_atomic():
+    # readers never see one key incremented and not the other
+    first = randostrs()
+    second = randostrs()
+    client = Client()
+    client.mset({first: 0, second: 0})
+    stop = threading.Event()
+
+    def _count(num, found):
+        transaction = Transaction()
+        for _ in range(num):
+            transaction.incr(first)
+            transaction.incr(second)
+            found.append(tuple(transaction.execute()))
+        transaction.close()
+
+    def _read(found):
+        reader = Client()
+        while not stop.is_set():
+            found.append(tuple(reader.mget([first, second])))
+        reader.close()
+
+    found = []
+    reader = threading.Thread(target=_read, args=(found,))
+    reader.start()
+    counters = [threading.Thread(target=_count, args=(500, found)) for _ in range(4)]
+    for thread in counters:
+        thread.start()
+    for thread in counters:
+        thread.join()
+    stop.set()
+    reader.join()
+    assert len(found) > 2000
+    assert all(a == b for a, b in found)
+    assert client.mget([first, second]) == [2000, 2000]
+    client.mdel([first, second])
+    client.close()
+
+
+@pytest.mark.parametrize(
+    ("args", "status"),
+    (
+        ((b"exec",), RES_BAD_ARGS),
+        ((b"exec", dumps("get")), RES_BAD_TYPE),
+        ((b"exec", b"'"), RES_ERR_CLIENT),
+        ((b"exec", b"'" + _pack(b"get")[2:-1]), RES_ERR_CLIENT),
+        ((b"exec", b"'" + _pack(b"get", dumps("k"))[2:] + b"x"), RES_ERR_CLIENT),
+        ((b"exec", b"'" + _pack(b"lock", dumps("n"), dumps("t"), dumps(1))[2:]), RES_BAD_CMD),
+        ((b"exec", b"'" + _pack(b"exec", b"'" + _pack(b"get", dumps("k"))[2:])[2:]), RES_BAD_CMD),
+        ((b"exec", b"'" + _pack(b"nope", dumps("k"))[2:]), RES_BAD_CMD),
+        ((b"exec", b"'" + _pack(b"get", dumps("k"))[2:]), RES_OK),
+    ),
+)
+def test_exec_bad_args(client, args, status):
+    assert _request(client, *args)[0] == status
@@ -107,3 +107,20 @@ def test_ttl_many_extend_ttl():
             is_success, msg = fut.result()
             if not is_success:
                 raise AssertionError(msg)
+
+
+def test_ttl_entries_past_the_free_list(client):
+    # more ttl entries than the server keeps for reuse, so the rest are freed
+    # when they come off the heap
+    key = randostrs()
+    for ix in range(1500):
+        client.set(key, ix, 2)
+    others = [randostrs() for _ in range(1500)]
+    for other in others:
+        client.set(other, 1, 2)
+    time.sleep(3.5)
+    assert client.get(key) is None
+    assert client.mget(others) == [None] * len(others)
+    client[key] = 1
+    assert client[key] == 1
+    del client[key]
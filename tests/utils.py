@@ -1,4 +1,10 @@
 import random
+import subprocess
+import sys
+import time
+from contextlib import contextmanager
+
+from five_one_one_kv import Client
 
 
 def randobytes(size=8):
@@ -7,3 +13,37 @@ def randobytes(size=8):
 
 def randostrs(size=8):
     return randobytes(size=size).decode("ascii")
+
+
+@contextmanager
+def spawn_server(port, *args):
+    # a server of its own on `port`, started with `args`, for tests that need
+    # options the server the other tests use doesn't have
+    proc = subprocess.Popen(
+        [sys.executable, "-m", "five_one_one_kv.server", "--port", str(port), *args],
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL,
+    )
+    try:
+        deadline = time.monotonic() + 10
+        while True:
+            try:
+                client = Client(port=port)
+                break
+            except ConnectionRefusedError:
+                if time.monotonic() > deadline:
+                    raise
+                time.sleep(0.1)
+        yield client
+        client.close()
+    finally:
+        proc.kill()
+        proc.wait()
+
+
+def execute(pipeline):
+    # executes and empties the pipeline, so it can be filled again
+    results = pipeline.execute()
+    pipeline._keys.clear()
+    pipeline._wbuff.clear()
+    return results